@@ -41,6 +41,7 @@ namespace blksnap
     struct SBlksnapEventLowFreeSpace
     {
         unsigned long long requestedSectors;
+        unsigned long long fillRate;
     };
 
     struct SBlksnapEventCorrupted
@@ -81,6 +82,28 @@ namespace blksnap
 #ifdef BLK_SNAP_MODIFICATION
         /* Additional functional */
         bool Modification(struct blk_snap_mod& mod);
+        void Create(const std::vector<struct blk_snap_dev>& devices, const struct blk_snap_snapshot_options& options,
+                    uuid_t& id);
+        bool ReadCbtRanges(struct blk_snap_dev dev_id, uint8_t snapNumber, sector_t& sectorOffset,
+                           std::vector<struct blk_snap_block_range>& ranges);
+        bool ReadCbtRangesSince(struct blk_snap_dev dev_id, const uuid_t& generationId, uint8_t snapNumber,
+                                sector_t& sectorOffset, std::vector<struct blk_snap_block_range>& ranges);
+        /*
+         * Process the requests for many devices in one call. Return false if
+         * the kernel module does not support it.
+         */
+        bool ReadCbtRangesMulti(std::vector<struct blk_snap_tracker_read_cbt_since>& requests);
+        bool MarkDirtyBlocksMulti(std::vector<struct blk_snap_tracker_mark_dirty_blocks>& devices);
+        /*
+         * The event file descriptor can be polled. It allows to read all
+         * events ready at the moment without an ioctl for every event.
+         * The caller owns the descriptor and should close it. Returns -1
+         * if the module does not support it.
+         */
+        int OpenEventFd(const uuid_t& id, bool nonblock);
+        static bool ReadEvents(int eventFd, int timeoutMs, std::vector<SBlksnapEvent>& events);
+        /* The I/O statistics of each device of the snapshot */
+        void SnapshotStats(const uuid_t& id, std::vector<struct blk_snap_device_stats>& stats);
 #    ifdef BLK_SNAP_DEBUG_SECTOR_STATE
         void GetSectorState(struct blk_snap_dev image_dev_id, off_t offset, struct blk_snap_sector_state& state);
 #    endif
@@ -21,10 +21,14 @@
  * The hi-level abstraction for the blksnap kernel module.
  * Allows to receive data from CBT.
  */
+#include <functional>
 #include <memory>
+#include <string>
 #include <uuid/uuid.h>
 #include <vector>
 
+#include "Sector.h"
+
 namespace blksnap
 {
     struct SCbtInfo
@@ -70,6 +74,29 @@ namespace blksnap
 
         virtual std::shared_ptr<SCbtInfo> GetCbtInfo(const std::string& original) = 0;
         virtual std::shared_ptr<SCbtData> GetCbtData(const std::shared_ptr<SCbtInfo>& ptrCbtInfo) = 0;
+        /*
+         * Calls the callback for each range of sectors that have changed
+         * since the snapshot with the sinceSnapNumber number. The ranges are
+         * sorted and adjacent ranges are merged. The whole CBT map is not
+         * copied into memory.
+         */
+        virtual void GetChangedRanges(const std::string& original, uint8_t sinceSnapNumber,
+                                      const std::function<void(const SRange&)>& callback)
+          = 0;
+        /*
+         * Works like GetChangedRanges(), but the sinceSnapNumber may be the
+         * number of any snapshot of the generation generationId. If the
+         * generation has been changed, the std::system_error with ESTALE is
+         * thrown, and the full backup is needed.
+         * If the generation is changed while the ranges are being read, the
+         * module returns EAGAIN, and the reading is restarted from the first
+         * sector up to three times. The callback is called only after all
+         * the ranges have been read, so no range is reported twice.
+         */
+        virtual void GetChangedRangesSince(const std::string& original, const uuid_t& generationId,
+                                           uint8_t sinceSnapNumber,
+                                           const std::function<void(const SRange&)>& callback)
+          = 0;
 
         static std::shared_ptr<ICbt> Create();
     };
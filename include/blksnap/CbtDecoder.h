@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * Decoding of the CBT map into ranges of changed blocks.
+ * The map is scanned with the widest vector instructions supported by the
+ * processor. The implementation is selected at runtime.
+ */
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Sector.h"
+
+namespace blksnap
+{
+    /*
+     * Calls the callback for each run of blocks with a change number greater
+     * than snapNumber. The callback receives the index of the first block of
+     * the run in the map and the number of blocks in it.
+     */
+    void CbtFindChanged(const uint8_t* map, size_t size, uint8_t snapNumber,
+                        const std::function<void(size_t, size_t)>& callback);
+
+    /*
+     * Returns the name of the implementation selected for this processor.
+     */
+    const char* CbtDecoderName();
+
+    /*
+     * Merges sorted ranges of sectors. Adjacent ranges are always merged.
+     * Ranges separated by a gap of no more than minIoSectors are also merged,
+     * which allows to reduce the number of I/O requests.
+     */
+    class CRangeMerger
+    {
+    public:
+        CRangeMerger(sector_t minIoSectors, const std::function<void(const SRange&)>& callback)
+            : m_minIoSectors(minIoSectors)
+            , m_callback(callback)
+        {};
+
+        void Add(sector_t sector, sector_t count)
+        {
+            if (!count)
+                return;
+
+            if (m_range.count && (sector <= m_range.sector + m_range.count + m_minIoSectors))
+            {
+                m_range.count = sector + count - m_range.sector;
+                return;
+            }
+
+            Flush();
+            m_range = SRange(sector, count);
+        };
+
+        void Flush()
+        {
+            if (m_range.count)
+                m_callback(m_range);
+            m_range = SRange();
+        };
+
+    private:
+        sector_t m_minIoSectors;
+        std::function<void(const SRange&)> m_callback;
+        SRange m_range;
+    };
+}
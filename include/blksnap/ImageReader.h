@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * The hi-level abstraction for the blksnap kernel module.
+ * Allows to read the snapshot image with direct asynchronous I/O.
+ */
+#include <functional>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+#include "Sector.h"
+
+namespace blksnap
+{
+    struct SImageReaderOptions
+    {
+        /* The number of read requests that are in flight at the same time */
+        unsigned int queueDepth = 32;
+        /* The maximum size of a read request in bytes */
+        size_t blockSize = 1024 * 1024;
+    };
+
+    struct IImageReader
+    {
+        /*
+         * The data is passed to the callback directly from the I/O buffer.
+         * It is valid only until the callback returns. The portions are
+         * passed in the order of completion, not in the order of offsets.
+         * The offset and the size are in bytes.
+         */
+        using DataCallback = std::function<void(off_t offset, const void* data, size_t size)>;
+
+        virtual ~IImageReader(){};
+
+        /* Returns the size of the image in bytes */
+        virtual off_t GetSize() = 0;
+        /* Reads the ranges of the image. The ranges are in sectors. */
+        virtual void Read(const std::vector<SRange>& ranges, const DataCallback& callback) = 0;
+        /* Reads the whole image */
+        virtual void ReadAll(const DataCallback& callback) = 0;
+        /*
+         * Reads only the ranges of the image that have been changed on the
+         * original device since the snapshot with the sinceSnapNumber number.
+         */
+        virtual void ReadChanged(const std::string& original, uint8_t sinceSnapNumber,
+                                 const DataCallback& callback) = 0;
+
+        static std::shared_ptr<IImageReader> Create(const std::string& imageName,
+                                                    const SImageReaderOptions& options = SImageReaderOptions());
+    };
+}
@@ -28,6 +28,44 @@
 
 namespace blksnap
 {
+    /*
+     * The tuning parameters of the snapshot. A negative value means that the
+     * parameter of the kernel module is used.
+     */
+    struct SSessionOptions
+    {
+        /* The minimum chunk size as a power of two */
+        int chunkShift = -1;
+        /* The size of the memory cache of chunks in bytes */
+        long long cacheSize = -1;
+        /* The number of chunks to read in advance */
+        int readAhead = -1;
+        /* The minimum portion of the difference storage in sectors */
+        long long storageIncrement = -1;
+        /* One of the values of enum blk_snap_durability */
+        int durability = -1;
+        /* The number of worker threads for each snapshot image */
+        int workerCount = -1;
+        /* Release the chunks of the snapshot images as soon as they are read */
+        bool readOnce = false;
+        /* Choose the chunk size of each device by its write pattern */
+        bool chunkAuto = false;
+        /* Compute the hashes of the original contents of the chunks */
+        bool chunkHash = false;
+    };
+
+    /* The I/O statistics of the kernel module summed up for all devices */
+    struct SSessionStats
+    {
+        /* The number of bytes written to the difference storage */
+        unsigned long long bytesStored = 0;
+        /*
+         * The latency histogram of read requests to the snapshot images.
+         * See BLK_SNAP_STATS_HIST_SIZE for the meaning of the buckets.
+         */
+        std::vector<unsigned long long> imageReadHist;
+    };
+
     struct ISession
     {
         virtual ~ISession(){};
@@ -35,12 +73,22 @@ namespace blksnap
         virtual std::string GetImageDevice(const std::string& original) = 0;
         virtual std::string GetOriginalDevice(const std::string& image) = 0;
         virtual bool GetError(std::string& errorMessage) = 0;
+        virtual void GetStats(SSessionStats& stats) = 0;
 
-        // TODO: add limits
         static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
-                                                const std::string& diffStorage);
+                                                const std::string& diffStorage,
+                                                const SSessionOptions& options = SSessionOptions());
+        static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
+                                                const SStorageRanges& diffStorageRanges,
+                                                const SSessionOptions& options = SSessionOptions());
+        /*
+         * The files of the difference storage are created in turn in
+         * several directories. The spare files are prepared in all
+         * directories in parallel.
+         */
         static std::shared_ptr<ISession> Create(const std::vector<std::string>& devices,
-                                                const SStorageRanges& diffStorageRanges);
+                                                const std::vector<std::string>& diffStorages,
+                                                const SSessionOptions& options = SSessionOptions());
     };
 
 }
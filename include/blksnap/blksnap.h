@@ -58,6 +58,31 @@ enum blk_snap_ioctl {
 	blk_snap_ioctl_mod = IOCTL_MOD,
 	blk_snap_ioctl_setlog,
 	blk_snap_ioctl_get_sector_state,
+	blk_snap_ioctl_set_read_ahead,
+	blk_snap_ioctl_snapshot_set_durability,
+	blk_snap_ioctl_tracker_read_cbt_ranges,
+	blk_snap_ioctl_tracker_export_cbt,
+	blk_snap_ioctl_tracker_import_cbt,
+	blk_snap_ioctl_tracker_set_granularity,
+	blk_snap_ioctl_snapshot_set_cbt_limit,
+	blk_snap_ioctl_tracker_map_cbt,
+	blk_snap_ioctl_snapshot_prepare,
+	blk_snap_ioctl_snapshot_abort,
+	blk_snap_ioctl_snapshot_timing,
+	blk_snap_ioctl_snapshot_stats,
+	blk_snap_ioctl_snapshot_unused_blocks,
+	blk_snap_ioctl_snapshot_set_compression,
+	blk_snap_ioctl_snapshot_set_memory_storage,
+	blk_snap_ioctl_snapshot_set_storage_weight,
+	blk_snap_ioctl_memory_stats,
+	blk_snap_ioctl_snapshot_event_fd,
+	blk_snap_ioctl_snapshot_create_ex,
+	blk_snap_ioctl_snapshot_release_blocks,
+	blk_snap_ioctl_snapshot_set_storage_file,
+	blk_snap_ioctl_snapshot_chunk_hashes,
+	blk_snap_ioctl_tracker_read_cbt_since,
+	blk_snap_ioctl_tracker_mark_dirty_multi,
+	blk_snap_ioctl_tracker_read_cbt_multi,
 	blk_snap_ioctl_end_mod
 #endif
 };
@@ -103,6 +128,26 @@ struct blk_snap_version {
 enum blk_snap_compat_flags {
 	blk_snap_compat_flag_debug_sector_state,
 	blk_snap_compat_flag_setlog,
+	blk_snap_compat_flag_read_ahead,
+	blk_snap_compat_flag_durability,
+	blk_snap_compat_flag_cbt_ranges,
+	blk_snap_compat_flag_cbt_persistent,
+	blk_snap_compat_flag_cbt_granularity,
+	blk_snap_compat_flag_cbt_mmap,
+	blk_snap_compat_flag_staged_take,
+	blk_snap_compat_flag_stats,
+	blk_snap_compat_flag_unused_blocks,
+	blk_snap_compat_flag_compression,
+	blk_snap_compat_flag_memory_storage,
+	blk_snap_compat_flag_storage_striping,
+	blk_snap_compat_flag_memory_stats,
+	blk_snap_compat_flag_event_fd,
+	blk_snap_compat_flag_snapshot_options,
+	blk_snap_compat_flag_release_blocks,
+	blk_snap_compat_flag_storage_file,
+	blk_snap_compat_flag_chunk_hashes,
+	blk_snap_compat_flag_cbt_since,
+	blk_snap_compat_flag_cbt_multi,
 	/*
 	 * Reserved for new features
 	 */
@@ -366,8 +411,14 @@ struct blk_snap_snapshot_create {
  * Creates a snapshot structure in the memory and allocates an identifier for
  * it. Further interaction with the snapshot is possible by this identifier.
  * A snapshot is created for several block devices at once.
- * Several snapshots can be created at the same time, but with the condition
- * that one block device can only be included in one snapshot.
+ * Several snapshots can be created at the same time, and one block device
+ * can be included in up to 8 of them. The snapshots of the same device
+ * share the reading of the original data when copying on write, but each
+ * of them stores its own copy of the data in its own difference storage,
+ * so the difference storage is consumed by each of them. Each take of
+ * a snapshot of the device switches the change tracking table of the
+ * device, which is common for all its snapshots, so the changes are
+ * tracked since the most recent snapshot of the device.
  *
  * Return: 0 if succeeded, negative errno otherwise.
  */
@@ -611,9 +662,17 @@ static_assert(sizeof(struct blk_snap_snapshot_event) == 4096,
  *	&blk_snap_event_code_low_free_space event.
  * @requested_nr_sect:
  *	The required number of sectors.
+ * @fill_rate:
+ *	The rate of filling of the difference storage in bytes per second.
+ *	Zero if it is not known yet.
+ *
+ * The requested size is calculated so that the free space lasts for some
+ * time at the current fill rate. If the free space is still running out,
+ * the next event can be generated before the previous request is satisfied.
  */
 struct blk_snap_event_low_free_space {
 	__u64 requested_nr_sect;
+	__u64 fill_rate;
 };
 
 /**
@@ -682,6 +741,1066 @@ struct blk_snap_get_sector_state {
 	_IOW(BLK_SNAP, blk_snap_ioctl_get_sector_state,                        \
 	     struct blk_snap_get_sector_state)
 
+/**
+ * struct blk_snap_set_read_ahead - Argument for the
+ *	&IOCTL_BLK_SNAP_SET_READ_AHEAD control.
+ * @image_dev_id:
+ *	Snapshot image device ID.
+ * @chunk_count:
+ *	The number of chunks to read in advance. Zero disables read-ahead.
+ */
+struct blk_snap_set_read_ahead {
+	struct blk_snap_dev image_dev_id;
+	__u32 chunk_count;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SET_READ_AHEAD - Set the read-ahead window for the
+ *	snapshot image.
+ *
+ * When sequential reading of the snapshot image is detected, the specified
+ * number of chunks following the current request are loaded in advance.
+ * The window is limited by the maximum number of chunks in the memory cache.
+ * The initial value is set by the module parameter chunk_read_ahead.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SET_READ_AHEAD                                          \
+	_IOW(BLK_SNAP, blk_snap_ioctl_set_read_ahead,                          \
+	     struct blk_snap_set_read_ahead)
+
+/**
+ * enum blk_snap_durability - Durability mode of the difference storage.
+ *
+ * @blk_snap_durability_fua:
+ *	Each write to the difference storage is performed with the REQ_FUA
+ *	flag. This is the default mode.
+ * @blk_snap_durability_flush:
+ *	The cache of the difference storage device is flushed once before
+ *	each request that stores one or several chunks. The data becomes
+ *	persistent with a delay of one request.
+ * @blk_snap_durability_none:
+ *	Writes are performed without forced flushing of the device cache.
+ *	The mode is suitable for snapshots whose data is not needed after
+ *	a power failure, for example, for the snapshots of a backup session.
+ */
+enum blk_snap_durability {
+	blk_snap_durability_fua,
+	blk_snap_durability_flush,
+	blk_snap_durability_none,
+	blk_snap_durability_end
+};
+
+/**
+ * struct blk_snap_snapshot_durability - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_SET_DURABILITY control.
+ * @id:
+ *	Snapshot ID.
+ * @mode:
+ *	One of the values of &enum blk_snap_durability.
+ */
+struct blk_snap_snapshot_durability {
+	struct blk_snap_uuid id;
+	__u32 mode;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_SET_DURABILITY - Set the durability mode
+ *	of the difference storage of the snapshot.
+ *
+ * The mode can be changed at any time and affects subsequent writes to the
+ * difference storage.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_SET_DURABILITY                                 \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_set_durability,                 \
+	     struct blk_snap_snapshot_durability)
+
+/**
+ * struct blk_snap_tracker_read_cbt_ranges - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES control.
+ * @dev_id:
+ *	Device ID.
+ * @snap_number:
+ *	Blocks with a sequential number of changes greater than this value
+ *	are considered changed.
+ * @count:
+ *	Size of @ranges in the number of &struct blk_snap_block_range.
+ *	On output, the number of ranges read.
+ * @sector_offset:
+ *	The sector from which the search starts. On output, the sector from
+ *	which the search should be continued.
+ * @ranges:
+ *	Pointer to the array of &struct blk_snap_block_range.
+ */
+struct blk_snap_tracker_read_cbt_ranges {
+	struct blk_snap_dev dev_id;
+	__u32 snap_number;
+	__u32 count;
+	__u64 sector_offset;
+	struct blk_snap_block_range *ranges;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES - Read the ranges of changed
+ *	blocks from the CBT map.
+ *
+ * Unlike &IOCTL_BLK_SNAP_TRACKER_READ_CBT_MAP, only the changed ranges are
+ * returned, and the regions of the table without changes are skipped
+ * without scanning. The ranges are read in a loop until
+ * &blk_snap_tracker_read_cbt_ranges.sector_offset reaches the capacity of
+ * the device.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES                                 \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_read_cbt_ranges,                \
+	      struct blk_snap_tracker_read_cbt_ranges)
+
+/**
+ * struct blk_snap_cbt_state - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_EXPORT_CBT and &IOCTL_BLK_SNAP_TRACKER_IMPORT_CBT
+ *	controls.
+ * @dev_id:
+ *	Device ID.
+ * @blk_size:
+ *	Block size in bytes.
+ * @blk_count:
+ *	Number of blocks.
+ * @device_capacity:
+ *	Device capacity in bytes.
+ * @generation_id:
+ *	Unique identifier of change tracking generation.
+ * @snap_number_active:
+ *	The sequential number of changes that is written to the table now.
+ * @snap_number_previous:
+ *	The sequential number of changes of the last snapshot.
+ * @buff:
+ *	Pointer to the table of changes of @blk_count bytes.
+ */
+struct blk_snap_cbt_state {
+	struct blk_snap_dev dev_id;
+	__u32 blk_size;
+	__u32 blk_count;
+	__u64 device_capacity;
+	struct blk_snap_uuid generation_id;
+	__u8 snap_number_active;
+	__u8 snap_number_previous;
+	__u8 *buff;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_EXPORT_CBT - Export the state of the change
+ *	tracking.
+ *
+ * Allows to save the table of changes, for example before a reboot or
+ * a module upgrade. If &blk_snap_cbt_state.buff is NULL, only the
+ * parameters of the table are returned. To get a consistent state, the
+ * device should not be written during the export.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_EXPORT_CBT                                      \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_export_cbt,                     \
+	      struct blk_snap_cbt_state)
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_IMPORT_CBT - Import the state of the change
+ *	tracking.
+ *
+ * Restores the table of changes saved by &IOCTL_BLK_SNAP_TRACKER_EXPORT_CBT
+ * together with its generation identifier and sequential numbers. The block
+ * size, the number of blocks and the capacity of the device must match the
+ * current table. Blocks that have been changed since the tracker was created
+ * remain marked as changed. The import is not allowed while the snapshot is
+ * taken.
+ *
+ * Return: 0 if succeeded, -EINVAL if the parameters do not match or
+ * &blk_snap_cbt_state.snap_number_previous is not less than
+ * &blk_snap_cbt_state.snap_number_active, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_IMPORT_CBT                                      \
+	_IOW(BLK_SNAP, blk_snap_ioctl_tracker_import_cbt,                      \
+	     struct blk_snap_cbt_state)
+
+/**
+ * struct blk_snap_tracker_granularity - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_SET_GRANULARITY control.
+ * @dev_id:
+ *	Device ID.
+ * @blk_size:
+ *	The minimum change tracking block size in bytes. Should be a power
+ *	of 2 from 4 KiB to 1 GiB. Zero keeps the current value.
+ * @blk_count_max:
+ *	The maximum number of change tracking blocks. If the device contains
+ *	more blocks of the minimum size, the block size is increased.
+ *	Zero keeps the current value.
+ */
+struct blk_snap_tracker_granularity {
+	struct blk_snap_dev dev_id;
+	__u32 blk_size;
+	__u32 blk_count_max;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_SET_GRANULARITY - Set the change tracking
+ *	block size for the device.
+ *
+ * The tracker is created if the device is not tracked yet. The initial
+ * values are set by the module parameters tracking_block_minimum_shift and
+ * tracking_block_maximum_count. If the block size or the number of blocks
+ * changes, the change tracking table is created again with a new
+ * generation identifier. Not allowed while the snapshot is taken.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_SET_GRANULARITY                                 \
+	_IOW(BLK_SNAP, blk_snap_ioctl_tracker_set_granularity,                 \
+	     struct blk_snap_tracker_granularity)
+
+/**
+ * struct blk_snap_snapshot_cbt_limit - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_SET_CBT_LIMIT control.
+ * @id:
+ *	Snapshot ID.
+ * @memory_limit:
+ *	The memory limit in bytes for the change tracking tables of all
+ *	devices of the snapshot.
+ */
+struct blk_snap_snapshot_cbt_limit {
+	struct blk_snap_uuid id;
+	__u64 memory_limit;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_SET_CBT_LIMIT - Limit the memory for the
+ *	change tracking of the snapshot devices.
+ *
+ * The limit is distributed among the devices in proportion to their
+ * capacity, and the maximum number of change tracking blocks is set for
+ * each of them. The tables of the devices whose block size changes are
+ * created again with a new generation identifier. Should be called before
+ * the snapshot is taken.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_SET_CBT_LIMIT                                  \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_set_cbt_limit,                  \
+	     struct blk_snap_snapshot_cbt_limit)
+
+/**
+ * struct blk_snap_tracker_map_cbt - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_MAP_CBT control.
+ * @dev_id:
+ *	Device ID.
+ * @fd:
+ *	[out] A file descriptor that allows to map the readable change
+ *	tracking table into the memory of the process.
+ * @blk_size:
+ *	[out] Block size in bytes.
+ * @blk_count:
+ *	[out] The size of the table in bytes.
+ * @switch_count:
+ *	[out] The number of times the readable table has been replaced since
+ *	the tracker was created.
+ * @snap_number:
+ *	[out] The sequential number of changes of the last snapshot.
+ * @padding:
+ *	Not used.
+ */
+struct blk_snap_tracker_map_cbt {
+	struct blk_snap_dev dev_id;
+	__s32 fd;
+	__u32 blk_size;
+	__u32 blk_count;
+	__u64 switch_count;
+	__u8 snap_number;
+	__u8 padding[7];
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_MAP_CBT - Get a file descriptor for mapping
+ *	the change tracking table.
+ *
+ * The readable table is brought up to date with the last snapshot and can
+ * be mapped with mmap() as a read-only shared mapping starting from offset
+ * zero. The mapping shows the table without copying it. The table is
+ * updated again when the next snapshot is taken, the @switch_count grows
+ * and the control should be called again before reading the mapping. If
+ * the table was created again, the old mapping keeps the old table, so the
+ * file descriptor should be closed.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_MAP_CBT                                         \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_map_cbt,                        \
+	      struct blk_snap_tracker_map_cbt)
+
+/**
+ * struct blk_snap_snapshot_prepare - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_PREPARE and &IOCTL_BLK_SNAP_SNAPSHOT_ABORT
+ *	controls.
+ * @id:
+ *	Snapshot ID.
+ */
+struct blk_snap_snapshot_prepare {
+	struct blk_snap_uuid id;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_PREPARE - Prepare the snapshot to be taken.
+ *
+ * Allocates the difference areas for all block devices of the snapshot
+ * without freezing them. The next &IOCTL_BLK_SNAP_SNAPSHOT_TAKE control
+ * only freezes the devices and switches the change trackers tables, so the
+ * time during which the I/O to the devices are suspended is shorter.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_PREPARE                                        \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_prepare,                        \
+	     struct blk_snap_snapshot_prepare)
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_ABORT - Cancel the preparation of the
+ *	snapshot.
+ *
+ * Releases the difference areas allocated by &IOCTL_BLK_SNAP_SNAPSHOT_PREPARE.
+ * The snapshot can be prepared again.
+ *
+ * Return: 0 if succeeded, -EBUSY if the snapshot is already taken, negative
+ * errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_ABORT                                          \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_abort,                          \
+	     struct blk_snap_snapshot_prepare)
+
+/**
+ * struct blk_snap_snapshot_timing - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_TIMING control.
+ * @id:
+ *	Snapshot ID.
+ * @prepare_time_ns:
+ *	[out] The time in nanoseconds spent preparing the snapshot.
+ * @freeze_time_ns:
+ *	[out] The time in nanoseconds from freezing the first device of the
+ *	snapshot to thawing the last one. This is the time during which the
+ *	writes of the applications are suspended.
+ */
+struct blk_snap_snapshot_timing {
+	struct blk_snap_uuid id;
+	__u64 prepare_time_ns;
+	__u64 freeze_time_ns;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_TIMING - Get the duration of the stages of
+ *	taking the snapshot.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_TIMING                                         \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_timing,                        \
+	      struct blk_snap_snapshot_timing)
+
+/*
+ * The number of buckets of the latency histograms. The bucket with index N
+ * counts the operations that took from 2^(N-1) to 2^N microseconds, the
+ * bucket with index zero counts the operations that took less than one
+ * microsecond, and the last bucket counts all longer operations.
+ */
+#define BLK_SNAP_STATS_HIST_SIZE 32
+
+/**
+ * struct blk_snap_device_stats - The I/O statistics of the snapshot of one
+ *	block device.
+ * @orig_dev_id:
+ *	Device ID of the original block device.
+ * @chunks_copied:
+ *	The number of chunks read from the original device for copy-on-write.
+ * @chunks_shared:
+ *	The number of chunks that were copied from the memory of a newer
+ *	snapshot of the same device without reading the original device.
+ * @bytes_stored:
+ *	The number of bytes written to the difference storage.
+ * @cow_eagain:
+ *	The number of writes with the REQ_NOWAIT flag which were completed
+ *	with -EAGAIN because the copy-on-write could not be performed without
+ *	waiting.
+ * @cow_wait_ns:
+ *	The total time in nanoseconds that writes to the original device spent
+ *	waiting for the copy-on-write to complete.
+ * @image_reads:
+ *	The number of read requests to the snapshot image.
+ * @image_writes:
+ *	The number of write requests to the snapshot image.
+ * @image_cache_hits:
+ *	The number of chunks accessed by the snapshot image that were already
+ *	in memory.
+ * @image_cache_misses:
+ *	The number of chunks accessed by the snapshot image that had to be
+ *	loaded from the original device or from the difference storage.
+ * @cow_load_hist:
+ *	The latency histogram of reading chunks from the original device.
+ * @cow_store_hist:
+ *	The latency histogram of writing chunks to the difference storage.
+ * @image_read_hist:
+ *	The latency histogram of read requests to the snapshot image.
+ */
+struct blk_snap_device_stats {
+	struct blk_snap_dev orig_dev_id;
+	__u64 chunks_copied;
+	__u64 chunks_shared;
+	__u64 bytes_stored;
+	__u64 cow_eagain;
+	__u64 cow_wait_ns;
+	__u64 image_reads;
+	__u64 image_writes;
+	__u64 image_cache_hits;
+	__u64 image_cache_misses;
+	__u64 cow_load_hist[BLK_SNAP_STATS_HIST_SIZE];
+	__u64 cow_store_hist[BLK_SNAP_STATS_HIST_SIZE];
+	__u64 image_read_hist[BLK_SNAP_STATS_HIST_SIZE];
+};
+
+/**
+ * struct blk_snap_snapshot_stats - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_STATS control.
+ * @id:
+ *	Snapshot ID.
+ * @count:
+ *	Size of &stats_array in the number of &struct blk_snap_device_stats.
+ *	If &stats_array is too small, an error is returned and the required
+ *	size is set. Otherwise, the number of devices of the snapshot is set.
+ * @stats_array:
+ *	Pointer to the array for the statistics of the block devices.
+ */
+struct blk_snap_snapshot_stats {
+	struct blk_snap_uuid id;
+	__u32 count;
+	struct blk_snap_device_stats *stats_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_STATS - Get the I/O statistics of the
+ *	snapshot.
+ *
+ * The statistics are collected for each block device of the snapshot from
+ * the moment the snapshot is taken.
+ *
+ * Return: 0 if succeeded, -ENODATA if the array is too small, negative errno
+ * otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_STATS                                          \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_stats,                         \
+	      struct blk_snap_snapshot_stats)
+
+/**
+ * struct blk_snap_snapshot_unused_blocks - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_UNUSED_BLOCKS control.
+ * @id:
+ *	Snapshot ID.
+ * @dev_id:
+ *	Device ID of the original block device.
+ * @count:
+ *	Size of @unused_blocks_array in the number of
+ *	&struct blk_snap_block_range.
+ * @unused_blocks_array:
+ *	Pointer to the array of &struct blk_snap_block_range.
+ */
+struct blk_snap_snapshot_unused_blocks {
+	struct blk_snap_uuid id;
+	struct blk_snap_dev dev_id;
+	__u32 count;
+	struct blk_snap_block_range *unused_blocks_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_UNUSED_BLOCKS - Set the blocks whose data
+ *	is not needed in the snapshot.
+ *
+ * The ranges may be the free space of the file system, the swap or temporary
+ * files. The data of the chunks that are completely covered by the ranges is
+ * not copied when the original device is written, including by discard and
+ * write-zeroes requests, and the snapshot image reads them as zeroes.
+ * The chunks that have already been copied or written are not changed.
+ * The control is allowed after the snapshot is prepared or taken.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_UNUSED_BLOCKS                                  \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_unused_blocks,                  \
+	     struct blk_snap_snapshot_unused_blocks)
+
+/**
+ * enum blk_snap_compression - Compression algorithm of the data stored in the
+ *	difference storage.
+ *
+ * @blk_snap_compression_none:
+ *	The data of the chunks is stored as is. This is the default.
+ * @blk_snap_compression_lz4:
+ *	The data of the chunks is compressed with the LZ4 algorithm.
+ */
+enum blk_snap_compression {
+	blk_snap_compression_none,
+	blk_snap_compression_lz4,
+	blk_snap_compression_end
+};
+
+/**
+ * struct blk_snap_snapshot_compression - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_SET_COMPRESSION control.
+ * @id:
+ *	Snapshot ID.
+ * @algorithm:
+ *	One of the values of &enum blk_snap_compression.
+ */
+struct blk_snap_snapshot_compression {
+	struct blk_snap_uuid id;
+	__u32 algorithm;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_SET_COMPRESSION - Set the compression
+ *	algorithm of the difference storage of the snapshot.
+ *
+ * The algorithm can be changed at any time and affects the chunks that are
+ * stored to the difference storage afterwards. The chunks which cannot be
+ * compressed by at least one page are stored as is. The compression allows
+ * to reduce the size of the difference storage and the amount of writes to
+ * it at the expense of the CPU time.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_SET_COMPRESSION                                \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_set_compression,                \
+	     struct blk_snap_snapshot_compression)
+
+/**
+ * struct blk_snap_snapshot_memory_storage - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_SET_MEMORY_STORAGE control.
+ * @id:
+ *	Snapshot ID.
+ * @memory_limit:
+ *	The limit in bytes of the memory that can be used to store the data
+ *	of the chunks of all devices of the snapshot. Zero disables the
+ *	storing of the chunks in the memory.
+ */
+struct blk_snap_snapshot_memory_storage {
+	struct blk_snap_uuid id;
+	__u64 memory_limit;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_SET_MEMORY_STORAGE - Allow to keep the
+ *	difference storage of the snapshot in RAM.
+ *
+ * The data of the copied chunks is compressed with the LZ4 algorithm and
+ * kept in the memory while the total size of the data does not exceed the
+ * limit. When the limit is reached, the chunks are stored in the block
+ * devices of the difference storage. The snapshot of short duration with a
+ * small amount of changes can be taken without any difference storage
+ * blocks. In this case, the snapshot is corrupted when the limit is
+ * reached.
+ * The limit can be changed at any time. The memory already used is not
+ * released when the limit is reduced.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_SET_MEMORY_STORAGE                             \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_set_memory_storage,             \
+	     struct blk_snap_snapshot_memory_storage)
+
+/**
+ * struct blk_snap_snapshot_storage_weight - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_WEIGHT control.
+ * @id:
+ *	Snapshot ID.
+ * @dev_id:
+ *	The ID of the block device of the difference storage.
+ * @weight:
+ *	The weight of the device, from 1 to 64. The default is 1.
+ */
+struct blk_snap_snapshot_storage_weight {
+	struct blk_snap_uuid id;
+	struct blk_snap_dev dev_id;
+	__u32 weight;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_WEIGHT - Set the weight of a
+ *	block device of the difference storage.
+ *
+ * If the difference storage is located on several block devices, the space
+ * for the chunks is allocated from them in turn, so the chunks are stored to
+ * all the devices simultaneously. A device with a greater weight receives
+ * proportionally more chunks. This allows to give more load to the faster
+ * devices. The device must already be added to the difference storage by
+ * &IOCTL_BLK_SNAP_SNAPSHOT_APPEND_STORAGE.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_WEIGHT                             \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_set_storage_weight,             \
+	     struct blk_snap_snapshot_storage_weight)
+
+#define BLK_SNAP_MEMORY_OBJECT_NAME_LIMIT 32
+
+/**
+ * struct blk_snap_memory_object - The memory usage of the module objects of
+ *	one type.
+ * @name:
+ *	The name of the object type.
+ * @value:
+ *	The number of objects of this type allocated now.
+ * @peak:
+ *	The maximum number of objects of this type that have been allocated
+ *	since the module was loaded.
+ */
+struct blk_snap_memory_object {
+	__u8 name[BLK_SNAP_MEMORY_OBJECT_NAME_LIMIT];
+	__s64 value;
+	__s64 peak;
+};
+
+/**
+ * struct blk_snap_memory_stats - Argument for the
+ *	&IOCTL_BLK_SNAP_MEMORY_STATS control.
+ * @count:
+ *	Size of @objects_array in the number of &struct blk_snap_memory_object.
+ *	If @objects_array is too small, an error is returned and the required
+ *	size is set. Otherwise, the number of object types is set.
+ * @objects_array:
+ *	Pointer to the array for the object types.
+ */
+struct blk_snap_memory_stats {
+	__u32 count;
+	struct blk_snap_memory_object *objects_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_MEMORY_STATS - Get the memory usage of the module.
+ *
+ * The module counts its allocations by the object type. The counters are
+ * per-CPU and are summed when they are read, so the values are accurate, and
+ * the peak values are approximate. It allows to estimate the memory
+ * consumption of the module on a live system.
+ *
+ * Return: 0 if succeeded, -ENODATA if the array is too small, negative errno
+ * otherwise.
+ */
+#define IOCTL_BLK_SNAP_MEMORY_STATS                                            \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_memory_stats,                           \
+	      struct blk_snap_memory_stats)
+
+/**
+ * struct blk_snap_snapshot_event_fd - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD control.
+ * @id:
+ *	Snapshot ID.
+ * @flags:
+ *	The flags of the file descriptor. Can be O_CLOEXEC and O_NONBLOCK.
+ * @fd:
+ *	The returned file descriptor.
+ */
+struct blk_snap_snapshot_event_fd {
+	struct blk_snap_uuid id;
+	__u32 flags;
+	__s32 fd;
+};
+
+/**
+ * struct blk_snap_event_header - The header of the event read from the event
+ *	file descriptor.
+ * @code:
+ *	Code of the event &enum blk_snap_event_codes.
+ * @data_size:
+ *	The number of bytes of the event body that follows the header.
+ * @time_label:
+ *	Timestamp of the event.
+ *
+ * The next event follows the body of the event, aligned to 8 bytes.
+ */
+struct blk_snap_event_header {
+	__u32 code;
+	__u32 data_size;
+	__s64 time_label;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD - Get the file descriptor for the
+ *	events of the snapshot.
+ *
+ * Unlike &IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT, the file descriptor can be used
+ * with poll(), select() and epoll, so the events of many snapshots can be
+ * waited for in one thread. The read() returns as many events as fit in the
+ * buffer, each as &struct blk_snap_event_header followed by the event body.
+ * If the buffer is too small for the first event, -EINVAL is returned. The
+ * end of the file is returned when the snapshot is destroyed and all its
+ * events are read. The events are taken from the same queue as by the
+ * &IOCTL_BLK_SNAP_SNAPSHOT_WAIT_EVENT.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD                                       \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_event_fd,                      \
+	      struct blk_snap_snapshot_event_fd)
+
+/**
+ * enum blk_snap_snapshot_option - The bits of the mask of the snapshot options.
+ * @blk_snap_snapshot_option_chunk_shift:
+ *	The &blk_snap_snapshot_options.chunk_shift is set.
+ * @blk_snap_snapshot_option_read_ahead:
+ *	The &blk_snap_snapshot_options.read_ahead is set.
+ * @blk_snap_snapshot_option_cache_size:
+ *	The &blk_snap_snapshot_options.cache_size is set.
+ * @blk_snap_snapshot_option_storage_increment:
+ *	The &blk_snap_snapshot_options.storage_increment is set.
+ * @blk_snap_snapshot_option_durability:
+ *	The &blk_snap_snapshot_options.durability is set.
+ * @blk_snap_snapshot_option_worker_count:
+ *	The &blk_snap_snapshot_options.worker_count is set.
+ * @blk_snap_snapshot_option_read_once:
+ *	The chunks of the snapshot images are released as soon as they are
+ *	read, see &IOCTL_BLK_SNAP_SNAPSHOT_RELEASE_BLOCKS. The option has
+ *	no value, the bit enables it.
+ * @blk_snap_snapshot_option_chunk_auto:
+ *	The chunk size of each device is chosen by the sizes of the recent
+ *	writes to it, so that most of them fit in a single chunk. The chunk
+ *	size does not exceed the one set by the chunk_shift. The option has
+ *	no value, the bit enables it.
+ * @blk_snap_snapshot_option_chunk_hash:
+ *	The hashes of the original contents of the chunks are computed when
+ *	they are read from the original devices, see
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_CHUNK_HASHES. The option has no value, the
+ *	bit enables it.
+ */
+enum blk_snap_snapshot_option {
+	blk_snap_snapshot_option_chunk_shift,
+	blk_snap_snapshot_option_read_ahead,
+	blk_snap_snapshot_option_cache_size,
+	blk_snap_snapshot_option_storage_increment,
+	blk_snap_snapshot_option_durability,
+	blk_snap_snapshot_option_worker_count,
+	blk_snap_snapshot_option_read_once,
+	blk_snap_snapshot_option_chunk_auto,
+	blk_snap_snapshot_option_chunk_hash,
+	blk_snap_snapshot_option_end
+};
+
+/**
+ * struct blk_snap_snapshot_options - The tuning parameters of the snapshot.
+ * @mask:
+ *	The bits of &enum blk_snap_snapshot_option. The options that are not
+ *	set in the mask are taken from the module parameters.
+ * @chunk_shift:
+ *	The minimum chunk size as a power of two, like the module parameter
+ *	chunk_minimum_shift.
+ * @read_ahead:
+ *	The number of chunks to read in advance, like the module parameter
+ *	chunk_read_ahead.
+ * @cache_size:
+ *	The size of the memory cache of chunks in bytes.
+ * @storage_increment:
+ *	The minimum portion of the difference storage in sectors requested
+ *	from the user space, like the module parameter diff_storage_minimum.
+ * @durability:
+ *	One of the values of &enum blk_snap_durability.
+ * @worker_count:
+ *	The number of worker threads for each snapshot image, like the module
+ *	parameter snapimage_worker_count. Zero means up to four threads.
+ */
+struct blk_snap_snapshot_options {
+	__u64 mask;
+	__u32 chunk_shift;
+	__u32 read_ahead;
+	__u64 cache_size;
+	__u64 storage_increment;
+	__u32 durability;
+	__u32 worker_count;
+};
+
+/**
+ * struct blk_snap_snapshot_create_ex - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX control.
+ * @count:
+ *	Size of @dev_id_array in the number of &struct blk_snap_dev.
+ * @dev_id_array:
+ *	Pointer to the array of &struct blk_snap_dev.
+ * @options:
+ *	The tuning parameters of the snapshot.
+ * @id:
+ *	Return ID of the created snapshot.
+ */
+struct blk_snap_snapshot_create_ex {
+	__u32 count;
+	struct blk_snap_dev *dev_id_array;
+	struct blk_snap_snapshot_options options;
+	struct blk_snap_uuid id;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX - Create snapshot with the tuning
+ *	parameters.
+ *
+ * Works like &IOCTL_BLK_SNAP_SNAPSHOT_CREATE, but allows to set the chunk
+ * size, the cache size, the read-ahead, the portion of the difference
+ * storage, the durability mode and the number of worker threads for this
+ * snapshot only. So the snapshots of block devices with different workloads
+ * can be tuned differently on the same system.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX                                      \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_create_ex,                     \
+	      struct blk_snap_snapshot_create_ex)
+
+/**
+ * struct blk_snap_snapshot_release_blocks - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_RELEASE_BLOCKS control.
+ * @id:
+ *	Snapshot ID.
+ * @dev_id:
+ *	Device ID of the original block device.
+ * @count:
+ *	Size of @released_blocks_array in the number of
+ *	&struct blk_snap_block_range.
+ * @released_blocks_array:
+ *	Pointer to the array of &struct blk_snap_block_range.
+ */
+struct blk_snap_snapshot_release_blocks {
+	struct blk_snap_uuid id;
+	struct blk_snap_dev dev_id;
+	__u32 count;
+	struct blk_snap_block_range *released_blocks_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_RELEASE_BLOCKS - Release the blocks of the
+ *	snapshot image that are no longer needed.
+ *
+ * Unlike &IOCTL_BLK_SNAP_SNAPSHOT_UNUSED_BLOCKS, the chunks that have
+ * already been copied are released too. Their regions of the difference
+ * storage are reused for other chunks, and their data is dropped from the
+ * cache. The data of the chunks that are completely covered by the ranges
+ * is not copied anymore, and the snapshot image reads them as zeroes.
+ * It allows the backup to shrink the difference storage as it progresses.
+ * With the &blk_snap_snapshot_option_read_once option, each chunk is
+ * released when the snapshot image read request reaches its last sector,
+ * so the image should be read in ascending order.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_RELEASE_BLOCKS                                 \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_release_blocks,                 \
+	     struct blk_snap_snapshot_release_blocks)
+
+/**
+ * struct blk_snap_snapshot_storage_file - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_FILE control.
+ * @id:
+ *	Snapshot ID.
+ * @fd:
+ *	The file descriptor of a regular file opened for writing without
+ *	O_DIRECT.
+ * @flags:
+ *	Reserved, must be zero.
+ * @size_limit:
+ *	The maximum size of the file in bytes. Zero means that the file is
+ *	limited only by the free space of its file system.
+ */
+struct blk_snap_snapshot_storage_file {
+	struct blk_snap_uuid id;
+	__s32 fd;
+	__u32 flags;
+	__u64 size_limit;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_FILE - Let the module extend
+ *	the difference storage with the file by itself.
+ *
+ * When the difference storage is running out of free space, the module
+ * allocates the next portion at the end of the file and appends its blocks
+ * to the difference storage without sending the low free space event to the
+ * user space. The file can be unnamed, opened with O_TMPFILE in a directory
+ * of the file system. The blocks of the file are written to directly, so the
+ * file must not be on the original devices of the snapshot. Until the
+ * snapshot is destroyed, the file is marked as a swap file, so it cannot be
+ * written to, truncated or defragmented. If the file cannot be extended, the
+ * free space is requested from the user space with the event as usual.
+ *
+ * Return: 0 if succeeded, -EBUSY if the file has already been set or the
+ * file is a swap file, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_FILE                               \
+	_IOW(BLK_SNAP, blk_snap_ioctl_snapshot_set_storage_file,               \
+	     struct blk_snap_snapshot_storage_file)
+
+/**
+ * struct blk_snap_snapshot_chunk_hashes - Argument for the
+ *	&IOCTL_BLK_SNAP_SNAPSHOT_CHUNK_HASHES control.
+ * @id:
+ *	Snapshot ID.
+ * @dev_id:
+ *	Device ID of the original block device.
+ * @chunk_shift:
+ *	Return the chunk size of the device as a power of two in bytes.
+ * @count:
+ *	Size of @hashes_array in the number of hashes. Return the number of
+ *	hashes copied.
+ * @first:
+ *	The number of the first chunk.
+ * @hashes_array:
+ *	Pointer to the array of hashes, one hash for each chunk. It is passed
+ *	as a 64-bit value, so the layout of the structure is the same for
+ *	32-bit user space.
+ */
+struct blk_snap_snapshot_chunk_hashes {
+	struct blk_snap_uuid id;
+	struct blk_snap_dev dev_id;
+	__u32 chunk_shift;
+	__u32 count;
+	__u64 first;
+	__u64 hashes_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_SNAPSHOT_CHUNK_HASHES - Get the hashes of the
+ *	original contents of the chunks.
+ *
+ * The snapshot must be created with the &blk_snap_snapshot_option_chunk_hash
+ * option. The hash is the xxh64 with zero seed of the original content of
+ * the chunk. It is computed when the chunk is copied on write, or when it
+ * is read from the original device through the snapshot image. A zero hash
+ * means that the hash of the chunk has not been computed yet. It is also
+ * zero for the chunks that were written through the snapshot image or
+ * released. A computed zero hash is returned as one. The backup can compare
+ * the hashes with the ones it has already stored, and skip reading the
+ * chunks whose content is already known. The last chunk of the device may
+ * be shorter than the chunk size.
+ *
+ * Return: 0 if succeeded, -EOPNOTSUPP if the hashes are not computed for the
+ * snapshot, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_SNAPSHOT_CHUNK_HASHES                                   \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_snapshot_chunk_hashes,                  \
+	      struct blk_snap_snapshot_chunk_hashes)
+
+/**
+ * struct blk_snap_tracker_read_cbt_since - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_READ_CBT_SINCE control.
+ * @dev_id:
+ *	Device ID.
+ * @generation_id:
+ *	The generation of changes in which the @snap_number was received.
+ * @snap_number:
+ *	Blocks with a sequential number of changes greater than this value
+ *	are considered changed.
+ * @count:
+ *	Size of @ranges in the number of &struct blk_snap_block_range.
+ *	On output, the number of ranges read.
+ * @sector_offset:
+ *	The sector from which the search starts. On output, the sector from
+ *	which the search should be continued.
+ * @ranges:
+ *	Pointer to the array of &struct blk_snap_block_range.
+ */
+struct blk_snap_tracker_read_cbt_since {
+	struct blk_snap_dev dev_id;
+	struct blk_snap_uuid generation_id;
+	__u32 snap_number;
+	__u32 count;
+	__u64 sector_offset;
+	struct blk_snap_block_range *ranges;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_READ_CBT_SINCE - Read the ranges of blocks
+ *	changed since any snapshot of the generation.
+ *
+ * Works like &IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES, but the module checks
+ * that the changes since the snapshot with the number
+ * &blk_snap_tracker_read_cbt_since.snap_number can still be found in the
+ * CBT map. So several backups that were last synchronized at different
+ * snapshots can be served by one tracker, each backup passing the generation
+ * and the snapshot number it has stored. The number must not be greater than
+ * the number of the last snapshot taken, &blk_snap_cbt_info.snap_number.
+ *
+ * Return: 0 if succeeded, -ESTALE if the generation of changes has been
+ * changed and the full backup is needed, -EAGAIN if the generation has been
+ * changed while the ranges were read, negative errno otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_READ_CBT_SINCE                                  \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_read_cbt_since,                 \
+	      struct blk_snap_tracker_read_cbt_since)
+
+/**
+ * struct blk_snap_tracker_mark_dirty_multi - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_MARK_DIRTY_MULTI control.
+ * @count:
+ *	Size of @devices_array in the number of
+ *	&struct blk_snap_tracker_mark_dirty_blocks. On output, the number of
+ *	devices processed.
+ * @devices_array:
+ *	Pointer to the array of &struct blk_snap_tracker_mark_dirty_blocks.
+ */
+struct blk_snap_tracker_mark_dirty_multi {
+	__u32 count;
+	struct blk_snap_tracker_mark_dirty_blocks *devices_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_MARK_DIRTY_MULTI - Set dirty blocks in the
+ *	CBT maps of several devices.
+ *
+ * Works like &IOCTL_BLK_SNAP_TRACKER_MARK_DIRTY_BLOCKS for each element of
+ * &blk_snap_tracker_mark_dirty_multi.devices_array in one call. The ranges
+ * of each device do not need to be sorted, they are sorted and merged by the
+ * module, and the CBT map of the device is locked once for all of them. To
+ * keep the writes to the device from waiting for long, the lock is released
+ * for a moment after every 65536 blocks marked. The processing stops at the first device that fails, and
+ * &blk_snap_tracker_mark_dirty_multi.count is set to the number of
+ * devices processed successfully.
+ *
+ * Return: 0 if succeeded, negative errno of the failed device otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_MARK_DIRTY_MULTI                                \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_mark_dirty_multi,               \
+	      struct blk_snap_tracker_mark_dirty_multi)
+
+/**
+ * struct blk_snap_tracker_read_cbt_multi - Argument for the
+ *	&IOCTL_BLK_SNAP_TRACKER_READ_CBT_MULTI control.
+ * @count:
+ *	Size of @requests_array in the number of
+ *	&struct blk_snap_tracker_read_cbt_since. On output, the number of
+ *	requests processed.
+ * @requests_array:
+ *	Pointer to the array of &struct blk_snap_tracker_read_cbt_since.
+ */
+struct blk_snap_tracker_read_cbt_multi {
+	__u32 count;
+	struct blk_snap_tracker_read_cbt_since *requests_array;
+};
+
+/**
+ * define IOCTL_BLK_SNAP_TRACKER_READ_CBT_MULTI - Read the ranges of changed
+ *	blocks of several devices.
+ *
+ * Works like &IOCTL_BLK_SNAP_TRACKER_READ_CBT_SINCE for each element of
+ * &blk_snap_tracker_read_cbt_multi.requests_array in one call. The output
+ * fields of each request are updated. The processing stops at the first
+ * request that fails, and &blk_snap_tracker_read_cbt_multi.count is set to
+ * the number of requests processed successfully.
+ *
+ * Return: 0 if succeeded, negative errno of the failed request otherwise.
+ */
+#define IOCTL_BLK_SNAP_TRACKER_READ_CBT_MULTI                                  \
+	_IOWR(BLK_SNAP, blk_snap_ioctl_tracker_read_cbt_multi,                 \
+	      struct blk_snap_tracker_read_cbt_multi)
+
 #endif /* BLK_SNAP_MODIFICATION */
 
 #endif /* _UAPI_LINUX_BLK_SNAP_H */
@@ -19,6 +19,7 @@
 #include <blksnap/Blksnap.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -63,6 +64,104 @@ bool CBlksnap::Modification(struct blk_snap_mod& mod)
     }
     return true;
 }
+
+/*
+ * Reads the next portion of changed ranges starting from sectorOffset.
+ * The ranges vector size limits the number of ranges; on return, the vector
+ * contains only the ranges read. Returns false if the kernel module does not
+ * support this ioctl.
+ */
+bool CBlksnap::ReadCbtRanges(struct blk_snap_dev dev_id, uint8_t snapNumber, sector_t& sectorOffset,
+                             std::vector<struct blk_snap_block_range>& ranges)
+{
+    struct blk_snap_tracker_read_cbt_ranges param = {
+      .dev_id = dev_id,
+      .snap_number = snapNumber,
+      .count = static_cast<__u32>(ranges.size()),
+      .sector_offset = sectorOffset,
+      .ranges = ranges.data()};
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_TRACKER_READ_CBT_RANGES, &param))
+    {
+        if (errno == ENOTTY)
+            return false;
+        throw std::system_error(errno, std::generic_category(), "Failed to read changed ranges from change tracking.");
+    }
+
+    ranges.resize(param.count);
+    sectorOffset = param.sector_offset;
+    return true;
+}
+
+/*
+ * Works like ReadCbtRanges(), but the kernel module checks that the changes
+ * since the snapshot with the snapNumber of the generation generationId can
+ * still be found. If the generation has been changed, the std::system_error
+ * with ESTALE is thrown.
+ */
+bool CBlksnap::ReadCbtRangesSince(struct blk_snap_dev dev_id, const uuid_t& generationId, uint8_t snapNumber,
+                                  sector_t& sectorOffset, std::vector<struct blk_snap_block_range>& ranges)
+{
+    struct blk_snap_tracker_read_cbt_since param = {
+      .dev_id = dev_id,
+      .snap_number = snapNumber,
+      .count = static_cast<__u32>(ranges.size()),
+      .sector_offset = sectorOffset,
+      .ranges = ranges.data()};
+
+    uuid_copy(param.generation_id.b, generationId);
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_TRACKER_READ_CBT_SINCE, &param))
+    {
+        if (errno == ENOTTY)
+            return false;
+        throw std::system_error(errno, std::generic_category(), "Failed to read changed ranges from change tracking.");
+    }
+
+    ranges.resize(param.count);
+    sectorOffset = param.sector_offset;
+    return true;
+}
+
+/*
+ * The count and sector_offset of each request are updated like by
+ * ReadCbtRangesSince(). If one of the requests fails, the std::system_error
+ * is thrown, the requests before it have already been processed.
+ */
+bool CBlksnap::ReadCbtRangesMulti(std::vector<struct blk_snap_tracker_read_cbt_since>& requests)
+{
+    struct blk_snap_tracker_read_cbt_multi param = {
+      .count = static_cast<__u32>(requests.size()),
+      .requests_array = requests.data()};
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_TRACKER_READ_CBT_MULTI, &param))
+    {
+        if (errno == ENOTTY)
+            return false;
+        throw std::system_error(errno, std::generic_category(),
+                                "Failed to read changed ranges from change tracking for request #"
+                                  + std::to_string(param.count) + ".");
+    }
+    return true;
+}
+
+/*
+ * The ranges of each device are sorted and merged by the kernel module.
+ */
+bool CBlksnap::MarkDirtyBlocksMulti(std::vector<struct blk_snap_tracker_mark_dirty_blocks>& devices)
+{
+    struct blk_snap_tracker_mark_dirty_multi param = {
+      .count = static_cast<__u32>(devices.size()),
+      .devices_array = devices.data()};
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_TRACKER_MARK_DIRTY_MULTI, &param))
+    {
+        if (errno == ENOTTY)
+            return false;
+        throw std::system_error(errno, std::generic_category(),
+                                "Failed to mark dirty blocks for device #" + std::to_string(param.count) + ".");
+    }
+    return true;
+}
 #endif
 
 void CBlksnap::CollectTrackers(std::vector<struct blk_snap_cbt_info>& cbtInfoVector)
@@ -108,6 +207,24 @@ void CBlksnap::Create(const std::vector<struct blk_snap_dev>& devices, uuid_t& i
     uuid_copy(id, param.id.b);
 }
 
+#ifdef BLK_SNAP_MODIFICATION
+void CBlksnap::Create(const std::vector<struct blk_snap_dev>& devices, const struct blk_snap_snapshot_options& options,
+                      uuid_t& id)
+{
+    struct blk_snap_snapshot_create_ex param = {0};
+
+    std::vector<struct blk_snap_dev> localDevices = devices;
+    param.count = localDevices.size();
+    param.dev_id_array = localDevices.data();
+    param.options = options;
+
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_CREATE_EX, &param))
+        throw std::system_error(errno, std::generic_category(), "Failed to create snapshot object with options.");
+
+    uuid_copy(id, param.id.b);
+}
+#endif
+
 void CBlksnap::Destroy(const uuid_t& id)
 {
     struct blk_snap_snapshot_destroy param = {0};
@@ -164,6 +281,33 @@ void CBlksnap::Take(const uuid_t& id)
         throw std::system_error(errno, std::generic_category(), "[TBD]Failed to take snapshot.");
 }
 
+static void DecodeEvent(unsigned int code, long long time, const void* data, SBlksnapEvent& ev)
+{
+    ev.code = code;
+    ev.time = time;
+
+    switch (code)
+    {
+    case blk_snap_event_code_low_free_space:
+    {
+        const struct blk_snap_event_low_free_space* lowFreeSpace
+          = static_cast<const struct blk_snap_event_low_free_space*>(data);
+
+        ev.lowFreeSpace.requestedSectors = lowFreeSpace->requested_nr_sect;
+        ev.lowFreeSpace.fillRate = lowFreeSpace->fill_rate;
+        break;
+    }
+    case blk_snap_event_code_corrupted:
+    {
+        const struct blk_snap_event_corrupted* corrupted = static_cast<const struct blk_snap_event_corrupted*>(data);
+
+        ev.corrupted.origDevId = corrupted->orig_dev_id;
+        ev.corrupted.errorCode = corrupted->err_code;
+        break;
+    }
+    }
+}
+
 bool CBlksnap::WaitEvent(const uuid_t& id, unsigned int timeoutMs, SBlksnapEvent& ev)
 {
     struct blk_snap_snapshot_event param;
@@ -178,29 +322,88 @@ bool CBlksnap::WaitEvent(const uuid_t& id, unsigned int timeoutMs, SBlksnapEvent
         else
             throw std::system_error(errno, std::generic_category(), "[TBD]Failed to get event from snapshot.");
     }
-    ev.code = param.code;
-    ev.time = param.time_label;
+    DecodeEvent(param.code, param.time_label, param.data, ev);
+    return true;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+int CBlksnap::OpenEventFd(const uuid_t& id, bool nonblock)
+{
+    struct blk_snap_snapshot_event_fd param = {0};
+
+    uuid_copy(param.id.b, id);
+    param.flags = O_CLOEXEC | (nonblock ? O_NONBLOCK : 0);
 
-    switch (param.code)
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_EVENT_FD, &param))
     {
-    case blk_snap_event_code_low_free_space:
+        if (errno == ENOTTY)
+            return -1;
+        throw std::system_error(errno, std::generic_category(), "Failed to open event file for snapshot.");
+    }
+    return param.fd;
+}
+
+bool CBlksnap::ReadEvents(int eventFd, int timeoutMs, std::vector<SBlksnapEvent>& events)
+{
+    struct pollfd pfd = {.fd = eventFd, .events = POLLIN, .revents = 0};
+    alignas(struct blk_snap_event_header) char buffer[sizeof(struct blk_snap_snapshot_event)];
+    ssize_t size;
+    size_t offset = 0;
+
+    events.clear();
+
+    int ret = ::poll(&pfd, 1, timeoutMs);
+    if (ret < 0)
     {
-        struct blk_snap_event_low_free_space* lowFreeSpace = (struct blk_snap_event_low_free_space*)(param.data);
+        if (errno == EINTR)
+            return false;
+        throw std::system_error(errno, std::generic_category(), "Failed to poll event file.");
+    }
+    if (ret == 0)
+        return false;
 
-        ev.lowFreeSpace.requestedSectors = lowFreeSpace->requested_nr_sect;
-        break;
+    size = ::read(eventFd, buffer, sizeof(buffer));
+    if (size < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EINTR))
+            return false;
+        throw std::system_error(errno, std::generic_category(), "Failed to read event file.");
     }
-    case blk_snap_event_code_corrupted:
+    if (size == 0)
+        throw std::system_error(ESRCH, std::generic_category(), "The snapshot has been destroyed.");
+
+    while ((offset + sizeof(struct blk_snap_event_header)) <= static_cast<size_t>(size))
     {
-        struct blk_snap_event_corrupted* corrupted = (struct blk_snap_event_corrupted*)(param.data);
+        const struct blk_snap_event_header* header
+          = reinterpret_cast<const struct blk_snap_event_header*>(buffer + offset);
+        SBlksnapEvent ev;
 
-        ev.corrupted.origDevId = corrupted->orig_dev_id;
-        ev.corrupted.errorCode = corrupted->err_code;
-        break;
-    }
+        DecodeEvent(header->code, header->time_label, header + 1, ev);
+        events.push_back(ev);
+
+        offset += (sizeof(struct blk_snap_event_header) + header->data_size + 7) & ~static_cast<size_t>(7);
     }
-    return true;
+    return !events.empty();
+}
+
+void CBlksnap::SnapshotStats(const uuid_t& id, std::vector<struct blk_snap_device_stats>& stats)
+{
+    struct blk_snap_snapshot_stats param = {0};
+
+    uuid_copy(param.id.b, id);
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_STATS, &param))
+        throw std::system_error(errno, std::generic_category(), "Failed to get snapshot statistics.");
+
+    stats.resize(param.count);
+    if (stats.empty())
+        return;
+
+    param.stats_array = stats.data();
+    if (::ioctl(m_fd, IOCTL_BLK_SNAP_SNAPSHOT_STATS, &param))
+        throw std::system_error(errno, std::generic_category(), "Failed to get snapshot statistics.");
+    stats.resize(param.count);
 }
+#endif
 
 #if defined(BLK_SNAP_MODIFICATION) && defined(BLK_SNAP_DEBUG_SECTOR_STATE)
 void CBlksnap::GetSectorState(struct blk_snap_dev image_dev_id, off_t offset, struct blk_snap_sector_state& state)
@@ -18,9 +18,11 @@
  */
 #include <blksnap/Blksnap.h>
 #include <blksnap/Cbt.h>
+#include <blksnap/CbtDecoder.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <algorithm>
 #include <system_error>
 
 using namespace blksnap;
@@ -33,15 +35,32 @@ public:
 
     std::shared_ptr<SCbtInfo> GetCbtInfo(const std::string& original) override;
     std::shared_ptr<SCbtData> GetCbtData(const std::shared_ptr<SCbtInfo>& ptrCbtInfo) override;
+    void GetChangedRanges(const std::string& original, uint8_t sinceSnapNumber,
+                          const std::function<void(const SRange&)>& callback) override;
+    void GetChangedRangesSince(const std::string& original, const uuid_t& generationId, uint8_t sinceSnapNumber,
+                               const std::function<void(const SRange&)>& callback) override;
 
 private:
     const struct blk_snap_cbt_info& GetCbtInfoInternal(unsigned int mj, unsigned int mn);
+    bool ReadChangedRanges(const struct blk_snap_cbt_info& cbtInfo, uint8_t sinceSnapNumber,
+                           const std::function<void(const SRange&)>& callback);
+    bool ReadChangedRangesSince(const struct blk_snap_cbt_info& cbtInfo, const uuid_t& generationId,
+                                uint8_t sinceSnapNumber, const std::function<void(const SRange&)>& callback);
+    void DecodeChangedRanges(const struct blk_snap_cbt_info& cbtInfo, uint8_t sinceSnapNumber,
+                             const std::function<void(const SRange&)>& callback);
 
 private:
     CBlksnap m_blksnap;
     std::vector<struct blk_snap_cbt_info> m_cbtInfos;
 };
 
+namespace
+{
+    const size_t cbtRangesPortion = 1024;
+    const size_t cbtMapPortion = 1024 * 1024;
+    const int cbtReadRetries = 3;
+}
+
 std::shared_ptr<ICbt> ICbt::Create()
 {
     return std::make_shared<CCbt>();
@@ -84,3 +103,136 @@ std::shared_ptr<SCbtData> CCbt::GetCbtData(const std::shared_ptr<SCbtInfo>& ptrC
 
     return ptrCbtMap;
 }
+
+bool CCbt::ReadChangedRanges(const struct blk_snap_cbt_info& cbtInfo, uint8_t sinceSnapNumber,
+                             const std::function<void(const SRange&)>& callback)
+{
+    const sector_t capacity = cbtInfo.device_capacity >> SECTOR_SHIFT;
+    std::vector<struct blk_snap_block_range> ranges;
+    CRangeMerger merger(0, callback);
+    sector_t sectorOffset = 0;
+
+    while (sectorOffset < capacity)
+    {
+        ranges.resize(cbtRangesPortion);
+        if (!m_blksnap.ReadCbtRanges(cbtInfo.dev_id, sinceSnapNumber, sectorOffset, ranges))
+            return false;
+
+        for (const struct blk_snap_block_range& range : ranges)
+            merger.Add(range.sector_offset, range.sector_count);
+    }
+    merger.Flush();
+
+    return true;
+}
+
+/*
+ * The portions read before the generation was changed cannot be combined
+ * with the next ones, so on EAGAIN the reading starts again from the first
+ * sector. The callback is called only when all the ranges have been read
+ * consistently.
+ */
+bool CCbt::ReadChangedRangesSince(const struct blk_snap_cbt_info& cbtInfo, const uuid_t& generationId,
+                                  uint8_t sinceSnapNumber, const std::function<void(const SRange&)>& callback)
+{
+    const sector_t capacity = cbtInfo.device_capacity >> SECTOR_SHIFT;
+    std::vector<struct blk_snap_block_range> ranges;
+    std::vector<SRange> changedRanges;
+
+    for (int retry = 0;; retry++)
+    {
+        CRangeMerger merger(0, [&changedRanges](const SRange& rg) { changedRanges.push_back(rg); });
+        sector_t sectorOffset = 0;
+
+        changedRanges.clear();
+        try
+        {
+            while (sectorOffset < capacity)
+            {
+                ranges.resize(cbtRangesPortion);
+                if (!m_blksnap.ReadCbtRangesSince(cbtInfo.dev_id, generationId, sinceSnapNumber, sectorOffset,
+                                                  ranges))
+                    return false;
+
+                for (const struct blk_snap_block_range& range : ranges)
+                    merger.Add(range.sector_offset, range.sector_count);
+            }
+        }
+        catch (const std::system_error& ex)
+        {
+            if ((ex.code().value() != EAGAIN) || (retry >= cbtReadRetries))
+                throw;
+            continue;
+        }
+        merger.Flush();
+        break;
+    }
+
+    for (const SRange& rg : changedRanges)
+        callback(rg);
+    return true;
+}
+
+void CCbt::DecodeChangedRanges(const struct blk_snap_cbt_info& cbtInfo, uint8_t sinceSnapNumber,
+                               const std::function<void(const SRange&)>& callback)
+{
+    const sector_t capacity = cbtInfo.device_capacity >> SECTOR_SHIFT;
+    const sector_t blockSectors = cbtInfo.blk_size >> SECTOR_SHIFT;
+    std::vector<uint8_t> portion(cbtMapPortion);
+    CRangeMerger merger(0, callback);
+
+    for (size_t offset = 0; offset < cbtInfo.blk_count; offset += portion.size())
+    {
+        const size_t length = std::min(portion.size(), static_cast<size_t>(cbtInfo.blk_count - offset));
+
+        m_blksnap.ReadCbtMap(cbtInfo.dev_id, offset, length, portion.data());
+        CbtFindChanged(portion.data(), length, sinceSnapNumber, [&](size_t first, size_t count) {
+            const sector_t sector = (offset + first) * blockSectors;
+
+            merger.Add(sector, std::min(count * blockSectors, capacity - sector));
+        });
+    }
+    merger.Flush();
+}
+
+void CCbt::GetChangedRanges(const std::string& original, uint8_t sinceSnapNumber,
+                            const std::function<void(const SRange&)>& callback)
+{
+    struct stat st;
+
+    if (::stat(original.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), original);
+
+    const struct blk_snap_cbt_info& cbtInfo = GetCbtInfoInternal(major(st.st_rdev), minor(st.st_rdev));
+
+    /*
+     * The kernel module skips unchanged regions of the map by itself.
+     * If it does not support this, the map is read and decoded in portions.
+     */
+    if (!ReadChangedRanges(cbtInfo, sinceSnapNumber, callback))
+        DecodeChangedRanges(cbtInfo, sinceSnapNumber, callback);
+}
+
+void CCbt::GetChangedRangesSince(const std::string& original, const uuid_t& generationId, uint8_t sinceSnapNumber,
+                                 const std::function<void(const SRange&)>& callback)
+{
+    struct stat st;
+
+    if (::stat(original.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), original);
+
+    const struct blk_snap_cbt_info& cbtInfo = GetCbtInfoInternal(major(st.st_rdev), minor(st.st_rdev));
+
+    if (ReadChangedRangesSince(cbtInfo, generationId, sinceSnapNumber, callback))
+        return;
+
+    /*
+     * The kernel module cannot check the generation by itself, so it is
+     * checked by the information collected on creation.
+     */
+    if (uuid_compare(cbtInfo.generation_id.b, generationId))
+        throw std::system_error(ESTALE, std::generic_category(), "The generation of changes has been changed.");
+    if (sinceSnapNumber > cbtInfo.snap_number)
+        throw std::system_error(EINVAL, std::generic_category(), "The snapshot has not been taken yet.");
+    GetChangedRanges(original, sinceSnapNumber, callback);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <blksnap/CbtDecoder.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define CBT_DECODER_X86
+#elif defined(__aarch64__)
+#    include <arm_neon.h>
+#    define CBT_DECODER_NEON
+#endif
+
+using namespace blksnap;
+
+namespace
+{
+    typedef void (*CbtFindChangedFn)(const uint8_t* map, size_t size, uint8_t snapNumber,
+                                     const std::function<void(size_t, size_t)>& callback);
+
+    /*
+     * The scanning loop is common for all implementations. The mask functor
+     * returns a bitmask of changed blocks for Width bytes of the map. Runs
+     * of unchanged blocks and runs of changed blocks are skipped for a whole
+     * vector at once.
+     */
+    template <size_t Width, typename Mask>
+    inline __attribute__((always_inline)) void FindChanged(const uint8_t* map, size_t size, uint8_t snapNumber,
+                                                           const std::function<void(size_t, size_t)>& callback,
+                                                           Mask mask)
+    {
+        const uint64_t full = (Width == 64) ? ~0ull : ((1ull << Width) - 1);
+        bool inRun = false;
+        size_t first = 0;
+        size_t inx = 0;
+
+        for (; inx + Width <= size; inx += Width)
+        {
+            const uint64_t changed = mask(map + inx);
+
+            if (!inRun && !changed)
+                continue;
+            if (inRun && (changed == full))
+                continue;
+
+            size_t bit = 0;
+            while (bit < Width)
+            {
+                const uint64_t rest = (inRun ? (~changed & full) : changed) >> bit;
+                if (!rest)
+                    break;
+
+                bit += __builtin_ctzll(rest);
+                if (inRun)
+                    callback(first, inx + bit - first);
+                else
+                    first = inx + bit;
+                inRun = !inRun;
+            }
+        }
+
+        for (; inx < size; inx++)
+        {
+            const bool isChanged = map[inx] > snapNumber;
+
+            if (isChanged == inRun)
+                continue;
+            if (inRun)
+                callback(first, inx - first);
+            else
+                first = inx;
+            inRun = isChanged;
+        }
+
+        if (inRun)
+            callback(first, size - first);
+    }
+
+    void FindChangedScalar(const uint8_t* map, size_t size, uint8_t snapNumber,
+                           const std::function<void(size_t, size_t)>& callback)
+    {
+        FindChanged<8>(map, size, snapNumber, callback, [snapNumber](const uint8_t* ptr) {
+            uint64_t changed = 0;
+
+            for (size_t inx = 0; inx < 8; inx++)
+                if (ptr[inx] > snapNumber)
+                    changed |= (1ull << inx);
+            return changed;
+        });
+    }
+
+#ifdef CBT_DECODER_X86
+    /*
+     * There is no unsigned comparison in SSE2 and AVX2. The value is
+     * greater than snapNumber if max(value, snapNumber + 1) == value.
+     */
+    __attribute__((target("sse2"))) void FindChangedSse2(const uint8_t* map, size_t size, uint8_t snapNumber,
+                                                         const std::function<void(size_t, size_t)>& callback)
+    {
+        FindChanged<16>(map, size, snapNumber, callback,
+                        [snapNumber](const uint8_t* ptr) __attribute__((target("sse2"))) {
+                            const __m128i threshold = _mm_set1_epi8(static_cast<char>(snapNumber + 1));
+                            const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+
+                            return static_cast<uint64_t>(static_cast<uint32_t>(
+                              _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(value, threshold), value))));
+                        });
+    }
+
+    __attribute__((target("avx2"))) void FindChangedAvx2(const uint8_t* map, size_t size, uint8_t snapNumber,
+                                                         const std::function<void(size_t, size_t)>& callback)
+    {
+        FindChanged<32>(map, size, snapNumber, callback,
+                        [snapNumber](const uint8_t* ptr) __attribute__((target("avx2"))) {
+                            const __m256i threshold = _mm256_set1_epi8(static_cast<char>(snapNumber + 1));
+                            const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+
+                            return static_cast<uint64_t>(static_cast<uint32_t>(
+                              _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(value, threshold), value))));
+                        });
+    }
+#endif
+
+#ifdef CBT_DECODER_NEON
+    void FindChangedNeon(const uint8_t* map, size_t size, uint8_t snapNumber,
+                         const std::function<void(size_t, size_t)>& callback)
+    {
+        const uint8x16_t threshold = vdupq_n_u8(snapNumber);
+        const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+        const uint8x16_t bits = vld1q_u8(weights);
+
+        FindChanged<16>(map, size, snapNumber, callback, [threshold, bits](const uint8_t* ptr) {
+            const uint8x16_t changed = vandq_u8(vcgtq_u8(vld1q_u8(ptr), threshold), bits);
+
+            return static_cast<uint64_t>(vaddv_u8(vget_low_u8(changed)))
+                   | (static_cast<uint64_t>(vaddv_u8(vget_high_u8(changed))) << 8);
+        });
+    }
+#endif
+
+    struct SCbtDecoder
+    {
+        CbtFindChangedFn fn;
+        const char* name;
+    };
+
+    SCbtDecoder SelectDecoder()
+    {
+#ifdef CBT_DECODER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return {FindChangedAvx2, "avx2"};
+        if (__builtin_cpu_supports("sse2"))
+            return {FindChangedSse2, "sse2"};
+#endif
+#ifdef CBT_DECODER_NEON
+        return {FindChangedNeon, "neon"};
+#endif
+        return {FindChangedScalar, "scalar"};
+    }
+
+    const SCbtDecoder& Decoder()
+    {
+        static const SCbtDecoder decoder = SelectDecoder();
+
+        return decoder;
+    }
+}
+
+void blksnap::CbtFindChanged(const uint8_t* map, size_t size, uint8_t snapNumber,
+                             const std::function<void(size_t, size_t)>& callback)
+{
+    /* No block can have a change number greater than the maximum */
+    if (snapNumber == UINT8_MAX)
+        return;
+
+    Decoder().fn(map, size, snapNumber, callback);
+}
+
+const char* blksnap::CbtDecoderName()
+{
+    return Decoder().name;
+}
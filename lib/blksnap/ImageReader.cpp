@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * The reader uses the native asynchronous I/O interface of the kernel.
+ * The image is opened with O_DIRECT, so the data is transferred from the
+ * block device right into the buffers of the requests without copying
+ * through the page cache. The queue of requests is kept full until all
+ * the ranges are read.
+ */
+#include <algorithm>
+#include <blksnap/Cbt.h>
+#include <blksnap/ImageReader.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+
+using namespace blksnap;
+
+namespace
+{
+    inline int io_setup(unsigned int nr, aio_context_t* ctx)
+    {
+        return ::syscall(__NR_io_setup, nr, ctx);
+    }
+    inline int io_destroy(aio_context_t ctx)
+    {
+        return ::syscall(__NR_io_destroy, ctx);
+    }
+    inline int io_submit(aio_context_t ctx, long nr, struct iocb** iocbpp)
+    {
+        return ::syscall(__NR_io_submit, ctx, nr, iocbpp);
+    }
+    inline int io_getevents(aio_context_t ctx, long min_nr, long max_nr, struct io_event* events)
+    {
+        return ::syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, nullptr);
+    }
+
+    struct SRequest
+    {
+        struct iocb cb;
+        void* buffer;
+        /* The requested portion of the image in bytes */
+        off_t offset;
+        size_t size;
+        /* The offset of the portion from the beginning of the buffer */
+        size_t shift;
+    };
+}
+
+class CImageReader : public IImageReader
+{
+public:
+    CImageReader(const std::string& imageName, const SImageReaderOptions& options);
+    ~CImageReader() override;
+
+    off_t GetSize() override
+    {
+        return m_size;
+    };
+    void Read(const std::vector<SRange>& ranges, const DataCallback& callback) override;
+    void ReadAll(const DataCallback& callback) override;
+    void ReadChanged(const std::string& original, uint8_t sinceSnapNumber,
+                     const DataCallback& callback) override;
+
+private:
+    void Submit(SRequest* req, off_t offset, size_t size);
+    void Complete(long minCount, const DataCallback& callback);
+    void Drain();
+
+private:
+    std::string m_imageName;
+    int m_fd;
+    off_t m_size;
+    size_t m_alignment;
+    size_t m_blockSize;
+    aio_context_t m_ctx;
+    std::vector<SRequest> m_requests;
+    std::vector<SRequest*> m_free;
+    std::vector<struct io_event> m_events;
+    unsigned int m_inflight;
+};
+
+std::shared_ptr<IImageReader> IImageReader::Create(const std::string& imageName,
+                                                   const SImageReaderOptions& options)
+{
+    return std::make_shared<CImageReader>(imageName, options);
+}
+
+CImageReader::CImageReader(const std::string& imageName, const SImageReaderOptions& options)
+    : m_imageName(imageName)
+    , m_fd(-1)
+    , m_size(0)
+    , m_alignment(SECTOR_SIZE)
+    , m_ctx(0)
+    , m_inflight(0)
+{
+    unsigned int queueDepth = std::max(options.queueDepth, 1U);
+    int logicalBlockSize = 0;
+    uint64_t size = 0;
+    int ret;
+
+    m_fd = ::open(m_imageName.c_str(), O_RDONLY | O_DIRECT);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to open image [" + m_imageName + "]");
+
+    if (!::ioctl(m_fd, BLKSSZGET, &logicalBlockSize) && (logicalBlockSize > SECTOR_SIZE))
+        m_alignment = logicalBlockSize;
+
+    if (::ioctl(m_fd, BLKGETSIZE64, &size))
+    {
+        ret = errno;
+        ::close(m_fd);
+        throw std::system_error(ret, std::generic_category(), "Failed to get size of image [" + m_imageName + "]");
+    }
+    m_size = static_cast<off_t>(size);
+
+    m_blockSize = std::max(options.blockSize & ~(m_alignment - 1), m_alignment);
+
+    if (io_setup(queueDepth, &m_ctx))
+    {
+        ret = errno;
+        ::close(m_fd);
+        throw std::system_error(ret, std::generic_category(), "Failed to create I/O context");
+    }
+
+    m_requests.resize(queueDepth);
+    for (SRequest& req : m_requests)
+    {
+        /*
+         * The buffer must be aligned to the page size so that any
+         * logical block size of the device is supported.
+         */
+        if (::posix_memalign(&req.buffer, std::max<size_t>(::sysconf(_SC_PAGESIZE), m_alignment), m_blockSize))
+            req.buffer = nullptr;
+        if (!req.buffer)
+        {
+            for (SRequest& r : m_requests)
+                ::free(r.buffer);
+            io_destroy(m_ctx);
+            ::close(m_fd);
+            throw std::system_error(ENOMEM, std::generic_category(), "Failed to allocate I/O buffers");
+        }
+        m_free.push_back(&req);
+    }
+    m_events.resize(queueDepth);
+}
+
+CImageReader::~CImageReader()
+{
+    /*
+     * Destroying the context waits for the completion of the requests
+     * that are still in flight.
+     */
+    io_destroy(m_ctx);
+    for (SRequest& req : m_requests)
+        ::free(req.buffer);
+    ::close(m_fd);
+}
+
+void CImageReader::Submit(SRequest* req, off_t offset, size_t size)
+{
+    off_t alignedOffset = offset & ~static_cast<off_t>(m_alignment - 1);
+    off_t alignedEnd = (offset + size + m_alignment - 1) & ~static_cast<off_t>(m_alignment - 1);
+    struct iocb* cbs[1] = {&req->cb};
+    int ret;
+
+    req->offset = offset;
+    req->size = size;
+    req->shift = offset - alignedOffset;
+
+    memset(&req->cb, 0, sizeof(req->cb));
+    req->cb.aio_data = reinterpret_cast<uint64_t>(req);
+    req->cb.aio_lio_opcode = IOCB_CMD_PREAD;
+    req->cb.aio_fildes = m_fd;
+    req->cb.aio_buf = reinterpret_cast<uint64_t>(req->buffer);
+    req->cb.aio_nbytes = alignedEnd - alignedOffset;
+    req->cb.aio_offset = alignedOffset;
+
+    do
+    {
+        ret = io_submit(m_ctx, 1, cbs);
+    } while ((ret < 0) && (errno == EINTR));
+    if (ret < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to submit read request");
+    m_inflight++;
+}
+
+void CImageReader::Complete(long minCount, const DataCallback& callback)
+{
+    int count;
+
+    do
+    {
+        count = io_getevents(m_ctx, minCount, m_events.size(), m_events.data());
+    } while ((count < 0) && (errno == EINTR));
+    if (count < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to get read completions");
+
+    /*
+     * All the reaped requests are accounted before the data is passed on,
+     * so that a failed request or the callback does not leave them in flight.
+     */
+    for (int inx = 0; inx < count; inx++)
+        m_free.push_back(reinterpret_cast<SRequest*>(m_events[inx].data));
+    m_inflight -= count;
+
+    const SRequest* failedReq = nullptr;
+    int error = 0;
+    for (int inx = 0; inx < count; inx++)
+    {
+        const struct io_event& ev = m_events[inx];
+        const SRequest* req = reinterpret_cast<SRequest*>(ev.data);
+
+        if (ev.res < 0)
+        {
+            if (!failedReq)
+            {
+                failedReq = req;
+                error = -ev.res;
+            }
+            continue;
+        }
+        /*
+         * The read is short only at the end of the image.
+         */
+        size_t done = static_cast<size_t>(ev.res) > req->shift ? ev.res - req->shift : 0;
+        if (done)
+            callback(req->offset, static_cast<const char*>(req->buffer) + req->shift, std::min(done, req->size));
+    }
+    if (failedReq)
+        throw std::system_error(error, std::generic_category(),
+                                "Failed to read image [" + m_imageName + "] at offset "
+                                    + std::to_string(failedReq->offset));
+}
+
+void CImageReader::Drain()
+{
+    while (m_inflight)
+    {
+        int count = io_getevents(m_ctx, 1, m_events.size(), m_events.data());
+
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int inx = 0; inx < count; inx++)
+            m_free.push_back(reinterpret_cast<SRequest*>(m_events[inx].data));
+        m_inflight -= count;
+    }
+}
+
+void CImageReader::Read(const std::vector<SRange>& ranges, const DataCallback& callback)
+{
+    try
+    {
+        for (const SRange& range : ranges)
+        {
+            off_t offset = static_cast<off_t>(range.sector) << SECTOR_SHIFT;
+            off_t end = std::min(static_cast<off_t>(range.sector + range.count) << SECTOR_SHIFT, m_size);
+
+            while (offset < end)
+            {
+                /*
+                 * The portions are split on the boundaries of blocks so
+                 * that the aligned request fits in the buffer.
+                 */
+                off_t blockEnd = (offset & ~static_cast<off_t>(m_alignment - 1)) + m_blockSize;
+                size_t size = std::min(blockEnd, end) - offset;
+
+                if (m_free.empty())
+                    Complete(1, callback);
+
+                SRequest* req = m_free.back();
+                m_free.pop_back();
+                try
+                {
+                    Submit(req, offset, size);
+                }
+                catch (...)
+                {
+                    m_free.push_back(req);
+                    throw;
+                }
+                offset += size;
+            }
+        }
+        while (m_inflight)
+            Complete(1, callback);
+    }
+    catch (...)
+    {
+        Drain();
+        throw;
+    }
+}
+
+void CImageReader::ReadAll(const DataCallback& callback)
+{
+    std::vector<SRange> ranges;
+
+    ranges.emplace_back(0, (m_size + SECTOR_SIZE - 1) >> SECTOR_SHIFT);
+    Read(ranges, callback);
+}
+
+void CImageReader::ReadChanged(const std::string& original, uint8_t sinceSnapNumber,
+                               const DataCallback& callback)
+{
+    std::vector<SRange> ranges;
+
+    ICbt::Create()->GetChangedRanges(original, sinceSnapNumber, [&ranges](const SRange& range) {
+        /*
+         * The adjacent ranges are merged to read them with larger requests.
+         */
+        if (!ranges.empty() && ((ranges.back().sector + ranges.back().count) == range.sector))
+            ranges.back().count += range.count;
+        else
+            ranges.push_back(range);
+    });
+    Read(ranges, callback);
+}
@@ -16,16 +16,19 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <atomic>
 #include <blksnap/Blksnap.h>
 #include <blksnap/Session.h>
 #include <boost/filesystem.hpp>
+#include <condition_variable>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
+#include <list>
 #include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
@@ -59,10 +62,31 @@ struct SRangeVectorPos
     {};
 };
 
+/*
+ * The file of the difference storage that is already allocated and whose
+ * extents are already known, so it can be appended to the snapshot by one
+ * ioctl.
+ */
+struct SSpareStorage
+{
+    std::string filename;
+    struct blk_snap_dev dev_id;
+    std::vector<struct blk_snap_block_range> ranges;
+};
+
+/*
+ * How many seconds the spare file should last at the observed fill rate of
+ * the difference storage. The size of the spare file is limited by the
+ * multiple of the requested portion.
+ */
+#define SPARE_STORAGE_LEAD_TIME 10
+#define SPARE_STORAGE_MAX_FACTOR 16
+
 struct SState
 {
     std::atomic<bool> stop;
-    std::string diffStorage;
+    std::vector<std::string> diffStorages;
+    std::atomic<int> diffStorageNumber;
     uuid_t id;
     std::mutex lock;
     std::list<std::string> errorMessage;
@@ -72,17 +96,27 @@ struct SState
     int diffDeviceMajor;
     int diffDeviceMinor;
     SRangeVectorPos diffStoragePosition;
+
+    std::mutex spareLock;
+    std::condition_variable spareCond;
+    std::list<SSpareStorage> spares;
+    size_t sparePreparing;
+    size_t spareLimit;
+    sector_t requestedSectors;
+    unsigned long long fillRate;
 };
 
 class CSession : public ISession
 {
 public:
-    CSession(const std::vector<std::string>& devices, const std::string& diffStorage, const SStorageRanges& diffStorageRanges);
+    CSession(const std::vector<std::string>& devices, const std::vector<std::string>& diffStorages,
+             const SStorageRanges& diffStorageRanges, const SSessionOptions& options);
     ~CSession() override;
 
     std::string GetImageDevice(const std::string& original) override;
     std::string GetOriginalDevice(const std::string& image) override;
     bool GetError(std::string& errorMessage) override;
+    void GetStats(SSessionStats& stats) override;
 
 private:
     uuid_t m_id;
@@ -91,20 +125,35 @@ private:
     std::shared_ptr<CBlksnap> m_ptrBlksnap;
     std::shared_ptr<SState> m_ptrState;
     std::shared_ptr<std::thread> m_ptrThread;
+    std::vector<std::shared_ptr<std::thread>> m_spareThreads;
 };
 
-std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const std::string& diffStorage)
+std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const std::string& diffStorage,
+                                           const SSessionOptions& options)
 {
     SStorageRanges diffStorageRanges;
+    std::vector<std::string> diffStorages;
 
-    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges);
+    if (!diffStorage.empty())
+        diffStorages.push_back(diffStorage);
+    return std::make_shared<CSession>(devices, diffStorages, diffStorageRanges, options);
 }
 
-std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const SStorageRanges& diffStorageRanges)
+std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices, const SStorageRanges& diffStorageRanges,
+                                           const SSessionOptions& options)
 {
-    std::string diffStorage;
+    std::vector<std::string> diffStorages;
 
-    return std::make_shared<CSession>(devices, diffStorage, diffStorageRanges);
+    return std::make_shared<CSession>(devices, diffStorages, diffStorageRanges, options);
+}
+
+std::shared_ptr<ISession> ISession::Create(const std::vector<std::string>& devices,
+                                           const std::vector<std::string>& diffStorages,
+                                           const SSessionOptions& options)
+{
+    SStorageRanges diffStorageRanges;
+
+    return std::make_shared<CSession>(devices, diffStorages, diffStorageRanges, options);
 }
 
 namespace
@@ -283,82 +332,259 @@ namespace
         std::cout << "Total sectors append: " << totalSectors << std::endl;
 
     }
-} //
-
-static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState)
-{
-    struct SBlksnapEvent ev;
-    int diffStorageNumber = 1;
-    bool is_eventReady;
 
-    while (!ptrState->stop)
+    static struct blk_snap_snapshot_options SnapshotOptions(const SSessionOptions& options)
     {
-        try
+        struct blk_snap_snapshot_options opt = {0};
+
+        if (options.chunkShift >= 0)
         {
-            is_eventReady = ptrBlksnap->WaitEvent(ptrState->id, 100, ev);
+            opt.mask |= (1ull << blk_snap_snapshot_option_chunk_shift);
+            opt.chunk_shift = options.chunkShift;
         }
-        catch (std::exception& ex)
+        if (options.readAhead >= 0)
+        {
+            opt.mask |= (1ull << blk_snap_snapshot_option_read_ahead);
+            opt.read_ahead = options.readAhead;
+        }
+        if (options.cacheSize >= 0)
+        {
+            opt.mask |= (1ull << blk_snap_snapshot_option_cache_size);
+            opt.cache_size = options.cacheSize;
+        }
+        if (options.storageIncrement >= 0)
+        {
+            opt.mask |= (1ull << blk_snap_snapshot_option_storage_increment);
+            opt.storage_increment = options.storageIncrement;
+        }
+        if (options.durability >= 0)
+        {
+            opt.mask |= (1ull << blk_snap_snapshot_option_durability);
+            opt.durability = options.durability;
+        }
+        if (options.workerCount >= 0)
+        {
+            opt.mask |= (1ull << blk_snap_snapshot_option_worker_count);
+            opt.worker_count = options.workerCount;
+        }
+        if (options.readOnce)
+            opt.mask |= (1ull << blk_snap_snapshot_option_read_once);
+        if (options.chunkAuto)
+            opt.mask |= (1ull << blk_snap_snapshot_option_chunk_auto);
+        if (options.chunkHash)
+            opt.mask |= (1ull << blk_snap_snapshot_option_chunk_hash);
+        return opt;
+    }
+
+    static void CreateStorageFile(std::shared_ptr<SState> ptrState, const std::string& diffStorage,
+                                  sector_t sectors, SSpareStorage& storage)
+    {
+        fs::path filepath(diffStorage);
+        filepath += std::string("diff_storage#" + std::to_string(ptrState->diffStorageNumber++));
+        if (fs::exists(filepath))
+            fs::remove(filepath);
+        storage.filename = filepath.string();
+
         {
-            std::cerr << ex.what() << std::endl;
             std::lock_guard<std::mutex> guard(ptrState->lock);
-            ptrState->errorMessage.push_back(std::string(ex.what()));
-            break;
+            ptrState->diffStorageFiles.push_back(storage.filename);
         }
+        FallocateStorage(storage.filename, sectors << SECTOR_SHIFT);
+        FiemapStorage(storage.filename, storage.dev_id, storage.ranges);
+    }
 
-        if (!is_eventReady)
-            continue;
+    /*
+     * Takes the spare file prepared in advance. The parameters of the
+     * low free space event are kept to calculate the size of the next
+     * spare files.
+     */
+    static bool TakeSpareStorage(std::shared_ptr<SState> ptrState, const SBlksnapEventLowFreeSpace& lowFreeSpace,
+                                 SSpareStorage& storage)
+    {
+        bool taken = false;
+        {
+            std::lock_guard<std::mutex> guard(ptrState->spareLock);
 
-        try
+            ptrState->requestedSectors = lowFreeSpace.requestedSectors;
+            ptrState->fillRate = lowFreeSpace.fillRate;
+            if (!ptrState->spares.empty())
+            {
+                storage = std::move(ptrState->spares.front());
+                ptrState->spares.pop_front();
+                taken = true;
+            }
+        }
+        ptrState->spareCond.notify_all();
+        return taken;
+    }
+
+    static sector_t SpareStorageSectors(std::shared_ptr<SState> ptrState)
+    {
+        sector_t sectors = (ptrState->fillRate * SPARE_STORAGE_LEAD_TIME) >> SECTOR_SHIFT;
+
+        sectors = std::min(sectors, ptrState->requestedSectors * SPARE_STORAGE_MAX_FACTOR);
+        return std::max(sectors, ptrState->requestedSectors);
+    }
+
+    /*
+     * Keeps the spare files ready in one of the directories of the difference
+     * storage. Each directory has its own thread, so the files are allocated
+     * in all directories in parallel.
+     */
+    static void SpareStorageThread(std::shared_ptr<SState> ptrState, size_t inx)
+    {
+        while (!ptrState->stop)
         {
-            switch (ev.code)
+            SSpareStorage storage;
+            sector_t sectors;
+
+            {
+                std::unique_lock<std::mutex> guard(ptrState->spareLock);
+
+                ptrState->spareCond.wait(guard, [ptrState] {
+                    return ptrState->stop
+                           || ((ptrState->spares.size() + ptrState->sparePreparing) < ptrState->spareLimit);
+                });
+                if (ptrState->stop)
+                    break;
+
+                ptrState->sparePreparing++;
+                sectors = SpareStorageSectors(ptrState);
+            }
+
+            try
+            {
+                CreateStorageFile(ptrState, ptrState->diffStorages[inx], sectors, storage);
+            }
+            catch (std::exception& ex)
             {
-            case blk_snap_event_code_low_free_space:
+                /*
+                 * The directory can no longer be used for the spare files.
+                 * The files will be allocated when requested.
+                 */
+                std::cerr << ex.what() << std::endl;
+                std::lock_guard<std::mutex> guard(ptrState->spareLock);
+                ptrState->sparePreparing--;
+                break;
+            }
+
+            std::lock_guard<std::mutex> guard(ptrState->spareLock);
+            ptrState->sparePreparing--;
+            ptrState->spares.push_back(std::move(storage));
+        }
+    }
+} //
+
+static void ProcessEvent(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState,
+                         const struct SBlksnapEvent& ev, size_t& diffStorageInx)
+{
+    try
+    {
+        switch (ev.code)
+        {
+        case blk_snap_event_code_low_free_space:
+        {
+            struct blk_snap_dev dev_id;
+            std::vector<struct blk_snap_block_range> ranges;
+
+            if (!ptrState->diffStorages.empty())
             {
-                struct blk_snap_dev dev_id;
-                std::vector<struct blk_snap_block_range> ranges;
+                SSpareStorage storage;
 
-                if (!ptrState->diffStorage.empty())
+                if (!TakeSpareStorage(ptrState, ev.lowFreeSpace, storage))
                 {
-                    fs::path filepath(ptrState->diffStorage);
-                    filepath += std::string("diff_storage#" + std::to_string(diffStorageNumber++));
-                    if (fs::exists(filepath))
-                        fs::remove(filepath);
-                    std::string filename = filepath.string();
-
-                    {
-                        std::lock_guard<std::mutex> guard(ptrState->lock);
-                        ptrState->diffStorageFiles.push_back(filename);
-                    }
-                    FallocateStorage(filename, ev.lowFreeSpace.requestedSectors << SECTOR_SHIFT);
-                    FiemapStorage(filename, dev_id, ranges);
-                }
-                else
-                    AllocateDiffStorage(ptrState, ev.lowFreeSpace.requestedSectors, dev_id, ranges);
+                    const std::string& diffStorage
+                      = ptrState->diffStorages[diffStorageInx++ % ptrState->diffStorages.size()];
 
-                LogAppendedRanges(ranges);
-                ptrBlksnap->AppendDiffStorage(ptrState->id, dev_id, ranges);
+                    CreateStorageFile(ptrState, diffStorage, ev.lowFreeSpace.requestedSectors, storage);
+                }
+                dev_id = storage.dev_id;
+                ranges = std::move(storage.ranges);
             }
+            else
+                AllocateDiffStorage(ptrState, ev.lowFreeSpace.requestedSectors, dev_id, ranges);
+
+            LogAppendedRanges(ranges);
+            ptrBlksnap->AppendDiffStorage(ptrState->id, dev_id, ranges);
+        }
+        break;
+        case blk_snap_event_code_corrupted:
+            throw std::system_error(ev.corrupted.errorCode, std::generic_category(),
+                                    std::string("Snapshot corrupted for device "
+                                                + std::to_string(ev.corrupted.origDevId.mj) + ":"
+                                                + std::to_string(ev.corrupted.origDevId.mn)));
             break;
-            case blk_snap_event_code_corrupted:
-                throw std::system_error(ev.corrupted.errorCode, std::generic_category(),
-                                        std::string("Snapshot corrupted for device "
-                                                    + std::to_string(ev.corrupted.origDevId.mj) + ":"
-                                                    + std::to_string(ev.corrupted.origDevId.mn)));
-                break;
-            default:
-                throw std::runtime_error("Invalid blksnap event code received.");
+        default:
+            throw std::runtime_error("Invalid blksnap event code received.");
+        }
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        std::lock_guard<std::mutex> guard(ptrState->lock);
+        ptrState->errorMessage.push_back(std::string(ex.what()));
+    }
+}
+
+static void BlksnapThread(std::shared_ptr<CBlksnap> ptrBlksnap, std::shared_ptr<SState> ptrState)
+{
+    std::vector<struct SBlksnapEvent> events;
+    size_t diffStorageInx = 0;
+    bool is_eventReady;
+    int eventFd = -1;
+
+    /*
+     * If the module allows, the events are read from the event file. It
+     * wakes up the thread as soon as the event is generated, and returns
+     * all the events ready at the moment.
+     * The timeout only allows to check that the thread should be stopped.
+     */
+    try
+    {
+        eventFd = ptrBlksnap->OpenEventFd(ptrState->id, true);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+    }
+
+    while (!ptrState->stop)
+    {
+        try
+        {
+            if (eventFd < 0)
+            {
+                struct SBlksnapEvent ev;
+
+                events.clear();
+                is_eventReady = ptrBlksnap->WaitEvent(ptrState->id, 100, ev);
+                if (is_eventReady)
+                    events.push_back(ev);
             }
+            else
+                is_eventReady = CBlksnap::ReadEvents(eventFd, 100, events);
         }
         catch (std::exception& ex)
         {
             std::cerr << ex.what() << std::endl;
             std::lock_guard<std::mutex> guard(ptrState->lock);
             ptrState->errorMessage.push_back(std::string(ex.what()));
+            break;
         }
+
+        if (!is_eventReady)
+            continue;
+
+        for (const struct SBlksnapEvent& ev : events)
+            ProcessEvent(ptrBlksnap, ptrState, ev, diffStorageInx);
     }
+
+    if (eventFd >= 0)
+        ::close(eventFd);
 }
 
-CSession::CSession(const std::vector<std::string>& devices, const std::string& diffStorage, const SStorageRanges& diffStorageRanges)
+CSession::CSession(const std::vector<std::string>& devices, const std::vector<std::string>& diffStorages,
+                   const SStorageRanges& diffStorageRanges, const SSessionOptions& options)
 {
     m_ptrBlksnap = std::make_shared<CBlksnap>();
 
@@ -379,15 +605,23 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
     std::vector<struct blk_snap_dev> blk_snap_devs;
     for (const SSessionInfo& info : m_devices)
         blk_snap_devs.push_back(info.original);
-    m_ptrBlksnap->Create(blk_snap_devs, m_id);
+    struct blk_snap_snapshot_options snapshotOptions = SnapshotOptions(options);
+    if (snapshotOptions.mask)
+        m_ptrBlksnap->Create(blk_snap_devs, snapshotOptions, m_id);
+    else
+        m_ptrBlksnap->Create(blk_snap_devs, m_id);
 
     /*
      * Prepare state structure for thread
      */
     m_ptrState = std::make_shared<SState>();
     m_ptrState->stop = false;
-    if (!diffStorage.empty())
-        m_ptrState->diffStorage = diffStorage;
+    m_ptrState->diffStorages = diffStorages;
+    m_ptrState->diffStorageNumber = 0;
+    m_ptrState->sparePreparing = 0;
+    m_ptrState->spareLimit = std::max<size_t>(2, diffStorages.size());
+    m_ptrState->requestedSectors = 0;
+    m_ptrState->fillRate = 0;
     if (!diffStorageRanges.ranges.empty())
         m_ptrState->diffStorageRanges = diffStorageRanges.ranges;
     if (!diffStorageRanges.device.empty())
@@ -407,17 +641,16 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
             struct blk_snap_dev dev_id;
             std::vector<struct blk_snap_block_range> ranges;
 
-            if (!m_ptrState->diffStorage.empty())
+            if (!m_ptrState->diffStorages.empty())
             {
-                fs::path filepath(m_ptrState->diffStorage);
-                filepath += std::string("diff_storage#" + std::to_string(0));
-                if (fs::exists(filepath))
-                    fs::remove(filepath);
-                std::string filename = filepath.string();
-
-                m_ptrState->diffStorageFiles.push_back(filename);
-                FallocateStorage(filename, ev.lowFreeSpace.requestedSectors << SECTOR_SHIFT);
-                FiemapStorage(filename, dev_id, ranges);
+                SSpareStorage storage;
+
+                m_ptrState->requestedSectors = ev.lowFreeSpace.requestedSectors;
+                m_ptrState->fillRate = ev.lowFreeSpace.fillRate;
+                CreateStorageFile(m_ptrState, m_ptrState->diffStorages[0], ev.lowFreeSpace.requestedSectors,
+                                  storage);
+                dev_id = storage.dev_id;
+                ranges = std::move(storage.ranges);
             }
             else
                 AllocateDiffStorage(m_ptrState, ev.lowFreeSpace.requestedSectors, dev_id, ranges);
@@ -437,6 +670,15 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
         }
     }
 
+    /*
+     * Start the threads that prepare the spare files for the difference
+     * storage ahead of demand. The size of the requested portion is known
+     * only after the first event.
+     */
+    if (m_ptrState->requestedSectors)
+        for (size_t inx = 0; inx < m_ptrState->diffStorages.size(); inx++)
+            m_spareThreads.push_back(std::make_shared<std::thread>(SpareStorageThread, m_ptrState, inx));
+
     /*
      * Start stretch snapshot thread
      */
@@ -475,8 +717,14 @@ CSession::~CSession()
     /**
      * Stop thread
      */
-    m_ptrState->stop = true;
+    {
+        std::lock_guard<std::mutex> guard(m_ptrState->spareLock);
+        m_ptrState->stop = true;
+    }
+    m_ptrState->spareCond.notify_all();
     m_ptrThread->join();
+    for (auto& ptrThread : m_spareThreads)
+        ptrThread->join();
 
     /**
      * Destroy snapshot
@@ -544,3 +792,19 @@ bool CSession::GetError(std::string& errorMessage)
     m_ptrState->errorMessage.pop_front();
     return true;
 }
+
+void CSession::GetStats(SSessionStats& stats)
+{
+    std::vector<struct blk_snap_device_stats> statsVector;
+
+    m_ptrBlksnap->SnapshotStats(m_id, statsVector);
+
+    stats.bytesStored = 0;
+    stats.imageReadHist.assign(BLK_SNAP_STATS_HIST_SIZE, 0);
+    for (const struct blk_snap_device_stats& st : statsVector)
+    {
+        stats.bytesStored += st.bytes_stored;
+        for (size_t inx = 0; inx < BLK_SNAP_STATS_HIST_SIZE; inx++)
+            stats.imageReadHist[inx] += st.image_read_hist[inx];
+    }
+}
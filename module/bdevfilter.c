@@ -10,6 +10,9 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/list.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/jump_label.h>
 
 #include "bdevfilter.h"
 #include "version.h"
@@ -22,8 +25,30 @@
 })
 #endif
 
+/**
+ * struct bdev_extension - The extension of the block device.
+ *
+ * @node:
+ *	Allows to combine structures into a hash table.
+ * @dev_id:
+ *	ID of the block device.
+ * @disk:
+ *	A pointer to the disk.
+ * @partno:
+ *	The number of the partition on the disk.
+ * @bdev:
+ *	A pointer to the block device.
+ * @bd_filter:
+ *	A pointer to the filter attached to the block device.
+ * @bd_filter_lock:
+ *	Serializes the attaching and detaching of the filter.
+ *
+ * The extensions are looked up for each bio under the RCU read lock. The
+ * filter pointer is published with RCU too, so no spinlocks are taken on
+ * the I/O path.
+ */
 struct bdev_extension {
-	struct list_head link;
+	struct hlist_node node;
 
 	dev_t dev_id;
 #if defined(HAVE_BI_BDISK)
@@ -33,40 +58,74 @@ struct bdev_extension {
 	struct block_device *bdev;
 #endif
 
-	struct bdev_filter *bd_filter;
+	struct bdev_filter __rcu *bd_filter;
 	spinlock_t bd_filter_lock;
 };
 
-/* The list of extensions for this block device */
-static LIST_HEAD(bdev_extension_list);
+#define BDEV_EXTENSION_HASH_BITS 6
+
+/* The hash table of extensions of block devices */
+static DEFINE_HASHTABLE(bdev_extension_table, BDEV_EXTENSION_HASH_BITS);
 
-/* Lock the queue of block device to add or delete extension. */
+/* Lock the hash table to add or delete extension. */
 static DEFINE_SPINLOCK(bdev_extension_list_lock);
 
+/*
+ * Enabled while at least one filter is attached. Without the filters, the
+ * bio is passed to the original function without searching for extension.
+ */
+static DEFINE_STATIC_KEY_FALSE(bdev_filters_enabled);
+
+#if defined(HAVE_BI_BDISK)
+static inline unsigned long bdev_extension_key(struct gendisk *disk, u8 partno)
+{
+	return (unsigned long)disk ^ partno;
+}
+#else
+static inline unsigned long bdev_extension_key(struct block_device *bdev)
+{
+	return (unsigned long)bdev;
+}
+#endif
+
+static inline void bdev_extension_add(struct bdev_extension *ext)
+{
+#if defined(HAVE_BI_BDISK)
+	hash_add_rcu(bdev_extension_table, &ext->node,
+		     bdev_extension_key(ext->disk, ext->partno));
+#else
+	hash_add_rcu(bdev_extension_table, &ext->node,
+		     bdev_extension_key(ext->bdev));
+#endif
+}
+
+/*
+ * Searches the extension by the device ID. It is not used on the I/O path,
+ * so the lock of the table must be held.
+ */
 static inline struct bdev_extension *bdev_extension_find(dev_t dev_id)
 {
 	struct bdev_extension *ext;
+	int bkt;
 
-	if (list_empty(&bdev_extension_list))
-		return NULL;
-
-	list_for_each_entry (ext, &bdev_extension_list, link)
+	hash_for_each (bdev_extension_table, bkt, ext, node)
 		if (dev_id == ext->dev_id)
 			return ext;
 
 	return NULL;
 }
 
+/*
+ * The RCU read lock must be held.
+ */
 #if defined(HAVE_BI_BDISK)
 static inline struct bdev_extension *bdev_extension_find_part(struct gendisk *disk,
 							 u8 partno)
 {
 	struct bdev_extension *ext;
 
-	if (list_empty(&bdev_extension_list))
-		return NULL;
-
-	list_for_each_entry (ext, &bdev_extension_list, link)
+	hash_for_each_possible_rcu (bdev_extension_table, ext, node,
+				    bdev_extension_key(disk, partno))
 		if ((disk == ext->disk) && (partno == ext->partno))
 			return ext;
 
@@ -77,10 +136,8 @@ static inline struct bdev_extension *bdev_extension_find_bdev(struct block_devic
 {
 	struct bdev_extension *ext;
 
-	if (list_empty(&bdev_extension_list))
-		return NULL;
-
-	list_for_each_entry (ext, &bdev_extension_list, link)
+	hash_for_each_possible_rcu (bdev_extension_table, ext, node,
+				    bdev_extension_key(bdev))
 		if (bdev == ext->bdev)
 			return ext;
 
@@ -88,6 +145,40 @@ static inline struct bdev_extension *bdev_extension_find_bdev(struct block_devic
 }
 #endif
 
+/*
+ * Replaces the filter of the extension. The readers that have received the
+ * previous filter under the RCU read lock should have time to take its
+ * reference before the caller puts it.
+ */
+static inline struct bdev_filter *bdev_extension_xchg_filter(
+	struct bdev_extension *ext, struct bdev_filter *new_flt)
+{
+	struct bdev_filter *flt;
+
+	spin_lock(&ext->bd_filter_lock);
+	flt = rcu_dereference_protected(ext->bd_filter,
+					lockdep_is_held(&ext->bd_filter_lock));
+	rcu_assign_pointer(ext->bd_filter, new_flt);
+	spin_unlock(&ext->bd_filter_lock);
+
+	return flt;
+}
+
+/*
+ * Takes the reference to the filter of the extension. The RCU read lock must
+ * be held.
+ */
+static inline struct bdev_filter *bdev_extension_get_filter(
+	struct bdev_extension *ext)
+{
+	struct bdev_filter *flt;
+
+	flt = rcu_dereference(ext->bd_filter);
+	if (flt)
+		bdev_filter_get(flt);
+	return flt;
+}
+
 static inline struct bdev_extension *bdev_extension_append(struct block_device *bdev)
 {
 	bool recreate = false;
@@ -99,7 +190,7 @@ static inline struct bdev_extension *bdev_extension_append(struct block_device *
 	if (!ext_tmp)
 		return NULL;
 
-	INIT_LIST_HEAD(&ext_tmp->link);
+	INIT_HLIST_NODE(&ext_tmp->node);
 	ext_tmp->dev_id = bdev->bd_dev;
 #if defined(HAVE_BI_BDISK)
 	ext_tmp->disk = bdev->bd_disk;
@@ -107,7 +198,7 @@ static inline struct bdev_extension *bdev_extension_append(struct block_device *
 #else
 	ext_tmp->bdev = bdev;
 #endif
-	ext_tmp->bd_filter = NULL;
+	RCU_INIT_POINTER(ext_tmp->bd_filter, NULL);
 
 	spin_lock_init(&ext_tmp->bd_filter_lock);
 
@@ -116,7 +207,7 @@ static inline struct bdev_extension *bdev_extension_append(struct block_device *
 	if (!ext) {
 		/* add new extension */
 		pr_debug("Add new bdev extension");
-		list_add_tail(&ext_tmp->link, &bdev_extension_list);
+		bdev_extension_add(ext_tmp);
 		result = ext_tmp;
 		ext_tmp = NULL;
 	} else {
@@ -131,11 +222,11 @@ static inline struct bdev_extension *bdev_extension_append(struct block_device *
 		} else {
 			/* extension should be recreated */
 			pr_debug("Bdev extension should be recreated");
-			list_add_tail(&ext_tmp->link, &bdev_extension_list);
+			bdev_extension_add(ext_tmp);
 			result = ext_tmp;
 
 			recreate = true;
-			list_del(&ext->link);
+			hash_del_rcu(&ext->node);
 			ext_tmp = ext;
 		}
 	}
@@ -148,13 +239,13 @@ static inline struct bdev_extension *bdev_extension_append(struct block_device *
 		pr_info("Detach all block device filters from %d:%d\n",
 			MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev));
 
-		spin_lock(&ext_tmp->bd_filter_lock);
-		flt = ext_tmp->bd_filter;
-		ext_tmp->bd_filter = NULL;
-		spin_unlock(&ext_tmp->bd_filter_lock);
-
-		if (flt)
+		flt = bdev_extension_xchg_filter(ext_tmp, NULL);
+		/* Wait for the readers of the removed extension */
+		synchronize_rcu();
+		if (flt) {
 			bdev_filter_put(flt);
+			static_branch_dec(&bdev_filters_enabled);
+		}
 	}
 	kfree(ext_tmp);
 
@@ -196,15 +287,19 @@ int bdev_filter_attach(struct block_device *bdev, struct bdev_filter *flt)
 	if (!ext)
 		return -ENOMEM;
 
+	/* The key is enabled before the filter becomes visible */
+	static_branch_inc(&bdev_filters_enabled);
 	spin_lock(&ext->bd_filter_lock);
-	if (ext->bd_filter) {
-		pr_debug("filter busy. 0x%p", ext->bd_filter);
+	if (rcu_access_pointer(ext->bd_filter)) {
+		pr_debug("filter busy. 0x%p", rcu_access_pointer(ext->bd_filter));
 		ret = -EBUSY;
 	} else
-		ext->bd_filter = flt;
+		rcu_assign_pointer(ext->bd_filter, flt);
 	spin_unlock(&ext->bd_filter_lock);
 
-	if (!ret)
+	if (ret)
+		static_branch_dec(&bdev_filters_enabled);
+	else
 		pr_info("Block device filter has been attached to %d:%d",
 			MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev));
 	return ret;
@@ -232,16 +327,14 @@ int lp_bdev_filter_detach(const dev_t dev_id)
 	if (!ext)
 		return -ENOENT;
 
-	spin_lock(&ext->bd_filter_lock);
-	flt = ext->bd_filter;
-	if (flt)
-		ext->bd_filter = NULL;
-	spin_unlock(&ext->bd_filter_lock);
-
+	flt = bdev_extension_xchg_filter(ext, NULL);
 	if (!flt)
 		return -ENOENT;
 
+	/* Wait for the readers that could receive the filter */
+	synchronize_rcu();
 	bdev_filter_put(flt);
+	static_branch_dec(&bdev_filters_enabled);
 	pr_info("Block device filter has been detached from %d:%d",
 		MAJOR(dev_id), MINOR(dev_id));
 	return 0;
@@ -281,21 +374,15 @@ struct bdev_filter *bdev_filter_get_by_bdev(struct block_device *bdev)
 	struct bdev_extension *ext;
 	struct bdev_filter *flt = NULL;
 
-	spin_lock(&bdev_extension_list_lock);
+	rcu_read_lock();
 #if defined(HAVE_BI_BDISK)
 	ext = bdev_extension_find_part(bdev->bd_disk, bdev->bd_partno);
 #else
 	ext = bdev_extension_find_bdev(bdev);
 #endif
-	spin_unlock(&bdev_extension_list_lock);
-	if (!ext)
-		return NULL;
-
-	spin_lock(&ext->bd_filter_lock);
-	flt = ext->bd_filter;
-	if (flt)
-		bdev_filter_get(flt);
-	spin_unlock(&ext->bd_filter_lock);
+	if (ext)
+		flt = bdev_extension_get_filter(ext);
+	rcu_read_unlock();
 
 	return flt;
 }
@@ -304,24 +391,18 @@ EXPORT_SYMBOL(bdev_filter_get_by_bdev);
 static inline bool bdev_filters_apply(struct bio *bio)
 {
 	bool completed;
-	struct bdev_filter *flt;
+	struct bdev_filter *flt = NULL;
 	struct bdev_extension *ext;
 
-	spin_lock(&bdev_extension_list_lock);
+	rcu_read_lock();
 #if defined(HAVE_BI_BDISK)
 	ext = bdev_extension_find_part(bio->bi_disk, bio->bi_partno);
 #else
 	ext = bdev_extension_find_bdev(bio->bi_bdev);
 #endif
-	spin_unlock(&bdev_extension_list_lock);
-	if (!ext)
-		return false;
-
-	spin_lock(&ext->bd_filter_lock);
-	flt = ext->bd_filter;
-	if (flt)
-		bdev_filter_get(flt);
-	spin_unlock(&ext->bd_filter_lock);
+	if (ext)
+		flt = bdev_extension_get_filter(ext);
+	rcu_read_unlock();
 
 	if (!flt)
 		return false;
@@ -344,6 +425,26 @@ out:
 	return completed;
 }
 
+/*
+ * Frees all extensions when the module is unloaded. The filter function is
+ * already disabled, but some readers can still be in progress.
+ */
+static void bdev_extension_cleanup(void)
+{
+	struct bdev_extension *ext;
+	struct hlist_node *tmp;
+	int bkt;
+
+	synchronize_rcu();
+
+	spin_lock(&bdev_extension_list_lock);
+	hash_for_each_safe (bdev_extension_table, bkt, tmp, ext, node) {
+		hash_del(&ext->node);
+		kfree(ext);
+	}
+	spin_unlock(&bdev_extension_list_lock);
+}
+
 #ifdef CONFIG_X86
 #define CALL_INSTRUCTION_LENGTH 5
 #else
@@ -369,7 +470,8 @@ static blk_qc_t notrace submit_bio_noacct_handler(struct bio *bio)
 static void notrace submit_bio_noacct_handler(struct bio *bio)
 #endif
 {
-	if (!current->bio_list) {
+	if (static_branch_unlikely(&bdev_filters_enabled) &&
+	    !current->bio_list) {
 		if (bdev_filters_apply(bio)) {
 #if defined(HAVE_QC_SUBMIT_BIO_NOACCT)
 			return BLK_QC_T_NONE;
@@ -428,13 +530,7 @@ static int __init lp_filter_init(void)
  */
 static void __exit lp_filter_done(void)
 {
-	struct bdev_extension *ext;
-
-	while ((ext = list_first_entry_or_null(&bdev_extension_list,
-					       struct bdev_extension, link))) {
-		list_del(&ext->link);
-		kfree(ext);
-	}
+	bdev_extension_cleanup();
 }
 module_init(lp_filter_init);
 module_exit(lp_filter_done);
@@ -493,17 +589,8 @@ err:
 
 static void __exit trace_filter_done(void)
 {
-	struct bdev_extension *ext;
-
 	unregister_ftrace_function(&ops_submit_bio_noacct);
-
-	spin_lock(&bdev_extension_list_lock);
-	while ((ext = list_first_entry_or_null(&bdev_extension_list,
-					       struct bdev_extension, link))) {
-		list_del(&ext->link);
-		kfree(ext);
-	}
-	spin_unlock(&bdev_extension_list_lock);
+	bdev_extension_cleanup();
 }
 
 module_init(trace_filter_init);
@@ -0,0 +1,420 @@
+// SPDX-License-Identifier: GPL-2.0
+#define pr_fmt(fmt) KBUILD_MODNAME "-benchmark: " fmt
+/*
+ * Microbenchmarks of the hot paths of the module.
+ *
+ * The benchmark is started by writing the device number to the debugfs file:
+ *	echo "<major>:<minor> [<operations per thread>]" > \
+ *		/sys/kernel/debug/blksnap/benchmark
+ * and the results are read from the same file.
+ *
+ * The device is used to create the structures of the module, as a snapshot
+ * would do. Nothing is read from it or written to it, so any unused block
+ * device, for example a loop device, is suitable.
+ *
+ * Each primitive is executed by 1, 2, 4 and so on threads up to the number
+ * of online CPUs. Each thread is bound to its own CPU. For each number of
+ * threads, the average time of an operation in a thread and the total
+ * throughput are reported.
+ */
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/xarray.h>
+#include <linux/math64.h>
+#include <linux/blkdev.h>
+#include "memory_checker.h"
+#include "benchmark.h"
+#include "cbt_map.h"
+#include "chunk_cache.h"
+#include "diff_area.h"
+#include "diff_buffer.h"
+#include "diff_io.h"
+#include "diff_storage.h"
+#include "snapshot.h"
+
+#define BENCHMARK_DEFAULT_OPS 100000
+#define BENCHMARK_REPORT_SIZE 8192
+#define BENCHMARK_XA_LIMIT (1ul << 20)
+
+struct benchmark_ctx {
+	struct cbt_map *cbt_map;
+	struct diff_storage *diff_storage;
+	struct chunk_cache *chunk_cache;
+	struct diff_area *diff_area;
+	struct xarray chunk_map;
+	unsigned long chunk_count;
+	unsigned long xa_count;
+	sector_t chunk_sectors;
+};
+
+struct benchmark_case {
+	const char *name;
+	int (*op)(struct benchmark_ctx *ctx, u32 *seed);
+};
+
+struct benchmark_run;
+
+struct benchmark_worker {
+	struct benchmark_run *run;
+	u32 seed;
+	u64 ns;
+};
+
+struct benchmark_run {
+	const struct benchmark_case *bcase;
+	struct benchmark_ctx *ctx;
+	unsigned long ops;
+	struct completion start;
+	struct completion done;
+	atomic_t active;
+	atomic_t error;
+};
+
+static DEFINE_MUTEX(benchmark_lock);
+static char benchmark_report[BENCHMARK_REPORT_SIZE];
+static size_t benchmark_report_len;
+
+static __printf(1, 2) void benchmark_print(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	benchmark_report_len +=
+		vscnprintf(benchmark_report + benchmark_report_len,
+			   BENCHMARK_REPORT_SIZE - benchmark_report_len, fmt,
+			   args);
+	va_end(args);
+}
+
+static inline u32 benchmark_random(u32 *seed)
+{
+	u32 x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+static inline unsigned long benchmark_random_below(u32 *seed,
+						   unsigned long limit)
+{
+	return (unsigned long)(((u64)benchmark_random(seed) * limit) >> 32);
+}
+
+static int benchmark_cbt_map_set(struct benchmark_ctx *ctx, u32 *seed)
+{
+	unsigned long number = benchmark_random_below(seed, ctx->chunk_count);
+
+	return cbt_map_set(ctx->cbt_map, (sector_t)number * ctx->chunk_sectors,
+			   ctx->chunk_sectors);
+}
+
+static int benchmark_diff_storage_region(struct benchmark_ctx *ctx, u32 *seed)
+{
+	struct diff_region region;
+	int ret;
+
+	ret = diff_storage_new_region(ctx->diff_storage, ctx->chunk_sectors,
+				      &region);
+	if (ret)
+		return ret;
+	diff_storage_free_region(ctx->diff_storage, &region);
+	return 0;
+}
+
+static int benchmark_diff_buffer(struct benchmark_ctx *ctx, u32 *seed)
+{
+	struct diff_buffer *diff_buffer;
+
+	diff_buffer = diff_buffer_take(ctx->diff_area, false);
+	if (IS_ERR(diff_buffer))
+		return PTR_ERR(diff_buffer);
+	diff_buffer_release(ctx->diff_area, diff_buffer);
+	return 0;
+}
+
+static int benchmark_chunk_lookup(struct benchmark_ctx *ctx, u32 *seed)
+{
+	unsigned long number = benchmark_random_below(seed, ctx->xa_count);
+
+	if (unlikely(!xa_load(&ctx->chunk_map, number)))
+		return -ENOENT;
+	return 0;
+}
+
+static const struct benchmark_case benchmark_cases[] = {
+	{ "cbt_map_set", benchmark_cbt_map_set },
+	{ "diff_storage_new_region+free_region",
+	  benchmark_diff_storage_region },
+	{ "diff_buffer_take+release", benchmark_diff_buffer },
+	{ "chunk_map xa_load", benchmark_chunk_lookup },
+};
+
+static int benchmark_thread(void *data)
+{
+	struct benchmark_worker *worker = data;
+	struct benchmark_run *run = worker->run;
+	unsigned long inx;
+	u64 start;
+	int ret;
+
+	wait_for_completion(&run->start);
+
+	start = ktime_get_ns();
+	for (inx = 0; inx < run->ops; inx++) {
+		ret = run->bcase->op(run->ctx, &worker->seed);
+		if (unlikely(ret)) {
+			atomic_cmpxchg(&run->error, 0, ret);
+			break;
+		}
+		if (!(inx & 0xFF))
+			cond_resched();
+	}
+	worker->ns = ktime_get_ns() - start;
+
+	if (atomic_dec_and_test(&run->active))
+		complete(&run->done);
+	return 0;
+}
+
+/*
+ * Runs the operation by the threads on the first @nr online CPUs.
+ */
+static int benchmark_run_threads(const struct benchmark_case *bcase,
+				 struct benchmark_ctx *ctx, unsigned long ops,
+				 unsigned int nr)
+{
+	struct benchmark_run run;
+	struct benchmark_worker *workers;
+	unsigned int started = 0;
+	unsigned int cpu;
+	u64 start;
+	u64 elapsed;
+	u64 thread_ns = 0;
+	int ret = 0;
+
+	workers = kcalloc(nr, sizeof(struct benchmark_worker), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+	memory_object_inc(memory_object_benchmark_worker_array);
+
+	run.bcase = bcase;
+	run.ctx = ctx;
+	run.ops = ops;
+	init_completion(&run.start);
+	init_completion(&run.done);
+	atomic_set(&run.active, 1);
+	atomic_set(&run.error, 0);
+
+	for_each_online_cpu(cpu) {
+		struct benchmark_worker *worker = &workers[started];
+		struct task_struct *task;
+
+		if (started == nr)
+			break;
+
+		worker->run = &run;
+		worker->seed = 0x9E3779B9 * (started + 1);
+		task = kthread_create(benchmark_thread, worker,
+				      "blksnap-bench/%u", cpu);
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			break;
+		}
+		kthread_bind(task, cpu);
+		atomic_inc(&run.active);
+		wake_up_process(task);
+		started++;
+	}
+	if (ret)
+		run.ops = 0;
+
+	start = ktime_get_ns();
+	complete_all(&run.start);
+	if (!atomic_dec_and_test(&run.active))
+		wait_for_completion(&run.done);
+	elapsed = ktime_get_ns() - start;
+
+	if (!ret)
+		ret = atomic_read(&run.error);
+	if (!ret) {
+		for (cpu = 0; cpu < started; cpu++)
+			thread_ns += workers[cpu].ns;
+
+		benchmark_print("  threads=%-4u ns/op=%-8llu kops/s=%llu\n", nr,
+				div64_u64(thread_ns, (u64)ops * started),
+				div64_u64((u64)ops * started * NSEC_PER_MSEC,
+					  max_t(u64, elapsed, 1)));
+	}
+
+	kfree(workers);
+	memory_object_dec(memory_object_benchmark_worker_array);
+	return ret;
+}
+
+static int benchmark_ctx_init(struct benchmark_ctx *ctx, dev_t dev_id)
+{
+	struct snapshot_options options;
+	struct block_device *bdev;
+	unsigned long inx;
+	int ret;
+
+	snapshot_options_init(&options);
+	xa_init(&ctx->chunk_map);
+
+	bdev = blkdev_get_by_dev(dev_id, FMODE_READ, NULL);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+	ctx->cbt_map = cbt_map_create(bdev);
+	blkdev_put(bdev, FMODE_READ);
+	if (!ctx->cbt_map)
+		return -ENOMEM;
+	if (!ctx->cbt_map->device_capacity)
+		return -EINVAL;
+
+	ctx->diff_storage = diff_storage_new(0, 1);
+	if (!ctx->diff_storage)
+		return -ENOMEM;
+	ctx->chunk_cache = chunk_cache_new(options.cache_size);
+	if (!ctx->chunk_cache)
+		return -ENOMEM;
+	/*
+	 * The whole device is the difference storage. The regions are only
+	 * allocated and released, the data is never stored.
+	 */
+	ret = diff_storage_append_range(ctx->diff_storage, dev_id, 0,
+					ctx->cbt_map->device_capacity);
+	if (ret)
+		return ret;
+
+	ctx->diff_area = diff_area_new(dev_id, ctx->diff_storage,
+				       ctx->chunk_cache, options.chunk_shift,
+				       options.read_ahead);
+	if (IS_ERR(ctx->diff_area)) {
+		ret = PTR_ERR(ctx->diff_area);
+		ctx->diff_area = NULL;
+		return ret;
+	}
+	ctx->chunk_count = ctx->diff_area->chunk_count;
+	ctx->chunk_sectors = diff_area_chunk_sectors(ctx->diff_area);
+
+	/*
+	 * The lookup is measured on the same number of entries as the chunk
+	 * map of the device would have when all chunks are accessed.
+	 */
+	ctx->xa_count = min(ctx->chunk_count, BENCHMARK_XA_LIMIT);
+	for (inx = 0; inx < ctx->xa_count; inx++) {
+		ret = xa_err(xa_store(&ctx->chunk_map, inx, xa_mk_value(inx),
+				      GFP_KERNEL));
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void benchmark_ctx_done(struct benchmark_ctx *ctx)
+{
+	xa_destroy(&ctx->chunk_map);
+	diff_area_put(ctx->diff_area);
+	chunk_cache_put(ctx->chunk_cache);
+	diff_storage_put(ctx->diff_storage);
+	cbt_map_put(ctx->cbt_map);
+}
+
+static int benchmark_run(dev_t dev_id, unsigned long ops)
+{
+	struct benchmark_ctx ctx = { 0 };
+	unsigned int cpus = num_online_cpus();
+	unsigned int inx;
+	unsigned int nr;
+	int ret;
+
+	benchmark_report_len = 0;
+	benchmark_report[0] = '\0';
+
+	ret = benchmark_ctx_init(&ctx, dev_id);
+	if (ret) {
+		pr_err("Failed to prepare benchmark. errno=%d\n", abs(ret));
+		goto out;
+	}
+
+	benchmark_print("device %u:%u, %lu chunks of %llu sectors, %lu operations per thread\n",
+			MAJOR(dev_id), MINOR(dev_id), ctx.chunk_count,
+			ctx.chunk_sectors, ops);
+	for (inx = 0; inx < ARRAY_SIZE(benchmark_cases); inx++) {
+		benchmark_print("%s:\n", benchmark_cases[inx].name);
+		for (nr = 1;; nr = min(nr * 2, cpus)) {
+			ret = benchmark_run_threads(&benchmark_cases[inx], &ctx,
+						    ops, nr);
+			if (ret) {
+				benchmark_print("  threads=%-4u failed errno=%d\n",
+						nr, abs(ret));
+				break;
+			}
+			if (nr == cpus)
+				break;
+		}
+	}
+	ret = 0;
+out:
+	benchmark_ctx_done(&ctx);
+	return ret;
+}
+
+static ssize_t benchmark_write(struct file *file, const char __user *ubuf,
+			       size_t count, loff_t *ppos)
+{
+	char buf[64];
+	unsigned int mj;
+	unsigned int mn;
+	unsigned long ops = BENCHMARK_DEFAULT_OPS;
+	int ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%u:%u %lu", &mj, &mn, &ops) < 2 || !ops)
+		return -EINVAL;
+
+	mutex_lock(&benchmark_lock);
+	ret = benchmark_run(MKDEV(mj, mn), ops);
+	mutex_unlock(&benchmark_lock);
+
+	return ret ? ret : count;
+}
+
+static int benchmark_show(struct seq_file *m, void *unused)
+{
+	mutex_lock(&benchmark_lock);
+	seq_write(m, benchmark_report, benchmark_report_len);
+	mutex_unlock(&benchmark_lock);
+	return 0;
+}
+
+static int benchmark_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, benchmark_show, inode->i_private);
+}
+
+static const struct file_operations benchmark_fops = {
+	.owner = THIS_MODULE,
+	.open = benchmark_open,
+	.read = seq_read,
+	.write = benchmark_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void benchmark_debugfs_init(struct dentry *parent)
+{
+	debugfs_create_file("benchmark", 0600, parent, NULL, &benchmark_fops);
+}
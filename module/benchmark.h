@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __BLK_SNAP_BENCHMARK_H
+#define __BLK_SNAP_BENCHMARK_H
+
+struct dentry;
+
+#ifdef BLK_SNAP_BENCHMARK
+void benchmark_debugfs_init(struct dentry *parent);
+#else
+static inline void benchmark_debugfs_init(
+	__attribute__ ((unused)) struct dentry *parent)
+{};
+#endif
+#endif /* __BLK_SNAP_BENCHMARK_H */
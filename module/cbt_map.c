@@ -3,6 +3,13 @@
 
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+#include <linux/sched/mm.h>
+#include <linux/sort.h>
+#ifdef BLK_SNAP_MODIFICATION
+#include <linux/anon_inodes.h>
+#include <linux/mm.h>
+#endif
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -30,7 +37,9 @@ static inline unsigned long long count_by_shift(sector_t capacity,
 	return round_up(capacity, blk_size) / blk_size;
 }
 
-static void cbt_map_calculate_block_size(struct cbt_map *cbt_map)
+static void cbt_map_block_size(sector_t capacity, size_t blk_size_shift_min,
+			       size_t blk_count_max, size_t *blk_size_shift,
+			       size_t *blk_count)
 {
 	unsigned long long shift;
 	unsigned long long count;
@@ -39,77 +48,254 @@ static void cbt_map_calculate_block_size(struct cbt_map *cbt_map)
 	 * The size of the tracking block is calculated based on the size of the disk
 	 * so that the CBT table does not exceed a reasonable size.
 	 */
-	shift = tracking_block_minimum_shift;
-	count = count_by_shift(cbt_map->device_capacity, shift);
+	shift = blk_size_shift_min;
+	count = count_by_shift(capacity, shift);
 
-	while (count > tracking_block_maximum_count) {
-		shift = shift << 1;
-		count = count_by_shift(cbt_map->device_capacity, shift);
+	while (count > blk_count_max) {
+		shift = shift + 1;
+		count = count_by_shift(capacity, shift);
 	}
 
-	cbt_map->blk_size_shift = shift;
-	cbt_map->blk_count = count;
+	*blk_size_shift = shift;
+	*blk_count = count;
 }
 
-static int cbt_map_allocate(struct cbt_map *cbt_map)
+static inline void cbt_map_calculate_block_size(struct cbt_map *cbt_map)
 {
-	unsigned char *read_map = NULL;
-	unsigned char *write_map = NULL;
-	size_t size = cbt_map->blk_count;
+	cbt_map_block_size(cbt_map->device_capacity,
+			   cbt_map->blk_size_shift_min, cbt_map->blk_count_max,
+			   &cbt_map->blk_size_shift, &cbt_map->blk_count);
+}
 
-	pr_debug("Allocate CBT map of %zu blocks\n", size);
+/*
+ * The tables and the bitmaps of the map. They are allocated without the
+ * locks of the map and then swapped with the ones of the map under them.
+ */
+struct cbt_map_tables {
+	unsigned char *read_map;
+	unsigned char *write_map;
+	unsigned long *bitmaps;
+	size_t page_count;
+};
 
-	if (cbt_map->read_map || cbt_map->write_map)
-		return -EINVAL;
+static int cbt_map_tables_alloc(struct cbt_map_tables *tables, size_t size,
+				int node)
+{
+	unsigned int noio_flags;
+
+	/*
+	 * The readable table can be mapped into the memory of the user's
+	 * process, so it is allocated as suitable for it. The allocation
+	 * must not cause I/O to the device, the queue of which may be frozen.
+	 */
+	noio_flags = memalloc_noio_save();
+	tables->read_map = vmalloc_user(size);
+	memalloc_noio_restore(noio_flags);
+	if (!tables->read_map)
+		return -ENOMEM;
 
-	read_map = __vmalloc(size, GFP_NOIO | __GFP_ZERO);
-	if (!read_map)
+	/*
+	 * The writable table is changed by every write to the device, so it
+	 * is allocated on the home node of the device. The kvmalloc() maps
+	 * a large table with huge pages where the architecture allows it,
+	 * which reduces the TLB misses on the write path.
+	 */
+	noio_flags = memalloc_noio_save();
+	tables->write_map = kvmalloc_node(size, GFP_KERNEL | __GFP_ZERO, node);
+	memalloc_noio_restore(noio_flags);
+	if (!tables->write_map) {
+		vfree(tables->read_map);
+		tables->read_map = NULL;
 		return -ENOMEM;
+	}
 
-	write_map = __vmalloc(size, GFP_NOIO | __GFP_ZERO);
-	if (!write_map) {
-		vfree(read_map);
+	tables->page_count = DIV_ROUND_UP(size, PAGE_SIZE);
+	/*
+	 * All three bitmaps have the same size and are allocated with
+	 * a single call.
+	 */
+	tables->bitmaps = bitmap_zalloc(tables->page_count * 3, GFP_NOIO);
+	if (!tables->bitmaps) {
+		kvfree(tables->write_map);
+		tables->write_map = NULL;
+		vfree(tables->read_map);
+		tables->read_map = NULL;
 		return -ENOMEM;
 	}
 
-	cbt_map->read_map = read_map;
 	memory_object_inc(memory_object_cbt_buffer);
-	cbt_map->write_map = write_map;
 	memory_object_inc(memory_object_cbt_buffer);
+	memory_object_inc(memory_object_cbt_buffer);
+	return 0;
+}
+
+static void cbt_map_tables_free(struct cbt_map_tables *tables)
+{
+	if (tables->read_map) {
+		memory_object_dec(memory_object_cbt_buffer);
+		vfree(tables->read_map);
+		tables->read_map = NULL;
+	}
 
+	if (tables->write_map) {
+		memory_object_dec(memory_object_cbt_buffer);
+		kvfree(tables->write_map);
+		tables->write_map = NULL;
+	}
+
+	if (tables->bitmaps) {
+		memory_object_dec(memory_object_cbt_buffer);
+		bitmap_free(tables->bitmaps);
+		tables->bitmaps = NULL;
+	}
+	tables->page_count = 0;
+}
+
+/*
+ * Takes the tables into the map and returns the previous ones of it in
+ * @tables.
+ */
+static void cbt_map_tables_swap(struct cbt_map *cbt_map,
+				struct cbt_map_tables *tables)
+{
+	struct cbt_map_tables prev = {
+		.read_map = cbt_map->read_map,
+		.write_map = cbt_map->write_map,
+		.bitmaps = cbt_map->read_map_stale,
+		.page_count = cbt_map->page_count,
+	};
+
+	cbt_map->read_map = tables->read_map;
+	cbt_map->write_map = tables->write_map;
+	cbt_map->read_map_stale = tables->bitmaps;
+	cbt_map->page_count = tables->page_count;
+	if (tables->bitmaps) {
+		cbt_map->read_summary = tables->bitmaps +
+					BITS_TO_LONGS(tables->page_count);
+		cbt_map->write_summary = tables->bitmaps +
+					 2 * BITS_TO_LONGS(tables->page_count);
+	} else {
+		cbt_map->read_summary = NULL;
+		cbt_map->write_summary = NULL;
+	}
+
+	*tables = prev;
+}
+
+/*
+ * The new tables start a new generation of the change tracking.
+ */
+static void cbt_map_new_generation(struct cbt_map *cbt_map)
+{
 	cbt_map->snap_number_previous = 0;
 	cbt_map->snap_number_active = 1;
 	generate_random_uuid(cbt_map->generation_id.b);
+	cbt_map->switch_count++;
 	cbt_map->is_corrupted = false;
+}
+
+static int cbt_map_allocate(struct cbt_map *cbt_map)
+{
+	int ret;
+	struct cbt_map_tables tables;
+
+	pr_debug("Allocate CBT map of %zu blocks\n", cbt_map->blk_count);
+
+	if (cbt_map->read_map || cbt_map->write_map)
+		return -EINVAL;
+
+	ret = cbt_map_tables_alloc(&tables, cbt_map->blk_count, cbt_map->node);
+	if (ret)
+		return ret;
+
+	cbt_map_tables_swap(cbt_map, &tables);
+	cbt_map_new_generation(cbt_map);
 
 	return 0;
 }
 
 static void cbt_map_deallocate(struct cbt_map *cbt_map)
 {
-	cbt_map->is_corrupted = false;
+	struct cbt_map_tables tables = { 0 };
 
-	if (cbt_map->read_map) {
-		memory_object_dec(memory_object_cbt_buffer);
-		vfree(cbt_map->read_map);
-		cbt_map->read_map = NULL;
-	}
+	cbt_map->is_corrupted = false;
 
-	if (cbt_map->write_map) {
-		memory_object_dec(memory_object_cbt_buffer);
-		vfree(cbt_map->write_map);
-		cbt_map->write_map = NULL;
-	}
+	cbt_map_tables_swap(cbt_map, &tables);
+	cbt_map_tables_free(&tables);
 }
 
 int cbt_map_reset(struct cbt_map *cbt_map, sector_t device_capacity)
 {
+	int ret;
+
+	mutex_lock(&cbt_map->mapping_lock);
 	cbt_map_deallocate(cbt_map);
 
 	cbt_map->device_capacity = device_capacity;
 	cbt_map_calculate_block_size(cbt_map);
 
-	return cbt_map_allocate(cbt_map);
+	ret = cbt_map_allocate(cbt_map);
+	mutex_unlock(&cbt_map->mapping_lock);
+
+	return ret;
+}
+
+/**
+ * cbt_map_set_granularity() - Set the block size policy for the device.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @blk_size_shift_min:
+ *	The power of 2 for the minimum change tracking block size.
+ * @blk_count_max:
+ *	The maximum number of change tracking blocks.
+ *
+ * If the block size or the number of blocks changes, the tables are
+ * created again with a new generation identifier. The new tables are
+ * allocated first and then replace the current ones under the mapping lock
+ * and the locker, so the readers of the map see either the old tables with
+ * the old parameters or the new ones. If the allocation fails, the map is
+ * not changed. The caller must guarantee that there are no concurrent
+ * writes to the device.
+ */
+int cbt_map_set_granularity(struct cbt_map *cbt_map, size_t blk_size_shift_min,
+			    size_t blk_count_max)
+{
+	int ret = 0;
+	size_t blk_size_shift;
+	size_t blk_count;
+	struct cbt_map_tables tables;
+
+	mutex_lock(&cbt_map->mapping_lock);
+	cbt_map_block_size(cbt_map->device_capacity, blk_size_shift_min,
+			   blk_count_max, &blk_size_shift, &blk_count);
+	if ((cbt_map->blk_size_shift == blk_size_shift) &&
+	    (cbt_map->blk_count == blk_count)) {
+		spin_lock(&cbt_map->locker);
+		cbt_map->blk_size_shift_min = blk_size_shift_min;
+		cbt_map->blk_count_max = blk_count_max;
+		spin_unlock(&cbt_map->locker);
+		goto out;
+	}
+
+	ret = cbt_map_tables_alloc(&tables, blk_count, cbt_map->node);
+	if (ret)
+		goto out;
+
+	spin_lock(&cbt_map->locker);
+	cbt_map->blk_size_shift_min = blk_size_shift_min;
+	cbt_map->blk_count_max = blk_count_max;
+	cbt_map->blk_size_shift = blk_size_shift;
+	cbt_map->blk_count = blk_count;
+	cbt_map_tables_swap(cbt_map, &tables);
+	cbt_map_new_generation(cbt_map);
+	spin_unlock(&cbt_map->locker);
+
+	cbt_map_tables_free(&tables);
+	pr_debug("CBT block size changed to %zu bytes, %zu blocks\n",
+		 cbt_map_blk_size(cbt_map), blk_count);
+out:
+	mutex_unlock(&cbt_map->mapping_lock);
+	return ret;
 }
 
 static inline void cbt_map_destroy(struct cbt_map *cbt_map)
@@ -133,7 +319,11 @@ struct cbt_map *cbt_map_create(struct block_device *bdev)
 		return NULL;
 	memory_object_inc(memory_object_cbt_map);
 
+	mutex_init(&cbt_map->mapping_lock);
+	cbt_map->node = bdev->bd_disk->node_id;
 	cbt_map->device_capacity = bdev_nr_sectors(bdev);
+	cbt_map->blk_size_shift_min = tracking_block_minimum_shift;
+	cbt_map->blk_count_max = tracking_block_maximum_count;
 	cbt_map_calculate_block_size(cbt_map);
 
 	ret = cbt_map_allocate(cbt_map);
@@ -155,6 +345,45 @@ void cbt_map_destroy_cb(struct kref *kref)
 	cbt_map_destroy(container_of(kref, struct cbt_map, kref));
 }
 
+static void __cbt_map_sync_page(struct cbt_map *cbt_map, size_t page_inx)
+{
+	size_t offset = page_inx << PAGE_SHIFT;
+
+	memcpy(cbt_map->read_map + offset, cbt_map->write_map + offset,
+	       min_t(size_t, PAGE_SIZE, cbt_map->blk_count - offset));
+	/*
+	 * The copy must be completed before other writers see that the page
+	 * has been synchronized.
+	 */
+	smp_mb__before_atomic();
+	clear_bit(page_inx, cbt_map->read_map_stale);
+}
+
+/*
+ * Copies the pages of the writable table to the readable table, if it has
+ * not been done since the last switch.
+ */
+static void cbt_map_sync_range(struct cbt_map *cbt_map, size_t blk_first,
+			       size_t blk_last)
+{
+	size_t page_inx;
+
+	for (page_inx = blk_first >> PAGE_SHIFT;
+	     page_inx <= (blk_last >> PAGE_SHIFT); page_inx++) {
+		if (likely(!test_bit(page_inx, cbt_map->read_map_stale)))
+			continue;
+
+		spin_lock(&cbt_map->locker);
+		if (test_bit(page_inx, cbt_map->read_map_stale))
+			__cbt_map_sync_page(cbt_map, page_inx);
+		spin_unlock(&cbt_map->locker);
+	}
+}
+
+/*
+ * The caller must guarantee that there are no concurrent writes to the
+ * device, for example by freezing its queue.
+ */
 void cbt_map_switch(struct cbt_map *cbt_map)
 {
 	pr_debug("CBT map switch\n");
@@ -165,84 +394,137 @@ void cbt_map_switch(struct cbt_map *cbt_map)
 	if (cbt_map->snap_number_active == 256) {
 		cbt_map->snap_number_active = 1;
 
+		bitmap_zero(cbt_map->read_map_stale, cbt_map->page_count);
+		bitmap_zero(cbt_map->write_summary, cbt_map->page_count);
 		memset(cbt_map->write_map, 0, cbt_map->blk_count);
 
 		generate_random_uuid(cbt_map->generation_id.b);
 
 		pr_debug("CBT reset\n");
-	} else
-		memcpy(cbt_map->read_map, cbt_map->write_map, cbt_map->blk_count);
+	} else {
+		/*
+		 * The summary keeps the pages with the changes of all the
+		 * previous snapshots of the generation, since the changes can
+		 * be read since any of them. Such pages are skipped only by
+		 * the scan of their blocks.
+		 */
+		bitmap_fill(cbt_map->read_map_stale, cbt_map->page_count);
+		bitmap_copy(cbt_map->read_summary, cbt_map->write_summary,
+			    cbt_map->page_count);
+	}
+	cbt_map->switch_count++;
 	spin_unlock(&cbt_map->locker);
 }
 
-static inline int _cbt_map_set(struct cbt_map *cbt_map, sector_t sector_start,
-			       sector_t sector_cnt, u8 snap_number,
-			       unsigned char *map)
+static inline int cbt_map_blocks(struct cbt_map *cbt_map, sector_t sector_start,
+				 sector_t sector_cnt, size_t *blk_first,
+				 size_t *blk_last)
 {
-	int res = 0;
-	u8 num;
-	size_t inx;
-	size_t cbt_block_first = (size_t)(
-		sector_start >> (cbt_map->blk_size_shift - SECTOR_SHIFT));
-	size_t cbt_block_last = (size_t)(
-		(sector_start + sector_cnt - 1) >>
-		(cbt_map->blk_size_shift - SECTOR_SHIFT));
-
-	for (inx = cbt_block_first; inx <= cbt_block_last; ++inx) {
-		if (unlikely(inx >= cbt_map->blk_count)) {
-			pr_err("Block index is too large.\n");
-			pr_err("Block #%zu was demanded, map size %zu blocks.\n",
-			       inx, cbt_map->blk_count);
-			res = -EINVAL;
-			break;
-		}
+	*blk_first = (size_t)(sector_start >>
+			      (cbt_map->blk_size_shift - SECTOR_SHIFT));
+	*blk_last = (size_t)((sector_start + sector_cnt - 1) >>
+			     (cbt_map->blk_size_shift - SECTOR_SHIFT));
 
-		num = map[inx];
-		if (num < snap_number)
-			map[inx] = snap_number;
+	if (unlikely(*blk_last >= cbt_map->blk_count)) {
+		pr_err("Block index is too large.\n");
+		pr_err("Block #%zu was demanded, map size %zu blocks.\n",
+		       *blk_last, cbt_map->blk_count);
+		return -EINVAL;
 	}
-	return res;
+	return 0;
+}
+
+/*
+ * All writers store the same sequential number to the writable table,
+ * since it is changed only when the device has no writes in flight.
+ * Therefore, concurrent writers do not need any locking. The number already
+ * stored is only increased, which keeps the table unchanged when the same
+ * blocks are written again.
+ */
+static inline void _cbt_map_set(unsigned char *map, unsigned long *summary,
+				size_t blk_first, size_t blk_last,
+				u8 snap_number)
+{
+	size_t inx;
+
+	for (inx = blk_first; inx <= blk_last; ++inx)
+		if (READ_ONCE(map[inx]) < snap_number)
+			WRITE_ONCE(map[inx], snap_number);
+
+	for (inx = blk_first >> PAGE_SHIFT; inx <= (blk_last >> PAGE_SHIFT);
+	     inx++)
+		if (!test_bit(inx, summary))
+			set_bit(inx, summary);
 }
 
 int cbt_map_set(struct cbt_map *cbt_map, sector_t sector_start,
 		sector_t sector_cnt)
 {
 	int res;
+	size_t blk_first;
+	size_t blk_last;
 
-	spin_lock(&cbt_map->locker);
-	if (unlikely(cbt_map->is_corrupted)) {
-		spin_unlock(&cbt_map->locker);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted)))
 		return -EINVAL;
+
+	res = cbt_map_blocks(cbt_map, sector_start, sector_cnt, &blk_first,
+			     &blk_last);
+	if (unlikely(res)) {
+		WRITE_ONCE(cbt_map->is_corrupted, true);
+		return res;
 	}
-	res = _cbt_map_set(cbt_map, sector_start, sector_cnt,
-			   (u8)cbt_map->snap_number_active, cbt_map->write_map);
-	if (unlikely(res))
-		cbt_map->is_corrupted = true;
 
-	spin_unlock(&cbt_map->locker);
+	/*
+	 * The readable table should receive the state of the writable table
+	 * before it is changed.
+	 */
+	cbt_map_sync_range(cbt_map, blk_first, blk_last);
+	_cbt_map_set(cbt_map->write_map, cbt_map->write_summary, blk_first,
+		     blk_last, (u8)READ_ONCE(cbt_map->snap_number_active));
 
-	return res;
+	return 0;
+}
+
+/*
+ * Marks the blocks as changed in both tables. The caller must hold the
+ * locker.
+ */
+static void __cbt_map_set_both(struct cbt_map *cbt_map, size_t blk_first,
+			       size_t blk_last)
+{
+	size_t page_inx;
+
+	for (page_inx = blk_first >> PAGE_SHIFT;
+	     page_inx <= (blk_last >> PAGE_SHIFT); page_inx++)
+		if (test_bit(page_inx, cbt_map->read_map_stale))
+			__cbt_map_sync_page(cbt_map, page_inx);
+
+	_cbt_map_set(cbt_map->write_map, cbt_map->write_summary, blk_first,
+		     blk_last, (u8)cbt_map->snap_number_active);
+	_cbt_map_set(cbt_map->read_map, cbt_map->read_summary, blk_first,
+		     blk_last, (u8)cbt_map->snap_number_previous);
 }
 
 int cbt_map_set_both(struct cbt_map *cbt_map, sector_t sector_start,
 		     sector_t sector_cnt)
 {
 	int res;
+	size_t blk_first;
+	size_t blk_last;
 
-	spin_lock(&cbt_map->locker);
-	if (unlikely(cbt_map->is_corrupted)) {
-		spin_unlock(&cbt_map->locker);
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted)))
 		return -EINVAL;
-	}
-	res = _cbt_map_set(cbt_map, sector_start, sector_cnt,
-			   (u8)cbt_map->snap_number_active, cbt_map->write_map);
-	if (!res)
-		res = _cbt_map_set(cbt_map, sector_start, sector_cnt,
-				   (u8)cbt_map->snap_number_previous,
-				   cbt_map->read_map);
+
+	res = cbt_map_blocks(cbt_map, sector_start, sector_cnt, &blk_first,
+			     &blk_last);
+	if (unlikely(res))
+		return res;
+
+	spin_lock(&cbt_map->locker);
+	__cbt_map_set_both(cbt_map, blk_first, blk_last);
 	spin_unlock(&cbt_map->locker);
 
-	return res;
+	return 0;
 }
 
 size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buff,
@@ -250,14 +532,21 @@ size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buff,
 {
 	size_t readed = 0;
 	size_t left_size;
-	size_t real_size = min((cbt_map->blk_count - offset), size);
+	size_t real_size;
 
 	if (unlikely(cbt_map->is_corrupted)) {
 		pr_err("CBT table was corrupted\n");
 		return -EFAULT;
 	}
 
-	left_size = copy_to_user(user_buff, cbt_map->read_map, real_size);
+	if (offset >= cbt_map->blk_count)
+		return 0;
+	real_size = min((cbt_map->blk_count - offset), size);
+
+	if (real_size)
+		cbt_map_sync_range(cbt_map, offset, offset + real_size - 1);
+	left_size = copy_to_user(user_buff, cbt_map->read_map + offset,
+				 real_size);
 
 	if (left_size == 0)
 		readed = real_size;
@@ -270,22 +559,502 @@ size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buff,
 	return readed;
 }
 
+static inline sector_t cbt_map_blk_sector(struct cbt_map *cbt_map,
+					  size_t blk)
+{
+	return min_t(sector_t,
+		     (sector_t)blk << (cbt_map->blk_size_shift - SECTOR_SHIFT),
+		     cbt_map->device_capacity);
+}
+
+/**
+ * cbt_map_read_ranges_to_user() - Read ranges of changed blocks.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @snap_number:
+ *	Blocks with a sequential number of changes greater than this value
+ *	are considered changed.
+ * @sector_offset:
+ *	The sector from which the search starts. On output, the sector from
+ *	which the search should be continued.
+ * @ranges:
+ *	A user space array for the ranges of changed sectors.
+ * @count:
+ *	The size of the @ranges array. On output, the number of ranges read.
+ *
+ * Only the pages of the readable table that have changed blocks in the
+ * current generation are scanned. Since the summary is cleared only when
+ * the generation changes, the pages with older changes only are scanned
+ * too, and the more snapshots were taken in the generation, the more
+ * such pages there can be. When all changes have been read, @sector_offset
+ * is equal to the capacity of the device.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int cbt_map_read_ranges_to_user(struct cbt_map *cbt_map, u8 snap_number,
+				sector_t *sector_offset,
+				struct blk_snap_block_range __user *ranges,
+				unsigned int *count)
+{
+	struct blk_snap_block_range range;
+	unsigned int ranges_count = 0;
+	size_t blk = (size_t)(*sector_offset >>
+			      (cbt_map->blk_size_shift - SECTOR_SHIFT));
+	size_t range_first;
+
+	if (unlikely(cbt_map->is_corrupted)) {
+		pr_err("CBT table was corrupted\n");
+		return -EFAULT;
+	}
+
+	while ((blk < cbt_map->blk_count) && (ranges_count < *count)) {
+		size_t page_inx = blk >> PAGE_SHIFT;
+		size_t page_end;
+
+		if (!test_bit(page_inx, cbt_map->read_summary)) {
+			/* Skip the pages without changes */
+			page_inx = find_next_bit(cbt_map->read_summary,
+						 cbt_map->page_count,
+						 page_inx + 1);
+			blk = min_t(size_t, page_inx << PAGE_SHIFT,
+				    cbt_map->blk_count);
+			continue;
+		}
+
+		cbt_map_sync_range(cbt_map, blk, blk);
+		page_end = min_t(size_t, (page_inx + 1) << PAGE_SHIFT,
+				 cbt_map->blk_count);
+		while ((blk < page_end) &&
+		       (cbt_map->read_map[blk] <= snap_number))
+			blk++;
+		if (blk == page_end)
+			continue;
+
+		/* The range can continue on the next pages */
+		range_first = blk;
+		for (blk++; blk < cbt_map->blk_count; blk++) {
+			if (!(blk & (PAGE_SIZE - 1))) {
+				if (!test_bit(blk >> PAGE_SHIFT,
+					      cbt_map->read_summary))
+					break;
+				cbt_map_sync_range(cbt_map, blk, blk);
+			}
+			if (cbt_map->read_map[blk] <= snap_number)
+				break;
+		}
+
+		range.sector_offset = cbt_map_blk_sector(cbt_map, range_first);
+		range.sector_count =
+			cbt_map_blk_sector(cbt_map, blk) - range.sector_offset;
+		if (copy_to_user(ranges + ranges_count, &range, sizeof(range))) {
+			pr_err("Unable to read CBT ranges: invalid user buffer\n");
+			return -ENODATA;
+		}
+		ranges_count++;
+	}
+
+	*sector_offset = cbt_map_blk_sector(cbt_map, blk);
+	*count = ranges_count;
+	return 0;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+/**
+ * cbt_map_export() - Save the state of the change tracking.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @state:
+ *	The parameters of the table. If the &state->buff is not NULL, the
+ *	writable table is copied to it.
+ */
+int cbt_map_export(struct cbt_map *cbt_map, struct blk_snap_cbt_state *state)
+{
+	if (unlikely(cbt_map->is_corrupted)) {
+		pr_err("CBT table was corrupted\n");
+		return -EFAULT;
+	}
+
+	spin_lock(&cbt_map->locker);
+	state->blk_size = (__u32)cbt_map_blk_size(cbt_map);
+	state->blk_count = (__u32)cbt_map->blk_count;
+	state->device_capacity =
+		(__u64)(cbt_map->device_capacity << SECTOR_SHIFT);
+	export_uuid(state->generation_id.b, &cbt_map->generation_id);
+	state->snap_number_active = (__u8)cbt_map->snap_number_active;
+	state->snap_number_previous = (__u8)cbt_map->snap_number_previous;
+	spin_unlock(&cbt_map->locker);
+
+	if (!state->buff)
+		return 0;
+
+	if (copy_to_user(state->buff, cbt_map->write_map, cbt_map->blk_count)) {
+		pr_err("Unable to export CBT table: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+/**
+ * cbt_map_read_ranges_since() - Read ranges of blocks changed since the
+ *	snapshot of the generation.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @generation_id:
+ *	The generation of changes in which the @snap_number was received.
+ * @snap_number:
+ *	Blocks with a sequential number of changes greater than this value
+ *	are considered changed.
+ * @sector_offset:
+ *	The sector from which the search starts. On output, the sector from
+ *	which the search should be continued.
+ * @ranges:
+ *	A user space array for the ranges of changed sectors.
+ * @count:
+ *	The size of the @ranges array. On output, the number of ranges read.
+ *
+ * The readable table keeps the numbers of all snapshots of the generation
+ * up to the last one taken, so the changes since any of them are found the
+ * same way as since the previous one. The lock cannot be held while the
+ * ranges are copied to the user, so the generation is checked again after
+ * reading.
+ *
+ * Return: 0 if succeeded, -ESTALE if the generation has been changed,
+ * -EAGAIN if it has been changed while the ranges were read, negative errno
+ * otherwise.
+ */
+int cbt_map_read_ranges_since(struct cbt_map *cbt_map, uuid_t *generation_id,
+			      u8 snap_number, sector_t *sector_offset,
+			      struct blk_snap_block_range __user *ranges,
+			      unsigned int *count)
+{
+	int ret;
+	bool is_stale;
+	unsigned long snap_number_previous;
+
+	spin_lock(&cbt_map->locker);
+	is_stale = !uuid_equal(&cbt_map->generation_id, generation_id);
+	snap_number_previous = cbt_map->snap_number_previous;
+	spin_unlock(&cbt_map->locker);
+
+	if (is_stale) {
+		pr_debug("CBT generation has been changed\n");
+		return -ESTALE;
+	}
+	if (snap_number > snap_number_previous) {
+		pr_err("Unable to read CBT ranges: snapshot number %u has not been taken yet\n",
+		       snap_number);
+		return -EINVAL;
+	}
+
+	ret = cbt_map_read_ranges_to_user(cbt_map, snap_number, sector_offset,
+					  ranges, count);
+	if (ret)
+		return ret;
+
+	spin_lock(&cbt_map->locker);
+	is_stale = !uuid_equal(&cbt_map->generation_id, generation_id);
+	spin_unlock(&cbt_map->locker);
+
+	if (is_stale) {
+		pr_debug("CBT generation has been changed while reading\n");
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+/**
+ * cbt_map_import() - Restore the state of the change tracking.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @state:
+ *	The state previously saved by cbt_map_export().
+ *
+ * The caller must guarantee that there are no concurrent writes to the
+ * device. The new writable table and its summary are prepared without the
+ * lock, only the pointer to the table is replaced under it.
+ */
+int cbt_map_import(struct cbt_map *cbt_map,
+		   const struct blk_snap_cbt_state *state)
+{
+	unsigned char *map;
+	unsigned long *summary;
+	size_t inx;
+	u8 snap_number_active = state->snap_number_active;
+
+	if ((state->blk_size != cbt_map_blk_size(cbt_map)) ||
+	    (state->blk_count != cbt_map->blk_count) ||
+	    (state->device_capacity !=
+	     (__u64)(cbt_map->device_capacity << SECTOR_SHIFT))) {
+		pr_err("Unable to import CBT table: the table parameters do not match\n");
+		return -EINVAL;
+	}
+	if (!snap_number_active || !state->buff ||
+	    (state->snap_number_previous >= snap_number_active)) {
+		pr_err("Unable to import CBT table: invalid state\n");
+		return -EINVAL;
+	}
+
+	map = kvmalloc_node(cbt_map->blk_count, GFP_KERNEL, cbt_map->node);
+	if (!map)
+		return -ENOMEM;
+	memory_object_inc(memory_object_cbt_buffer);
+
+	summary = bitmap_zalloc(cbt_map->page_count, GFP_KERNEL);
+	if (!summary) {
+		memory_object_dec(memory_object_cbt_buffer);
+		kvfree(map);
+		return -ENOMEM;
+	}
+	memory_object_inc(memory_object_cbt_buffer);
+
+	if (copy_from_user(map, state->buff, cbt_map->blk_count)) {
+		pr_err("Unable to import CBT table: invalid user buffer\n");
+		memory_object_dec(memory_object_cbt_buffer);
+		bitmap_free(summary);
+		memory_object_dec(memory_object_cbt_buffer);
+		kvfree(map);
+		return -ENODATA;
+	}
+
+	/*
+	 * The blocks that have been changed since the tracker was created
+	 * should remain marked as changed in the imported table.
+	 */
+	for (inx = 0; inx < cbt_map->blk_count; inx++) {
+		if (map[inx] > snap_number_active)
+			map[inx] = snap_number_active;
+		if (cbt_map->write_map[inx])
+			map[inx] = snap_number_active;
+	}
+	for (inx = 0; inx < cbt_map->page_count; inx++)
+		if (memchr_inv(map + (inx << PAGE_SHIFT), 0,
+			       min_t(size_t, PAGE_SIZE,
+				     cbt_map->blk_count - (inx << PAGE_SHIFT))))
+			set_bit(inx, summary);
+
+	spin_lock(&cbt_map->locker);
+	swap(cbt_map->write_map, map);
+	bitmap_copy(cbt_map->write_summary, summary, cbt_map->page_count);
+	bitmap_copy(cbt_map->read_summary, summary, cbt_map->page_count);
+	bitmap_fill(cbt_map->read_map_stale, cbt_map->page_count);
+
+	cbt_map->snap_number_active = snap_number_active;
+	cbt_map->snap_number_previous = state->snap_number_previous;
+	import_uuid(&cbt_map->generation_id, state->generation_id.b);
+	cbt_map->switch_count++;
+	cbt_map->is_corrupted = false;
+	spin_unlock(&cbt_map->locker);
+
+	/* The previous writable table */
+	memory_object_dec(memory_object_cbt_buffer);
+	kvfree(map);
+	memory_object_dec(memory_object_cbt_buffer);
+	bitmap_free(summary);
+
+	pr_debug("CBT table imported, snap number %u\n", snap_number_active);
+	return 0;
+}
+
+static int cbt_map_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct cbt_map *cbt_map = file->private_data;
+	int ret;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	/* The mapping cannot be made writable later by mprotect() */
+#ifdef HAVE_VMA_VM_FLAGS_WRITABLE
+	vma->vm_flags &= ~VM_MAYWRITE;
+#else
+	vm_flags_clear(vma, VM_MAYWRITE);
+#endif
+
+	mutex_lock(&cbt_map->mapping_lock);
+	if (cbt_map->read_map)
+		ret = remap_vmalloc_range(vma, cbt_map->read_map,
+					  vma->vm_pgoff);
+	else
+		ret = -ENODATA;
+	mutex_unlock(&cbt_map->mapping_lock);
+
+	return ret;
+}
+
+static int cbt_map_release(struct inode *inode, struct file *file)
+{
+	cbt_map_put(file->private_data);
+	return 0;
+}
+
+static const struct file_operations cbt_map_fops = {
+	.owner = THIS_MODULE,
+	.mmap = cbt_map_mmap,
+	.release = cbt_map_release,
+};
+
+/**
+ * cbt_map_get_file() - Create a file for mapping the readable table.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @arg:
+ *	The parameters of the table.
+ *
+ * All pages of the readable table are synchronized before it is mapped, so
+ * the mapping shows the state of the table at the moment of the last switch.
+ * The mapped pages are held by the mapping, therefore, the table can be
+ * created again while it is mapped. The caller installs the file descriptor
+ * for the file when the parameters have been passed to the user space.
+ *
+ * Return: the file if succeeded, ERR_PTR() otherwise.
+ */
+struct file *cbt_map_get_file(struct cbt_map *cbt_map,
+			      struct blk_snap_tracker_map_cbt *arg)
+{
+	struct file *file;
+
+	if (unlikely(cbt_map->is_corrupted)) {
+		pr_err("CBT table was corrupted\n");
+		return ERR_PTR(-EFAULT);
+	}
+
+	mutex_lock(&cbt_map->mapping_lock);
+	cbt_map_sync_range(cbt_map, 0, cbt_map->blk_count - 1);
+
+	spin_lock(&cbt_map->locker);
+	arg->blk_size = (__u32)cbt_map_blk_size(cbt_map);
+	arg->blk_count = (__u32)cbt_map->blk_count;
+	arg->switch_count = cbt_map->switch_count;
+	arg->snap_number = (__u8)cbt_map->snap_number_previous;
+	spin_unlock(&cbt_map->locker);
+	mutex_unlock(&cbt_map->mapping_lock);
+
+	cbt_map_get(cbt_map);
+	file = anon_inode_getfile("[blksnap-cbt]", &cbt_map_fops, cbt_map,
+				  O_RDONLY);
+	if (IS_ERR(file))
+		cbt_map_put(cbt_map);
+
+	return file;
+}
+#endif
+
+static int cbt_map_range_cmp(const void *a, const void *b)
+{
+	const struct blk_snap_block_range *ra = a;
+	const struct blk_snap_block_range *rb = b;
+
+	if (ra->sector_offset < rb->sector_offset)
+		return -1;
+	return ra->sector_offset > rb->sector_offset;
+}
+
+/*
+ * Sorts the ranges and merges the overlapping and adjacent ones in place.
+ * The empty ranges are dropped. Returns the number of the merged ranges.
+ */
+static unsigned int cbt_map_merge_ranges(struct blk_snap_block_range *ranges,
+					 unsigned int count)
+{
+	unsigned int inx;
+	unsigned int merged = 0;
+
+	sort(ranges, count, sizeof(struct blk_snap_block_range),
+	     cbt_map_range_cmp, NULL);
+
+	for (inx = 0; inx < count; inx++) {
+		struct blk_snap_block_range *range = &ranges[inx];
+
+		if (!range->sector_count)
+			continue;
+
+		if (merged) {
+			struct blk_snap_block_range *last = &ranges[merged - 1];
+			__u64 last_end = last->sector_offset + last->sector_count;
+
+			if (range->sector_offset <= last_end) {
+				last->sector_count =
+					max(last_end, range->sector_offset +
+							      range->sector_count) -
+					last->sector_offset;
+				continue;
+			}
+		}
+		ranges[merged++] = *range;
+	}
+
+	return merged;
+}
+
+/*
+ * The number of blocks marked under the lock of the map at a time. The
+ * writes to the original device wait for the lock meanwhile.
+ */
+#define CBT_MAP_MARK_BATCH_BLOCKS (1 << 16)
+
+/**
+ * cbt_map_mark_dirty_blocks() - Mark the ranges of sectors as changed in
+ *	both tables.
+ * @cbt_map:
+ *	The change block tracking map.
+ * @block_ranges:
+ *	The ranges of sectors. They are sorted and merged in place.
+ * @count:
+ *	The number of the ranges.
+ *
+ * All ranges are checked before any of them is marked. The lock is taken once
+ * for the ranges, but it is released to reschedule after every
+ * CBT_MAP_MARK_BATCH_BLOCKS blocks, so a large array of ranges or a large
+ * range does not keep it for long.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
 int cbt_map_mark_dirty_blocks(struct cbt_map *cbt_map,
 			      struct blk_snap_block_range *block_ranges,
 			      unsigned int count)
 {
-	int inx;
-	int ret = 0;
+	int ret;
+	unsigned int inx;
+	size_t blk_first;
+	size_t blk_last;
+	size_t budget = CBT_MAP_MARK_BATCH_BLOCKS;
 
+	if (unlikely(READ_ONCE(cbt_map->is_corrupted)))
+		return -EINVAL;
+
+	count = cbt_map_merge_ranges(block_ranges, count);
 	for (inx = 0; inx < count; inx++) {
-		ret = cbt_map_set_both(
-			cbt_map, (sector_t)block_ranges[inx].sector_offset,
-			(sector_t)block_ranges[inx].sector_count);
-		if (ret)
-			break;
+		ret = cbt_map_blocks(cbt_map,
+				     (sector_t)block_ranges[inx].sector_offset,
+				     (sector_t)block_ranges[inx].sector_count,
+				     &blk_first, &blk_last);
+		if (unlikely(ret))
+			return ret;
 	}
 
-	return ret;
+	spin_lock(&cbt_map->locker);
+	for (inx = 0; inx < count; inx++) {
+		cbt_map_blocks(cbt_map, (sector_t)block_ranges[inx].sector_offset,
+			       (sector_t)block_ranges[inx].sector_count,
+			       &blk_first, &blk_last);
+		while (blk_first <= blk_last) {
+			size_t last = min(blk_last, blk_first + budget - 1);
+
+			__cbt_map_set_both(cbt_map, blk_first, last);
+			budget -= last - blk_first + 1;
+			blk_first = last + 1;
+			if (budget)
+				continue;
+
+			spin_unlock(&cbt_map->locker);
+			cond_resched();
+			spin_lock(&cbt_map->locker);
+			budget = CBT_MAP_MARK_BATCH_BLOCKS;
+		}
+	}
+	spin_unlock(&cbt_map->locker);
+
+	return 0;
 }
 
 #ifdef BLK_SNAP_DEBUG_SECTOR_STATE
@@ -304,6 +1073,8 @@ int cbt_map_get_sector_state(struct cbt_map *cbt_map, sector_t sector,
 		return -EINVAL;
 	}
 
+	cbt_map_sync_range(cbt_map, cbt_block, cbt_block);
+
 	spin_lock(&cbt_map->locker);
 	if (unlikely(cbt_map->is_corrupted)) {
 		ret = -EINVAL;
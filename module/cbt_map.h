@@ -6,9 +6,12 @@
 #include <linux/kref.h>
 #include <linux/uuid.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/blkdev.h>
 
 struct blk_snap_block_range;
+struct blk_snap_cbt_state;
+struct blk_snap_tracker_map_cbt;
 
 /**
  * struct cbt_map - The table of changes for a block device.
@@ -16,18 +19,47 @@ struct blk_snap_block_range;
  * @kref:
  *	Reference counter.
  * @locker:
- *	Locking for atomic modification of structure members.
+ *	Serializes switching of the tables, synchronization of the readable
+ *	table and modification of both tables. Marking of the writable table
+ *	does not use it.
+ * @mapping_lock:
+ *	Protects the readable table from being replaced while it is mapped
+ *	into the memory of a process.
+ * @blk_size_shift_min:
+ *	The power of 2 for the minimum change tracking block size for this
+ *	device.
+ * @blk_count_max:
+ *	The maximum number of change tracking blocks for this device. Limits
+ *	the memory used by the tables.
  * @blk_size_shift:
  *	The power of 2 used to specify the change tracking block size.
  * @blk_count:
  *	The number of change tracking blocks.
  * @device_capacity:
  *	The actual capacity of the device.
+ * @node:
+ *	The home NUMA node of the device. The writable table is allocated on
+ *	it.
  * @read_map:
  *	A table of changes available for reading. This is the table that can
  *	be read after taking a snapshot.
  * @write_map:
  *	The current table for tracking changes.
+ * @read_map_stale:
+ *	A bitmap in which each bit corresponds to one page of the tables.
+ *	The bit is set if the page of the readable table has not yet been
+ *	synchronized with the writable table since the last switch.
+ * @read_summary:
+ *	The summary bitmap of the readable table. Each bit corresponds to one
+ *	page of the table and is set if the page contains changed blocks.
+ *	The bits are cleared only when a new generation of changes starts,
+ *	so a set bit does not mean that the page has changes newer than
+ *	the previous snapshot. A page whose blocks are all older is still
+ *	needed for the reads of the changes since an earlier snapshot.
+ * @write_summary:
+ *	The summary bitmap of the writable table.
+ * @page_count:
+ *	The number of pages in the tables.
  * @snap_number_active:
  *	The current sequential number of changes. This is the number that is written to
  *	the current table when the block data changes.
@@ -36,6 +68,10 @@ struct blk_snap_block_range;
  *	blocks that were changed between the penultimate snapshot and the last snapshot.
  * @generation_id:
  *	UUID of the generation of changes.
+ * @switch_count:
+ *	The number of times the readable table has been switched or created
+ *	again. Allows the user's process to find out that the mapped table
+ *	has changed.
  * @is_corrupted:
  *	A flag that the change tracking data is no longer reliable.
  *
@@ -56,6 +92,20 @@ struct blk_snap_block_range;
  * At the same time, the change tracking mechanism continues to work with
  * the writable table.
  *
+ * The synchronization is performed lazily, page by page. Switching only
+ * marks all pages of the readable table as stale. A stale page is copied
+ * from the writable table before the first modification of the writable
+ * page and before reading it. Marking of the writable table does not take
+ * the lock. A sequential number is written to the table as an atomic
+ * maximum, so concurrent writers never decrease it.
+ *
+ * The summary bitmaps allow to skip the pages of the table without changes.
+ * Thus, the search for changed blocks takes time proportional to the amount
+ * of changes, not to the size of the device.
+ *
+ * The readable table can be mapped into the memory of the user's process
+ * for reading without copying. Before that, all its pages are synchronized.
+ *
  * To provide the ability to mount a snapshot image as writeable, it is
  * possible to make changes to both of these tables simultaneously.
  *
@@ -64,23 +114,34 @@ struct cbt_map {
 	struct kref kref;
 
 	spinlock_t locker;
+	struct mutex mapping_lock;
 
+	size_t blk_size_shift_min;
+	size_t blk_count_max;
 	size_t blk_size_shift;
 	size_t blk_count;
 	sector_t device_capacity;
+	int node;
 
 	unsigned char *read_map;
 	unsigned char *write_map;
+	unsigned long *read_map_stale;
+	unsigned long *read_summary;
+	unsigned long *write_summary;
+	size_t page_count;
 
 	unsigned long snap_number_active;
 	unsigned long snap_number_previous;
 	uuid_t generation_id;
+	u64 switch_count;
 
 	bool is_corrupted;
 };
 
 struct cbt_map *cbt_map_create(struct block_device *bdev);
 int cbt_map_reset(struct cbt_map *cbt_map, sector_t device_capacity);
+int cbt_map_set_granularity(struct cbt_map *cbt_map, size_t blk_size_shift_min,
+			    size_t blk_count_max);
 
 void cbt_map_destroy_cb(struct kref *kref);
 static inline void cbt_map_get(struct cbt_map *cbt_map)
@@ -102,6 +163,23 @@ int cbt_map_set_both(struct cbt_map *cbt_map, sector_t sector_start,
 size_t cbt_map_read_to_user(struct cbt_map *cbt_map, char __user *user_buffer,
 			    size_t offset, size_t size);
 
+int cbt_map_read_ranges_to_user(struct cbt_map *cbt_map, u8 snap_number,
+				sector_t *sector_offset,
+				struct blk_snap_block_range __user *ranges,
+				unsigned int *count);
+
+#ifdef BLK_SNAP_MODIFICATION
+int cbt_map_export(struct cbt_map *cbt_map, struct blk_snap_cbt_state *state);
+int cbt_map_import(struct cbt_map *cbt_map,
+		   const struct blk_snap_cbt_state *state);
+struct file *cbt_map_get_file(struct cbt_map *cbt_map,
+			      struct blk_snap_tracker_map_cbt *arg);
+int cbt_map_read_ranges_since(struct cbt_map *cbt_map, uuid_t *generation_id,
+			      u8 snap_number, sector_t *sector_offset,
+			      struct blk_snap_block_range __user *ranges,
+			      unsigned int *count);
+#endif
+
 static inline size_t cbt_map_blk_size(struct cbt_map *cbt_map)
 {
 	return 1 << cbt_map->blk_size_shift;
@@ -2,17 +2,128 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "-chunk: " fmt
 
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/dm-io.h>
 #include <linux/sched/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/lz4.h>
 #include "memory_checker.h"
 #include "chunk.h"
+#include "chunk_cache.h"
 #include "diff_io.h"
 #include "diff_buffer.h"
 #include "diff_area.h"
 #include "diff_storage.h"
 #include "log.h"
+#include "trace.h"
 
-extern int chunk_maximum_in_cache;
+/*
+ * The workspace of the LZ4 compression is allocated for each CPU when the
+ * compression is enabled for a snapshot for the first time, and is kept until
+ * the module is unloaded. The mutex protects it, since the compression work
+ * can be preempted.
+ */
+struct chunk_compress_wrkmem {
+	struct mutex lock;
+	void *mem;
+};
+
+static struct chunk_compress_wrkmem __percpu *chunk_compress_wrkmem;
+static DEFINE_MUTEX(chunk_compress_init_lock);
+
+static void chunk_compress_wrkmem_free(
+	struct chunk_compress_wrkmem __percpu *wrkmems)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct chunk_compress_wrkmem *wrkmem =
+			per_cpu_ptr(wrkmems, cpu);
+
+		if (!wrkmem->mem)
+			continue;
+		kvfree(wrkmem->mem);
+		memory_object_dec(memory_object_compress_wrkmem);
+	}
+	free_percpu(wrkmems);
+}
+
+/**
+ * chunk_compress_init() - Allocate the workspaces of the compression.
+ *
+ * Called before the compression is enabled for a snapshot. The workspaces
+ * are allocated only once.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int chunk_compress_init(void)
+{
+	struct chunk_compress_wrkmem __percpu *wrkmems;
+	int ret = 0;
+	int cpu;
+
+	if (smp_load_acquire(&chunk_compress_wrkmem))
+		return 0;
+
+	mutex_lock(&chunk_compress_init_lock);
+	if (chunk_compress_wrkmem)
+		goto out;
+
+	wrkmems = alloc_percpu(struct chunk_compress_wrkmem);
+	if (!wrkmems) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct chunk_compress_wrkmem *wrkmem =
+			per_cpu_ptr(wrkmems, cpu);
+
+		mutex_init(&wrkmem->lock);
+		wrkmem->mem = kvmalloc_node(LZ4_MEM_COMPRESS, GFP_KERNEL,
+					    cpu_to_node(cpu));
+		if (!wrkmem->mem) {
+			chunk_compress_wrkmem_free(wrkmems);
+			ret = -ENOMEM;
+			goto out;
+		}
+		memory_object_inc(memory_object_compress_wrkmem);
+	}
+	/*
+	 * The workspaces are initialized before they can be seen by the
+	 * compression work.
+	 */
+	smp_store_release(&chunk_compress_wrkmem, wrkmems);
+out:
+	mutex_unlock(&chunk_compress_init_lock);
+	return ret;
+}
+
+void chunk_done(void)
+{
+	if (!chunk_compress_wrkmem)
+		return;
+
+	chunk_compress_wrkmem_free(chunk_compress_wrkmem);
+	chunk_compress_wrkmem = NULL;
+}
+
+/*
+ * The buffers are mapped by vm_map_ram(), which uses the per-CPU blocks of
+ * the virtual address space for the small buffers and is cheaper than vmap().
+ */
+static inline void *chunk_map_buffer(struct diff_buffer *diff_buffer)
+{
+	return vm_map_ram(diff_buffer->pages, diff_buffer->page_count,
+			  NUMA_NO_NODE);
+}
+
+static inline void chunk_unmap_buffer(struct diff_buffer *diff_buffer,
+				      void *mem)
+{
+	vm_unmap_ram(mem, diff_buffer->page_count);
+}
 
 void chunk_diff_buffer_release(struct chunk *chunk)
 {
@@ -22,6 +133,7 @@ void chunk_diff_buffer_release(struct chunk *chunk)
 	chunk_state_unset(chunk, CHUNK_ST_BUFFER_READY);
 	diff_buffer_release(chunk->diff_area, chunk->diff_buffer);
 	chunk->diff_buffer = NULL;
+	trace_blksnap_chunk_evict(chunk);
 }
 
 void chunk_store_failed(struct chunk *chunk, int error)
@@ -30,16 +142,397 @@ void chunk_store_failed(struct chunk *chunk, int error)
 
 	chunk_state_set(chunk, CHUNK_ST_FAILED);
 	chunk_diff_buffer_release(chunk);
-	diff_storage_free_region(chunk->diff_region);
-	chunk->diff_region = NULL;
+	if (chunk->diff_region.count)
+		diff_storage_free_region(chunk->diff_area->diff_storage,
+					 &chunk->diff_region);
+	memset(&chunk->diff_region, 0, sizeof(struct diff_region));
 
-	up(&chunk->lock);
+	chunk_unlock(chunk);
 	if (error)
 		diff_area_set_corrupted(diff_area, error);
+	diff_area_notify_buffer_ready(diff_area);
 };
 
+/*
+ * Provides the region of the difference storage for the chunk data of the
+ * specified size. The data of the chunk that has been written to the snapshot
+ * image is stored again, so the region of the chunk is reused if it is large
+ * enough.
+ */
+static int chunk_prepare_region(struct chunk *chunk, sector_t count)
+{
+	struct diff_storage *diff_storage = chunk->diff_area->diff_storage;
+	struct diff_region old_region = chunk->diff_region;
+	int ret;
+
+	if (chunk->diff_region.count >= count)
+		return 0;
+
+	ret = diff_storage_new_region(diff_storage, count, &chunk->diff_region);
+	if (ret) {
+		pr_debug("Cannot get store for chunk #%ld\n", chunk->number);
+		return ret;
+	}
+
+	/* The region that is too small for the chunk can be used by others */
+	if (old_region.count)
+		diff_storage_free_region(diff_storage, &old_region);
+	return 0;
+}
+
+static inline sector_t chunk_compressed_sectors(struct chunk *chunk)
+{
+	return round_up(chunk->compressed_size, PAGE_SIZE) >> SECTOR_SHIFT;
+}
+
+/*
+ * The chunks are compressed before storing if it is required by the
+ * difference storage, or if they can be kept in the memory.
+ */
+static inline bool chunk_compression_required(struct diff_area *diff_area)
+{
+	return diff_storage_is_compressed(diff_area->diff_storage) ||
+	       diff_storage_in_memory(diff_area->diff_storage);
+}
+
+static inline size_t chunk_mem_size(struct chunk *chunk)
+{
+	return chunk->compressed_size ? chunk->compressed_size :
+					chunk->sector_count << SECTOR_SHIFT;
+}
+
+static void chunk_mem_release(struct chunk *chunk)
+{
+	if (!chunk->mem_data)
+		return;
+
+	diff_storage_memory_release(chunk->diff_area->diff_storage,
+				    chunk_mem_size(chunk));
+	kvfree(chunk->mem_data);
+	memory_object_dec(memory_object_chunk_mem_data);
+	chunk->mem_data = NULL;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * Releases the data of the chunk which is no longer needed in the snapshot.
+ * The buffer, the data kept in memory and the region of the difference
+ * storage are freed, and the chunk is marked as zeroed, so it is not copied
+ * anymore. The chunk must be locked and must not be in the cache.
+ */
+void chunk_release(struct chunk *chunk)
+{
+	struct diff_area *diff_area = chunk->diff_area;
+
+	chunk_diff_buffer_release(chunk);
+	chunk_mem_release(chunk);
+	if (chunk->diff_region.count)
+		diff_storage_free_region(diff_area->diff_storage,
+					 &chunk->diff_region);
+	memset(&chunk->diff_region, 0, sizeof(struct diff_region));
+	chunk->compressed_size = 0;
+	diff_area_chunk_hash_clear(diff_area, chunk->number);
+
+	/*
+	 * The zero state is set first, so the copy-on-write that checks the
+	 * state without the lock never sees the chunk as not copied.
+	 */
+	chunk_state_set(chunk, CHUNK_ST_ZERO);
+	chunk_state_unset(chunk, CHUNK_STATE_MASK & ~CHUNK_ST_ZERO);
+}
+#endif
+
+static struct chunk_compress *chunk_compress_new(struct chunk *chunk,
+						 const bool is_nowait)
+{
+	struct chunk_compress *compress;
+
+	compress = kzalloc(sizeof(struct chunk_compress),
+			   is_nowait ? (GFP_NOWAIT | __GFP_NOWARN) : GFP_NOIO);
+	if (unlikely(!compress))
+		return ERR_PTR(is_nowait ? -EAGAIN : -ENOMEM);
+	memory_object_inc(memory_object_chunk_compress);
+
+	compress->diff_buffer = diff_buffer_take(chunk->diff_area, is_nowait);
+	if (IS_ERR(compress->diff_buffer)) {
+		int ret = PTR_ERR(compress->diff_buffer);
+
+		kfree(compress);
+		memory_object_dec(memory_object_chunk_compress);
+		return ERR_PTR(ret);
+	}
+	compress->chunk = chunk;
+
+	return compress;
+}
+
+static void chunk_compress_free(struct chunk_compress *compress)
+{
+	if (unlikely(!compress))
+		return;
+
+	diff_buffer_release(compress->chunk->diff_area, compress->diff_buffer);
+	kfree(compress);
+	memory_object_dec(memory_object_chunk_compress);
+}
+
+/*
+ * Compresses the data of the chunk to the buffer. Returns the size of the
+ * compressed data, or zero if the data cannot be compressed by at least one
+ * page.
+ */
+static size_t chunk_compress_buffer(struct chunk *chunk,
+				    struct diff_buffer *diff_buffer)
+{
+	size_t size = chunk->sector_count << SECTOR_SHIFT;
+	struct chunk_compress_wrkmem __percpu *wrkmems;
+	struct chunk_compress_wrkmem *wrkmem;
+	void *src;
+	void *dst;
+	int len = 0;
+
+	if (size <= PAGE_SIZE)
+		return 0;
+
+	/* The data is stored uncompressed without the workspaces */
+	wrkmems = smp_load_acquire(&chunk_compress_wrkmem);
+	if (unlikely(!wrkmems))
+		return 0;
+
+	src = chunk_map_buffer(chunk->diff_buffer);
+	if (!src)
+		return 0;
+	dst = chunk_map_buffer(diff_buffer);
+	if (dst) {
+		wrkmem = raw_cpu_ptr(wrkmems);
+		mutex_lock(&wrkmem->lock);
+		len = LZ4_compress_default(src, dst, size, size - PAGE_SIZE,
+					   wrkmem->mem);
+		mutex_unlock(&wrkmem->lock);
+		chunk_unmap_buffer(diff_buffer, dst);
+	}
+	chunk_unmap_buffer(chunk->diff_buffer, src);
+
+	return len > 0 ? len : 0;
+}
+
+/*
+ * Decompresses the data of the chunk into the buffer of the chunk.
+ */
+static int chunk_decompress(struct chunk *chunk, const void *src)
+{
+	int ret = 0;
+	int len;
+	size_t size = chunk->sector_count << SECTOR_SHIFT;
+	void *dst;
+	unsigned int current_flag;
+
+	current_flag = memalloc_noio_save();
+	dst = chunk_map_buffer(chunk->diff_buffer);
+	memalloc_noio_restore(current_flag);
+	if (!dst)
+		return -ENOMEM;
+
+	len = LZ4_decompress_safe(src, dst, chunk->compressed_size, size);
+	if (len != size) {
+		pr_err("Failed to decompress chunk #%ld\n", chunk->number);
+		ret = -EIO;
+	}
+
+	chunk_unmap_buffer(chunk->diff_buffer, dst);
+	return ret;
+}
+
+/*
+ * Decompresses the data of the chunk loaded from the difference storage into
+ * the buffer of the chunk.
+ */
+static int chunk_decompress_buffer(struct chunk *chunk,
+				   struct diff_buffer *diff_buffer)
+{
+	int ret;
+	void *src;
+	unsigned int current_flag;
+
+	current_flag = memalloc_noio_save();
+	src = chunk_map_buffer(diff_buffer);
+	memalloc_noio_restore(current_flag);
+	if (!src)
+		return -ENOMEM;
+
+	ret = chunk_decompress(chunk, src);
+
+	chunk_unmap_buffer(diff_buffer, src);
+	return ret;
+}
+
+/*
+ * Keeps the data of the chunk in the memory if the memory limit of the
+ * difference storage allows it. The compressed data is taken from the buffer,
+ * the data that cannot be compressed is taken from the buffer of the chunk.
+ */
+static bool chunk_store_in_memory(struct chunk *chunk,
+				  struct diff_buffer *diff_buffer,
+				  size_t compressed_size)
+{
+	struct diff_storage *diff_storage = chunk->diff_area->diff_storage;
+	size_t size = compressed_size ? compressed_size :
+					chunk->sector_count << SECTOR_SHIFT;
+	size_t offset;
+	void *data;
+
+	if (!diff_storage_in_memory(diff_storage) ||
+	    !diff_storage_memory_reserve(diff_storage, size))
+		return false;
+
+	data = kvmalloc(size, GFP_NOIO);
+	if (!data) {
+		diff_storage_memory_release(diff_storage, size);
+		return false;
+	}
+	memory_object_inc(memory_object_chunk_mem_data);
+
+	if (!compressed_size)
+		diff_buffer = chunk->diff_buffer;
+	for (offset = 0; offset < size; offset += PAGE_SIZE)
+		memcpy(data + offset,
+		       page_address(diff_buffer->pages[offset >> PAGE_SHIFT]),
+		       min_t(size_t, PAGE_SIZE, size - offset));
+
+	chunk_mem_release(chunk);
+	chunk->mem_data = data;
+	chunk->compressed_size = compressed_size;
+	if (chunk->diff_region.count) {
+		diff_storage_free_region(diff_storage, &chunk->diff_region);
+		memset(&chunk->diff_region, 0, sizeof(struct diff_region));
+	}
+	return true;
+}
+
+/*
+ * Restores the data of the chunk kept in the memory to the buffer of the
+ * chunk.
+ */
+static int chunk_load_mem(struct chunk *chunk)
+{
+	size_t size = chunk->sector_count << SECTOR_SHIFT;
+	size_t offset;
+
+	if (chunk->compressed_size)
+		return chunk_decompress(chunk, chunk->mem_data);
+
+	for (offset = 0; offset < size; offset += PAGE_SIZE)
+		memcpy(page_address(
+			       chunk->diff_buffer->pages[offset >> PAGE_SHIFT]),
+		       chunk->mem_data + offset,
+		       min_t(size_t, PAGE_SIZE, size - offset));
+	return 0;
+}
+
+static void chunk_notify_store(void *ctx);
+static void chunk_complete_store(struct chunk *chunk, int error);
+
+static void chunk_notify_store_compressed(void *ctx)
+{
+	struct chunk_compress *compress = ctx;
+	struct chunk *chunk = compress->chunk;
+
+	chunk_compress_free(compress);
+	chunk_notify_store(chunk);
+}
+
+static void chunk_compress_work(struct work_struct *work)
+{
+	int ret;
+	struct chunk_compress *compress =
+		container_of(work, struct chunk_compress, work);
+	struct chunk *chunk = compress->chunk;
+	struct diff_area *diff_area = chunk->diff_area;
+	struct diff_buffer *diff_buffer = compress->diff_buffer;
+	struct diff_region region;
+	struct diff_io *diff_io;
+	unsigned int current_flag;
+	size_t compressed_size;
+
+	current_flag = memalloc_noio_save();
+
+	compressed_size = chunk_compress_buffer(chunk, diff_buffer);
+	if (chunk_store_in_memory(chunk, diff_buffer, compressed_size)) {
+		chunk_compress_free(compress);
+		diff_area_stats_add(diff_area, bytes_stored,
+				    chunk_mem_size(chunk));
+		chunk_complete_store(chunk, 0);
+		diff_area_io_complete(diff_area, 1);
+		goto out;
+	}
+
+	/* The chunk is not kept in the memory, so it spills to the disk */
+	chunk_mem_release(chunk);
+	chunk->compressed_size = compressed_size;
+	if (chunk->compressed_size)
+		region.count = chunk_compressed_sectors(chunk);
+	else {
+		/* The data is stored as is */
+		diff_buffer = chunk->diff_buffer;
+		region.count = diff_area_chunk_sectors(diff_area);
+	}
+
+	ret = chunk_prepare_region(chunk, region.count);
+	if (ret)
+		goto fail;
+	region.bdev = chunk->diff_region.bdev;
+	region.sector = chunk->diff_region.sector;
+
+	diff_io = diff_io_new_async_write(chunk_notify_store_compressed,
+					  compress, false);
+	if (unlikely(!diff_io)) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	diff_io->op_flags = diff_storage_write_flags(diff_area->diff_storage);
+	WARN_ON(chunk->diff_io);
+	chunk->diff_io = diff_io;
+
+	ret = diff_io_do(diff_io, &region, diff_buffer, false);
+	if (!ret)
+		goto out;
+
+	diff_io_free(diff_io);
+	chunk->diff_io = NULL;
+fail:
+	chunk_compress_free(compress);
+	chunk_state_unset(chunk, CHUNK_ST_STORING);
+	chunk_store_failed(chunk, ret);
+	diff_area_io_complete(diff_area, 1);
+out:
+	memalloc_noio_restore(current_flag);
+}
+
+/*
+ * Starts storing of the chunk with the compression. The compression is
+ * performed by the work, which then keeps the compressed data in the memory
+ * or writes it to the difference storage. The chunk that cannot be
+ * compressed is stored as is.
+ */
+static int chunk_schedule_compressing(struct chunk *chunk, bool is_nowait)
+{
+	struct chunk_compress *compress;
+
+	compress = chunk_compress_new(chunk, is_nowait);
+	if (IS_ERR(compress))
+		return PTR_ERR(compress);
+
+	INIT_WORK(&compress->work, chunk_compress_work);
+	chunk_state_set(chunk, CHUNK_ST_STORING);
+	trace_blksnap_chunk_store(chunk);
+	atomic_inc(&chunk->diff_area->pending_io_count);
+	queue_work(diff_io_store_wq, &compress->work);
+	return 0;
+}
+
 int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 {
+	int ret;
 	struct diff_area *diff_area = chunk->diff_area;
 
 	if (WARN(!list_is_first(&chunk->cache_link, &chunk->cache_link),
@@ -48,73 +541,73 @@ int chunk_schedule_storing(struct chunk *chunk, bool is_nowait)
 
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 	if (diff_area->in_memory) {
-		up(&chunk->lock);
+		chunk_unlock(chunk);
 		return 0;
 	}
 #endif
-	if (!chunk->diff_region) {
-		struct diff_region *diff_region;
-
-		diff_region = diff_storage_new_region(
-			diff_area->diff_storage,
-			diff_area_chunk_sectors(diff_area));
-		if (IS_ERR(diff_region)) {
-			pr_debug("Cannot get store for chunk #%ld\n",
-				 chunk->number);
-			return PTR_ERR(diff_region);
-		}
+	if (chunk_compression_required(diff_area))
+		return chunk_schedule_compressing(chunk, is_nowait);
 
-		chunk->diff_region = diff_region;
-	}
+	ret = chunk_prepare_region(chunk, diff_area_chunk_sectors(diff_area));
+	if (ret)
+		return ret;
+	chunk_mem_release(chunk);
+	chunk->compressed_size = 0;
 
 	return chunk_async_store_diff(chunk, is_nowait);
 }
 
 void chunk_schedule_caching(struct chunk *chunk)
 {
-	int in_cache_count = 0;
-	struct diff_area *diff_area = chunk->diff_area;
-
 	might_sleep();
 
-	spin_lock(&diff_area->caches_lock);
-
-	/*
-	 * The locked chunk cannot be in the cache.
-	 * If the check reveals that the chunk is in the cache, then something
-	 * is wrong in the algorithm.
-	 */
-	if (WARN(!list_is_first(&chunk->cache_link, &chunk->cache_link),
-		 "The chunk already in the cache")) {
-		spin_unlock(&diff_area->caches_lock);
-
+	if (chunk_cache_add(chunk->diff_area->chunk_cache, chunk)) {
 		chunk_store_failed(chunk, 0);
 		return;
 	}
+	trace_blksnap_chunk_cache(chunk);
+	chunk_unlock(chunk);
+}
 
-	if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
-		list_add_tail(&chunk->cache_link,
-			      &diff_area->write_cache_queue);
-		in_cache_count =
-			atomic_inc_return(&diff_area->write_cache_count);
-	} else {
-		list_add_tail(&chunk->cache_link, &diff_area->read_cache_queue);
-		in_cache_count =
-			atomic_inc_return(&diff_area->read_cache_count);
-	}
-	spin_unlock(&diff_area->caches_lock);
+/*
+ * Remembers the hash of the original content of the chunk which has just been
+ * read from the original device.
+ */
+static inline void chunk_hash_original(struct chunk *chunk)
+{
+#ifdef BLK_SNAP_MODIFICATION
+	struct diff_area *diff_area = chunk->diff_area;
 
-	up(&chunk->lock);
+	if (diff_area->chunk_hashes)
+		diff_area_chunk_hash_set(diff_area, chunk->number,
+			diff_buffer_hash(chunk->diff_buffer,
+					 chunk->sector_count << SECTOR_SHIFT));
+#endif
+}
 
-	/* Initiate the cache clearing process */
-	if (in_cache_count > chunk_maximum_in_cache)
-		queue_work(system_wq, &diff_area->cache_release_work);
+/*
+ * The data of the chunk which is all zeroes is not stored to the difference
+ * storage. Its buffer is released, and the snapshot image reads the chunk as
+ * zeroes.
+ */
+static bool chunk_skip_zero(struct chunk *chunk)
+{
+	if (!diff_buffer_is_zero(chunk->diff_buffer,
+				 chunk->sector_count << SECTOR_SHIFT))
+		return false;
+
+	chunk_diff_buffer_release(chunk);
+	chunk_state_set(chunk, CHUNK_ST_ZERO);
+	chunk_unlock(chunk);
+	return true;
 }
 
 static void chunk_notify_load(void *ctx)
 {
 	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
 	int error = chunk->diff_io->error;
+	u64 start_time = chunk->diff_io->start_time;
 
 	diff_io_free(chunk->diff_io);
 	chunk->diff_io = NULL;
@@ -128,7 +621,7 @@ static void chunk_notify_load(void *ctx)
 
 	if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
 		pr_err("Chunk in a failed state\n");
-		up(&chunk->lock);
+		chunk_unlock(chunk);
 		goto out;
 	}
 
@@ -137,7 +630,17 @@ static void chunk_notify_load(void *ctx)
 		unsigned int current_flag;
 
 		chunk_state_unset(chunk, CHUNK_ST_LOADING);
+		diff_area_stats_inc(chunk->diff_area, chunks_copied);
+		diff_area_stats_latency(chunk->diff_area, cow_load_hist,
+					start_time);
+		chunk_hash_original(chunk);
+		if (chunk_skip_zero(chunk)) {
+			diff_area_notify_buffer_ready(chunk->diff_area);
+			goto out;
+		}
 		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+		trace_blksnap_chunk_loaded(chunk);
+		diff_area_notify_buffer_ready(chunk->diff_area);
 
 		current_flag = memalloc_noio_save();
 		ret = chunk_schedule_storing(chunk, false);
@@ -147,35 +650,31 @@ static void chunk_notify_load(void *ctx)
 		goto out;
 	}
 
-	pr_err("invalid chunk state 0x%x\n", atomic_read(&chunk->state));
-	up(&chunk->lock);
+	pr_err("invalid chunk state 0x%x\n", chunk_state_get(chunk));
+	chunk_unlock(chunk);
 out:
-	atomic_dec(&chunk->diff_area->pending_io_count);
+	diff_area_cow_io_complete(diff_area, 1);
+	diff_area_io_complete(diff_area, 1);
 }
 
-static void chunk_notify_store(void *ctx)
+static void chunk_complete_store(struct chunk *chunk, int error)
 {
-	struct chunk *chunk = ctx;
-	int error = chunk->diff_io->error;
-
-	diff_io_free(chunk->diff_io);
-	chunk->diff_io = NULL;
-
 	might_sleep();
 
 	if (unlikely(error)) {
 		chunk_store_failed(chunk, error);
-		goto out;
+		return;
 	}
 
 	if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
 		pr_err("Chunk in a failed state\n");
 		chunk_store_failed(chunk, 0);
-		goto out;
+		return;
 	}
 	if (chunk_state_check(chunk, CHUNK_ST_STORING)) {
 		chunk_state_unset(chunk, CHUNK_ST_STORING);
 		chunk_state_set(chunk, CHUNK_ST_STORE_READY);
+		trace_blksnap_chunk_stored(chunk);
 
 		if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
 			/*
@@ -192,29 +691,332 @@ static void chunk_notify_store(void *ctx)
 			current_flag = memalloc_noio_save();
 			chunk_schedule_caching(chunk);
 			memalloc_noio_restore(current_flag);
-			goto out;
+			return;
+		}
+	} else
+		pr_err("invalid chunk state 0x%x\n", chunk_state_get(chunk));
+	chunk_unlock(chunk);
+}
+
+static void chunk_notify_store(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	int error = chunk->diff_io->error;
+	u64 start_time = chunk->diff_io->start_time;
+
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+
+	if (likely(!error)) {
+		diff_area_stats_add(chunk->diff_area, bytes_stored,
+				    chunk->compressed_size ?
+					    round_up(chunk->compressed_size,
+						     PAGE_SIZE) :
+					    chunk->sector_count << SECTOR_SHIFT);
+		diff_area_stats_latency(chunk->diff_area, cow_store_hist,
+					start_time);
+	}
+
+	chunk_complete_store(chunk, error);
+	diff_area_io_complete(chunk->diff_area, 1);
+}
+
+static inline void chunk_batch_free(struct chunk_batch *batch)
+{
+	kfree(batch);
+	memory_object_dec(memory_object_chunk_batch);
+}
+
+static void chunk_batch_notify_store(void *ctx)
+{
+	struct chunk_batch *batch = ctx;
+	struct diff_area *diff_area = batch->chunks[0]->diff_area;
+	unsigned int count = batch->count;
+	int error = batch->diff_io->error;
+	u64 start_time = batch->diff_io->start_time;
+	unsigned int inx;
+
+	diff_io_free(batch->diff_io);
+	batch->diff_io = NULL;
+
+	if (likely(!error)) {
+		diff_area_stats_add(diff_area, bytes_stored,
+				    (u64)count * diff_area_chunk_sectors(diff_area)
+					    << SECTOR_SHIFT);
+		diff_area_stats_latency(diff_area, cow_store_hist, start_time);
+	}
+
+	for (inx = 0; inx < count; inx++)
+		chunk_complete_store(batch->chunks[inx], error);
+
+	chunk_batch_free(batch);
+	diff_area_io_complete(diff_area, count);
+}
+
+/*
+ * Stores the chunks of the batch to adjacent regions of the difference
+ * storage with a single request. The batch is released when the storing is
+ * completed.
+ */
+static void chunk_batch_schedule_storing(struct chunk_batch *batch)
+{
+	int ret;
+	unsigned int inx;
+	struct diff_area *diff_area = batch->chunks[0]->diff_area;
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	struct diff_buffer *diff_buffers[CHUNK_BATCH_MAX_COUNT];
+	struct diff_region *regions[CHUNK_BATCH_MAX_COUNT];
+	struct diff_region region;
+	struct diff_io *diff_io;
+
+#ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
+	if (diff_area->in_memory) {
+		for (inx = 0; inx < batch->count; inx++)
+			chunk_unlock(batch->chunks[inx]);
+		chunk_batch_free(batch);
+		return;
+	}
+#endif
+	/*
+	 * The compressed chunks have different sizes, so each of them is
+	 * stored separately.
+	 */
+	if ((batch->count == 1) || chunk_compression_required(diff_area)) {
+		for (inx = 0; inx < batch->count; inx++) {
+			struct chunk *chunk = batch->chunks[inx];
+
+			ret = chunk_schedule_storing(chunk, false);
+			if (ret)
+				chunk_store_failed(chunk, ret);
+		}
+		chunk_batch_free(batch);
+		return;
+	}
+
+	for (inx = 0; inx < batch->count; inx++) {
+		WARN_ON(batch->chunks[inx]->diff_region.count);
+		batch->chunks[inx]->compressed_size = 0;
+		regions[inx] = &batch->chunks[inx]->diff_region;
+		diff_buffers[inx] = batch->chunks[inx]->diff_buffer;
+	}
+	ret = diff_storage_new_regions(diff_area->diff_storage, chunk_sectors,
+				       batch->count, regions);
+	if (ret) {
+		pr_debug("Cannot get store for %u chunks\n", batch->count);
+		goto fail;
+	}
+
+	region.bdev = regions[0]->bdev;
+	region.sector = regions[0]->sector;
+	region.count = chunk_sectors * batch->count;
+
+	diff_io = diff_io_new_async_write(chunk_batch_notify_store, batch,
+					  false);
+	if (unlikely(!diff_io)) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	diff_io->op_flags = diff_storage_write_flags(diff_area->diff_storage);
+	batch->diff_io = diff_io;
+
+	for (inx = 0; inx < batch->count; inx++) {
+		chunk_state_set(batch->chunks[inx], CHUNK_ST_STORING);
+		trace_blksnap_chunk_store(batch->chunks[inx]);
+	}
+	atomic_add(batch->count, &diff_area->pending_io_count);
+
+	ret = diff_io_do_multi(diff_io, &region, diff_buffers, batch->count,
+			       false);
+	if (!ret)
+		return;
+
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_state_unset(batch->chunks[inx], CHUNK_ST_STORING);
+	diff_area_io_complete(diff_area, batch->count);
+	diff_io_free(diff_io);
+	batch->diff_io = NULL;
+fail:
+	for (inx = 0; inx < batch->count; inx++)
+		chunk_store_failed(batch->chunks[inx], ret);
+	chunk_batch_free(batch);
+}
+
+/**
+ * chunk_schedule_writeback() - Starts storing of the adjacent dirty chunks
+ *	of the snapshot image.
+ * @chunks:
+ *	An array of pointers to chunks. The chunks follow each other in order.
+ * @count:
+ *	The number of chunks, not more than CHUNK_BATCH_MAX_COUNT.
+ *
+ * The chunks are stored to new adjacent regions of the difference storage
+ * with a single request, and the regions that were used by the chunks
+ * before are released. The compressed chunks are stored one by one.
+ * The chunks must be locked, their buffers must be ready.
+ */
+void chunk_schedule_writeback(struct chunk **chunks, unsigned int count)
+{
+	int ret;
+	unsigned int inx;
+	struct diff_area *diff_area = chunks[0]->diff_area;
+	struct chunk_batch *batch = NULL;
+
+	if ((count > 1) && !chunk_compression_required(diff_area)) {
+		batch = kzalloc(struct_size(batch, chunks, count), GFP_NOIO);
+		if (batch)
+			memory_object_inc(memory_object_chunk_batch);
+	}
+	if (!batch) {
+		for (inx = 0; inx < count; inx++) {
+			ret = chunk_schedule_storing(chunks[inx], false);
+			if (ret)
+				chunk_store_failed(chunks[inx], ret);
+		}
+		return;
+	}
+
+	batch->count = count;
+	for (inx = 0; inx < count; inx++) {
+		struct chunk *chunk = chunks[inx];
+
+		WARN_ON(chunk->number != chunks[0]->number + inx);
+		chunk_mem_release(chunk);
+		if (chunk->diff_region.count)
+			diff_storage_free_region(diff_area->diff_storage,
+						 &chunk->diff_region);
+		memset(&chunk->diff_region, 0, sizeof(struct diff_region));
+		batch->chunks[inx] = chunk;
+	}
+	chunk_batch_schedule_storing(batch);
+}
+
+static void chunk_batch_notify_load(void *ctx)
+{
+	struct chunk_batch *batch = ctx;
+	struct diff_area *diff_area = batch->chunks[0]->diff_area;
+	unsigned int count = batch->count;
+	int error = batch->diff_io->error;
+	u64 start_time = batch->diff_io->start_time;
+	unsigned int inx;
+	unsigned int loaded = 0;
+
+	diff_io_free(batch->diff_io);
+	batch->diff_io = NULL;
+
+	might_sleep();
+
+	if (likely(!error))
+		diff_area_stats_latency(diff_area, cow_load_hist, start_time);
+
+	for (inx = 0; inx < count; inx++) {
+		struct chunk *chunk = batch->chunks[inx];
+
+		if (unlikely(error)) {
+			chunk_store_failed(chunk, error);
+			continue;
 		}
+
+		if (unlikely(chunk_state_check(chunk, CHUNK_ST_FAILED))) {
+			pr_err("Chunk in a failed state\n");
+			chunk_unlock(chunk);
+			continue;
+		}
+
+		if (unlikely(!chunk_state_check(chunk, CHUNK_ST_LOADING))) {
+			pr_err("invalid chunk state 0x%x\n",
+			       chunk_state_get(chunk));
+			chunk_unlock(chunk);
+			continue;
+		}
+
+		chunk_state_unset(chunk, CHUNK_ST_LOADING);
+		diff_area_stats_inc(diff_area, chunks_copied);
+		chunk_hash_original(chunk);
+		if (chunk_skip_zero(chunk))
+			continue;
+		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+		trace_blksnap_chunk_loaded(chunk);
+		batch->chunks[loaded++] = chunk;
+	}
+
+	batch->count = loaded;
+	diff_area_notify_buffer_ready(diff_area);
+	if (loaded) {
+		unsigned int current_flag;
+
+		current_flag = memalloc_noio_save();
+		chunk_batch_schedule_storing(batch);
+		memalloc_noio_restore(current_flag);
 	} else
-		pr_err("invalid chunk state 0x%x\n", atomic_read(&chunk->state));
-	up(&chunk->lock);
+		chunk_batch_free(batch);
+
+	diff_area_cow_io_complete(diff_area, count);
+	diff_area_io_complete(diff_area, count);
+}
+
+static void chunk_notify_load_image(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	int error = chunk->diff_io->error;
+	unsigned int current_flag;
+
+	diff_io_free(chunk->diff_io);
+	chunk->diff_io = NULL;
+
+	might_sleep();
+
+	chunk_state_unset(chunk, CHUNK_ST_LOADING);
+	if (unlikely(error)) {
+		/*
+		 * The chunk is not marked as failed. The error will be
+		 * repeated and processed when the chunk is loaded
+		 * synchronously.
+		 */
+		pr_debug("Failed to load chunk #%ld. errno=%d\n",
+			 chunk->number, abs(error));
+		chunk_diff_buffer_release(chunk);
+		chunk_unlock(chunk);
+		goto out;
+	}
+
+	if (!chunk_state_check(chunk, CHUNK_ST_STORE_READY))
+		chunk_hash_original(chunk);
+	chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+	trace_blksnap_chunk_loaded(chunk);
+
+	current_flag = memalloc_noio_save();
+	chunk_schedule_caching(chunk);
+	memalloc_noio_restore(current_flag);
 out:
-	atomic_dec(&chunk->diff_area->pending_io_count);
+	diff_area_io_complete(chunk->diff_area, 1);
 }
 
-struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number)
+static void chunk_notify_load_image_compressed(void *ctx)
+{
+	struct chunk_compress *compress = ctx;
+	struct chunk *chunk = compress->chunk;
+
+	if (likely(!chunk->diff_io->error))
+		chunk->diff_io->error =
+			chunk_decompress_buffer(chunk, compress->diff_buffer);
+
+	chunk_compress_free(compress);
+	chunk_notify_load_image(chunk);
+}
+
+struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number,
+			  gfp_t gfp_mask)
 {
 	struct chunk *chunk;
 
-	chunk = kzalloc(sizeof(struct chunk), GFP_KERNEL);
+	chunk = kzalloc(sizeof(struct chunk), gfp_mask);
 	if (!chunk)
 		return NULL;
 	memory_object_inc(memory_object_chunk);
 
 	INIT_LIST_HEAD(&chunk->cache_link);
-	sema_init(&chunk->lock, 1);
 	chunk->diff_area = diff_area;
 	chunk->number = number;
-	atomic_set(&chunk->state, 0);
 
 	return chunk;
 }
@@ -224,11 +1026,11 @@ void chunk_free(struct chunk *chunk)
 	if (unlikely(!chunk))
 		return;
 
-	down(&chunk->lock);
+	chunk_lock(chunk);
 	chunk_diff_buffer_release(chunk);
-	diff_storage_free_region(chunk->diff_region);
+	chunk_mem_release(chunk);
 	chunk_state_set(chunk, CHUNK_ST_FAILED);
-	up(&chunk->lock);
+	chunk_unlock(chunk);
 
 	kfree(chunk);
 	memory_object_dec(memory_object_chunk);
@@ -241,7 +1043,7 @@ int chunk_async_store_diff(struct chunk *chunk, bool is_nowait)
 {
 	int ret;
 	struct diff_io *diff_io;
-	struct diff_region *region = chunk->diff_region;
+	struct diff_region *region = &chunk->diff_region;
 
 	if (WARN(!list_is_first(&chunk->cache_link, &chunk->cache_link),
 		 "The chunk already in the cache"))
@@ -255,14 +1057,17 @@ int chunk_async_store_diff(struct chunk *chunk, bool is_nowait)
 			return -ENOMEM;
 	}
 
+	diff_io->op_flags =
+		diff_storage_write_flags(chunk->diff_area->diff_storage);
 	WARN_ON(chunk->diff_io);
 	chunk->diff_io = diff_io;
 	chunk_state_set(chunk, CHUNK_ST_STORING);
+	trace_blksnap_chunk_store(chunk);
 	atomic_inc(&chunk->diff_area->pending_io_count);
 
 	ret = diff_io_do(chunk->diff_io, region, chunk->diff_buffer, is_nowait);
 	if (ret) {
-		atomic_dec(&chunk->diff_area->pending_io_count);
+		diff_area_io_complete(chunk->diff_area, 1);
 		diff_io_free(chunk->diff_io);
 		chunk->diff_io = NULL;
 	}
@@ -295,17 +1100,210 @@ int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait)
 	WARN_ON(chunk->diff_io);
 	chunk->diff_io = diff_io;
 	chunk_state_set(chunk, CHUNK_ST_LOADING);
+	trace_blksnap_chunk_load(chunk);
 	atomic_inc(&chunk->diff_area->pending_io_count);
+	diff_area_cow_io_start(chunk->diff_area, 1);
 
 	ret = diff_io_do(chunk->diff_io, &region, chunk->diff_buffer, is_nowait);
 	if (ret) {
-		atomic_dec(&chunk->diff_area->pending_io_count);
+		diff_area_cow_io_complete(chunk->diff_area, 1);
+		diff_area_io_complete(chunk->diff_area, 1);
 		diff_io_free(chunk->diff_io);
 		chunk->diff_io = NULL;
 	}
 	return ret;
 }
 
+static void chunk_notify_remap(void *ctx)
+{
+	struct chunk *chunk = ctx;
+	struct diff_area *diff_area = chunk->diff_area;
+
+	chunk_unlock(chunk);
+	diff_area_io_complete(diff_area, 1);
+}
+
+/*
+ * Redirects the part of the read request to the snapshot image that falls
+ * into the chunk directly to the block device where the data of the chunk
+ * is located. If the chunk has been stored, its data is read from the
+ * difference storage. Otherwise, the chunk has not been copied, so its data
+ * on the original device is the same as in the snapshot.
+ *
+ * The chunk must be locked. It stays locked until the reading is completed,
+ * so the copy-on-write of the chunk or the writing to the snapshot image
+ * waits for this, and the data cannot be overwritten before it is read.
+ */
+int chunk_remap_image(struct chunk *chunk, struct bio *bio,
+		      struct bvec_iter *iter)
+{
+	int ret;
+	struct block_device *bdev = chunk->diff_area->orig_bdev;
+	sector_t sector = iter->bi_sector;
+
+	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY)) {
+		sector_t chunk_start = (sector_t)(chunk->number) *
+				       diff_area_chunk_sectors(chunk->diff_area);
+
+		/*
+		 * The compressed data and the data kept in the memory cannot
+		 * be read directly.
+		 */
+		if (chunk->compressed_size || chunk->mem_data)
+			return -EOPNOTSUPP;
+		if (WARN_ON(!chunk->diff_region.count))
+			return -EINVAL;
+		bdev = chunk->diff_region.bdev;
+		sector = chunk->diff_region.sector +
+			 (iter->bi_sector - chunk_start);
+	}
+
+	atomic_inc(&chunk->diff_area->pending_io_count);
+	ret = diff_io_remap(bio, iter, bdev, sector, chunk_notify_remap, chunk);
+	if (ret)
+		diff_area_io_complete(chunk->diff_area, 1);
+	return ret;
+}
+
+/*
+ * Starts asynchronous loading of a chunk for the snapshot image.
+ * The data is read from the difference storage if the chunk has already been
+ * stored there, otherwise from the original block device. When the loading is
+ * completed, the chunk is placed in the read cache.
+ */
+int chunk_async_load_image(struct chunk *chunk)
+{
+	int ret;
+	struct diff_io *diff_io;
+	struct chunk_compress *compress = NULL;
+	struct diff_buffer *diff_buffer = chunk->diff_buffer;
+	struct diff_region region = {
+		.bdev = chunk->diff_area->orig_bdev,
+		.sector = (sector_t)(chunk->number) *
+			  diff_area_chunk_sectors(chunk->diff_area),
+		.count = chunk->sector_count,
+	};
+
+	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY) && chunk->mem_data) {
+		/* The data is in the memory, so it is restored immediately */
+		ret = chunk_load_mem(chunk);
+		if (ret)
+			return ret;
+		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+		trace_blksnap_chunk_loaded(chunk);
+		chunk_schedule_caching(chunk);
+		return 0;
+	}
+
+	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY)) {
+		region = chunk->diff_region;
+		if (chunk->compressed_size) {
+			compress = chunk_compress_new(chunk, false);
+			if (IS_ERR(compress))
+				return PTR_ERR(compress);
+			diff_buffer = compress->diff_buffer;
+			region.count = chunk_compressed_sectors(chunk);
+		}
+	}
+
+	if (compress)
+		diff_io = diff_io_new_async_read(
+			chunk_notify_load_image_compressed, compress, false);
+	else
+		diff_io = diff_io_new_async_read(chunk_notify_load_image, chunk,
+						 false);
+	if (unlikely(!diff_io)) {
+		chunk_compress_free(compress);
+		return -ENOMEM;
+	}
+
+	WARN_ON(chunk->diff_io);
+	chunk->diff_io = diff_io;
+	chunk_state_set(chunk, CHUNK_ST_LOADING);
+	trace_blksnap_chunk_load(chunk);
+	atomic_inc(&chunk->diff_area->pending_io_count);
+
+	ret = diff_io_do(chunk->diff_io, &region, diff_buffer, false);
+	if (ret) {
+		chunk_state_unset(chunk, CHUNK_ST_LOADING);
+		diff_area_io_complete(chunk->diff_area, 1);
+		diff_io_free(chunk->diff_io);
+		chunk->diff_io = NULL;
+		chunk_compress_free(compress);
+	}
+	return ret;
+}
+
+/*
+ * Starts asynchronous loading of several adjacent chunks from the original
+ * block device with a single request. When the loading is completed, the
+ * chunks are stored to adjacent regions of the difference storage also with
+ * a single request.
+ * The chunks must be locked and must have the difference buffers.
+ */
+int chunk_async_load_orig_batch(struct chunk **chunks, unsigned int count,
+				const bool is_nowait)
+{
+	int ret;
+	unsigned int inx;
+	struct chunk_batch *batch;
+	struct diff_io *diff_io;
+	struct diff_area *diff_area = chunks[0]->diff_area;
+	struct diff_buffer *diff_buffers[CHUNK_BATCH_MAX_COUNT];
+	struct diff_region region = {
+		.bdev = diff_area->orig_bdev,
+		.sector = (sector_t)(chunks[0]->number) *
+			  diff_area_chunk_sectors(diff_area),
+		.count = 0,
+	};
+
+	if (count == 1)
+		return chunk_async_load_orig(chunks[0], is_nowait);
+
+	if (WARN_ON(count > CHUNK_BATCH_MAX_COUNT))
+		return -EINVAL;
+
+	batch = kzalloc(struct_size(batch, chunks, count),
+			is_nowait ? (GFP_NOWAIT | __GFP_NOWARN) : GFP_NOIO);
+	if (unlikely(!batch))
+		return is_nowait ? -EAGAIN : -ENOMEM;
+	memory_object_inc(memory_object_chunk_batch);
+
+	diff_io = diff_io_new_async_read(chunk_batch_notify_load, batch,
+					 is_nowait);
+	if (unlikely(!diff_io)) {
+		chunk_batch_free(batch);
+		return is_nowait ? -EAGAIN : -ENOMEM;
+	}
+	batch->diff_io = diff_io;
+	batch->count = count;
+
+	for (inx = 0; inx < count; inx++) {
+		struct chunk *chunk = chunks[inx];
+
+		WARN_ON(chunk->number != chunks[0]->number + inx);
+		batch->chunks[inx] = chunk;
+		diff_buffers[inx] = chunk->diff_buffer;
+		region.count += chunk->sector_count;
+		chunk_state_set(chunk, CHUNK_ST_LOADING);
+		trace_blksnap_chunk_load(chunk);
+	}
+	atomic_add(count, &diff_area->pending_io_count);
+	diff_area_cow_io_start(diff_area, count);
+
+	ret = diff_io_do_multi(diff_io, &region, diff_buffers, count,
+			       is_nowait);
+	if (ret) {
+		for (inx = 0; inx < count; inx++)
+			chunk_state_unset(chunks[inx], CHUNK_ST_LOADING);
+		diff_area_cow_io_complete(diff_area, count);
+		diff_area_io_complete(diff_area, count);
+		diff_io_free(diff_io);
+		chunk_batch_free(batch);
+	}
+	return ret;
+}
+
 /*
  * Performs synchronous loading of a chunk from the original block device.
  */
@@ -324,11 +1322,14 @@ int chunk_load_orig(struct chunk *chunk)
 	if (unlikely(!diff_io))
 		return -ENOMEM;
 
+	trace_blksnap_chunk_load(chunk);
 	ret = diff_io_do(diff_io, &region, chunk->diff_buffer, false);
 	if (!ret)
 		ret = diff_io->error;
 
 	diff_io_free(diff_io);
+	if (!ret)
+		chunk_hash_original(chunk);
 	return ret;
 }
 
@@ -339,17 +1340,38 @@ int chunk_load_diff(struct chunk *chunk)
 {
 	int ret;
 	struct diff_io *diff_io;
-	struct diff_region *region = chunk->diff_region;
+	struct chunk_compress *compress = NULL;
+	struct diff_buffer *diff_buffer = chunk->diff_buffer;
+	struct diff_region region;
+
+	if (chunk->mem_data)
+		return chunk_load_mem(chunk);
+
+	region = chunk->diff_region;
+	if (chunk->compressed_size) {
+		compress = chunk_compress_new(chunk, false);
+		if (IS_ERR(compress))
+			return PTR_ERR(compress);
+		diff_buffer = compress->diff_buffer;
+		region.count = chunk_compressed_sectors(chunk);
+	}
 
 	diff_io = diff_io_new_sync_read();
-	if (unlikely(!diff_io))
-		return -ENOMEM;
+	if (unlikely(!diff_io)) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	ret = diff_io_do(diff_io, region, chunk->diff_buffer, false);
+	trace_blksnap_chunk_load(chunk);
+	ret = diff_io_do(diff_io, &region, diff_buffer, false);
 	if (!ret)
 		ret = diff_io->error;
 
 	diff_io_free(diff_io);
 
+	if (!ret && compress)
+		ret = chunk_decompress_buffer(chunk, compress->diff_buffer);
+out:
+	chunk_compress_free(compress);
 	return ret;
 }
@@ -6,10 +6,9 @@
 #include <linux/blkdev.h>
 #include <linux/rwsem.h>
 #include <linux/atomic.h>
-
-struct diff_area;
-struct diff_region;
-struct diff_io;
+#include <linux/wait_bit.h>
+#include "diff_area.h"
+#include "diff_io.h"
 
 /**
  * enum chunk_st - Possible states for a chunk.
@@ -34,11 +33,19 @@ struct diff_io;
  * @CHUNK_ST_STORING:
  *	The data is being saved to the difference storage.
  *	The flag is replaced with the CHUNK_ST_STORE_READY flag.
+ * @CHUNK_ST_ZERO:
+ *	The data of the chunk is not used or is all zeroes, so it is not
+ *	stored and the snapshot image reads it as zeroes. The flag is set for
+ *	a chunk in the initial state, or when the data read from the original
+ *	device for copy-on-write appears to be zeroes. It is removed when the
+ *	snapshot image is written to the chunk.
  *
  * Chunks life circle.
  * Copy-on-write when writing to original:
  *	0 -> LOADING -> BUFFER_READY -> BUFFER_READY | STORING ->
  *	BUFFER_READY | STORE_READY -> STORE_READY
+ * Copy-on-write of a chunk filled with zeroes:
+ *	0 -> LOADING -> ZERO
  * Write to snapshot image:
  *	0 -> LOADING -> BUFFER_READY | DIRTY -> DIRTY | STORING ->
  *	BUFFER_READY | STORE_READY -> STORE_READY
@@ -50,6 +57,7 @@ enum chunk_st {
 	CHUNK_ST_STORE_READY = (1 << 3),
 	CHUNK_ST_LOADING = (1 << 4),
 	CHUNK_ST_STORING = (1 << 5),
+	CHUNK_ST_ZERO = (1 << 6),
 };
 
 /**
@@ -64,31 +72,44 @@ enum chunk_st {
  * @sector_count:
  *	Number of sectors in the current chunk. This is especially true
  *	for the	last chunk.
- * @lock:
- *	Binary semaphore. Syncs access to the chunks fields: state,
- *	diff_buffer, diff_region and diff_io.
- * @state:
- *	Defines the state of a chunk. May contain CHUNK_ST_* bits.
  * @diff_buffer:
  *	Pointer to &struct diff_buffer. Describes a buffer in the memory
  *	for storing the chunk data.
  * @diff_region:
- *	Pointer to &struct diff_region. Describes a copy of the chunk data
- *	on the difference storage.
+ *	Describes a copy of the chunk data on the difference storage. The
+ *	count of sectors is zero if the region has not been allocated yet.
+ * @compressed_size:
+ *	The size in bytes of the compressed data of the chunk in the
+ *	difference storage. Zero if the data is stored uncompressed.
+ * @mem_data:
+ *	The data of the chunk kept in the memory instead of the region on the
+ *	difference storage. Compressed if @compressed_size is not zero.
  * @diff_io:
  *	Provides I/O operations for a chunk.
+ * @cache_protected:
+ *	The chunk is in the protected queue of the cache or will be placed
+ *	there when it gets into the cache again.
+ * @cache_evicted:
+ *	The value of the eviction clock of the cache when the chunk was
+ *	evicted. Zero if the chunk has not been evicted yet.
  *
  * This structure describes the block of data that the module operates
  * with when executing the copy-on-write algorithm and when performing I/O
  * to snapshot images.
  *
+ * The state of the chunk is stored in the compact chunk_state_map of the
+ * difference area. Therefore, the state of chunks that have not yet been
+ * created can also be checked.
+ *
  * If the data of the chunk has been changed or has just been read, then
  * the chunk gets into cache.
  *
- * The semaphore is blocked for writing if there is no actual data in the
- * buffer, since a block of data is being read from the original device or
- * from a diff storage. If data is being read from or written to the
- * diff_buffer, the semaphore must be locked.
+ * The chunk is locked by the lock bit of its state in the chunk_state_map.
+ * The lock syncs access to the chunks fields: state, diff_buffer,
+ * diff_region, compressed_size, mem_data and diff_io. It is held if there
+ * is no actual data in the buffer, since a block of data is being read from
+ * the original device or from a diff storage. If data is being read from or
+ * written to the diff_buffer, the lock must be held.
  */
 struct chunk {
 	struct list_head cache_link;
@@ -97,41 +118,162 @@ struct chunk {
 	unsigned long number;
 	sector_t sector_count;
 
-	struct semaphore lock;
-
-	atomic_t state;
 	struct diff_buffer *diff_buffer;
-	struct diff_region *diff_region;
+	struct diff_region diff_region;
+	unsigned int compressed_size;
+	void *mem_data;
+	struct diff_io *diff_io;
+
+	bool cache_protected;
+	unsigned long cache_evicted;
+};
+
+/*
+ * The maximum number of adjacent chunks that can be copied by a single
+ * request.
+ */
+#define CHUNK_BATCH_MAX_COUNT 16
+
+/**
+ * struct chunk_batch - A set of adjacent chunks processed by a single I/O
+ *	request.
+ * @diff_io:
+ *	Provides I/O operations for the batch.
+ * @count:
+ *	The number of chunks in the batch.
+ * @chunks:
+ *	An array of pointers to chunks. The chunks follow each other in order.
+ *
+ * When a large write to the original device affects several chunks, their
+ * data is read from the original device and written to the difference
+ * storage using large requests.
+ */
+struct chunk_batch {
 	struct diff_io *diff_io;
+	unsigned int count;
+	struct chunk *chunks[];
+};
+
+/**
+ * struct chunk_compress - The context of the compression of a chunk.
+ * @work:
+ *	The work that compresses the chunk data and starts storing it.
+ * @chunk:
+ *	The chunk being stored or loaded.
+ * @diff_buffer:
+ *	The buffer for the compressed data of the chunk.
+ *
+ * The compression is too heavy to be performed in the I/O completion
+ * callback, so the chunk data is compressed by the work in the unbound
+ * workqueue. The loaded compressed data is decompressed in the completion
+ * callback, which is already called in the workqueue.
+ */
+struct chunk_compress {
+	struct work_struct work;
+	struct chunk *chunk;
+	struct diff_buffer *diff_buffer;
 };
 
 static inline void chunk_state_set(struct chunk *chunk, int st)
 {
-	atomic_or(st, &chunk->state);
+	diff_area_chunk_state_set(chunk->diff_area, chunk->number, st);
 };
 
 static inline void chunk_state_unset(struct chunk *chunk, int st)
 {
-	atomic_and(~st, &chunk->state);
+	diff_area_chunk_state_unset(chunk->diff_area, chunk->number, st);
+};
+
+static inline unsigned int chunk_state_get(struct chunk *chunk)
+{
+	return diff_area_chunk_state(chunk->diff_area, chunk->number);
 };
 
 static inline bool chunk_state_check(struct chunk *chunk, int st)
 {
-	return !!(atomic_read(&chunk->state) & st);
+	return !!(chunk_state_get(chunk) & st);
 };
 
-struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number);
+/*
+ * The lock of the chunk is a bit of the chunk_state_map word, so it takes no
+ * memory in the chunk and its waiters sleep on the hashed bit waitqueues.
+ * Like a binary semaphore, it can be released by another thread, since the
+ * chunk stays locked while its I/O is in progress and is unlocked in the
+ * completion callback.
+ */
+static inline unsigned long *chunk_lock_word(struct chunk *chunk, int *bit)
+{
+	unsigned int shift;
+	atomic_long_t *word = diff_area_chunk_state_word(chunk->diff_area,
+							 chunk->number, &shift);
+
+	*bit = shift + CHUNK_STATE_LOCK_BIT;
+	return (unsigned long *)&word->counter;
+};
+
+static inline bool chunk_trylock(struct chunk *chunk)
+{
+	int bit;
+	unsigned long *word = chunk_lock_word(chunk, &bit);
+
+	return !test_and_set_bit_lock(bit, word);
+};
+
+static inline void chunk_lock(struct chunk *chunk)
+{
+	int bit;
+	unsigned long *word = chunk_lock_word(chunk, &bit);
+
+	wait_on_bit_lock(word, bit, TASK_UNINTERRUPTIBLE);
+};
+
+static inline int chunk_lock_killable(struct chunk *chunk)
+{
+	int bit;
+	unsigned long *word = chunk_lock_word(chunk, &bit);
+
+	return wait_on_bit_lock(word, bit, TASK_KILLABLE);
+};
+
+static inline void chunk_unlock(struct chunk *chunk)
+{
+	int bit;
+	unsigned long *word = chunk_lock_word(chunk, &bit);
+
+	clear_bit_unlock(bit, word);
+	smp_mb__after_atomic();
+	wake_up_bit(word, bit);
+};
+
+int chunk_compress_init(void);
+void chunk_done(void);
+
+struct chunk *chunk_alloc(struct diff_area *diff_area, unsigned long number,
+			  gfp_t gfp_mask);
 void chunk_free(struct chunk *chunk);
 
 int chunk_schedule_storing(struct chunk *chunk, bool is_nowait);
+void chunk_schedule_writeback(struct chunk **chunks, unsigned int count);
 void chunk_diff_buffer_release(struct chunk *chunk);
 void chunk_store_failed(struct chunk *chunk, int error);
 
 void chunk_schedule_caching(struct chunk *chunk);
+#ifdef BLK_SNAP_MODIFICATION
+void chunk_release(struct chunk *chunk);
+#endif
 
 /* Asynchronous operations are used to implement the COW algorithm. */
 int chunk_async_store_diff(struct chunk *chunk, bool is_nowait);
 int chunk_async_load_orig(struct chunk *chunk, const bool is_nowait);
+int chunk_async_load_orig_batch(struct chunk **chunks, unsigned int count,
+				const bool is_nowait);
+
+/* Asynchronous loading allows to prepare the chunks for the snapshot image in advance. */
+int chunk_async_load_image(struct chunk *chunk);
+
+/* Redirection allows to read the snapshot image without copying the data. */
+int chunk_remap_image(struct chunk *chunk, struct bio *bio,
+		      struct bvec_iter *iter);
 
 /* Synchronous operations are used to implement reading and writing to the snapshot image. */
 int chunk_load_orig(struct chunk *chunk);
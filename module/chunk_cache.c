@@ -0,0 +1,368 @@
+// SPDX-License-Identifier: GPL-2.0
+#define pr_fmt(fmt) KBUILD_MODNAME "-chunk-cache: " fmt
+
+#include <linux/slab.h>
+#include "memory_checker.h"
+#include "chunk_cache.h"
+#include "chunk.h"
+#include "diff_area.h"
+#include "log.h"
+
+/*
+ * The buffers of the cache are released by a dedicated workqueue. Its
+ * max_active and cpumask can be changed in /sys/devices/virtual/workqueue/.
+ */
+static struct workqueue_struct *chunk_cache_wq;
+
+int chunk_cache_init(void)
+{
+	chunk_cache_wq = alloc_workqueue("blksnap-cache",
+					 WQ_UNBOUND | WQ_MEM_RECLAIM |
+						 WQ_HIGHPRI | WQ_SYSFS,
+					 0);
+	if (!chunk_cache_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+void chunk_cache_done(void)
+{
+	destroy_workqueue(chunk_cache_wq);
+}
+
+static inline size_t chunk_cache_chunk_size(struct chunk *chunk)
+{
+	return chunk->sector_count << SECTOR_SHIFT;
+}
+
+static inline bool chunk_cache_is_over(struct chunk_cache *chunk_cache)
+{
+	return (chunk_cache->probation_size + chunk_cache->protected_size) >
+	       chunk_cache->limit;
+}
+
+/*
+ * Removes the chunk from its queue. The lock of the cache must be held.
+ */
+static inline void chunk_cache_unlink(struct chunk_cache *chunk_cache,
+				      struct chunk *chunk)
+{
+	list_del_init(&chunk->cache_link);
+	if (chunk->cache_protected)
+		chunk_cache->protected_size -= chunk_cache_chunk_size(chunk);
+	else
+		chunk_cache->probation_size -= chunk_cache_chunk_size(chunk);
+}
+
+/*
+ * Moves the oldest chunks of the protected queue to the probation queue
+ * while the protected queue exceeds its share of the cache.
+ */
+static void chunk_cache_demote(struct chunk_cache *chunk_cache)
+{
+	size_t protected_limit = chunk_cache->limit - (chunk_cache->limit >> 2);
+	struct chunk *chunk;
+
+	while (chunk_cache->protected_size > protected_limit) {
+		chunk = list_first_entry_or_null(&chunk_cache->protected,
+						 struct chunk, cache_link);
+		if (!chunk)
+			break;
+
+		chunk_cache_unlink(chunk_cache, chunk);
+		chunk->cache_protected = false;
+		list_add_tail(&chunk->cache_link, &chunk_cache->probation);
+		chunk_cache->probation_size += chunk_cache_chunk_size(chunk);
+	}
+}
+
+static inline struct chunk *chunk_cache_lock_first(struct list_head *queue)
+{
+	struct chunk *chunk;
+
+	list_for_each_entry(chunk, queue, cache_link) {
+		/*
+		 * If it is not possible to lock a chunk for writing,
+		 * then it is currently in use, and we try to clean up the
+		 * next chunk.
+		 */
+		if (chunk_trylock(chunk))
+			return chunk;
+	}
+	return NULL;
+}
+
+/*
+ * Removes the chunk being evicted from its queue. The lock of the cache must
+ * be held.
+ */
+static inline void chunk_cache_evict(struct chunk_cache *chunk_cache,
+				     struct chunk *chunk)
+{
+	chunk_cache_unlink(chunk_cache, chunk);
+	chunk->cache_protected = false;
+	chunk->cache_evicted = ++chunk_cache->evicted;
+}
+
+/*
+ * Takes the dirty chunk with the specified number from the cache and locks
+ * it. Returns NULL if there is no such chunk in the cache or if it is in use.
+ * The lock of the cache must be held.
+ */
+static struct chunk *chunk_cache_take_dirty(struct chunk_cache *chunk_cache,
+					    struct diff_area *diff_area,
+					    unsigned long number)
+{
+	struct chunk *chunk;
+
+	if ((number >= diff_area->chunk_count) ||
+	    ((diff_area_chunk_state(diff_area, number) &
+	      (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY)) !=
+	     (CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY)))
+		return NULL;
+
+	chunk = xa_load(&diff_area->chunk_map, number);
+	if (!chunk || list_empty(&chunk->cache_link) || !chunk_trylock(chunk))
+		return NULL;
+
+	chunk_cache_evict(chunk_cache, chunk);
+	return chunk;
+}
+
+/*
+ * Takes the dirty chunks adjacent to the dirty victim from the cache, so that
+ * they are written back together with a single request. The chunks are
+ * placed in the array in order of their numbers. Returns the number of the
+ * chunks in the array, including the victim. The lock of the cache must be
+ * held.
+ */
+static unsigned int chunk_cache_take_adjacent(struct chunk_cache *chunk_cache,
+					      struct chunk *victim,
+					      struct chunk **chunks)
+{
+	struct diff_area *diff_area = victim->diff_area;
+	struct chunk *prev[CHUNK_BATCH_MAX_COUNT - 1];
+	struct chunk *chunk;
+	unsigned int back = 0;
+	unsigned int count = 0;
+
+	while ((back < ARRAY_SIZE(prev)) && (victim->number > back)) {
+		chunk = chunk_cache_take_dirty(chunk_cache, diff_area,
+					       victim->number - back - 1);
+		if (!chunk)
+			break;
+		prev[back++] = chunk;
+	}
+	while (back)
+		chunks[count++] = prev[--back];
+	chunks[count++] = victim;
+
+	while (count < CHUNK_BATCH_MAX_COUNT) {
+		chunk = chunk_cache_take_dirty(chunk_cache, diff_area,
+					       chunks[count - 1]->number + 1);
+		if (!chunk)
+			break;
+		chunks[count++] = chunk;
+	}
+	return count;
+}
+
+/*
+ * Takes the chunk to be evicted from the cache and locks it. The chunks of
+ * the probation queue are evicted first. The dirty chunks adjacent to the
+ * dirty victim are taken too. Returns the number of the chunks placed in the
+ * array, zero if the cache is not over the limit.
+ */
+static unsigned int chunk_cache_get_victims(struct chunk_cache *chunk_cache,
+					    struct chunk **chunks)
+{
+	struct chunk *chunk;
+	unsigned int count = 0;
+
+	spin_lock(&chunk_cache->lock);
+	if (!chunk_cache_is_over(chunk_cache))
+		goto out;
+
+	chunk_cache_demote(chunk_cache);
+
+	chunk = chunk_cache_lock_first(&chunk_cache->probation);
+	if (!chunk)
+		chunk = chunk_cache_lock_first(&chunk_cache->protected);
+	if (!chunk)
+		goto out;
+
+	chunk_cache_evict(chunk_cache, chunk);
+	if (chunk_state_check(chunk, CHUNK_ST_DIRTY) &&
+	    !diff_area_is_corrupted(chunk->diff_area))
+		count = chunk_cache_take_adjacent(chunk_cache, chunk, chunks);
+	else
+		chunks[count++] = chunk;
+out:
+	spin_unlock(&chunk_cache->lock);
+	return count;
+}
+
+static void chunk_cache_release_work(struct work_struct *work)
+{
+	struct chunk_cache *chunk_cache =
+		container_of(work, struct chunk_cache, release_work);
+	struct chunk *chunks[CHUNK_BATCH_MAX_COUNT];
+	struct chunk *chunk;
+	unsigned int count;
+
+	while ((count = chunk_cache_get_victims(chunk_cache, chunks))) {
+		if (count > 1) {
+			chunk_schedule_writeback(chunks, count);
+			continue;
+		}
+		chunk = chunks[0];
+		/*
+		 * There cannot be a chunk in the cache whose buffer is
+		 * not ready.
+		 */
+		if (WARN(!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY),
+			 "Cannot release empty buffer for chunk #%ld",
+			 chunk->number)) {
+			chunk_unlock(chunk);
+			continue;
+		}
+
+		if (chunk_state_check(chunk, CHUNK_ST_DIRTY) &&
+		    !diff_area_is_corrupted(chunk->diff_area)) {
+			int ret;
+
+			ret = chunk_schedule_storing(chunk, false);
+			if (ret)
+				chunk_store_failed(chunk, ret);
+		} else {
+			chunk_diff_buffer_release(chunk);
+			chunk_unlock(chunk);
+		}
+	}
+}
+
+struct chunk_cache *chunk_cache_new(size_t limit)
+{
+	struct chunk_cache *chunk_cache;
+
+	chunk_cache = kzalloc(sizeof(struct chunk_cache), GFP_KERNEL);
+	if (!chunk_cache)
+		return NULL;
+	memory_object_inc(memory_object_chunk_cache);
+
+	kref_init(&chunk_cache->kref);
+	spin_lock_init(&chunk_cache->lock);
+	INIT_LIST_HEAD(&chunk_cache->probation);
+	INIT_LIST_HEAD(&chunk_cache->protected);
+	chunk_cache->limit = limit;
+	INIT_WORK(&chunk_cache->release_work, chunk_cache_release_work);
+
+	return chunk_cache;
+}
+
+void chunk_cache_free(struct kref *kref)
+{
+	struct chunk_cache *chunk_cache =
+		container_of(kref, struct chunk_cache, kref);
+
+	flush_work(&chunk_cache->release_work);
+	WARN_ON(!list_empty(&chunk_cache->probation) ||
+		!list_empty(&chunk_cache->protected));
+
+	kfree(chunk_cache);
+	memory_object_dec(memory_object_chunk_cache);
+}
+
+/**
+ * chunk_cache_add() - Puts the chunk into the cache.
+ * @chunk_cache:
+ *	Pointer to &struct chunk_cache.
+ * @chunk:
+ *	The chunk whose buffer is ready. It must be locked.
+ *
+ * The chunk is placed in the protected queue if it was evicted recently,
+ * that is, no more chunks have been evicted since then than fit in the
+ * cache. Otherwise, it is placed in the probation queue.
+ * If the cache exceeds the limit, the release of buffers is initiated.
+ */
+int chunk_cache_add(struct chunk_cache *chunk_cache, struct chunk *chunk)
+{
+	size_t size = chunk_cache_chunk_size(chunk);
+	bool is_over;
+
+	spin_lock(&chunk_cache->lock);
+	/*
+	 * The locked chunk cannot be in the cache.
+	 * If the check reveals that the chunk is in the cache, then something
+	 * is wrong in the algorithm.
+	 */
+	if (WARN(!list_empty(&chunk->cache_link),
+		 "The chunk already in the cache")) {
+		spin_unlock(&chunk_cache->lock);
+		return -EINVAL;
+	}
+
+	if (!chunk->cache_protected && chunk->cache_evicted &&
+	    (chunk_cache->evicted - chunk->cache_evicted) <=
+		    chunk_cache->limit / size)
+		chunk->cache_protected = true;
+
+	if (chunk->cache_protected) {
+		list_add_tail(&chunk->cache_link, &chunk_cache->protected);
+		chunk_cache->protected_size += size;
+	} else {
+		list_add_tail(&chunk->cache_link, &chunk_cache->probation);
+		chunk_cache->probation_size += size;
+	}
+	is_over = chunk_cache_is_over(chunk_cache);
+	spin_unlock(&chunk_cache->lock);
+
+	if (is_over)
+		queue_work(chunk_cache_wq, &chunk_cache->release_work);
+	return 0;
+}
+
+/**
+ * chunk_cache_take() - Takes the chunk from the cache when it is accessed.
+ * @chunk_cache:
+ *	Pointer to &struct chunk_cache.
+ * @chunk:
+ *	The chunk. It must be locked.
+ *
+ * The chunk keeps its queue when it is put into the cache again.
+ */
+void chunk_cache_take(struct chunk_cache *chunk_cache, struct chunk *chunk)
+{
+	spin_lock(&chunk_cache->lock);
+	if (!list_empty(&chunk->cache_link))
+		chunk_cache_unlink(chunk_cache, chunk);
+	spin_unlock(&chunk_cache->lock);
+}
+
+/**
+ * chunk_cache_remove_area() - Removes the chunks of the difference area
+ *	from the cache.
+ * @chunk_cache:
+ *	Pointer to &struct chunk_cache.
+ * @diff_area:
+ *	The difference area being released.
+ *
+ * The buffers of the chunks are released together with the chunks.
+ */
+void chunk_cache_remove_area(struct chunk_cache *chunk_cache,
+			     struct diff_area *diff_area)
+{
+	struct chunk *chunk;
+	struct chunk *tmp;
+
+	spin_lock(&chunk_cache->lock);
+	list_for_each_entry_safe(chunk, tmp, &chunk_cache->probation,
+				 cache_link)
+		if (chunk->diff_area == diff_area)
+			chunk_cache_unlink(chunk_cache, chunk);
+	list_for_each_entry_safe(chunk, tmp, &chunk_cache->protected,
+				 cache_link)
+		if (chunk->diff_area == diff_area)
+			chunk_cache_unlink(chunk_cache, chunk);
+	spin_unlock(&chunk_cache->lock);
+}
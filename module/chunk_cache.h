@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __BLK_SNAP_CHUNK_CACHE_H
+#define __BLK_SNAP_CHUNK_CACHE_H
+
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct chunk;
+struct diff_area;
+
+/**
+ * struct chunk_cache - The cache of chunks whose data is kept in memory.
+ * @kref:
+ *	The reference counter. The cache is shared by all difference areas
+ *	of the snapshot.
+ * @lock:
+ *	This spinlock guarantees consistency of the lists and sizes.
+ * @probation:
+ *	The queue of chunks that were accessed once recently.
+ * @probation_size:
+ *	The total size in bytes of the chunks in the probation queue.
+ * @protected:
+ *	The queue of chunks that were accessed again soon after being evicted.
+ * @protected_size:
+ *	The total size in bytes of the chunks in the protected queue.
+ * @limit:
+ *	The maximum total size in bytes of the chunks in the cache.
+ * @evicted:
+ *	The number of chunks evicted from the cache. It is used as a clock to
+ *	find out how long ago the chunk was evicted.
+ * @release_work:
+ *	The workqueue work item. This worker releases the buffers of chunks
+ *	while the cache is over the limit.
+ *
+ * The cache is a segmented LRU. A chunk that gets into the cache for the
+ * first time is placed in the probation queue. If the chunk gets into the
+ * cache again while the cache still remembers its eviction, it is placed in
+ * the protected queue. Chunks are evicted from the probation queue first,
+ * so a single sequential pass over the snapshot image does not push out the
+ * chunks that are repeatedly accessed by random readers. The protected
+ * queue is limited by three quarters of the cache, its oldest chunks are
+ * moved back to the probation queue.
+ *
+ * The dirty chunks of writable snapshot images are stored to the difference
+ * storage when they are evicted.
+ */
+struct chunk_cache {
+	struct kref kref;
+	spinlock_t lock;
+
+	struct list_head probation;
+	size_t probation_size;
+	struct list_head protected;
+	size_t protected_size;
+
+	size_t limit;
+	unsigned long evicted;
+
+	struct work_struct release_work;
+};
+
+int chunk_cache_init(void);
+void chunk_cache_done(void);
+
+struct chunk_cache *chunk_cache_new(size_t limit);
+void chunk_cache_free(struct kref *kref);
+static inline void chunk_cache_get(struct chunk_cache *chunk_cache)
+{
+	kref_get(&chunk_cache->kref);
+};
+static inline void chunk_cache_put(struct chunk_cache *chunk_cache)
+{
+	if (likely(chunk_cache))
+		kref_put(&chunk_cache->kref, chunk_cache_free);
+};
+
+int chunk_cache_add(struct chunk_cache *chunk_cache, struct chunk *chunk);
+void chunk_cache_take(struct chunk_cache *chunk_cache, struct chunk *chunk);
+void chunk_cache_remove_area(struct chunk_cache *chunk_cache,
+			     struct diff_area *diff_area);
+#endif /* __BLK_SNAP_CHUNK_CACHE_H */
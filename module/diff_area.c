@@ -6,6 +6,10 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/highmem.h>
+#include <linux/sched/signal.h>
+#include <linux/uaccess.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -13,15 +17,20 @@
 #endif
 #include "memory_checker.h"
 #include "chunk.h"
+#include "chunk_cache.h"
 #include "diff_area.h"
 #include "diff_buffer.h"
 #include "diff_storage.h"
 #include "diff_io.h"
 #include "log.h"
 
-extern int chunk_minimum_shift;
 extern int chunk_maximum_count;
-extern int chunk_maximum_in_cache;
+extern int nonblocking_cow;
+extern int nonblocking_cow_memory_limit;
+extern int image_read_remap;
+extern int image_throttling_limit;
+extern int image_throttling_timeout;
+extern int numa_affinity;
 
 #ifndef HAVE_BDEV_NR_SECTORS
 static inline sector_t bdev_nr_sectors(struct block_device *bdev)
@@ -53,6 +62,53 @@ static inline void recalculate_last_chunk_size(struct chunk *chunk)
 			capacity - round_down(capacity, chunk->sector_count);
 }
 
+/*
+ * Returns the chunk with the specified number.
+ * The chunks are created on demand when they are accessed for the first time.
+ * A chunk that is absent in the chunk map has never been copied or read,
+ * so the memory is consumed only for the chunks in the working set.
+ */
+static struct chunk *diff_area_get_chunk(struct diff_area *diff_area,
+					 unsigned long number,
+					 const bool is_nowait)
+{
+	struct chunk *chunk;
+	struct chunk *old;
+	gfp_t gfp = is_nowait ? (GFP_NOWAIT | __GFP_NOWARN) : GFP_NOIO;
+
+	if (unlikely(number >= diff_area->chunk_count))
+		return ERR_PTR(-EINVAL);
+
+	chunk = xa_load(&diff_area->chunk_map, number);
+	if (chunk)
+		return chunk;
+
+	chunk = chunk_alloc(diff_area, number, gfp);
+	if (unlikely(!chunk))
+		return ERR_PTR(is_nowait ? -EAGAIN : -ENOMEM);
+
+	chunk->sector_count = diff_area_chunk_sectors(diff_area);
+	if (number == (diff_area->chunk_count - 1))
+		recalculate_last_chunk_size(chunk);
+
+	old = xa_cmpxchg(&diff_area->chunk_map, number, NULL, chunk, gfp);
+	if (unlikely(xa_is_err(old) || old)) {
+		/*
+		 * The chunk state is shared, so chunk_free() cannot be used
+		 * for a chunk that was not inserted into the map.
+		 */
+		kfree(chunk);
+		memory_object_dec(memory_object_chunk);
+
+		if (xa_is_err(old))
+			return ERR_PTR(is_nowait ? -EAGAIN : xa_err(old));
+		/* The chunk has been created by another thread. */
+		return old;
+	}
+
+	return chunk;
+}
+
 static inline unsigned long long count_by_shift(sector_t capacity,
 						unsigned long long shift)
 {
@@ -61,9 +117,10 @@ static inline unsigned long long count_by_shift(sector_t capacity,
 	return round_up(capacity, (1ull << shift_sector)) >> shift_sector;
 }
 
-static void diff_area_calculate_chunk_size(struct diff_area *diff_area)
+static void diff_area_calculate_chunk_size(struct diff_area *diff_area,
+					   unsigned int minimum_shift)
 {
-	unsigned long long shift = chunk_minimum_shift;
+	unsigned long long shift = minimum_shift;
 	unsigned long long count;
 	sector_t capacity;
 	sector_t min_io_sect;
@@ -92,147 +149,91 @@ static void diff_area_calculate_chunk_size(struct diff_area *diff_area)
 		 MINOR(diff_area->orig_bdev->bd_dev));
 }
 
+static void diff_area_wait_pending_io(struct diff_area *diff_area)
+{
+	unsigned long inx = 0;
+
+	while (!wait_event_timeout(diff_area->pending_io_wq,
+				   !atomic_read(&diff_area->pending_io_count),
+				   HZ)) {
+		inx++;
+		pr_warn("Waiting for pending I/O to complete\n");
+		if (inx > 5) {
+			pr_err("Failed to complete pending I/O\n");
+			break;
+		}
+	}
+	/* Waits for the completion that has just woken us up to leave */
+	spin_lock_irq(&diff_area->pending_io_wq.lock);
+	spin_unlock_irq(&diff_area->pending_io_wq.lock);
+}
+
 void diff_area_free(struct kref *kref)
 {
 	unsigned long inx = 0;
-	u64 start_waiting;
 	struct chunk *chunk;
 	struct diff_area *diff_area =
 		container_of(kref, struct diff_area, kref);
 
 	might_sleep();
-	start_waiting = jiffies_64;
-	while (atomic_read(&diff_area->pending_io_count)) {
-		schedule_timeout_interruptible(1);
-		if (jiffies_64 > (start_waiting + HZ)) {
-			start_waiting = jiffies_64;
-			inx++;
-			pr_warn("Waiting for pending I/O to complete\n");
-			if (inx > 5) {
-				pr_err("Failed to complete pending I/O\n");
-				break;
-			}
-		}
+	diff_area_wait_pending_io(diff_area);
+
+	if (diff_area->chunk_cache) {
+		chunk_cache_remove_area(diff_area->chunk_cache, diff_area);
+		/*
+		 * The worker could take a chunk of this difference area before
+		 * it was removed from the cache, and start storing it.
+		 */
+		flush_work(&diff_area->chunk_cache->release_work);
+		diff_area_wait_pending_io(diff_area);
+		chunk_cache_put(diff_area->chunk_cache);
 	}
 
-	flush_work(&diff_area->cache_release_work);
-	xa_for_each(&diff_area->chunk_map, inx, chunk)
+	xa_for_each(&diff_area->chunk_map, inx, chunk) {
 		chunk_free(chunk);
+		cond_resched();
+	}
 	xa_destroy(&diff_area->chunk_map);
 
+	if (diff_area->chunk_state_map) {
+		vfree(diff_area->chunk_state_map);
+		memory_object_dec(memory_object_chunk_state_map);
+	}
+#ifdef BLK_SNAP_MODIFICATION
+	if (diff_area->read_progress) {
+		vfree(diff_area->read_progress);
+		memory_object_dec(memory_object_read_progress);
+	}
+	if (diff_area->chunk_hashes) {
+		vfree(diff_area->chunk_hashes);
+		memory_object_dec(memory_object_chunk_hashes);
+	}
+#endif
+
 	if (diff_area->orig_bdev) {
 		blkdev_put(diff_area->orig_bdev, FMODE_READ | FMODE_WRITE);
 		diff_area->orig_bdev = NULL;
 	}
+	diff_storage_put(diff_area->diff_storage);
 
 	/* Clean up free_diff_buffers */
 	diff_buffer_cleanup(diff_area);
 
-	kfree(diff_area);
-	memory_object_dec(memory_object_diff_area);
-}
-
-static inline struct chunk *
-get_chunk_from_cache_and_write_lock(spinlock_t *caches_lock,
-				    struct list_head *cache_queue,
-				    atomic_t *cache_count)
-{
-	struct chunk *iter;
-	struct chunk *chunk = NULL;
-
-	spin_lock(caches_lock);
-	list_for_each_entry(iter, cache_queue, cache_link) {
-		if (!down_trylock(&iter->lock)) {
-			chunk = iter;
-			break;
-		}
-		/*
-		 * If it is not possible to lock a chunk for writing,
-		 * then it is currently in use, and we try to clean up the
-		 * next chunk.
-		 */
-	}
-	if (likely(chunk)) {
-		atomic_dec(cache_count);
-		list_del_init(&chunk->cache_link);
-	}
-	spin_unlock(caches_lock);
-
-	return chunk;
-}
-
-static struct chunk *
-diff_area_get_chunk_from_cache_and_write_lock(struct diff_area *diff_area)
-{
-	struct chunk *chunk;
-
-	if (atomic_read(&diff_area->read_cache_count) >
-	    chunk_maximum_in_cache) {
-		chunk = get_chunk_from_cache_and_write_lock(
-			&diff_area->caches_lock, &diff_area->read_cache_queue,
-			&diff_area->read_cache_count);
-		if (chunk)
-			return chunk;
-	}
-
-	if (atomic_read(&diff_area->write_cache_count) >
-	    chunk_maximum_in_cache) {
-		chunk = get_chunk_from_cache_and_write_lock(
-			&diff_area->caches_lock, &diff_area->write_cache_queue,
-			&diff_area->write_cache_count);
-		if (chunk)
-			return chunk;
+	if (diff_area->stats) {
+		free_percpu(diff_area->stats);
+		memory_object_dec(memory_object_diff_area_stats);
 	}
 
-	return NULL;
-}
-
-static void diff_area_cache_release(struct diff_area *diff_area)
-{
-	struct chunk *chunk;
-
-	while (!diff_area_is_corrupted(diff_area) &&
-	       (chunk = diff_area_get_chunk_from_cache_and_write_lock(
-			diff_area))) {
-		/*
-		 * There cannot be a chunk in the cache whose buffer is
-		 * not ready.
-		 */
-		if (WARN(!chunk_state_check(chunk, CHUNK_ST_BUFFER_READY),
-			 "Cannot release empty buffer for chunk #%ld",
-			 chunk->number)) {
-			up(&chunk->lock);
-			continue;
-		}
-
-		if (chunk_state_check(chunk, CHUNK_ST_DIRTY)) {
-			int ret;
-
-			ret = chunk_schedule_storing(chunk, false);
-			if (ret)
-				chunk_store_failed(chunk, ret);
-		} else {
-			chunk_diff_buffer_release(chunk);
-			up(&chunk->lock);
-		}
-	}
-}
-
-static void diff_area_cache_release_work(struct work_struct *work)
-{
-	struct diff_area *diff_area =
-		container_of(work, struct diff_area, cache_release_work);
-
-	diff_area_cache_release(diff_area);
+	kfree(diff_area);
+	memory_object_dec(memory_object_diff_area);
 }
 
-struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
+struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage,
+				struct chunk_cache *chunk_cache,
+				unsigned int chunk_shift, unsigned int read_ahead)
 {
-	int ret = 0;
 	struct diff_area *diff_area = NULL;
 	struct block_device *bdev;
-	unsigned long number;
-	struct chunk *chunk;
 
 	pr_debug("Open device [%u:%u]\n", MAJOR(dev_id), MINOR(dev_id));
 
@@ -252,16 +253,22 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 	memory_object_inc(memory_object_diff_area);
 
 	diff_area->orig_bdev = bdev;
+	diff_area->node = numa_affinity ? bdev->bd_disk->node_id : NUMA_NO_NODE;
+	/*
+	 * The chunks kept in the memory release it to the difference storage,
+	 * so the storage must outlive the difference area.
+	 */
+	diff_storage_get(diff_storage);
 	diff_area->diff_storage = diff_storage;
 
-	diff_area_calculate_chunk_size(diff_area);
+	diff_area_calculate_chunk_size(diff_area, chunk_shift);
 	pr_debug("Chunk size %llu in bytes\n", 1ull << diff_area->chunk_shift);
 	pr_debug("Chunk count %lu\n", diff_area->chunk_count);
 
 	kref_init(&diff_area->kref);
 	xa_init(&diff_area->chunk_map);
 
-	if (!diff_storage->capacity) {
+	if (!diff_storage->capacity && !diff_storage_in_memory(diff_storage)) {
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 		diff_area->in_memory = true;
 		pr_debug("Difference storage is empty.\n");
@@ -269,115 +276,225 @@ struct diff_area *diff_area_new(dev_t dev_id, struct diff_storage *diff_storage)
 #else
 		pr_err("Difference storage is empty.\n");
 		pr_err("In-memory difference storage is not supported");
+		diff_storage_put(diff_storage);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE);
+		kfree(diff_area);
+		memory_object_dec(memory_object_diff_area);
 		return ERR_PTR(-EFAULT);
 #endif
 	}
 
-	spin_lock_init(&diff_area->caches_lock);
-	INIT_LIST_HEAD(&diff_area->read_cache_queue);
-	atomic_set(&diff_area->read_cache_count, 0);
-	INIT_LIST_HEAD(&diff_area->write_cache_queue);
-	atomic_set(&diff_area->write_cache_count, 0);
-	INIT_WORK(&diff_area->cache_release_work, diff_area_cache_release_work);
+	chunk_cache_get(chunk_cache);
+	diff_area->chunk_cache = chunk_cache;
 
-	spin_lock_init(&diff_area->free_diff_buffers_lock);
-	INIT_LIST_HEAD(&diff_area->free_diff_buffers);
 	atomic_set(&diff_area->free_diff_buffers_count, 0);
+	if (diff_buffer_pools_init(diff_area)) {
+		pr_err("Failed to allocate difference buffer pools\n");
+		diff_area_put(diff_area);
+		return ERR_PTR(-ENOMEM);
+	}
 
 	diff_area->corrupt_flag = 0;
 	atomic_set(&diff_area->pending_io_count, 0);
+	init_waitqueue_head(&diff_area->pending_io_wq);
+	atomic_set(&diff_area->cow_io_count, 0);
+	init_waitqueue_head(&diff_area->cow_io_wq);
+	diff_area->throttling_limit = max(image_throttling_limit, 0);
+
+	diff_area->nonblocking_cow = !!nonblocking_cow;
+	init_waitqueue_head(&diff_area->buffer_ready_wq);
+	INIT_LIST_HEAD(&diff_area->tracker_link);
+
+	spin_lock_init(&diff_area->read_ahead_lock);
+	diff_area->read_ahead_pos = 0;
+	diff_area->read_ahead_next = 0;
+	diff_area_set_read_ahead(diff_area, read_ahead);
+
+	diff_area->chunk_state_map = __vmalloc(
+		DIV_ROUND_UP(diff_area->chunk_count, CHUNK_STATE_PER_WORD) *
+			sizeof(atomic_long_t),
+		GFP_KERNEL | __GFP_ZERO);
+	if (!diff_area->chunk_state_map) {
+		pr_err("Failed to allocate chunk state map\n");
+		diff_area_put(diff_area);
+		return ERR_PTR(-ENOMEM);
+	}
+	memory_object_inc(memory_object_chunk_state_map);
+
+	diff_area->stats = alloc_percpu(struct diff_area_stats);
+	if (!diff_area->stats) {
+		pr_err("Failed to allocate statistics\n");
+		diff_area_put(diff_area);
+		return ERR_PTR(-ENOMEM);
+	}
+	memory_object_inc(memory_object_diff_area_stats);
 
 	/*
-	 * Allocating all chunks in advance allows to avoid doing this in
-	 * the process of filtering bio.
-	 * In addition, the chunk structure has an rw semaphore that allows
-	 * to lock data of a single chunk.
+	 * The chunks are not allocated in advance. Each chunk is created when
+	 * it is accessed for the first time, either when copying on write or
+	 * when accessing the snapshot image.
+	 * Each chunk has a lock bit in the chunk state map that allows to
+	 * lock data of a single chunk.
 	 * Different threads can read, write, or dump their data to diff storage
 	 * independently of each other, provided that different chunks are used.
 	 */
-	for (number = 0; number < diff_area->chunk_count; number++) {
-		chunk = chunk_alloc(diff_area, number);
-		if (!chunk) {
-			pr_err("Failed allocate chunk\n");
-			ret = -ENOMEM;
-			break;
-		}
-		chunk->sector_count = diff_area_chunk_sectors(diff_area);
+	return diff_area;
+}
 
-		ret = xa_insert(&diff_area->chunk_map, number, chunk,
-				GFP_KERNEL);
-		if (ret) {
-			pr_err("Failed insert chunk to chunk map\n");
-			chunk_free(chunk);
-			break;
-		}
-	}
-	if (ret) {
-		diff_area_put(diff_area);
-		return ERR_PTR(ret);
-	}
+static inline void diff_area_take_chunk_from_cache(struct diff_area *diff_area,
+						   struct chunk *chunk)
+{
+	chunk_cache_take(diff_area->chunk_cache, chunk);
+}
+
+/*
+ * Starts loading of the accumulated adjacent chunks. If it fails, the chunks
+ * are marked as failed.
+ */
+static int diff_area_copy_flush(struct chunk **batch, unsigned int *count,
+				const bool is_nowait)
+{
+	int ret;
+	unsigned int inx;
 
-	recalculate_last_chunk_size(chunk);
+	if (!*count)
+		return 0;
 
-	return diff_area;
+	ret = chunk_async_load_orig_batch(batch, *count, is_nowait);
+	if (unlikely(ret)) {
+		for (inx = 0; inx < *count; inx++)
+			chunk_store_failed(batch[inx], ret);
+	}
+	*count = 0;
+
+	return ret;
 }
 
-static void diff_area_take_chunk_from_cache(struct diff_area *diff_area,
-					    struct chunk *chunk)
+/*
+ * Copies the data of the chunk from the chunk with the same number of the
+ * newer snapshot, if its data is in memory. Since the older snapshot has not
+ * yet copied the chunk, the original device has not been changed since it
+ * was taken, and the data in memory is the same as on the original device.
+ */
+static bool diff_area_copy_from_source(struct diff_area *source,
+				       struct chunk *chunk,
+				       const bool is_nowait)
 {
-	spin_lock(&diff_area->caches_lock);
-	if (!list_is_first(&chunk->cache_link, &chunk->cache_link)) {
-		list_del_init(&chunk->cache_link);
-
-		if (chunk_state_check(chunk, CHUNK_ST_DIRTY))
-			atomic_dec(&diff_area->write_cache_count);
-		else
-			atomic_dec(&diff_area->read_cache_count);
+	struct chunk *src;
+	size_t inx;
+	bool copied = false;
+
+	if (!source || diff_area_is_corrupted(source) ||
+	    (source->chunk_shift != chunk->diff_area->chunk_shift) ||
+	    (source->chunk_count != chunk->diff_area->chunk_count))
+		return false;
+
+	if ((diff_area_chunk_state(source, chunk->number) &
+	     (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY |
+	      CHUNK_ST_ZERO)) != CHUNK_ST_BUFFER_READY)
+		return false;
+
+	src = xa_load(&source->chunk_map, chunk->number);
+	if (!src)
+		return false;
+	/*
+	 * The newer snapshot may still be storing the chunk. In non-blocking
+	 * mode it is faster to read the data from the original device than to
+	 * wait for it.
+	 */
+	if (is_nowait || chunk->diff_area->nonblocking_cow) {
+		if (!chunk_trylock(src))
+			return false;
+	} else if (chunk_lock_killable(src))
+		return false;
+
+	if (((chunk_state_get(src) &
+	      (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY |
+	       CHUNK_ST_ZERO)) == CHUNK_ST_BUFFER_READY) &&
+	    src->diff_buffer &&
+	    (src->diff_buffer->page_count == chunk->diff_buffer->page_count)) {
+		for (inx = 0; inx < chunk->diff_buffer->page_count; inx++)
+			copy_highpage(chunk->diff_buffer->pages[inx],
+				      src->diff_buffer->pages[inx]);
+		copied = true;
 	}
-	spin_unlock(&diff_area->caches_lock);
+	chunk_unlock(src);
+
+	if (copied)
+		diff_area_stats_inc(chunk->diff_area, chunks_shared);
+
+	return copied;
 }
 
 /*
  * Implements the copy-on-write mechanism.
+ *
+ * Adjacent chunks that need to be copied are accumulated in a batch, so that
+ * their data is read from the original device and written to the difference
+ * storage with large requests. If the @source difference area of a newer
+ * snapshot of the same device is specified, the chunks that it has in memory
+ * are copied from it without reading the original device.
  */
-int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
-		   const bool is_nowait)
+int diff_area_copy(struct diff_area *diff_area, struct diff_area *source,
+		   sector_t sector, sector_t count, const bool is_nowait)
 {
 	int ret = 0;
+	int flush_ret;
 	sector_t offset;
 	struct chunk *chunk;
 	struct diff_buffer *diff_buffer;
 	sector_t area_sect_first;
 	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	struct chunk *batch[CHUNK_BATCH_MAX_COUNT];
+	unsigned int batch_count = 0;
 
 	area_sect_first = round_down(sector, chunk_sectors);
 	for (offset = area_sect_first; offset < (sector + count);
 	     offset += chunk_sectors) {
-		chunk = xa_load(&diff_area->chunk_map,
-				chunk_number(diff_area, offset));
-		if (!chunk) {
-			diff_area_set_corrupted(diff_area, -EINVAL);
-			return -EINVAL;
+		/*
+		 * Most often the chunk has already been copied or does not
+		 * need to be copied. It can be checked by the chunk state map
+		 * without looking up the chunk and without locking it.
+		 */
+		if (chunk_number(diff_area, offset) < diff_area->chunk_count &&
+		    (diff_area_chunk_state(diff_area,
+					   chunk_number(diff_area, offset)) &
+		     (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_STORE_READY |
+		      CHUNK_ST_ZERO)))
+			continue;
+
+		chunk = diff_area_get_chunk(diff_area,
+					    chunk_number(diff_area, offset),
+					    is_nowait);
+		if (IS_ERR(chunk)) {
+			ret = PTR_ERR(chunk);
+			if (ret != -EAGAIN)
+				diff_area_set_corrupted(diff_area, ret);
+			goto out;
 		}
 		WARN_ON(chunk_number(diff_area, offset) != chunk->number);
 		if (is_nowait) {
-			if (down_trylock(&chunk->lock))
-				return -EAGAIN;
+			if (!chunk_trylock(chunk)) {
+				ret = -EAGAIN;
+				goto out;
+			}
 		} else {
-			ret = down_killable(&chunk->lock);
+			ret = chunk_lock_killable(chunk);
 			if (unlikely(ret))
-				return ret;
+				goto out;
 		}
 
 		if (chunk_state_check(chunk, CHUNK_ST_FAILED | CHUNK_ST_DIRTY |
-						     CHUNK_ST_STORE_READY)) {
+						     CHUNK_ST_STORE_READY |
+						     CHUNK_ST_ZERO)) {
 			/*
 			 * The chunk has already been:
 			 * - Failed, when the snapshot is corrupted
 			 * - Overwritten in the snapshot image
 			 * - Already stored in the diff storage
+			 * - Marked as unused
 			 */
-			up(&chunk->lock);
+			chunk_unlock(chunk);
 			continue;
 		}
 
@@ -407,17 +524,101 @@ int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
 			WARN(chunk->diff_buffer, "Chunks buffer has been lost");
 			chunk->diff_buffer = diff_buffer;
 
-			ret = chunk_async_load_orig(chunk, is_nowait);
-			if (unlikely(ret))
-				goto fail_unlock_chunk;
+			if (diff_area_copy_from_source(source, chunk,
+						       is_nowait)) {
+				chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
+				diff_area_notify_buffer_ready(diff_area);
+				ret = chunk_schedule_storing(chunk, is_nowait);
+				if (unlikely(ret))
+					goto fail_unlock_chunk;
+				continue;
+			}
+
+			if (batch_count &&
+			    ((batch[batch_count - 1]->number + 1 !=
+			      chunk->number) ||
+			     (batch_count == CHUNK_BATCH_MAX_COUNT))) {
+				ret = diff_area_copy_flush(batch, &batch_count,
+							   is_nowait);
+				if (unlikely(ret))
+					goto fail_unlock_chunk;
+			}
+			batch[batch_count++] = chunk;
 		}
 	}
-
-	return ret;
+out:
+	flush_ret = diff_area_copy_flush(batch, &batch_count, is_nowait);
+	return ret ? ret : flush_ret;
 fail_unlock_chunk:
 	WARN_ON(!chunk);
 	chunk_store_failed(chunk, ret);
-	return ret;
+	goto out;
+}
+
+/*
+ * The data of all chunks that are being loaded or stored are kept in memory.
+ * If there is too much of it, the writes to the original device should wait
+ * until the chunks are stored.
+ */
+static inline bool diff_area_cow_over_budget(struct diff_area *diff_area)
+{
+	unsigned long long in_flight =
+		(unsigned long long)atomic_read(&diff_area->pending_io_count)
+		<< diff_area->chunk_shift;
+
+	return in_flight > ((unsigned long long)nonblocking_cow_memory_limit
+			    << 20);
+}
+
+static inline bool diff_area_chunk_buffer_ready(struct diff_area *diff_area,
+						unsigned long number)
+{
+	return !!(diff_area_chunk_state(diff_area, number) &
+		  (CHUNK_ST_FAILED | CHUNK_ST_BUFFER_READY | CHUNK_ST_DIRTY |
+		   CHUNK_ST_STORE_READY | CHUNK_ST_ZERO));
+}
+
+/*
+ * Waits until the data of the chunks is read into memory. The chunks may
+ * still be being stored to the difference storage.
+ */
+static int diff_area_wait_buffer_ready(struct diff_area *diff_area,
+				       sector_t sector, sector_t count,
+				       const bool is_nowait)
+{
+	int ret;
+	sector_t offset;
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+
+	for (offset = round_down(sector, chunk_sectors);
+	     offset < (sector + count); offset += chunk_sectors) {
+		unsigned long number = chunk_number(diff_area, offset);
+
+		if (number >= diff_area->chunk_count)
+			break;
+
+		if (!diff_area_chunk_buffer_ready(diff_area, number)) {
+			u64 start_time;
+
+			if (is_nowait)
+				return -EAGAIN;
+
+			start_time = ktime_get_ns();
+			ret = wait_event_killable(
+				diff_area->buffer_ready_wq,
+				diff_area_chunk_buffer_ready(diff_area,
+							     number));
+			diff_area_stats_add(diff_area, cow_wait_ns,
+					    ktime_get_ns() - start_time);
+			if (unlikely(ret))
+				return ret;
+		}
+
+		if (diff_area_chunk_state(diff_area, number) & CHUNK_ST_FAILED)
+			return -EFAULT;
+	}
+
+	return 0;
 }
 
 int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
@@ -429,21 +630,53 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 	sector_t area_sect_first;
 	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
 
+	if (diff_area->nonblocking_cow && !diff_area_cow_over_budget(diff_area))
+		return diff_area_wait_buffer_ready(diff_area, sector, count,
+						   is_nowait);
+
 	area_sect_first = round_down(sector, chunk_sectors);
 	for (offset = area_sect_first; offset < (sector + count);
 	     offset += chunk_sectors) {
-		chunk = xa_load(&diff_area->chunk_map,
-				chunk_number(diff_area, offset));
+		unsigned long number = chunk_number(diff_area, offset);
+		unsigned int state;
+
+		if (number >= diff_area->chunk_count)
+			break;
+		/*
+		 * Most often the chunk has already been copied. It can be
+		 * checked by the chunk state map without looking up the chunk
+		 * and without locking it.
+		 */
+		state = diff_area_chunk_state(diff_area, number);
+		if (state & CHUNK_ST_FAILED) {
+			ret = -EFAULT;
+			break;
+		}
+		if ((state & (CHUNK_ST_DIRTY | CHUNK_ST_STORE_READY |
+			      CHUNK_ST_ZERO)) &&
+		    !(state & (CHUNK_ST_LOADING | CHUNK_ST_STORING)))
+			continue;
+
+		chunk = xa_load(&diff_area->chunk_map, number);
 		if (!chunk) {
-			diff_area_set_corrupted(diff_area, -EINVAL);
-			return -EINVAL;
+			/*
+			 * The chunk has not been created, so there is
+			 * nothing to wait for.
+			 */
+			continue;
 		}
-		WARN_ON(chunk_number(diff_area, offset) != chunk->number);
-		if (is_nowait) {
-			if (down_trylock(&chunk->lock))
+		WARN_ON(number != chunk->number);
+		if (!chunk_trylock(chunk)) {
+			u64 start_time;
+
+			if (is_nowait)
 				return -EAGAIN;
-		} else {
-			ret = down_killable(&chunk->lock);
+
+			/* Only the time actually spent waiting is accounted */
+			start_time = ktime_get_ns();
+			ret = chunk_lock_killable(chunk);
+			diff_area_stats_add(diff_area, cow_wait_ns,
+					    ktime_get_ns() - start_time);
 			if (unlikely(ret))
 				return ret;
 		}
@@ -455,27 +688,371 @@ int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 			 * - Overwritten in the snapshot image
 			 * - Already stored in the diff storage
 			 */
-			up(&chunk->lock);
+			chunk_unlock(chunk);
 			ret = -EFAULT;
 			break;
 		}
 
-		if (chunk_state_check(chunk, CHUNK_ST_BUFFER_READY |
-				      CHUNK_ST_DIRTY | CHUNK_ST_STORE_READY)) {
+		/*
+		 * The chunk has already been:
+		 * - Read
+		 * - Overwritten in the snapshot image
+		 * - Already stored in the diff storage
+		 * - Skipped, since its data is not needed or is all zeroes
+		 */
+		chunk_unlock(chunk);
+	}
+
+	return ret;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * Calculates the numbers of the chunks that are completely covered by the
+ * range. Returns false if there are no such chunks.
+ */
+static bool diff_area_covered_chunks(struct diff_area *diff_area,
+				     struct blk_snap_block_range *range,
+				     unsigned long *pfirst, unsigned long *plast)
+{
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	sector_t capacity = bdev_nr_sectors(diff_area->orig_bdev);
+	sector_t first = range->sector_offset;
+	sector_t last;
+
+	if (first >= capacity)
+		return false;
+	if (range->sector_count >= capacity - first)
+		last = capacity;
+	else
+		last = first + range->sector_count;
+
+	first = round_up(first, chunk_sectors);
+	/* The last chunk of the device can be incomplete. */
+	if (last == capacity)
+		last = (sector_t)diff_area->chunk_count * chunk_sectors;
+	else
+		last = round_down(last, chunk_sectors);
+
+	*pfirst = chunk_number(diff_area, first);
+	*plast = chunk_number(diff_area, last);
+	return *pfirst < *plast;
+}
+
+/*
+ * Marks the chunks that are completely covered by the ranges as unused.
+ * These chunks are not copied when the original device is written, and
+ * the snapshot image reads them as zeroes. The chunks that have already been
+ * processed are skipped. Returns the number of marked chunks.
+ */
+unsigned long diff_area_set_unused(struct diff_area *diff_area,
+				   struct blk_snap_block_range *ranges,
+				   unsigned int count)
+{
+	unsigned int inx;
+	unsigned long marked = 0;
+	unsigned long first;
+	unsigned long last;
+	unsigned long number;
+
+	for (inx = 0; inx < count; inx++) {
+		if (!diff_area_covered_chunks(diff_area, &ranges[inx], &first,
+					      &last))
+			continue;
+
+		for (number = first; number < last; number++)
+			if (diff_area_chunk_state_try_init(diff_area, number,
+							   CHUNK_ST_ZERO))
+				marked++;
+	}
+
+	return marked;
+}
+
+/*
+ * Releases the chunks from @first up to @last, not including it. Unlike the
+ * unused chunks, the chunks that have already been copied or read are
+ * released too. If @is_killable is set, the waiting for the lock of a chunk
+ * is interrupted by a fatal signal. Returns the number of released chunks.
+ */
+static unsigned long diff_area_release_chunks(struct diff_area *diff_area,
+					      unsigned long first,
+					      unsigned long last,
+					      const bool is_killable)
+{
+	unsigned long number;
+	unsigned long released = 0;
+	struct chunk *chunk;
+
+	for (number = first; number < last; number++) {
+		chunk = xa_load(&diff_area->chunk_map, number);
+		if (!chunk) {
 			/*
-			 * The chunk has already been:
-			 * - Read
-			 * - Overwritten in the snapshot image
-			 * - Already stored in the diff storage
+			 * The chunk has not been created, so it is enough to
+			 * mark it. If the chunk is being created right now,
+			 * its state is checked again under its lock.
 			 */
-			up(&chunk->lock);
+			if (diff_area_chunk_state_try_init(diff_area, number,
+							   CHUNK_ST_ZERO)) {
+				released++;
+				continue;
+			}
+			chunk = xa_load(&diff_area->chunk_map, number);
+			if (!chunk)
+				continue;
+		}
+
+		/*
+		 * The lock of the chunk is held until its I/O is completed,
+		 * so there is nothing in flight when it is taken.
+		 */
+		if (!is_killable)
+			chunk_lock(chunk);
+		else if (chunk_lock_killable(chunk))
+			break;
+		if (!chunk_state_check(chunk, CHUNK_ST_FAILED) &&
+		    (chunk_state_get(chunk) != CHUNK_ST_ZERO)) {
+			diff_area_take_chunk_from_cache(diff_area, chunk);
+			chunk_release(chunk);
+			released++;
+		}
+		chunk_unlock(chunk);
+	}
+
+	return released;
+}
+
+/**
+ * diff_area_release() - Releases the chunks that are no longer needed.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ * @ranges:
+ *	The ranges of the sectors that are no longer needed.
+ * @count:
+ *	The number of the ranges.
+ * @is_killable:
+ *	The releasing is interrupted by a fatal signal of the current task. It
+ *	is not set by the workers of the snapshot image, for which the signals
+ *	are not delivered.
+ *
+ * The chunks that are completely covered by the ranges are released. Their
+ * regions of the difference storage and their buffers are freed, they are not
+ * copied anymore, and the snapshot image reads them as zeroes.
+ *
+ * Return: the number of released chunks.
+ */
+unsigned long diff_area_release(struct diff_area *diff_area,
+				struct blk_snap_block_range *ranges,
+				unsigned int count, const bool is_killable)
+{
+	unsigned int inx;
+	unsigned long released = 0;
+	unsigned long first;
+	unsigned long last;
+
+	for (inx = 0; inx < count; inx++) {
+		if (!diff_area_covered_chunks(diff_area, &ranges[inx], &first,
+					      &last))
 			continue;
+
+		released += diff_area_release_chunks(diff_area, first, last,
+						     is_killable);
+		if (is_killable && fatal_signal_pending(current))
+			break;
+	}
+
+	return released;
+}
+
+/**
+ * diff_area_release_read() - Releases the chunks that have been read from
+ *	the snapshot image in the read-once mode.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ * @sector:
+ *	The first sector of the completed read request.
+ * @count:
+ *	The number of sectors of the completed read request.
+ *
+ * The read progress of the chunk is advanced only by a read that starts
+ * within the part of the chunk that has already been read, so a re-read does
+ * not advance it, and the parts read out of order are not counted. The chunk
+ * is released when the progress reaches its end. A chunk with a gap in the
+ * progress is kept until the snapshot is destroyed.
+ */
+void diff_area_release_read(struct diff_area *diff_area, sector_t sector,
+			    sector_t count)
+{
+	sector_t capacity = bdev_nr_sectors(diff_area->orig_bdev);
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	sector_t end = min_t(sector_t, sector + count, capacity);
+	unsigned long number;
+
+	if (!diff_area->read_progress)
+		return;
+
+	for (number = chunk_number(diff_area, sector);
+	     (number < diff_area->chunk_count) &&
+	     ((sector_t)number * chunk_sectors < end);
+	     number++) {
+		sector_t first = (sector_t)number * chunk_sectors;
+		int size = min_t(sector_t, chunk_sectors, capacity - first);
+		int from = max_t(sector_t, sector, first) - first;
+		int to = min_t(sector_t, end, first + size) - first;
+		atomic_t *progress = &diff_area->read_progress[number];
+		int old = atomic_read(progress);
+
+		while ((from <= old) && (to > old)) {
+			int prev = atomic_cmpxchg(progress, old, to);
+
+			if (prev == old) {
+				if (to == size)
+					diff_area_release_chunks(diff_area,
+								 number,
+								 number + 1,
+								 false);
+				break;
+			}
+			old = prev;
 		}
 	}
+}
 
-	return ret;
+/**
+ * diff_area_enable_read_once() - Allocates the read progress of the chunks
+ *	for the read-once mode.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int diff_area_enable_read_once(struct diff_area *diff_area)
+{
+	diff_area->read_progress =
+		__vmalloc(diff_area->chunk_count * sizeof(atomic_t),
+			  GFP_KERNEL | __GFP_ZERO);
+	if (!diff_area->read_progress) {
+		pr_err("Failed to allocate the read progress of chunks\n");
+		return -ENOMEM;
+	}
+	memory_object_inc(memory_object_read_progress);
+	diff_area->read_once = true;
+
+	return 0;
+}
+
+/**
+ * diff_area_enable_hashes() - Allocates the array of the chunk hashes.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ *
+ * Since then, the hash of the original content of the chunk is computed
+ * each time the chunk is read from the original device.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int diff_area_enable_hashes(struct diff_area *diff_area)
+{
+	diff_area->chunk_hashes = __vmalloc(diff_area->chunk_count * sizeof(u64),
+					    GFP_KERNEL | __GFP_ZERO);
+	if (!diff_area->chunk_hashes) {
+		pr_err("Failed to allocate chunk hashes\n");
+		return -ENOMEM;
+	}
+	memory_object_inc(memory_object_chunk_hashes);
+
+	return 0;
 }
 
+#define DIFF_AREA_HASHES_PORTION 32
+
+/**
+ * diff_area_get_hashes() - Copies the chunk hashes to the user space.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ * @first:
+ *	The number of the first chunk.
+ * @user_hashes:
+ *	The user space array of hashes.
+ * @pcount:
+ *	The size of @user_hashes. Returns the number of hashes copied.
+ *
+ * The hashes are updated while they are being copied, so each of them is read
+ * once into a small buffer first.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int diff_area_get_hashes(struct diff_area *diff_area, u64 first,
+			 u64 __user *user_hashes, unsigned int *pcount)
+{
+	u64 buf[DIFF_AREA_HASHES_PORTION];
+	unsigned long count;
+	unsigned long copied = 0;
+
+	if (!diff_area->chunk_hashes)
+		return -EOPNOTSUPP;
+
+	if (first >= diff_area->chunk_count) {
+		*pcount = 0;
+		return 0;
+	}
+	count = min_t(unsigned long, *pcount, diff_area->chunk_count - first);
+
+	while (copied < count) {
+		unsigned long portion = min_t(unsigned long, count - copied,
+					      DIFF_AREA_HASHES_PORTION);
+		unsigned long inx;
+
+		for (inx = 0; inx < portion; inx++)
+			buf[inx] = READ_ONCE(
+				diff_area->chunk_hashes[first + copied + inx]);
+
+		if (copy_to_user(user_hashes + copied, buf,
+				 portion * sizeof(u64))) {
+			pr_err("Unable to get chunk hashes: invalid user buffer\n");
+			return -ENODATA;
+		}
+		copied += portion;
+
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	*pcount = copied;
+
+	return 0;
+}
+
+static_assert(DIFF_AREA_STATS_HIST_SIZE == BLK_SNAP_STATS_HIST_SIZE,
+	      "The size of the latency histograms does not match the UAPI.");
+
+void diff_area_stats_collect(struct diff_area *diff_area,
+			     struct blk_snap_device_stats *stats)
+{
+	int cpu;
+	unsigned int inx;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_area_stats *st = per_cpu_ptr(diff_area->stats, cpu);
+
+		stats->chunks_copied += st->chunks_copied;
+		stats->chunks_shared += st->chunks_shared;
+		stats->bytes_stored += st->bytes_stored;
+		stats->cow_eagain += st->cow_eagain;
+		stats->cow_wait_ns += st->cow_wait_ns;
+		stats->image_reads += st->image_reads;
+		stats->image_writes += st->image_writes;
+		stats->image_cache_hits += st->image_cache_hits;
+		stats->image_cache_misses += st->image_cache_misses;
+		for (inx = 0; inx < BLK_SNAP_STATS_HIST_SIZE; inx++) {
+			stats->cow_load_hist[inx] += st->cow_load_hist[inx];
+			stats->cow_store_hist[inx] += st->cow_store_hist[inx];
+			stats->image_read_hist[inx] += st->image_read_hist[inx];
+		}
+	}
+}
+#endif
+
 static inline void diff_area_image_put_chunk(struct chunk *chunk, bool is_write)
 {
 	if (is_write) {
@@ -484,6 +1061,13 @@ static inline void diff_area_image_put_chunk(struct chunk *chunk, bool is_write)
 		 * we mark it as dirty.
 		 */
 		chunk_state_set(chunk, CHUNK_ST_DIRTY);
+		if (!xa_get_mark(&chunk->diff_area->chunk_map, chunk->number,
+				 DIFF_AREA_CHUNK_DIRTY))
+			xa_set_mark(&chunk->diff_area->chunk_map, chunk->number,
+				    DIFF_AREA_CHUNK_DIRTY);
+#ifdef BLK_SNAP_MODIFICATION
+		diff_area_chunk_hash_clear(chunk->diff_area, chunk->number);
+#endif
 	}
 
 	chunk_schedule_caching(chunk);
@@ -495,6 +1079,22 @@ void diff_area_image_ctx_done(struct diff_area_image_ctx *io_ctx)
 		return;
 
 	diff_area_image_put_chunk(io_ctx->chunk, io_ctx->is_write);
+	io_ctx->chunk = NULL;
+}
+
+/*
+ * The chunks that have not been copied are read directly from the original
+ * device, and the chunks that have been stored and are not in memory are
+ * read directly from the difference storage. So there is no need to load
+ * them into memory for reading.
+ */
+static inline bool diff_area_image_chunk_remapped(struct diff_area *diff_area,
+						  unsigned long number)
+{
+	return image_read_remap &&
+	       !(diff_area_chunk_state(diff_area, number) &
+		 (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY |
+		  CHUNK_ST_LOADING | CHUNK_ST_STORING | CHUNK_ST_ZERO));
 }
 
 static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
@@ -509,12 +1109,137 @@ static int diff_area_load_chunk_from_storage(struct diff_area *diff_area,
 	WARN_ON(chunk->diff_buffer);
 	chunk->diff_buffer = diff_buffer;
 
+	if (chunk_state_check(chunk, CHUNK_ST_ZERO)) {
+		size_t inx;
+
+		for (inx = 0; inx < diff_buffer->page_count; inx++)
+			clear_highpage(diff_buffer->pages[inx]);
+		return 0;
+	}
+
 	if (chunk_state_check(chunk, CHUNK_ST_STORE_READY))
 		return chunk_load_diff(chunk);
 
 	return chunk_load_orig(chunk);
 }
 
+/*
+ * Starts asynchronous loading of all chunks in the range.
+ * The chunks that are already in use, already loaded or failed are skipped.
+ * Chunks that could not be loaded in advance will be loaded synchronously
+ * when they are accessed.
+ */
+void diff_area_image_prefetch(struct diff_area *diff_area, sector_t sector,
+			      sector_t count, const bool is_write)
+{
+	sector_t offset;
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+
+	for (offset = round_down(sector, chunk_sectors);
+	     offset < (sector + count); offset += chunk_sectors) {
+		struct chunk *chunk;
+		struct diff_buffer *diff_buffer;
+
+		if (diff_area_is_corrupted(diff_area))
+			break;
+
+		if (!is_write &&
+		    diff_area_image_chunk_remapped(
+			    diff_area, chunk_number(diff_area, offset)))
+			continue;
+
+		chunk = diff_area_get_chunk(diff_area,
+					    chunk_number(diff_area, offset),
+					    true);
+		if (IS_ERR(chunk))
+			break;
+
+		if (!chunk_trylock(chunk))
+			continue;
+
+		if (chunk_state_check(chunk, CHUNK_ST_FAILED |
+					     CHUNK_ST_BUFFER_READY |
+					     CHUNK_ST_ZERO)) {
+			chunk_unlock(chunk);
+			continue;
+		}
+
+		diff_buffer = diff_buffer_take(diff_area, true);
+		if (IS_ERR(diff_buffer)) {
+			chunk_unlock(chunk);
+			break;
+		}
+		WARN_ON(chunk->diff_buffer);
+		chunk->diff_buffer = diff_buffer;
+
+		if (chunk_async_load_image(chunk)) {
+			chunk_diff_buffer_release(chunk);
+			chunk_unlock(chunk);
+			break;
+		}
+	}
+}
+
+void diff_area_set_read_ahead(struct diff_area *diff_area,
+			      unsigned int chunk_count)
+{
+	/*
+	 * The chunks that have been read in advance are placed in the
+	 * probation queue of the cache, which takes at least a quarter of it.
+	 * If the window is larger, the chunks will be released before they
+	 * are read.
+	 */
+	chunk_count = min_t(unsigned long, chunk_count,
+			    (diff_area->chunk_cache->limit >> 2) >>
+				    diff_area->chunk_shift);
+
+	WRITE_ONCE(diff_area->read_ahead_window, chunk_count);
+}
+
+/*
+ * Detects sequential reading of the snapshot image and starts loading of the
+ * next chunks in advance.
+ *
+ * Since the requests are processed by several worker threads, they can come
+ * slightly out of order. Therefore, reading is considered sequential if the
+ * request starts within the read-ahead window of the expected position.
+ */
+void diff_area_image_read_ahead(struct diff_area *diff_area, sector_t sector,
+				sector_t count)
+{
+	unsigned int window = READ_ONCE(diff_area->read_ahead_window);
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	sector_t window_sectors = (sector_t)window * chunk_sectors;
+	sector_t capacity = (sector_t)diff_area->chunk_count * chunk_sectors;
+	sector_t end = sector + count;
+	sector_t ra_first = 0;
+	sector_t ra_last = 0;
+
+	if (!window)
+		return;
+
+	spin_lock(&diff_area->read_ahead_lock);
+	if ((sector + window_sectors >= diff_area->read_ahead_pos) &&
+	    (sector <= diff_area->read_ahead_pos + window_sectors)) {
+		ra_first = max(round_up(end, chunk_sectors),
+			       diff_area->read_ahead_next);
+		ra_last = min(round_up(end, chunk_sectors) + window_sectors,
+			      capacity);
+		if (ra_first < ra_last)
+			diff_area->read_ahead_next = ra_last;
+		diff_area->read_ahead_pos = max(diff_area->read_ahead_pos, end);
+	} else {
+		/* The stream is not sequential. Start a new one. */
+		diff_area->read_ahead_pos = end;
+		diff_area->read_ahead_next = 0;
+	}
+	spin_unlock(&diff_area->read_ahead_lock);
+
+	if (ra_first < ra_last)
+		diff_area_image_prefetch(diff_area, ra_first,
+					 ra_last - ra_first, false);
+}
+
 static struct chunk *
 diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 				  sector_t sector)
@@ -538,11 +1263,11 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 	}
 
 	/* Take a next chunk. */
-	chunk = xa_load(&diff_area->chunk_map, new_chunk_number);
-	if (unlikely(!chunk))
-		return ERR_PTR(-EINVAL);
+	chunk = diff_area_get_chunk(diff_area, new_chunk_number, false);
+	if (IS_ERR(chunk))
+		return chunk;
 
-	ret = down_killable(&chunk->lock);
+	ret = chunk_lock_killable(chunk);
 	if (ret)
 		return ERR_PTR(ret);
 
@@ -571,15 +1296,24 @@ diff_area_image_context_get_chunk(struct diff_area_image_ctx *io_ctx,
 
 		/* Set the flag that the buffer contains the required data. */
 		chunk_state_set(chunk, CHUNK_ST_BUFFER_READY);
-	} else
+		diff_area_stats_inc(diff_area, image_cache_misses);
+	} else {
 		diff_area_take_chunk_from_cache(diff_area, chunk);
+		diff_area_stats_inc(diff_area, image_cache_hits);
+	}
+	/*
+	 * After writing, the data of the unused chunk is no longer zeroes and
+	 * it will be stored as a dirty chunk.
+	 */
+	if (io_ctx->is_write)
+		chunk_state_unset(chunk, CHUNK_ST_ZERO);
 
 	io_ctx->chunk = chunk;
 	return chunk;
 
 fail_unlock_chunk:
 	pr_err("Failed to load chunk #%ld\n", chunk->number);
-	up(&chunk->lock);
+	chunk_unlock(chunk);
 	return ERR_PTR(ret);
 }
 
@@ -641,6 +1375,216 @@ blk_status_t diff_area_image_io(struct diff_area_image_ctx *io_ctx,
 	return BLK_STS_OK;
 }
 
+/*
+ * Tries to redirect the part of the read request that falls into one chunk
+ * to the original device or to the difference storage. Returns false if the
+ * data of the chunk should be copied from memory, or if an error occurred.
+ * In this case, the part is processed by diff_area_image_io().
+ */
+static bool diff_area_image_remap(struct diff_area *diff_area, struct bio *bio,
+				  struct bvec_iter *iter)
+{
+	struct chunk *chunk;
+	unsigned long number = chunk_number(diff_area, iter->bi_sector);
+
+	if (!diff_area_image_chunk_remapped(diff_area, number))
+		return false;
+
+	chunk = diff_area_get_chunk(diff_area, number, false);
+	if (IS_ERR(chunk))
+		return false;
+
+	if (chunk_lock_killable(chunk))
+		return false;
+	/*
+	 * The state of the chunk can only be changed under its lock. While the
+	 * chunk is locked, its copy-on-write waits, so the original device
+	 * keeps the data of the snapshot until the redirected read completes.
+	 */
+	if (!diff_area_image_chunk_remapped(diff_area, number) ||
+	    chunk_remap_image(chunk, bio, iter)) {
+		chunk_unlock(chunk);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Implements reading from the snapshot image. The request is processed
+ * chunk by chunk. The parts of the request that fall into the chunks that
+ * are not in memory are redirected to the original device or to the
+ * difference storage, the others are copied from the chunks data. The unused
+ * chunks are read as zeroes.
+ */
+blk_status_t diff_area_image_read(struct diff_area_image_ctx *io_ctx,
+				  struct bio *bio)
+{
+	struct diff_area *diff_area = io_ctx->diff_area;
+	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
+	struct bvec_iter iter = bio->bi_iter;
+
+	while (iter.bi_size) {
+		struct bvec_iter portion = iter;
+		struct bvec_iter bv_iter;
+		struct bio_vec bvec;
+		sector_t pos = iter.bi_sector;
+		sector_t sectors = round_down(pos, chunk_sectors) +
+				   chunk_sectors - pos;
+
+		if (((u64)sectors << SECTOR_SHIFT) < iter.bi_size)
+			portion.bi_size = (unsigned int)(sectors << SECTOR_SHIFT);
+
+		/* The chunk of the previous portion is no longer needed. */
+		diff_area_image_ctx_done(io_ctx);
+
+		if (diff_area_chunk_state(diff_area,
+					  chunk_number(diff_area, pos)) &
+		    CHUNK_ST_ZERO)
+			zero_fill_bio_iter(bio, portion);
+		else if (!diff_area_image_remap(diff_area, bio, &portion)) {
+			__bio_for_each_segment(bvec, bio, bv_iter, portion) {
+				blk_status_t st;
+
+				st = diff_area_image_io(io_ctx, &bvec, &pos);
+				if (unlikely(st != BLK_STS_OK))
+					return st;
+			}
+		}
+
+		bio_advance_iter(bio, &iter, portion.bi_size);
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Removes the dirty mark of the chunk which has already been stored. The
+ * chunk must be locked.
+ */
+static inline void diff_area_chunk_clean(struct diff_area *diff_area,
+					 struct chunk *chunk)
+{
+	if (!chunk_state_check(chunk, CHUNK_ST_DIRTY))
+		xa_clear_mark(&diff_area->chunk_map, chunk->number,
+			      DIFF_AREA_CHUNK_DIRTY);
+}
+
+/*
+ * Writes back the dirty chunks of the snapshot image with numbers from @first
+ * to @last and waits for the completion. The adjacent chunks are stored with
+ * a single request. Only the chunks with the dirty mark are visited.
+ */
+static int diff_area_image_writeback_chunks(struct diff_area *diff_area,
+					    unsigned long first,
+					    unsigned long last)
+{
+	int ret = 0;
+	unsigned long inx = first;
+	struct chunk *chunk;
+	struct chunk *batch[CHUNK_BATCH_MAX_COUNT];
+	unsigned int count = 0;
+
+	for (chunk = xa_find(&diff_area->chunk_map, &inx, last,
+			     DIFF_AREA_CHUNK_DIRTY);
+	     chunk;
+	     chunk = xa_find_after(&diff_area->chunk_map, &inx, last,
+				   DIFF_AREA_CHUNK_DIRTY)) {
+		if (!(diff_area_chunk_state(diff_area, inx) & CHUNK_ST_DIRTY)) {
+			/* The chunk has been stored since it was marked */
+			if (chunk_trylock(chunk)) {
+				diff_area_chunk_clean(diff_area, chunk);
+				chunk_unlock(chunk);
+			}
+			continue;
+		}
+
+		if (count && ((count == CHUNK_BATCH_MAX_COUNT) ||
+			      (batch[count - 1]->number + 1 != chunk->number))) {
+			chunk_schedule_writeback(batch, count);
+			count = 0;
+		}
+
+		ret = chunk_lock_killable(chunk);
+		if (unlikely(ret))
+			break;
+		if ((chunk_state_get(chunk) &
+		     (CHUNK_ST_FAILED | CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY |
+		      CHUNK_ST_STORING)) !=
+		    (CHUNK_ST_DIRTY | CHUNK_ST_BUFFER_READY)) {
+			diff_area_chunk_clean(diff_area, chunk);
+			chunk_unlock(chunk);
+			continue;
+		}
+		diff_area_take_chunk_from_cache(diff_area, chunk);
+		batch[count++] = chunk;
+	}
+	if (count)
+		chunk_schedule_writeback(batch, count);
+	if (unlikely(ret))
+		return ret;
+
+	/* The chunk is unlocked when its storing is completed */
+	inx = first;
+	for (chunk = xa_find(&diff_area->chunk_map, &inx, last,
+			     DIFF_AREA_CHUNK_DIRTY);
+	     chunk;
+	     chunk = xa_find_after(&diff_area->chunk_map, &inx, last,
+				   DIFF_AREA_CHUNK_DIRTY)) {
+		if ((diff_area_chunk_state(diff_area, inx) &
+		     (CHUNK_ST_DIRTY | CHUNK_ST_STORING)) !=
+		    (CHUNK_ST_DIRTY | CHUNK_ST_STORING))
+			continue;
+
+		ret = chunk_lock_killable(chunk);
+		if (unlikely(ret))
+			return ret;
+		diff_area_chunk_clean(diff_area, chunk);
+		chunk_unlock(chunk);
+	}
+
+	return diff_area_is_corrupted(diff_area) ? -EIO : 0;
+}
+
+/**
+ * diff_area_image_flush() - Writes back all dirty chunks of the snapshot
+ *	image.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ *
+ * The dirty chunks kept in the cache are the write cache of the snapshot
+ * image, so they are written back when the image is flushed.
+ */
+int diff_area_image_flush(struct diff_area *diff_area)
+{
+	return diff_area_image_writeback_chunks(diff_area, 0,
+						diff_area->chunk_count - 1);
+}
+
+/**
+ * diff_area_image_writeback() - Writes back the dirty chunks of the range of
+ *	the snapshot image.
+ * @diff_area:
+ *	Pointer to &struct diff_area.
+ * @sector:
+ *	The first sector of the range.
+ * @count:
+ *	The number of sectors in the range.
+ *
+ * It is used to complete the write to the snapshot image with the FUA flag.
+ */
+int diff_area_image_writeback(struct diff_area *diff_area, sector_t sector,
+			      sector_t count)
+{
+	if (!count)
+		return 0;
+
+	return diff_area_image_writeback_chunks(diff_area,
+					chunk_number(diff_area, sector),
+					chunk_number(diff_area,
+						     sector + count - 1));
+}
+
 static inline void diff_area_event_corrupted(struct diff_area *diff_area,
 					     int err_code)
 {
@@ -650,9 +1594,10 @@ static inline void diff_area_event_corrupted(struct diff_area *diff_area,
 		.err_code = abs(err_code),
 	};
 
-	event_gen(&diff_area->diff_storage->event_queue, GFP_NOIO,
+	event_gen(&diff_area->diff_storage->event_queue,
 		  blk_snap_event_code_corrupted, &data,
-		  sizeof(struct blk_snap_event_corrupted));
+		  sizeof(struct blk_snap_event_corrupted),
+		  sizeof(struct blk_snap_dev), NULL);
 }
 
 void diff_area_set_corrupted(struct diff_area *diff_area, int err_code)
@@ -667,16 +1612,24 @@ void diff_area_set_corrupted(struct diff_area *diff_area, int err_code)
 	       MINOR(diff_area->orig_bdev->bd_dev), abs(err_code));
 }
 
+/*
+ * The I/O to the snapshot image yields to the copy-on-write operations of the
+ * original device. It waits until the number of incomplete operations drops
+ * to the limit, but no longer than the timeout. If the original device is
+ * idle, the image I/O is not delayed. The I/O of the image itself is not
+ * counted, so it does not wait for itself.
+ */
 void diff_area_throttling_io(struct diff_area *diff_area)
 {
-	u64 start_waiting;
+	int limit = READ_ONCE(diff_area->throttling_limit);
 
-	start_waiting = jiffies_64;
-	while (atomic_read(&diff_area->pending_io_count)) {
-		schedule_timeout_interruptible(0);
-		if (jiffies_64 > (start_waiting + HZ / 10))
-			break;
-	}
+	if (atomic_read(&diff_area->cow_io_count) <= limit)
+		return;
+
+	wait_event_interruptible_timeout(
+		diff_area->cow_io_wq,
+		atomic_read(&diff_area->cow_io_count) <= limit,
+		msecs_to_jiffies(max(image_throttling_timeout, 0)));
 }
 
 #ifdef BLK_SNAP_DEBUG_SECTOR_STATE
@@ -687,14 +1640,21 @@ int diff_area_get_sector_state(struct diff_area *diff_area, sector_t sector,
 	sector_t chunk_sectors = diff_area_chunk_sectors(diff_area);
 	sector_t offset = round_down(sector, chunk_sectors);
 
-	chunk = xa_load(&diff_area->chunk_map, chunk_number(diff_area, offset));
-	if (!chunk)
+	if (chunk_number(diff_area, offset) >= diff_area->chunk_count)
 		return -EINVAL;
 
+	chunk = xa_load(&diff_area->chunk_map, chunk_number(diff_area, offset));
+	if (!chunk) {
+		/* The chunk has not been accessed yet. */
+		*chunk_state = diff_area_chunk_state(diff_area,
+					chunk_number(diff_area, offset));
+		return 0;
+	}
+
 	WARN_ON(chunk_number(diff_area, offset) != chunk->number);
-	down(&chunk->lock);
-	*chunk_state = atomic_read(&chunk->state);
-	up(&chunk->lock);
+	chunk_lock(chunk);
+	*chunk_state = chunk_state_get(chunk);
+	chunk_unlock(chunk);
 
 	return 0;
 }
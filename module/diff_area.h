@@ -9,18 +9,67 @@
 #include <linux/spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/xarray.h>
+#include <linux/wait.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include "event_queue.h"
 
 struct diff_storage;
+struct chunk_cache;
+struct diff_buffer_pool;
+struct diff_buffer_cache;
 struct chunk;
+struct blk_snap_device_stats;
+struct blk_snap_block_range;
+
+/*
+ * The number of buckets of the latency histograms. It is equal to
+ * BLK_SNAP_STATS_HIST_SIZE.
+ */
+#define DIFF_AREA_STATS_HIST_SIZE 32
+
+/**
+ * struct diff_area_stats - The I/O statistics of the difference area.
+ *
+ * The counters are per-CPU to avoid contention in the I/O path. Their
+ * meaning is described in &struct blk_snap_device_stats.
+ */
+struct diff_area_stats {
+	u64 chunks_copied;
+	u64 chunks_shared;
+	u64 bytes_stored;
+	u64 cow_eagain;
+	u64 cow_wait_ns;
+	u64 image_reads;
+	u64 image_writes;
+	u64 image_cache_hits;
+	u64 image_cache_misses;
+	u64 cow_load_hist[DIFF_AREA_STATS_HIST_SIZE];
+	u64 cow_store_hist[DIFF_AREA_STATS_HIST_SIZE];
+	u64 image_read_hist[DIFF_AREA_STATS_HIST_SIZE];
+};
+
+/*
+ * The mark of the chunk map for the chunks that may be dirty. It is set
+ * and cleared with the chunk locked, and it is cleared only when the chunk
+ * is no longer dirty.
+ */
+#define DIFF_AREA_CHUNK_DIRTY XA_MARK_0
 
 /**
  * struct diff_area - Discribes the difference area for one original device.
  * @kref:
  *	The reference counter. The &struct diff_area can be shared between
  *	the &struct tracker and &struct snapimage.
+ * @tracker_link:
+ *	The list header allows to add the difference area to the list of
+ *	snapshots of the tracker.
  * @orig_bdev:
  *	A pointer to the structure of an opened block device.
+ * @node:
+ *	The NUMA node on which the workers and the buffers of the difference
+ *	area are placed, or NUMA_NO_NODE.
  * @diff_storage:
  *	Pointer to difference storage for storing difference data.
  * @chunk_shift:
@@ -30,32 +79,30 @@ struct chunk;
  *	Count of chunks. The number of chunks into which the block device
  *	is divided.
  * @chunk_map:
- *	A map of chunks.
+ *	A map of chunks. The chunks are created on demand, so the map contains
+ *	only the chunks that have been accessed. The chunks written to the
+ *	snapshot image are marked with DIFF_AREA_CHUNK_DIRTY, so the flush
+ *	finds them without walking the whole map.
+ * @chunk_state_map:
+ *	A compact array of chunk states. Each chunk has CHUNK_STATE_BITS bits
+ *	that may contain CHUNK_ST_* flags and the lock bit of the chunk. It
+ *	allows to check the state of a chunk without looking it up in the
+ *	chunk map and without locking it.
  * @in_memory:
  *	A sign that difference storage is not prepared and all differences are
  *	stored in RAM.
- * @caches_lock:
- *	This spinlock guarantees consistency of the linked lists of chunk
- *	caches.
- * @read_cache_queue:
- *	Queue for the read cache.
- * @read_cache_count:
- *	The number of chunks in the read cache.
- * @write_cache_queue:
- *	Queue for the write cache.
- * @write_cache_count:
- *	The number of chunks in the write cache.
- * @cache_release_work:
- *	The workqueue work item. This worker limits the number of chunks
- *	that store their data in RAM.
- * @free_diff_buffers_lock:
- *	This spinlock guarantees consistency of the linked lists of
- *	free difference buffers.
+ * @chunk_cache:
+ *	The cache of chunks that keep their data in RAM. It is shared by all
+ *	difference areas of the snapshot.
  * @free_diff_buffers:
- *	Linked list of free difference buffers allows to reduce the number
- *	of buffer allocation and release operations.
+ *	The array of pools of free difference buffers, one for each NUMA node.
+ *	Allows to reduce the number of buffer allocation and release
+ *	operations.
+ * @diff_buffer_cache:
+ *	Per-CPU caches of free difference buffers. They are checked before
+ *	the pool of the NUMA node.
  * @free_diff_buffers_count:
- *	The number of free difference buffers in the linked list.
+ *	The number of free difference buffers in the pools and caches.
  * @corrupt_flag:
  *	The flag is set if an error occurred in the operation of the data
  *	saving mechanism in the diff area. In this case, an error will be
@@ -63,6 +110,47 @@ struct chunk;
  * @pending_io_count:
  *	Counter of incomplete I/O operations. Allows to wait for all I/O
  *	operations to be completed before releasing this structure.
+ * @pending_io_wq:
+ *	The wait queue for the release of this structure waiting for all I/O
+ *	operations to be completed.
+ * @cow_io_count:
+ *	The number of chunks that are being read from the original device for
+ *	the copy-on-write. Unlike @pending_io_count, the I/O of the snapshot
+ *	image does not change it.
+ * @cow_io_wq:
+ *	The wait queue for the I/O to the snapshot image waiting for
+ *	@cow_io_count to drop to @throttling_limit.
+ * @throttling_limit:
+ *	The number of incomplete copy-on-write operations that still allows
+ *	the I/O to the snapshot image to proceed.
+ * @nonblocking_cow:
+ *	Allows to release the write to the original device as soon as the
+ *	data of the chunk is read into memory.
+ * @read_once:
+ *	The chunks are released as soon as they are read from the snapshot
+ *	image, see diff_area_release_read().
+ * @read_progress:
+ *	The array of the numbers of sectors of the chunks that have been read
+ *	sequentially from their beginning in the read-once mode.
+ * @chunk_hashes:
+ *	The array of the hashes of the original contents of the chunks, or
+ *	NULL if the hashes are not computed. Zero means that the hash of the
+ *	chunk is unknown.
+ * @buffer_ready_wq:
+ *	The wait queue for writes waiting for the chunks data to be read
+ *	into memory in non-blocking copy-on-write mode.
+ * @read_ahead_lock:
+ *	This spinlock guarantees consistency of the read-ahead state.
+ * @read_ahead_window:
+ *	The number of chunks that are loaded in advance when sequential
+ *	reading of the snapshot image is detected. Zero disables read-ahead.
+ * @read_ahead_pos:
+ *	The expected position of the next read request of a sequential
+ *	stream.
+ * @read_ahead_next:
+ *	The first sector which has not yet been loaded in advance.
+ * @stats:
+ *	Per-CPU I/O statistics.
  *
  * The &struct diff_area is created for each block device in the snapshot.
  * It is used to save the differences between the original block device and
@@ -80,14 +168,11 @@ struct chunk;
  * Therefore, the number of chunks into which the block device is divided is
  * limited.
  *
- * To provide high performance, a read cache and a write cache for chunks are
- * used. The cache algorithm is the simplest. If the data of the chunk was
- * read to the difference buffer, then the buffer is not released immediately,
- * but is placed at the end of the queue. The worker thread checks the number
- * of chunks in the queue and releases a difference buffer for the first chunk
- * in the queue, but only if the binary semaphore of the chunk is not locked.
- * If the read thread accesses the chunk from the cache again, it returns
- * back to the end of the queue.
+ * To provide high performance, a cache for chunks is used. If the data of the
+ * chunk was read to the difference buffer, then the buffer is not released
+ * immediately, but the chunk is placed in the cache. The cache is limited by
+ * the size of the buffers, the worker thread releases the buffers of the
+ * chunks that are not locked. See &struct chunk_cache.
  *
  * The linked list of difference buffers allows to have a certain number of
  * "hot" buffers. This allows to reduce the number of allocations and releases
@@ -97,33 +182,53 @@ struct chunk;
  */
 struct diff_area {
 	struct kref kref;
+	struct list_head tracker_link;
 
 	struct block_device *orig_bdev;
+	int node;
 	struct diff_storage *diff_storage;
 
 	unsigned long long chunk_shift;
 	unsigned long chunk_count;
 	struct xarray chunk_map;
+	atomic_long_t *chunk_state_map;
 #ifdef BLK_SNAP_ALLOW_DIFF_STORAGE_IN_MEMORY
 	bool in_memory;
 #endif
-	spinlock_t caches_lock;
-	struct list_head read_cache_queue;
-	atomic_t read_cache_count;
-	struct list_head write_cache_queue;
-	atomic_t write_cache_count;
-	struct work_struct cache_release_work;
-
-	spinlock_t free_diff_buffers_lock;
-	struct list_head free_diff_buffers;
+	struct chunk_cache *chunk_cache;
+
+	struct diff_buffer_pool *free_diff_buffers;
+	struct diff_buffer_cache __percpu *diff_buffer_cache;
 	atomic_t free_diff_buffers_count;
 
 	unsigned long corrupt_flag;
 	atomic_t pending_io_count;
+	wait_queue_head_t pending_io_wq;
+	atomic_t cow_io_count;
+	wait_queue_head_t cow_io_wq;
+	int throttling_limit;
+
+	bool nonblocking_cow;
+	wait_queue_head_t buffer_ready_wq;
+#ifdef BLK_SNAP_MODIFICATION
+	bool read_once;
+	atomic_t *read_progress;
+	u64 *chunk_hashes;
+#endif
+
+	spinlock_t read_ahead_lock;
+	unsigned int read_ahead_window;
+	sector_t read_ahead_pos;
+	sector_t read_ahead_next;
+
+	struct diff_area_stats __percpu *stats;
 };
 
 struct diff_area *diff_area_new(dev_t dev_id,
-				struct diff_storage *diff_storage);
+				struct diff_storage *diff_storage,
+				struct chunk_cache *chunk_cache,
+				unsigned int chunk_shift,
+				unsigned int read_ahead);
 void diff_area_free(struct kref *kref);
 static inline void diff_area_get(struct diff_area *diff_area)
 {
@@ -135,19 +240,187 @@ static inline void diff_area_put(struct diff_area *diff_area)
 		kref_put(&diff_area->kref, diff_area_free);
 };
 void diff_area_set_corrupted(struct diff_area *diff_area, int err_code);
+static inline void diff_area_notify_buffer_ready(struct diff_area *diff_area)
+{
+	if (wq_has_sleeper(&diff_area->buffer_ready_wq))
+		wake_up_all(&diff_area->buffer_ready_wq);
+};
 static inline bool diff_area_is_corrupted(struct diff_area *diff_area)
 {
 	return !!diff_area->corrupt_flag;
 };
+/*
+ * Completes the I/O operations counted in pending_io_count. Only the release
+ * of the difference area waits for the counter, and only for it to drop to
+ * zero. The last operations decrement the counter under the lock of the wait
+ * queue, so the difference area cannot be released until the wake-up is
+ * done, see diff_area_wait_pending_io(). The others do not take the lock.
+ */
+static inline void diff_area_io_complete(struct diff_area *diff_area,
+					 int count)
+{
+	unsigned long flags;
+
+	if (atomic_add_unless(&diff_area->pending_io_count, -count, count))
+		return;
+
+	spin_lock_irqsave(&diff_area->pending_io_wq.lock, flags);
+	if (!atomic_sub_return(count, &diff_area->pending_io_count) &&
+	    waitqueue_active(&diff_area->pending_io_wq))
+		wake_up_all_locked(&diff_area->pending_io_wq);
+	spin_unlock_irqrestore(&diff_area->pending_io_wq.lock, flags);
+};
+
+/*
+ * The copy-on-write reads of the original device are counted both in
+ * cow_io_count and in pending_io_count. The former is decremented first,
+ * so the difference area cannot be released during the wake-up.
+ */
+static inline void diff_area_cow_io_start(struct diff_area *diff_area,
+					  int count)
+{
+	atomic_add(count, &diff_area->cow_io_count);
+}
+static inline void diff_area_cow_io_complete(struct diff_area *diff_area,
+					     int count)
+{
+	if ((atomic_sub_return(count, &diff_area->cow_io_count) <=
+	     READ_ONCE(diff_area->throttling_limit)) &&
+	    wq_has_sleeper(&diff_area->cow_io_wq))
+		wake_up_all(&diff_area->cow_io_wq);
+};
+
+#define diff_area_stats_add(diff_area, field, val)                             \
+	this_cpu_add((diff_area)->stats->field, (val))
+#define diff_area_stats_inc(diff_area, field)                                  \
+	this_cpu_inc((diff_area)->stats->field)
+
+/*
+ * Returns the index of the latency histogram bucket for the operation
+ * started at @start_time.
+ */
+static inline unsigned int diff_area_stats_bucket(u64 start_time)
+{
+	u64 us = div_u64(ktime_get_ns() - start_time, NSEC_PER_USEC);
+
+	return min_t(unsigned int, fls64(us), DIFF_AREA_STATS_HIST_SIZE - 1);
+};
+#define diff_area_stats_latency(diff_area, hist, start_time)                   \
+	do {                                                                   \
+		unsigned int __bucket = diff_area_stats_bucket(start_time);    \
+									       \
+		this_cpu_inc((diff_area)->stats->hist[__bucket]);              \
+	} while (0)
+#ifdef BLK_SNAP_MODIFICATION
+void diff_area_stats_collect(struct diff_area *diff_area,
+			     struct blk_snap_device_stats *stats);
+#endif
+
 static inline sector_t diff_area_chunk_sectors(struct diff_area *diff_area)
 {
 	return (sector_t)(1ull << (diff_area->chunk_shift - SECTOR_SHIFT));
 };
-int diff_area_copy(struct diff_area *diff_area, sector_t sector, sector_t count,
-		   const bool is_nowait);
+
+/*
+ * The number of bits to store the state of a single chunk in the
+ * chunk_state_map. The states of several chunks are packed into one word.
+ * The highest bit is the lock of the chunk, it is not a part of the state.
+ */
+#define CHUNK_STATE_BITS 8
+#define CHUNK_STATE_LOCK_BIT (CHUNK_STATE_BITS - 1)
+#define CHUNK_STATE_MASK ((1ul << CHUNK_STATE_LOCK_BIT) - 1)
+#define CHUNK_STATE_PER_WORD (BITS_PER_LONG / CHUNK_STATE_BITS)
+
+static inline atomic_long_t *
+diff_area_chunk_state_word(struct diff_area *diff_area, unsigned long number,
+			   unsigned int *shift)
+{
+	*shift = (number % CHUNK_STATE_PER_WORD) * CHUNK_STATE_BITS;
+	return &diff_area->chunk_state_map[number / CHUNK_STATE_PER_WORD];
+};
+static inline unsigned int diff_area_chunk_state(struct diff_area *diff_area,
+						 unsigned long number)
+{
+	unsigned int shift;
+	atomic_long_t *word =
+		diff_area_chunk_state_word(diff_area, number, &shift);
+
+	return (unsigned int)((atomic_long_read(word) >> shift) &
+			      CHUNK_STATE_MASK);
+};
+static inline void diff_area_chunk_state_set(struct diff_area *diff_area,
+					     unsigned long number, int st)
+{
+	unsigned int shift;
+	atomic_long_t *word =
+		diff_area_chunk_state_word(diff_area, number, &shift);
+
+	atomic_long_or((unsigned long)st << shift, word);
+};
+static inline void diff_area_chunk_state_unset(struct diff_area *diff_area,
+					       unsigned long number, int st)
+{
+	unsigned int shift;
+	atomic_long_t *word =
+		diff_area_chunk_state_word(diff_area, number, &shift);
+
+	atomic_long_andnot((unsigned long)st << shift, word);
+};
+/*
+ * Sets the state of the chunk only if the chunk is in the initial state.
+ * Returns false if the chunk has already been processed.
+ */
+static inline bool diff_area_chunk_state_try_init(struct diff_area *diff_area,
+						  unsigned long number, int st)
+{
+	unsigned int shift;
+	atomic_long_t *word =
+		diff_area_chunk_state_word(diff_area, number, &shift);
+	long old = atomic_long_read(word);
+
+	do {
+		if ((old >> shift) & CHUNK_STATE_MASK)
+			return false;
+	} while (!atomic_long_try_cmpxchg(word, &old,
+					  old | ((long)st << shift)));
+
+	return true;
+};
+int diff_area_copy(struct diff_area *diff_area, struct diff_area *source,
+		   sector_t sector, sector_t count, const bool is_nowait);
 
 int diff_area_wait(struct diff_area *diff_area, sector_t sector, sector_t count,
 		   const bool is_nowait);
+#ifdef BLK_SNAP_MODIFICATION
+unsigned long diff_area_set_unused(struct diff_area *diff_area,
+				   struct blk_snap_block_range *ranges,
+				   unsigned int count);
+unsigned long diff_area_release(struct diff_area *diff_area,
+				struct blk_snap_block_range *ranges,
+				unsigned int count, const bool is_killable);
+void diff_area_release_read(struct diff_area *diff_area, sector_t sector,
+			    sector_t count);
+int diff_area_enable_read_once(struct diff_area *diff_area);
+int diff_area_enable_hashes(struct diff_area *diff_area);
+int diff_area_get_hashes(struct diff_area *diff_area, u64 first,
+			 u64 __user *user_hashes, unsigned int *pcount);
+/*
+ * The computed zero hash is stored as one, since zero means that the hash
+ * of the chunk is unknown.
+ */
+static inline void diff_area_chunk_hash_set(struct diff_area *diff_area,
+					    unsigned long number, u64 hash)
+{
+	if (diff_area->chunk_hashes)
+		WRITE_ONCE(diff_area->chunk_hashes[number], hash ? hash : 1);
+};
+static inline void diff_area_chunk_hash_clear(struct diff_area *diff_area,
+					      unsigned long number)
+{
+	if (diff_area->chunk_hashes)
+		WRITE_ONCE(diff_area->chunk_hashes[number], 0);
+};
+#endif
 /**
  * struct diff_area_image_ctx - The context for processing an io request to
  *	the snapshot image.
@@ -174,8 +447,19 @@ static inline void diff_area_image_ctx_init(struct diff_area_image_ctx *io_ctx,
 	io_ctx->chunk = NULL;
 };
 void diff_area_image_ctx_done(struct diff_area_image_ctx *io_ctx);
+void diff_area_image_prefetch(struct diff_area *diff_area, sector_t sector,
+			      sector_t count, const bool is_write);
+void diff_area_set_read_ahead(struct diff_area *diff_area,
+			      unsigned int chunk_count);
+void diff_area_image_read_ahead(struct diff_area *diff_area, sector_t sector,
+				sector_t count);
 blk_status_t diff_area_image_io(struct diff_area_image_ctx *io_ctx,
 				const struct bio_vec *bvec, sector_t *pos);
+blk_status_t diff_area_image_read(struct diff_area_image_ctx *io_ctx,
+				  struct bio *bio);
+int diff_area_image_flush(struct diff_area *diff_area);
+int diff_area_image_writeback(struct diff_area *diff_area, sector_t sector,
+			      sector_t count);
 
 void diff_area_throttling_io(struct diff_area *diff_area);
 
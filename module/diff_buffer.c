@@ -1,6 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0
 #define pr_fmt(fmt) KBUILD_MODNAME "-diff-buffer: " fmt
 
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/topology.h>
+#include <linux/xxhash.h>
 #include "memory_checker.h"
 #include "diff_buffer.h"
 #include "diff_area.h"
@@ -29,11 +33,13 @@ static void diff_buffer_free(struct diff_buffer *diff_buffer)
 }
 
 static struct diff_buffer *
-diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
+diff_buffer_new(size_t page_count, size_t buffer_size, int node,
+		gfp_t gfp_mask)
 {
 	struct diff_buffer *diff_buffer;
 	size_t inx = 0;
 	struct page *page;
+	unsigned int order;
 
 	if (unlikely(page_count <= 0))
 		return NULL;
@@ -42,24 +48,53 @@ diff_buffer_new(size_t page_count, size_t buffer_size, gfp_t gfp_mask)
 	 * In case of overflow, it is better to get a null pointer
 	 * than a pointer to some memory area. Therefore + 1.
 	 */
-	diff_buffer = kzalloc(sizeof(struct diff_buffer) +
-				      (page_count + 1) * sizeof(struct page *),
-			      gfp_mask);
+	diff_buffer = kzalloc_node(sizeof(struct diff_buffer) +
+					   (page_count + 1) *
+						   sizeof(struct page *),
+				   gfp_mask, node);
 	if (!diff_buffer)
 		return NULL;
 	memory_object_inc(memory_object_diff_buffer);
 
 	INIT_LIST_HEAD(&diff_buffer->link);
+	diff_buffer->node = node;
 	diff_buffer->size = buffer_size;
 	diff_buffer->page_count = page_count;
 
-	for (inx = 0; inx < page_count; inx++) {
-		page = alloc_page(gfp_mask);
-		if (!page)
-			goto fail;
-		memory_object_inc(memory_object_page);
+	order = min_t(unsigned int, get_order(buffer_size),
+		      DIFF_BUFFER_MAX_ORDER);
+	while (inx < page_count) {
+		size_t block_inx;
 
-		diff_buffer->pages[inx] = page;
+		order = min_t(unsigned int, order, ilog2(page_count - inx));
+		page = NULL;
+		if (order) {
+			/*
+			 * A high-order allocation should not cause a long
+			 * reclaim. If it fails, order-0 pages are used.
+			 */
+			page = alloc_pages_node(node,
+					gfp_mask | __GFP_NORETRY | __GFP_NOWARN,
+					order);
+			if (page)
+				split_page(page, order);
+			else
+				order = 0;
+		}
+		if (!page) {
+			page = alloc_pages_node(node, gfp_mask, 0);
+			if (!page)
+				goto fail;
+		}
+
+		/*
+		 * After splitting, each page of the block is released
+		 * separately, as if it was allocated by itself.
+		 */
+		for (block_inx = 0; block_inx < (1ul << order); block_inx++) {
+			memory_object_inc(memory_object_page);
+			diff_buffer->pages[inx++] = nth_page(page, block_inx);
+		}
 	}
 	return diff_buffer;
 fail:
@@ -67,6 +102,49 @@ fail:
 	return NULL;
 }
 
+static struct diff_buffer *diff_buffer_cache_pop(struct diff_area *diff_area)
+{
+	struct diff_buffer_cache *cache;
+	struct diff_buffer *diff_buffer = NULL;
+
+	cache = get_cpu_ptr(diff_area->diff_buffer_cache);
+	if (cache->count)
+		diff_buffer = cache->buffers[--cache->count];
+	put_cpu_ptr(diff_area->diff_buffer_cache);
+
+	return diff_buffer;
+}
+
+static bool diff_buffer_cache_push(struct diff_area *diff_area,
+				   struct diff_buffer *diff_buffer)
+{
+	struct diff_buffer_cache *cache;
+	bool is_pushed = false;
+
+	cache = get_cpu_ptr(diff_area->diff_buffer_cache);
+	if (cache->count < DIFF_BUFFER_CACHE_SIZE) {
+		cache->buffers[cache->count++] = diff_buffer;
+		is_pushed = true;
+	}
+	put_cpu_ptr(diff_area->diff_buffer_cache);
+
+	return is_pushed;
+}
+
+static struct diff_buffer *diff_buffer_pool_get(struct diff_buffer_pool *pool)
+{
+	struct diff_buffer *diff_buffer;
+
+	spin_lock(&pool->lock);
+	diff_buffer = list_first_entry_or_null(&pool->list, struct diff_buffer,
+					       link);
+	if (diff_buffer)
+		list_del(&diff_buffer->link);
+	spin_unlock(&pool->lock);
+
+	return diff_buffer;
+}
+
 struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 				     const bool is_nowait)
 {
@@ -74,27 +152,43 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 	sector_t chunk_sectors;
 	size_t page_count;
 	size_t buffer_size;
+	int node = (diff_area->node != NUMA_NO_NODE) ? diff_area->node :
+						       numa_node_id();
 
-	spin_lock(&diff_area->free_diff_buffers_lock);
-	diff_buffer = list_first_entry_or_null(&diff_area->free_diff_buffers,
-					       struct diff_buffer, link);
-	if (diff_buffer) {
-		list_del(&diff_buffer->link);
-		atomic_dec(&diff_area->free_diff_buffers_count);
+	diff_buffer = diff_buffer_cache_pop(diff_area);
+	if (!diff_buffer)
+		diff_buffer =
+			diff_buffer_pool_get(&diff_area->free_diff_buffers[node]);
+	if (!diff_buffer && atomic_read(&diff_area->free_diff_buffers_count)) {
+		int inx;
+
+		/* Reusing a remote buffer is cheaper than allocating a new one */
+		for_each_online_node(inx) {
+			if (inx == node)
+				continue;
+			diff_buffer = diff_buffer_pool_get(
+				&diff_area->free_diff_buffers[inx]);
+			if (diff_buffer)
+				break;
+		}
 	}
-	spin_unlock(&diff_area->free_diff_buffers_lock);
 
-	/* Return free buffer if it was found in a pool */
-	if (diff_buffer)
+	/* Return free buffer if it was found in a cache or in a pool */
+	if (diff_buffer) {
+		atomic_dec(&diff_area->free_diff_buffers_count);
 		return diff_buffer;
+	}
 
-	/* Allocate new buffer */
+	/*
+	 * Allocate new buffer on the node of the original device, or on the
+	 * node of the current CPU.
+	 */
 	chunk_sectors = diff_area_chunk_sectors(diff_area);
 	page_count = round_up(chunk_sectors, PAGE_SECTORS) / PAGE_SECTORS;
 	buffer_size = chunk_sectors << SECTOR_SHIFT;
 
 	diff_buffer =
-		diff_buffer_new(page_count, buffer_size,
+		diff_buffer_new(page_count, buffer_size, node,
 				is_nowait ? (GFP_NOIO | GFP_NOWAIT) : GFP_NOIO);
 	if (unlikely(!diff_buffer)) {
 		if (is_nowait)
@@ -109,33 +203,128 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 void diff_buffer_release(struct diff_area *diff_area,
 			 struct diff_buffer *diff_buffer)
 {
+	struct diff_buffer_pool *pool;
+
 	if (atomic_read(&diff_area->free_diff_buffers_count) >
 	    free_diff_buffer_pool_size) {
 		diff_buffer_free(diff_buffer);
 		return;
 	}
-	spin_lock(&diff_area->free_diff_buffers_lock);
-	list_add_tail(&diff_buffer->link, &diff_area->free_diff_buffers);
 	atomic_inc(&diff_area->free_diff_buffers_count);
-	spin_unlock(&diff_area->free_diff_buffers_lock);
+
+	/*
+	 * The buffer is cached on the current CPU only if its pages are
+	 * located on the local node. Otherwise, it is returned to the pool
+	 * of its own node.
+	 */
+	if ((diff_buffer->node == numa_node_id()) &&
+	    diff_buffer_cache_push(diff_area, diff_buffer))
+		return;
+
+	pool = &diff_area->free_diff_buffers[diff_buffer->node];
+	spin_lock(&pool->lock);
+	list_add_tail(&diff_buffer->link, &pool->list);
+	spin_unlock(&pool->lock);
+}
+
+/*
+ * Checks that the first @size bytes of the buffer are zeroes. The
+ * memchr_inv() compares the data by words and stops at the first non-zero
+ * byte, so the check of a chunk with data is usually short.
+ */
+bool diff_buffer_is_zero(struct diff_buffer *diff_buffer, size_t size)
+{
+	size_t inx;
+
+	for (inx = 0; (inx < diff_buffer->page_count) && size; inx++) {
+		size_t bytes = min_t(size_t, size, PAGE_SIZE);
+
+		if (memchr_inv(page_address(diff_buffer->pages[inx]), 0, bytes))
+			return false;
+		size -= bytes;
+	}
+
+	return true;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * Returns the xxh64 hash with zero seed of the first @size bytes of the
+ * buffer.
+ */
+u64 diff_buffer_hash(struct diff_buffer *diff_buffer, size_t size)
+{
+	struct xxh64_state state;
+	size_t inx;
+
+	xxh64_reset(&state, 0);
+	for (inx = 0; (inx < diff_buffer->page_count) && size; inx++) {
+		size_t bytes = min_t(size_t, size, PAGE_SIZE);
+
+		xxh64_update(&state, page_address(diff_buffer->pages[inx]),
+			     bytes);
+		size -= bytes;
+	}
+
+	return xxh64_digest(&state);
+}
+#endif
+
+int diff_buffer_pools_init(struct diff_area *diff_area)
+{
+	int node;
+
+	diff_area->free_diff_buffers = kcalloc(
+		nr_node_ids, sizeof(struct diff_buffer_pool), GFP_KERNEL);
+	if (!diff_area->free_diff_buffers)
+		return -ENOMEM;
+	memory_object_inc(memory_object_diff_buffer_pool);
+
+	for (node = 0; node < nr_node_ids; node++) {
+		spin_lock_init(&diff_area->free_diff_buffers[node].lock);
+		INIT_LIST_HEAD(&diff_area->free_diff_buffers[node].list);
+	}
+
+	diff_area->diff_buffer_cache = alloc_percpu(struct diff_buffer_cache);
+	if (!diff_area->diff_buffer_cache)
+		return -ENOMEM;
+	memory_object_inc(memory_object_diff_buffer_cache);
+
+	return 0;
 }
 
 void diff_buffer_cleanup(struct diff_area *diff_area)
 {
-	struct diff_buffer *diff_buffer = NULL;
+	struct diff_buffer *diff_buffer;
+	int cpu;
+	int node;
 
-	do {
-		spin_lock(&diff_area->free_diff_buffers_lock);
-		diff_buffer =
-			list_first_entry_or_null(&diff_area->free_diff_buffers,
-						 struct diff_buffer, link);
-		if (diff_buffer) {
-			list_del(&diff_buffer->link);
-			atomic_dec(&diff_area->free_diff_buffers_count);
+	if (diff_area->diff_buffer_cache) {
+		for_each_possible_cpu(cpu) {
+			struct diff_buffer_cache *cache =
+				per_cpu_ptr(diff_area->diff_buffer_cache, cpu);
+
+			while (cache->count)
+				diff_buffer_free(cache->buffers[--cache->count]);
 		}
-		spin_unlock(&diff_area->free_diff_buffers_lock);
+		free_percpu(diff_area->diff_buffer_cache);
+		diff_area->diff_buffer_cache = NULL;
+		memory_object_dec(memory_object_diff_buffer_cache);
+	}
+
+	if (diff_area->free_diff_buffers) {
+		for (node = 0; node < nr_node_ids; node++) {
+			struct diff_buffer_pool *pool =
+				&diff_area->free_diff_buffers[node];
 
-		if (diff_buffer)
-			diff_buffer_free(diff_buffer);
-	} while (diff_buffer);
+			while ((diff_buffer = diff_buffer_pool_get(pool))) {
+				diff_buffer_free(diff_buffer);
+				cond_resched();
+			}
+		}
+		kfree(diff_area->free_diff_buffers);
+		diff_area->free_diff_buffers = NULL;
+		memory_object_dec(memory_object_diff_buffer_pool);
+	}
+	atomic_set(&diff_area->free_diff_buffers_count, 0);
 }
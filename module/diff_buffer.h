@@ -13,6 +13,8 @@ struct diff_area;
  * struct diff_buffer - Difference buffer.
  * @link:
  *	The list header allows to create a pool of the diff_buffer structures.
+ * @node:
+ *	The NUMA node on which the buffer pages were allocated.
  * @size:
  *	Count of bytes in the buffer.
  * @page_count:
@@ -21,14 +23,45 @@ struct diff_area;
  *	An array of pointers to pages.
  *
  * Describes the memory buffer for a chunk in the memory.
+ * Whenever possible, the pages are allocated in physically contiguous
+ * blocks. This allows to describe the buffer with fewer bio segments.
  */
 struct diff_buffer {
 	struct list_head link;
+	int node;
 	size_t size;
 	size_t page_count;
 	struct page *pages[0];
 };
 
+/**
+ * struct diff_buffer_pool - The pool of free difference buffers of a NUMA node.
+ * @lock:
+ *	This spinlock guarantees consistency of the linked list.
+ * @list:
+ *	Linked list of free difference buffers allocated on this node.
+ */
+struct diff_buffer_pool {
+	spinlock_t lock;
+	struct list_head list;
+} ____cacheline_aligned_in_smp;
+
+#define DIFF_BUFFER_CACHE_SIZE 8
+
+/**
+ * struct diff_buffer_cache - Per-CPU cache of free difference buffers.
+ * @count:
+ *	The number of buffers in the cache.
+ * @buffers:
+ *	The buffers ready for use.
+ *
+ * Allows to take and release buffers without taking the lock of the pool.
+ */
+struct diff_buffer_cache {
+	unsigned int count;
+	struct diff_buffer *buffers[DIFF_BUFFER_CACHE_SIZE];
+};
+
 /**
  * struct diff_buffer_iter - Iterator for &struct diff_buffer.
  * @page:
@@ -50,6 +83,38 @@ struct diff_buffer_iter {
 #define PAGE_SECTORS (1 << (PAGE_SHIFT - SECTOR_SHIFT))
 #endif
 
+/*
+ * The maximum order of the page blocks from which the buffer is allocated.
+ * A 64 KiB block for 4 KiB pages.
+ */
+#define DIFF_BUFFER_MAX_ORDER 4
+
+/**
+ * diff_buffer_segment_pages() - Counts physically contiguous pages.
+ * @diff_buffer:
+ *	The buffer.
+ * @page_inx:
+ *	Index of the first page of the segment.
+ * @max_pages:
+ *	The maximum number of pages in the segment.
+ *
+ * Return: the number of contiguous pages starting from &page_inx.
+ */
+static inline size_t diff_buffer_segment_pages(struct diff_buffer *diff_buffer,
+					       size_t page_inx,
+					       size_t max_pages)
+{
+	size_t count = 1;
+
+	while ((count < max_pages) &&
+	       ((page_inx + count) < diff_buffer->page_count) &&
+	       (page_to_pfn(diff_buffer->pages[page_inx + count]) ==
+		(page_to_pfn(diff_buffer->pages[page_inx]) + count)))
+		count++;
+
+	return count;
+}
+
 static inline bool diff_buffer_iter_get(struct diff_buffer *diff_buffer,
 					size_t buff_offset,
 					struct diff_buffer_iter *iter)
@@ -75,5 +140,10 @@ struct diff_buffer *diff_buffer_take(struct diff_area *diff_area,
 				     const bool is_nowait);
 void diff_buffer_release(struct diff_area *diff_area,
 			 struct diff_buffer *diff_buffer);
+bool diff_buffer_is_zero(struct diff_buffer *diff_buffer, size_t size);
+#ifdef BLK_SNAP_MODIFICATION
+u64 diff_buffer_hash(struct diff_buffer *diff_buffer, size_t size);
+#endif
+int diff_buffer_pools_init(struct diff_area *diff_area);
 void diff_buffer_cleanup(struct diff_area *diff_area);
 #endif /* __BLK_SNAP_DIFF_BUFFER_H */
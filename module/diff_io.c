@@ -6,10 +6,13 @@
 #endif
 #include <linux/blkdev.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
 #include "memory_checker.h"
 #include "diff_io.h"
 #include "diff_buffer.h"
 #include "log.h"
+#include "trace.h"
 
 #ifdef STANDALONE_BDEVFILTER
 #ifndef PAGE_SECTORS
@@ -17,17 +20,116 @@
 #endif
 #endif
 
+extern int numa_affinity;
+
 struct bio_set diff_io_bioset;
 
+/*
+ * The completions of reading and writing chunks are processed by separate
+ * workqueues, so the copy-on-write pipeline does not compete with the
+ * unrelated kernel work. Their max_active and cpumask can be changed in
+ * /sys/devices/virtual/workqueue/.
+ */
+struct workqueue_struct *diff_io_load_wq;
+struct workqueue_struct *diff_io_store_wq;
+
+#define DIFF_IO_WQ_FLAGS (WQ_UNBOUND | WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_SYSFS)
+
+/*
+ * The minimum number of preallocated &struct diff_io. The reserve is used
+ * when the slab allocation fails under memory pressure. It does not
+ * guarantee forward progress of the copy-on-write: its bios are deferred on
+ * the bio list of the current thread until all chunks of the write are
+ * processed, so one write can hold several elements of the pool that are
+ * not released until it returns.
+ */
+#define DIFF_IO_POOL_MIN_NR 64
+
+static struct kmem_cache *diff_io_cache;
+static mempool_t diff_io_pool;
+
+/**
+ * struct diff_io_remap - The context of the redirected part of a request.
+ * @notify_cb:
+ *	A pointer to the callback function that will be executed when
+ *	the I/O execution is completed. It can be called in interrupt context.
+ * @ctx:
+ *	The context for the callback function &notify_cb.
+ * @parent:
+ *	The request whose part is redirected. It is completed after all its
+ *	redirected parts are completed.
+ * @bio:
+ *	The clone of the parent request. Must be the last field.
+ */
+struct diff_io_remap {
+	void (*notify_cb)(void *ctx);
+	void *ctx;
+	struct bio *parent;
+	struct bio bio;
+};
+
+static struct bio_set diff_io_remap_bioset;
+
 int diff_io_init(void)
 {
-	return bioset_init(&diff_io_bioset, 64, 0,
-			   BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+	int ret;
+
+	diff_io_cache = KMEM_CACHE(diff_io, 0);
+	if (!diff_io_cache)
+		return -ENOMEM;
+
+	ret = mempool_init_slab_pool(&diff_io_pool,
+				     max_t(int, DIFF_IO_POOL_MIN_NR,
+					   2 * num_possible_cpus()),
+				     diff_io_cache);
+	if (ret)
+		goto fail_pool;
+
+	ret = bioset_init(&diff_io_bioset, 64, 0,
+			  BIOSET_NEED_BVECS | BIOSET_NEED_RESCUER);
+	if (ret)
+		goto fail_bioset;
+
+	ret = bioset_init(&diff_io_remap_bioset, 64,
+			  offsetof(struct diff_io_remap, bio), 0);
+	if (ret)
+		goto fail_remap_bioset;
+
+	diff_io_load_wq = alloc_workqueue("blksnap-load", DIFF_IO_WQ_FLAGS, 0);
+	if (!diff_io_load_wq) {
+		ret = -ENOMEM;
+		goto fail_load_wq;
+	}
+
+	diff_io_store_wq = alloc_workqueue("blksnap-store", DIFF_IO_WQ_FLAGS, 0);
+	if (!diff_io_store_wq) {
+		ret = -ENOMEM;
+		goto fail_store_wq;
+	}
+
+	return 0;
+
+fail_store_wq:
+	destroy_workqueue(diff_io_load_wq);
+fail_load_wq:
+	bioset_exit(&diff_io_remap_bioset);
+fail_remap_bioset:
+	bioset_exit(&diff_io_bioset);
+fail_bioset:
+	mempool_exit(&diff_io_pool);
+fail_pool:
+	kmem_cache_destroy(diff_io_cache);
+	return ret;
 }
 
 void diff_io_done(void)
 {
+	destroy_workqueue(diff_io_store_wq);
+	destroy_workqueue(diff_io_load_wq);
+	bioset_exit(&diff_io_remap_bioset);
 	bioset_exit(&diff_io_bioset);
+	mempool_exit(&diff_io_pool);
+	kmem_cache_destroy(diff_io_cache);
 }
 
 static void diff_io_notify_cb(struct work_struct *work)
@@ -51,10 +153,18 @@ static void diff_io_endio(struct bio *bio)
 		diff_io->error = -EIO;
 
 	if (atomic_dec_and_test(&diff_io->bio_count)) {
+		trace_blksnap_diff_io_complete(diff_io);
 		if (diff_io->is_sync_io)
 			complete(&diff_io->notify.sync.completion);
+		else if (diff_io->node != NUMA_NO_NODE)
+			queue_work_node(diff_io->node,
+					diff_io->is_write ? diff_io_store_wq :
+							    diff_io_load_wq,
+					&diff_io->notify.async.work);
 		else
-			queue_work(system_wq, &diff_io->notify.async.work);
+			queue_work(diff_io->is_write ? diff_io_store_wq :
+						       diff_io_load_wq,
+				   &diff_io->notify.async.work);
 	}
 
 	bio_put(bio);
@@ -63,20 +173,37 @@ static void diff_io_endio(struct bio *bio)
 static inline struct diff_io *diff_io_new(bool is_write, bool is_nowait)
 {
 	struct diff_io *diff_io;
-	gfp_t gfp_mask = is_nowait ? (GFP_NOIO | GFP_NOWAIT) : GFP_NOIO;
+	/*
+	 * Without the direct reclaim, the allocation from the pool does not
+	 * wait for the release of the elements.
+	 */
+	gfp_t gfp_mask = is_nowait ? GFP_NOWAIT : GFP_NOIO;
 
-	diff_io = kzalloc(sizeof(struct diff_io), gfp_mask);
+	diff_io = mempool_alloc(&diff_io_pool, gfp_mask);
 	if (unlikely(!diff_io))
 		return NULL;
 	memory_object_inc(memory_object_diff_io);
+	memset(diff_io, 0, sizeof(struct diff_io));
 
 	diff_io->error = 0;
 	diff_io->is_write = is_write;
+	diff_io->op_flags = REQ_SYNC | (is_write ? REQ_FUA : 0);
 	atomic_set(&diff_io->bio_count, 0);
+	diff_io->start_time = ktime_get_ns();
+	diff_io->node = NUMA_NO_NODE;
 
 	return diff_io;
 }
 
+void diff_io_free(struct diff_io *diff_io)
+{
+	if (!diff_io)
+		return;
+
+	mempool_free(diff_io, &diff_io_pool);
+	memory_object_dec(memory_object_diff_io);
+}
+
 struct diff_io *diff_io_new_sync(bool is_write)
 {
 	struct diff_io *diff_io;
@@ -106,16 +233,100 @@ struct diff_io *diff_io_new_async(bool is_write, bool is_nowait,
 	return diff_io;
 }
 
+static void diff_io_remap_endio(struct bio *bio)
+{
+	struct diff_io_remap *remap =
+		container_of(bio, struct diff_io_remap, bio);
+	struct bio *parent = remap->parent;
+
+	if (bio->bi_status != BLK_STS_OK)
+		parent->bi_status = bio->bi_status;
+
+	remap->notify_cb(remap->ctx);
+	bio_put(bio);
+	bio_endio(parent);
+}
+
+/*
+ * diff_io_remap() - Redirect a part of the request to another block device.
+ *
+ * The part of the @parent request described by @iter is sent to the @bdev
+ * device starting from @sector. The pages of the parent are used, so the data
+ * is not copied. The parent is completed only after all redirected parts are
+ * completed, as if they were chained to it.
+ */
+int diff_io_remap(struct bio *parent, struct bvec_iter *iter,
+		  struct block_device *bdev, sector_t sector,
+		  void (*notify_cb)(void *ctx), void *ctx)
+{
+	struct bio *bio;
+	struct diff_io_remap *remap;
+
+#ifdef HAVE_BIO_ALLOC_CLONE
+	bio = bio_alloc_clone(bdev, parent, GFP_NOIO, &diff_io_remap_bioset);
+#else
+	bio = bio_clone_fast(parent, GFP_NOIO, &diff_io_remap_bioset);
+#endif
+	if (unlikely(!bio))
+		return -ENOMEM;
+#ifndef HAVE_BIO_ALLOC_CLONE
+	bio_set_dev(bio, bdev);
+#endif
+#ifndef STANDALONE_BDEVFILTER
+	bio_set_flag(bio, BIO_FILTERED);
+#endif
+	bio->bi_iter = *iter;
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_end_io = diff_io_remap_endio;
+
+	remap = container_of(bio, struct diff_io_remap, bio);
+	remap->notify_cb = notify_cb;
+	remap->ctx = ctx;
+	remap->parent = parent;
+
+	bio_inc_remaining(parent);
+	submit_bio_noacct(bio);
+	return 0;
+}
+
 static inline bool check_page_aligned(sector_t sector)
 {
 	return !(sector & ((1ull << (PAGE_SHIFT - SECTOR_SHIFT)) - 1));
 }
 
-static inline unsigned short calc_page_count(sector_t sectors)
+static inline size_t calc_page_count(sector_t sectors)
 {
 	return round_up(sectors, PAGE_SECTORS) / PAGE_SECTORS;
 }
 
+/*
+ * Calculates the number of bio segments for the physically contiguous
+ * fragments of the buffers.
+ */
+static unsigned short calc_segment_count(struct diff_buffer **buffer_ptr,
+					 size_t page_inx, sector_t sectors)
+{
+	size_t page_count = calc_page_count(sectors);
+	unsigned short count = 0;
+
+	while (page_count && (count < USHRT_MAX)) {
+		size_t pages;
+
+		if (page_inx == (*buffer_ptr)->page_count) {
+			buffer_ptr++;
+			page_inx = 0;
+		}
+
+		pages = diff_buffer_segment_pages(*buffer_ptr, page_inx,
+						  page_count);
+		page_inx += pages;
+		page_count -= pages;
+		count++;
+	}
+
+	return count;
+}
+
 #ifdef HAVE_BIO_MAX_PAGES
 static inline unsigned int bio_max_segs(unsigned int nr_segs)
 {
@@ -124,49 +335,73 @@ static inline unsigned int bio_max_segs(unsigned int nr_segs)
 #endif
 
 /*
- * diff_io_do() - Perform an I/O operation.
+ * diff_io_do_multi() - Perform an I/O operation for several buffers.
+ *
+ * The region is divided between the buffers in order. Each buffer, except
+ * the last one, is used completely. This allows to read or write the data of
+ * adjacent chunks with a single request.
  *
  * Returns zero if successful. Failure is possible if the is_nowait flag is set
  * and a failure was occured when allocating memory. In this case, the error
  * code -EAGAIN is returned. The error code -EINVAL means that the input
  * arguments are incorrect.
  */
-int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
-	       struct diff_buffer *diff_buffer, const bool is_nowait)
+int diff_io_do_multi(struct diff_io *diff_io, struct diff_region *diff_region,
+		     struct diff_buffer **diff_buffers,
+		     unsigned int buffer_count, const bool is_nowait)
 {
 	struct bio *bio;
 	struct bio_list bio_list_head = BIO_EMPTY_LIST;
-	struct page **current_page_ptr;
+	struct diff_buffer **current_buffer_ptr = diff_buffers;
+	size_t current_page_inx = 0;
+	size_t page_count = 0;
+	unsigned int inx;
 	sector_t processed = 0;
 	gfp_t gfp = GFP_NOIO | (is_nowait ? GFP_NOWAIT : 0);
 	unsigned int opf = diff_io->is_write ? REQ_OP_WRITE : REQ_OP_READ;
-	unsigned op_flags = REQ_SYNC | (diff_io->is_write ? REQ_FUA : 0);
+	unsigned op_flags;
 
 	if (unlikely(!check_page_aligned(diff_region->sector))) {
 		pr_err("Difference storage block should be aligned to PAGE_SIZE\n");
 		return -EINVAL;
 	}
 
-	if (unlikely(calc_page_count(diff_region->count) >
-		     diff_buffer->page_count)) {
+	for (inx = 0; inx < buffer_count; inx++)
+		page_count += diff_buffers[inx]->page_count;
+	if (unlikely(calc_page_count(diff_region->count) > page_count)) {
 		pr_err("The difference storage block is larger than the buffer size\n");
 		return -EINVAL;
 	}
 
+	/*
+	 * The completion processes the data of the buffers, so it runs on
+	 * their node, which is the node of the original device, or on the
+	 * node of the device being accessed.
+	 */
+	if (numa_affinity == 2)
+		diff_io->node = diff_region->bdev->bd_disk->node_id;
+	else if (numa_affinity)
+		diff_io->node = diff_buffers[0]->node;
+
 	/* Append bio with datas to bio_list */
-	current_page_ptr = diff_buffer->pages;
 	while (processed < diff_region->count) {
 		sector_t offset = 0;
 		sector_t portion;
 		unsigned short nr_iovecs;
+		unsigned short segment;
 
-		portion = diff_region->count - processed;
-		nr_iovecs = calc_page_count(portion);
+		/*
+		 * Flushing the cache of the device once before the first
+		 * I/O unit is enough for the whole request.
+		 */
+		op_flags = diff_io->op_flags;
+		if (processed)
+			op_flags &= ~REQ_PREFLUSH;
 
-		if (nr_iovecs > bio_max_segs(nr_iovecs)) {
-			nr_iovecs = bio_max_segs(nr_iovecs);
-			portion = nr_iovecs * PAGE_SECTORS;
-		}
+		portion = diff_region->count - processed;
+		nr_iovecs = calc_segment_count(current_buffer_ptr,
+					       current_page_inx, portion);
+		nr_iovecs = bio_max_segs(nr_iovecs);
 
 #ifdef HAVE_BDEV_BIO_ALLOC
 		bio = bio_alloc_bioset(diff_region->bdev, nr_iovecs,
@@ -189,19 +424,30 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 		bio_set_op_attrs(bio, opf, op_flags);
 #endif
 
-		while (offset < portion) {
+		for (segment = 0; (segment < nr_iovecs) && (offset < portion);
+		     segment++) {
+			size_t pages;
 			sector_t bvec_len_sect;
-			unsigned int bvec_len;
 
-			bvec_len_sect = min_t(sector_t, PAGE_SECTORS,
+			if (current_page_inx ==
+			    (*current_buffer_ptr)->page_count) {
+				current_buffer_ptr++;
+				current_page_inx = 0;
+			}
+
+			pages = diff_buffer_segment_pages(*current_buffer_ptr,
+				current_page_inx,
+				calc_page_count(portion - offset));
+			bvec_len_sect = min_t(sector_t, pages * PAGE_SECTORS,
 					      portion - offset);
-			bvec_len =
-				(unsigned int)(bvec_len_sect << SECTOR_SHIFT);
 
 			/* All pages offset aligned to PAGE_SIZE */
-			__bio_add_page(bio, *current_page_ptr, bvec_len, 0);
+			__bio_add_page(bio,
+				(*current_buffer_ptr)->pages[current_page_inx],
+				(unsigned int)(bvec_len_sect << SECTOR_SHIFT),
+				0);
 
-			current_page_ptr++;
+			current_page_inx += pages;
 			offset += bvec_len_sect;
 		}
 
@@ -212,6 +458,7 @@ int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
 	}
 
 	/* sumbit all bios */
+	trace_blksnap_diff_io_submit(diff_io, diff_region);
 	while ((bio = bio_list_pop(&bio_list_head)))
 		submit_bio_noacct(bio);
 
@@ -66,6 +66,16 @@ struct diff_io_async {
  *	Indicates that a write operation is being performed.
  * @is_sync_io:
  *	Indicates that the operation is being performed synchronously.
+ * @op_flags:
+ *	Request flags for the I/O units. By default, the REQ_FUA flag is set
+ *	for write operations. The REQ_PREFLUSH flag is set only for the first
+ *	I/O unit of the request.
+ * @start_time:
+ *	The time in nanoseconds when the request was created. Allows to
+ *	collect the latency statistics.
+ * @node:
+ *	The NUMA node on which the completion of the asynchronous request is
+ *	processed, or NUMA_NO_NODE.
  * @notify:
  *	This union may contain the diff_io_sync or diff_io_async structure
  *	for synchronous or asynchronous request.
@@ -79,21 +89,22 @@ struct diff_io {
 	atomic_t bio_count;
 	bool is_write;
 	bool is_sync_io;
+	unsigned int op_flags;
+	u64 start_time;
+	int node;
 	union {
 		struct diff_io_sync sync;
 		struct diff_io_async async;
 	} notify;
 };
 
+extern struct workqueue_struct *diff_io_load_wq;
+extern struct workqueue_struct *diff_io_store_wq;
+
 int diff_io_init(void);
 void diff_io_done(void);
 
-static inline void diff_io_free(struct diff_io *diff_io)
-{
-	kfree(diff_io);
-	if (diff_io)
-		memory_object_dec(memory_object_diff_io);
-}
+void diff_io_free(struct diff_io *diff_io);
 
 struct diff_io *diff_io_new_sync(bool is_write);
 static inline struct diff_io *diff_io_new_sync_read(void)
@@ -118,6 +129,19 @@ diff_io_new_async_write(void (*notify_cb)(void *ctx), void *ctx, bool is_nowait)
 	return diff_io_new_async(true, is_nowait, notify_cb, ctx);
 };
 
-int diff_io_do(struct diff_io *diff_io, struct diff_region *diff_region,
-	       struct diff_buffer *diff_buffer, const bool is_nowait);
+int diff_io_remap(struct bio *parent, struct bvec_iter *iter,
+		  struct block_device *bdev, sector_t sector,
+		  void (*notify_cb)(void *ctx), void *ctx);
+
+int diff_io_do_multi(struct diff_io *diff_io, struct diff_region *diff_region,
+		     struct diff_buffer **diff_buffers,
+		     unsigned int buffer_count, const bool is_nowait);
+static inline int diff_io_do(struct diff_io *diff_io,
+			     struct diff_region *diff_region,
+			     struct diff_buffer *diff_buffer,
+			     const bool is_nowait)
+{
+	return diff_io_do_multi(diff_io, diff_region, &diff_buffer, 1,
+				is_nowait);
+};
 #endif /* __BLK_SNAP_DIFF_IO_H */
@@ -5,6 +5,14 @@
 #include <linux/sched/mm.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -16,13 +24,35 @@
 #include "diff_buffer.h"
 #include "diff_storage.h"
 #include "log.h"
+#include "trace.h"
 
-extern int diff_storage_minimum;
+extern int diff_storage_lead_time;
 
 #ifndef PAGE_SECTORS
 #define PAGE_SECTORS	(1 << (PAGE_SHIFT - SECTOR_SHIFT))
 #endif
 
+/*
+ * The number of sectors reserved for a CPU at once. 4 MiB.
+ */
+#define DIFF_STORAGE_RESERVE_SECTORS	(1ull << (22 - SECTOR_SHIFT))
+
+/*
+ * The maximum weight of a storage device. A faster device can be given a
+ * greater weight, then it receives proportionally more reservations.
+ */
+#define DIFF_STORAGE_WEIGHT_MAX		64
+
+/*
+ * The maximum number of requests for free space that can be outstanding.
+ */
+#define DIFF_STORAGE_MAX_REQUESTS	4
+
+/*
+ * The minimum interval for estimating the fill rate. 100 ms.
+ */
+#define DIFF_STORAGE_RATE_INTERVAL_NS	(100 * NSEC_PER_MSEC)
+
 /**
  * struct storage_bdev - Information about the opened block device.
  *
@@ -32,11 +62,40 @@ extern int diff_storage_minimum;
  *	ID of the block device.
  * @bdev:
  *	A pointer to an open block device.
+ * @empty_blocks:
+ *	List of empty blocks on the device. This list can be updated while
+ *	holding a snapshot. This allows us to dynamically increase the
+ *	storage size for these snapshots.
+ * @weight:
+ *	The number of reservations taken from the device in a row when the
+ *	storage is striped across several devices.
  */
 struct storage_bdev {
 	struct list_head link;
 	dev_t dev_id;
 	struct block_device *bdev;
+	struct list_head empty_blocks;
+	unsigned int weight;
+};
+
+/**
+ * struct free_region - A region of the difference storage that was used
+ *	and then released.
+ *
+ * @link:
+ *	Allows to combine structures into a linked list.
+ * @bdev:
+ *	A pointer to a block device.
+ * @sector:
+ *	The number of the first sector of the region.
+ * @count:
+ *	The count of sectors in the region. It is a multiple of the page size.
+ */
+struct free_region {
+	struct list_head link;
+	struct block_device *bdev;
+	sector_t sector;
+	sector_t count;
 };
 
 /**
@@ -64,44 +123,114 @@ struct storage_block {
 	sector_t used;
 };
 
-static inline void diff_storage_event_low(struct diff_storage *diff_storage)
+/*
+ * Each request is for a new portion on top of the previous ones, so when the
+ * pending event has not been read yet, the portions are summed up and user
+ * space appends all of them at once.
+ */
+static void diff_storage_event_low_merge(void *pending_data, const void *data)
+{
+	struct blk_snap_event_low_free_space *pending = pending_data;
+	const struct blk_snap_event_low_free_space *event = data;
+
+	pending->requested_nr_sect += event->requested_nr_sect;
+	pending->fill_rate = event->fill_rate;
+}
+
+static inline void diff_storage_event_low(struct diff_storage *diff_storage,
+					  sector_t requested_nr_sect)
 {
 	struct blk_snap_event_low_free_space data = {
-		.requested_nr_sect = diff_storage_minimum,
+		.requested_nr_sect = requested_nr_sect,
+		.fill_rate = READ_ONCE(diff_storage->fill_rate) << SECTOR_SHIFT,
 	};
 
-	diff_storage->requested += data.requested_nr_sect;
-	pr_debug("Diff storage low free space. Portion: %llu sectors, requested: %llu\n",
-		data.requested_nr_sect, diff_storage->requested);
-	event_gen(&diff_storage->event_queue, GFP_NOIO,
-		  blk_snap_event_code_low_free_space, &data, sizeof(data));
+	pr_debug("Diff storage low free space. Portion: %llu sectors, fill rate: %llu bytes/s\n",
+		data.requested_nr_sect, data.fill_rate);
+	event_gen(&diff_storage->event_queue, blk_snap_event_code_low_free_space,
+		  &data, sizeof(data), 0, diff_storage_event_low_merge);
 }
 
-struct diff_storage *diff_storage_new(void)
+#ifdef BLK_SNAP_MODIFICATION
+static void diff_storage_grow_work(struct work_struct *work);
+#endif
+
+/*
+ * Requests more free space. If the file of the difference storage is set,
+ * it is extended by the worker, otherwise user space is notified.
+ */
+static inline void diff_storage_request_space(struct diff_storage *diff_storage,
+					      sector_t requested_nr_sect)
+{
+#ifdef BLK_SNAP_MODIFICATION
+	if (READ_ONCE(diff_storage->file)) {
+		queue_work(system_unbound_wq, &diff_storage->grow_work);
+		return;
+	}
+#endif
+	diff_storage_event_low(diff_storage, requested_nr_sect);
+}
+
+struct diff_storage *diff_storage_new(sector_t minimum,
+				      unsigned int device_count)
 {
 	struct diff_storage *diff_storage;
+	int cpu;
+	int order;
 
 	diff_storage = kzalloc(sizeof(struct diff_storage), GFP_KERNEL);
 	if (!diff_storage)
 		return NULL;
 	memory_object_inc(memory_object_diff_storage);
 
+	diff_storage->reserves = alloc_percpu(struct diff_storage_reserve);
+	if (!diff_storage->reserves) {
+		kfree(diff_storage);
+		memory_object_dec(memory_object_diff_storage);
+		return NULL;
+	}
+	memory_object_inc(memory_object_diff_storage_reserve);
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(diff_storage->reserves, cpu)->lock);
+
+	/*
+	 * One low free space event and one corrupted event for each device
+	 * can be pending at the same time.
+	 */
+	if (event_queue_init(&diff_storage->event_queue, device_count + 1)) {
+		free_percpu(diff_storage->reserves);
+		memory_object_dec(memory_object_diff_storage_reserve);
+		kfree(diff_storage);
+		memory_object_dec(memory_object_diff_storage);
+		return NULL;
+	}
+
 	kref_init(&diff_storage->kref);
 	spin_lock_init(&diff_storage->lock);
 	INIT_LIST_HEAD(&diff_storage->storage_bdevs);
-	INIT_LIST_HEAD(&diff_storage->empty_blocks);
 	INIT_LIST_HEAD(&diff_storage->filled_blocks);
+	for (order = 0; order < DIFF_STORAGE_FREE_ORDERS; order++)
+		INIT_LIST_HEAD(&diff_storage->free_regions[order]);
+#ifdef BLK_SNAP_MODIFICATION
+	diff_storage->durability = blk_snap_durability_fua;
+	diff_storage->compression = blk_snap_compression_none;
+	diff_storage->memory_limit = 0;
+	atomic64_set(&diff_storage->memory_used, 0);
+	INIT_WORK(&diff_storage->grow_work, diff_storage_grow_work);
+#endif
 
-	event_queue_init(&diff_storage->event_queue);
-	diff_storage_event_low(diff_storage);
+	diff_storage->rate_time = ktime_get_ns();
+	diff_storage->minimum = minimum;
+	diff_storage->requested = minimum;
+	diff_storage_event_low(diff_storage, minimum);
 
 	return diff_storage;
 }
 
 static inline struct storage_block *
-first_empty_storage_block(struct diff_storage *diff_storage)
+first_empty_storage_block(struct storage_bdev *storage_bdev)
 {
-	return list_first_entry_or_null(&diff_storage->empty_blocks,
+	return list_first_entry_or_null(&storage_bdev->empty_blocks,
 					struct storage_block, link);
 };
 
@@ -119,17 +248,50 @@ first_storage_bdev(struct diff_storage *diff_storage)
 					struct storage_bdev, link);
 };
 
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * The blocks of the file are written to directly, so the file system must
+ * not move them. The file is marked as a swap file for this, as swapon()
+ * does, the kernel then refuses to truncate the file, to write to it and to
+ * change its blocks.
+ */
+static void diff_storage_pin_file(struct file *file, const bool pin)
+{
+	struct inode *inode = file_inode(file);
+
+	inode_lock(inode);
+	if (pin)
+		inode->i_flags |= S_SWAPFILE;
+	else
+		inode->i_flags &= ~S_SWAPFILE;
+	inode_unlock(inode);
+}
+#endif
+
 void diff_storage_free(struct kref *kref)
 {
 	struct diff_storage *diff_storage =
 		container_of(kref, struct diff_storage, kref);
 	struct storage_block *blk;
 	struct storage_bdev *storage_bdev;
+	struct free_region *free_region;
+	int order;
 
-	while ((blk = first_empty_storage_block(diff_storage))) {
-		list_del(&blk->link);
-		kfree(blk);
-		memory_object_dec(memory_object_storage_block);
+#ifdef BLK_SNAP_MODIFICATION
+	cancel_work_sync(&diff_storage->grow_work);
+	if (diff_storage->file) {
+		diff_storage_pin_file(diff_storage->file, false);
+		fput(diff_storage->file);
+	}
+#endif
+	for (order = 0; order < DIFF_STORAGE_FREE_ORDERS; order++) {
+		while ((free_region = list_first_entry_or_null(
+				&diff_storage->free_regions[order],
+				struct free_region, link))) {
+			list_del(&free_region->link);
+			kfree(free_region);
+			memory_object_dec(memory_object_free_region);
+		}
 	}
 
 	while ((blk = first_filled_storage_block(diff_storage))) {
@@ -139,6 +301,11 @@ void diff_storage_free(struct kref *kref)
 	}
 
 	while ((storage_bdev = first_storage_bdev(diff_storage))) {
+		while ((blk = first_empty_storage_block(storage_bdev))) {
+			list_del(&blk->link);
+			kfree(blk);
+			memory_object_dec(memory_object_storage_block);
+		}
 		blkdev_put(storage_bdev->bdev, FMODE_READ | FMODE_WRITE);
 		list_del(&storage_bdev->link);
 		kfree(storage_bdev);
@@ -146,29 +313,37 @@ void diff_storage_free(struct kref *kref)
 	}
 	event_queue_done(&diff_storage->event_queue);
 
+	free_percpu(diff_storage->reserves);
+	memory_object_dec(memory_object_diff_storage_reserve);
+
 	kfree(diff_storage);
 	memory_object_dec(memory_object_diff_storage);
 }
 
-static struct block_device *
+/*
+ * The storage devices are never removed from the list until the difference
+ * storage is released, so the pointer remains valid after the lock is
+ * released.
+ */
+static struct storage_bdev *
 diff_storage_bdev_by_id(struct diff_storage *diff_storage, dev_t dev_id)
 {
-	struct block_device *bdev = NULL;
+	struct storage_bdev *found = NULL;
 	struct storage_bdev *storage_bdev;
 
 	spin_lock(&diff_storage->lock);
 	list_for_each_entry(storage_bdev, &diff_storage->storage_bdevs, link) {
 		if (storage_bdev->dev_id == dev_id) {
-			bdev = storage_bdev->bdev;
+			found = storage_bdev;
 			break;
 		}
 	}
 	spin_unlock(&diff_storage->lock);
 
-	return bdev;
+	return found;
 }
 
-static inline struct block_device *
+static inline struct storage_bdev *
 diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 {
 	struct block_device *bdev;
@@ -178,7 +353,7 @@ diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 	if (IS_ERR(bdev)) {
 		pr_err("Failed to open device. errno=%d\n",
 		       abs((int)PTR_ERR(bdev)));
-		return bdev;
+		return ERR_CAST(bdev);
 	}
 
 	storage_bdev = kzalloc(sizeof(struct storage_bdev), GFP_KERNEL);
@@ -191,19 +366,22 @@ diff_storage_add_storage_bdev(struct diff_storage *diff_storage, dev_t dev_id)
 	storage_bdev->bdev = bdev;
 	storage_bdev->dev_id = dev_id;
 	INIT_LIST_HEAD(&storage_bdev->link);
+	INIT_LIST_HEAD(&storage_bdev->empty_blocks);
+	storage_bdev->weight = 1;
 
 	spin_lock(&diff_storage->lock);
 	list_add_tail(&storage_bdev->link, &diff_storage->storage_bdevs);
 	spin_unlock(&diff_storage->lock);
 
-	return bdev;
+	return storage_bdev;
 }
 
 static inline int diff_storage_add_range(struct diff_storage *diff_storage,
-					 struct block_device *bdev,
+					 struct storage_bdev *storage_bdev,
 					 sector_t sector, sector_t count)
 {
 	struct storage_block *storage_block;
+	struct block_device *bdev = storage_bdev->bdev;
 
 	pr_debug("Add range to diff storage: [%u:%u] %llu:%llu\n",
 		 MAJOR(bdev->bd_dev), MINOR(bdev->bd_dev), sector, count);
@@ -219,7 +397,7 @@ static inline int diff_storage_add_range(struct diff_storage *diff_storage,
 	storage_block->count = count;
 
 	spin_lock(&diff_storage->lock);
-	list_add_tail(&storage_block->link, &diff_storage->empty_blocks);
+	list_add_tail(&storage_block->link, &storage_bdev->empty_blocks);
 
 	diff_storage->capacity += count;
 	spin_unlock(&diff_storage->lock);
@@ -233,24 +411,25 @@ int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 {
 	int ret;
 	int inx;
-	struct block_device *bdev;
+	struct storage_bdev *storage_bdev;
 	struct blk_snap_block_range range;
 	const unsigned long range_size = sizeof(struct blk_snap_block_range);
 
 	pr_debug("Append %u blocks\n", range_count);
 
-	bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
-	if (!bdev) {
-		bdev = diff_storage_add_storage_bdev(diff_storage, dev_id);
-		if (IS_ERR(bdev))
-			return PTR_ERR(bdev);
+	storage_bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
+	if (!storage_bdev) {
+		storage_bdev = diff_storage_add_storage_bdev(diff_storage,
+							     dev_id);
+		if (IS_ERR(storage_bdev))
+			return PTR_ERR(storage_bdev);
 	}
 
 	for (inx = 0; inx < range_count; inx++) {
 		if (unlikely(copy_from_user(&range, ranges+inx, range_size)))
 			return -EINVAL;
 
-		ret = diff_storage_add_range(diff_storage, bdev,
+		ret = diff_storage_add_range(diff_storage, storage_bdev,
 					     range.sector_offset,
 					     range.sector_count);
 		if (unlikely(ret))
@@ -264,74 +443,812 @@ int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 	return 0;
 }
 
-static inline bool is_halffull(const sector_t sectors_left)
+#ifdef BLK_SNAP_BENCHMARK
+/*
+ * Appends the range of the block device to the difference storage without
+ * copying it from the user space. It is used by the benchmark.
+ */
+int diff_storage_append_range(struct diff_storage *diff_storage, dev_t dev_id,
+			      sector_t sector, sector_t count)
+{
+	struct storage_bdev *storage_bdev;
+
+	storage_bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
+	if (!storage_bdev) {
+		storage_bdev = diff_storage_add_storage_bdev(diff_storage,
+							     dev_id);
+		if (IS_ERR(storage_bdev))
+			return PTR_ERR(storage_bdev);
+	}
+
+	return diff_storage_add_range(diff_storage, storage_bdev, sector,
+				      count);
+}
+#endif
+
+int diff_storage_set_weight(struct diff_storage *diff_storage, dev_t dev_id,
+			    unsigned int weight)
+{
+	struct storage_bdev *storage_bdev;
+
+	if (!weight || (weight > DIFF_STORAGE_WEIGHT_MAX))
+		return -EINVAL;
+
+	storage_bdev = diff_storage_bdev_by_id(diff_storage, dev_id);
+	if (!storage_bdev)
+		return -ENODEV;
+
+	spin_lock(&diff_storage->lock);
+	storage_bdev->weight = weight;
+	spin_unlock(&diff_storage->lock);
+
+	return 0;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+static inline int diff_storage_bmap(struct inode *inode, sector_t *block)
 {
-	return sectors_left <= ((diff_storage_minimum >> 1) & ~(PAGE_SECTORS - 1));
+#ifdef HAVE_INT_BMAP
+	return bmap(inode, block);
+#else
+	*block = bmap(inode, *block);
+	return 0;
+#endif
 }
 
-struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
-					   sector_t count)
+/*
+ * Appends the blocks of the part of the file to the difference storage.
+ * The adjacent blocks are combined into one storage block.
+ */
+static int diff_storage_map_file(struct diff_storage *diff_storage,
+				 struct storage_bdev *storage_bdev, loff_t pos,
+				 loff_t len)
+{
+	int ret;
+	struct inode *inode = file_inode(diff_storage->file);
+	unsigned int blk_shift = inode->i_blkbits - SECTOR_SHIFT;
+	sector_t block = pos >> inode->i_blkbits;
+	sector_t last = (pos + len) >> inode->i_blkbits;
+	sector_t sector = 0;
+	sector_t count = 0;
+
+	for (; block < last; block++) {
+		sector_t phys = block;
+
+		ret = diff_storage_bmap(inode, &phys);
+		if (unlikely(ret))
+			return ret;
+		/* The file system cannot map the block */
+		if (unlikely(!phys))
+			return -EOPNOTSUPP;
+
+		if (count && ((sector + count) == (phys << blk_shift))) {
+			count += 1ull << blk_shift;
+			continue;
+		}
+
+		if (count) {
+			ret = diff_storage_add_range(diff_storage, storage_bdev,
+						     sector, count);
+			if (unlikely(ret))
+				return ret;
+		}
+		sector = phys << blk_shift;
+		count = 1ull << blk_shift;
+		cond_resched();
+	}
+	if (!count)
+		return 0;
+
+	return diff_storage_add_range(diff_storage, storage_bdev, sector, count);
+}
+
+/*
+ * The number of pages written to the file by one request when the unwritten
+ * extents are converted. All of them refer to the zero page.
+ */
+#define DIFF_STORAGE_ZERO_PAGES 256
+
+/*
+ * Writes zeroes to the part of the file and writes them back. The blocks of
+ * the unwritten extents allocated by fallocate() cannot be mapped, so the
+ * extents are converted by writing. The zeroes are written by large requests
+ * of DIFF_STORAGE_ZERO_PAGES pages, so the file system allocates and writes
+ * the blocks contiguously. The page cache of the file is dropped, since the
+ * blocks are then written to bypassing it.
+ */
+static int diff_storage_zero_file(struct file *file, loff_t pos, loff_t len)
 {
 	int ret = 0;
-	struct diff_region *diff_region;
-	sector_t sectors_left;
+	ssize_t written;
+	loff_t offset = pos;
+	const loff_t end = pos + len;
+	struct bio_vec *bvec;
+	struct iov_iter iter;
+	unsigned int inx;
 
-	if (atomic_read(&diff_storage->overflow_flag))
-		return ERR_PTR(-ENOSPC);
+	bvec = kmalloc_array(DIFF_STORAGE_ZERO_PAGES, sizeof(struct bio_vec),
+			     GFP_NOIO);
+	if (!bvec)
+		return -ENOMEM;
+	memory_object_inc(memory_object_zero_bvec_array);
+	for (inx = 0; inx < DIFF_STORAGE_ZERO_PAGES; inx++) {
+		bvec[inx].bv_page = ZERO_PAGE(0);
+		bvec[inx].bv_len = PAGE_SIZE;
+		bvec[inx].bv_offset = 0;
+	}
 
-	diff_region = kzalloc(sizeof(struct diff_region), GFP_NOIO);
-	if (!diff_region)
-		return ERR_PTR(-ENOMEM);
-	memory_object_inc(memory_object_diff_region);
+	while (offset < end) {
+		size_t portion = min_t(loff_t,
+				       DIFF_STORAGE_ZERO_PAGES * PAGE_SIZE,
+				       end - offset);
+
+		iov_iter_bvec(&iter, WRITE, bvec,
+			      DIV_ROUND_UP(portion, PAGE_SIZE), portion);
+		written = vfs_iter_write(file, &iter, &offset, 0);
+		if (unlikely(written <= 0)) {
+			ret = written ? written : -EIO;
+			break;
+		}
+		cond_resched();
+	}
+	kfree(bvec);
+	memory_object_dec(memory_object_zero_bvec_array);
+	if (unlikely(ret))
+		return ret;
+
+	ret = vfs_fsync_range(file, pos, end - 1, 0);
+	if (unlikely(ret))
+		return ret;
+
+	invalidate_mapping_pages(file->f_mapping, pos >> PAGE_SHIFT,
+				 (end - 1) >> PAGE_SHIFT);
+	return 0;
+}
+
+/*
+ * Extends the file by at least the requested number of sectors, unless the
+ * limit of the file size is reached, and appends the new blocks to the
+ * difference storage.
+ */
+static int diff_storage_grow_file(struct diff_storage *diff_storage,
+				  sector_t sectors)
+{
+	int ret;
+	struct file *file = diff_storage->file;
+	struct inode *inode = file_inode(file);
+	struct storage_bdev *storage_bdev;
+	loff_t pos = diff_storage->file_size;
+	loff_t align = max_t(loff_t, PAGE_SIZE, i_blocksize(inode));
+	loff_t len = round_up((loff_t)sectors << SECTOR_SHIFT, align);
+
+	if (diff_storage->file_limit) {
+		if (pos + len > diff_storage->file_limit)
+			len = round_down(diff_storage->file_limit - pos, align);
+		if (len <= 0)
+			return -EFBIG;
+	}
+
+	storage_bdev = diff_storage_bdev_by_id(diff_storage,
+					       inode->i_sb->s_bdev->bd_dev);
+	if (unlikely(!storage_bdev))
+		return -ENODEV;
+
+	/*
+	 * The kernel does not allow to allocate and to write the blocks of a
+	 * swap file, so the file is unpinned while it is extended. The blocks
+	 * are mapped only after the file is pinned again.
+	 */
+	diff_storage_pin_file(file, false);
+	ret = vfs_fallocate(file, 0, pos, len);
+	if (!ret)
+		ret = diff_storage_zero_file(file, pos, len);
+	diff_storage_pin_file(file, true);
+	if (ret)
+		return ret;
+	diff_storage->file_size = pos + len;
+
+	pr_debug("Difference storage file extended by %lld bytes\n", len);
+	return diff_storage_map_file(diff_storage, storage_bdev, pos, len);
+}
+
+static void diff_storage_grow_work(struct work_struct *work)
+{
+	struct diff_storage *diff_storage =
+		container_of(work, struct diff_storage, grow_work);
+	unsigned int noio_flags;
+	sector_t shortage;
+	int ret = 0;
+
+	/*
+	 * The file system must not start writeback to the snapshot devices,
+	 * which may wait for the difference storage.
+	 */
+	noio_flags = memalloc_noio_save();
+	do {
+		spin_lock(&diff_storage->lock);
+		shortage = 0;
+		if (diff_storage->requested > diff_storage->capacity)
+			shortage = diff_storage->requested -
+				   diff_storage->capacity;
+		spin_unlock(&diff_storage->lock);
+		if (!shortage)
+			break;
+
+		ret = diff_storage_grow_file(diff_storage, shortage);
+	} while (!ret);
+	memalloc_noio_restore(noio_flags);
+
+	if (ret) {
+		pr_err("Failed to extend difference storage file. errno=%d\n",
+		       abs(ret));
+		diff_storage_event_low(diff_storage, shortage);
+		return;
+	}
+
+	if (atomic_read(&diff_storage->low_space_flag))
+		atomic_set(&diff_storage->low_space_flag, 0);
+}
+
+/**
+ * diff_storage_set_file() - Sets the file that the difference storage
+ *	extends by itself.
+ * @diff_storage:
+ *	Pointer to &struct diff_storage.
+ * @file:
+ *	A regular file opened for writing. The difference storage takes its
+ *	own reference to it.
+ * @size_limit:
+ *	The maximum size of the file in bytes. Zero if it is not limited.
+ *
+ * The file is extended beyond its current size, so the existing data of it
+ * is not affected. The requests for free space that are outstanding are
+ * satisfied at once.
+ *
+ * The file is marked as a swap file until the difference storage is freed,
+ * so that its blocks cannot be moved or released. Only while the file is
+ * being extended, the mark is removed. A file that is already used as a
+ * swap file cannot be set.
+ */
+int diff_storage_set_file(struct diff_storage *diff_storage, struct file *file,
+			  loff_t size_limit)
+{
+	struct inode *inode = file_inode(file);
+	struct block_device *bdev = inode->i_sb->s_bdev;
+	struct storage_bdev *storage_bdev;
+
+	if (!S_ISREG(inode->i_mode) || (file->f_flags & O_DIRECT))
+		return -EINVAL;
+	if (!(file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (!bdev || !file->f_mapping->a_ops->bmap)
+		return -EOPNOTSUPP;
 
+	storage_bdev = diff_storage_bdev_by_id(diff_storage, bdev->bd_dev);
+	if (!storage_bdev) {
+		storage_bdev = diff_storage_add_storage_bdev(diff_storage,
+							     bdev->bd_dev);
+		if (IS_ERR(storage_bdev))
+			return PTR_ERR(storage_bdev);
+	}
+
+	inode_lock(inode);
+	if (IS_SWAPFILE(inode)) {
+		inode_unlock(inode);
+		return -EBUSY;
+	}
 	spin_lock(&diff_storage->lock);
+	if (diff_storage->file) {
+		spin_unlock(&diff_storage->lock);
+		inode_unlock(inode);
+		return -EBUSY;
+	}
+	diff_storage->file_size = round_up(i_size_read(inode),
+					   i_blocksize(inode));
+	diff_storage->file_limit = size_limit;
+	WRITE_ONCE(diff_storage->file, get_file(file));
+	spin_unlock(&diff_storage->lock);
+	inode->i_flags |= S_SWAPFILE;
+	inode_unlock(inode);
+
+	queue_work(system_unbound_wq, &diff_storage->grow_work);
+	return 0;
+}
+#endif
+
+static inline struct storage_bdev *
+next_storage_bdev(struct diff_storage *diff_storage,
+		  struct storage_bdev *storage_bdev)
+{
+	if (list_is_last(&storage_bdev->link, &diff_storage->storage_bdevs))
+		return first_storage_bdev(diff_storage);
+
+	return list_next_entry(storage_bdev, link);
+}
+
+/*
+ * Selects the storage block for the next reservation. The reservations are
+ * taken from the storage devices in turn, so the chunks are striped across
+ * all of them. A device with a greater weight gives several reservations in
+ * a row. The lock of the difference storage must be held.
+ */
+static struct storage_block *
+diff_storage_next_block(struct diff_storage *diff_storage)
+{
+	struct storage_bdev *storage_bdev = diff_storage->stripe_bdev;
+	struct storage_bdev *start;
+	int wrapped = 0;
+
+	if (!storage_bdev) {
+		storage_bdev = first_storage_bdev(diff_storage);
+		if (!storage_bdev)
+			return NULL;
+		diff_storage->stripe_bdev = storage_bdev;
+		diff_storage->stripe_credit = storage_bdev->weight;
+	}
+
+	start = storage_bdev;
+	do {
+		if (diff_storage->stripe_credit &&
+		    !list_empty(&storage_bdev->empty_blocks)) {
+			diff_storage->stripe_credit--;
+			return first_empty_storage_block(storage_bdev);
+		}
+
+		storage_bdev = next_storage_bdev(diff_storage, storage_bdev);
+		diff_storage->stripe_bdev = storage_bdev;
+		diff_storage->stripe_credit = storage_bdev->weight;
+		if (storage_bdev == start)
+			wrapped++;
+	} while (wrapped < 2);
+
+	return NULL;
+}
+
+/*
+ * Returns the number of sectors actually consumed. The unused rest of the
+ * reservations of the CPUs is counted in the filled size, but it is still
+ * available for the chunks. The reservations are read without their locks,
+ * so the result is an estimate. The lock of the difference storage must be
+ * held.
+ */
+static sector_t diff_storage_consumed(struct diff_storage *diff_storage)
+{
+	sector_t unused = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_storage_reserve *reserve =
+			per_cpu_ptr(diff_storage->reserves, cpu);
+
+		unused += READ_ONCE(reserve->count);
+	}
+
+	if (diff_storage->filled > unused)
+		return diff_storage->filled - unused;
+	return 0;
+}
+
+/*
+ * Updates the estimate of the fill rate of the difference storage. The rate
+ * is averaged exponentially. The lock of the difference storage must be held.
+ */
+static void diff_storage_update_rate(struct diff_storage *diff_storage,
+				     sector_t consumed)
+{
+	u64 now = ktime_get_ns();
+	u64 elapsed = now - diff_storage->rate_time;
+	u64 rate;
+
+	if (elapsed < DIFF_STORAGE_RATE_INTERVAL_NS)
+		return;
+
+	/* The consumed size decreases when the regions are released */
+	if (consumed > diff_storage->rate_filled)
+		rate = div64_u64((u64)(consumed - diff_storage->rate_filled) *
+					 NSEC_PER_SEC,
+				 elapsed);
+	else
+		rate = 0;
+	if (diff_storage->fill_rate)
+		rate = (diff_storage->fill_rate * 3 + rate) >> 2;
+	WRITE_ONCE(diff_storage->fill_rate, rate);
+
+	diff_storage->rate_time = now;
+	diff_storage->rate_filled = consumed;
+}
+
+/*
+ * Checks whether more free space should be requested from user space and
+ * returns the number of sectors to request. The free space should last for
+ * the lead time at the current fill rate, and should not be less than half of
+ * the minimum. During a burst of writes, user space may not be able to
+ * satisfy the requests in time, so several requests can be outstanding.
+ * Only the consumed sectors are taken into account, since the reservations
+ * of the CPUs are still free. The lock of the difference storage must be
+ * held.
+ */
+static sector_t diff_storage_request_size(struct diff_storage *diff_storage,
+					  sector_t consumed)
+{
+	sector_t sectors_left = 0;
+	sector_t projected;
+	sector_t request;
+
+	/* The consumption can overtake the requested size */
+	if (diff_storage->requested > consumed)
+		sectors_left = diff_storage->requested - consumed;
+
+	projected = diff_storage->fill_rate * max(diff_storage_lead_time, 1);
+	if (sectors_left > max_t(sector_t, projected,
+				 (diff_storage->minimum >> 1) &
+					 ~(PAGE_SECTORS - 1)))
+		return 0;
+
+	if (atomic_read(&diff_storage->low_space_flag) >=
+	    DIFF_STORAGE_MAX_REQUESTS)
+		return 0;
+
+	request = round_up(max_t(sector_t, projected, diff_storage->minimum),
+			   PAGE_SECTORS);
+	atomic_inc(&diff_storage->low_space_flag);
+	diff_storage->requested += request;
+
+	return request;
+}
+
+static inline unsigned int free_region_order(sector_t count)
+{
+	if (count <= PAGE_SECTORS)
+		return 0;
+	return min_t(unsigned int, ilog2(count / PAGE_SECTORS),
+		     DIFF_STORAGE_FREE_ORDERS - 1);
+}
+
+/*
+ * Adds the region to the list of free regions. The lock of the difference
+ * storage must be held.
+ */
+static void diff_storage_insert_free(struct diff_storage *diff_storage,
+				     struct free_region *free_region)
+{
+	unsigned int order = free_region_order(free_region->count);
+
+	list_add_tail(&free_region->link, &diff_storage->free_regions[order]);
+	WRITE_ONCE(diff_storage->free_mask,
+		   diff_storage->free_mask | (1ul << order));
+}
+
+/*
+ * Checks whether the release of the unused space requires a description of
+ * the free region.
+ */
+static inline bool diff_storage_release_needs(sector_t count,
+					      struct free_region *spare)
+{
+	return round_down(count, PAGE_SECTORS) && !spare;
+}
+
+/*
+ * Releases the unused space of the storage while the lock of the difference
+ * storage is held. The description of the free region is allocated before
+ * the lock is taken and is passed in @spare, the caller must check it with
+ * diff_storage_release_needs().
+ */
+static void diff_storage_release_locked(struct diff_storage *diff_storage,
+					struct block_device *bdev,
+					sector_t sector, sector_t count,
+					struct free_region **spare)
+{
+	struct free_region *free_region;
+
+	count = round_down(count, PAGE_SECTORS);
+	if (!count)
+		return;
+
+	free_region = *spare;
+	*spare = NULL;
+
+	free_region->bdev = bdev;
+	free_region->sector = sector;
+	free_region->count = count;
+	diff_storage_insert_free(diff_storage, free_region);
+	diff_storage->filled -= count;
+}
+
+void diff_storage_free_region(struct diff_storage *diff_storage,
+			      struct diff_region *region)
+{
+	struct free_region *free_region;
+	sector_t count = round_down(region->count, PAGE_SECTORS);
+
+	if (!count)
+		return;
+
+	free_region = kzalloc(sizeof(struct free_region),
+			      GFP_NOIO | __GFP_NOWARN);
+	if (!free_region)
+		return;
+	memory_object_inc(memory_object_free_region);
+
+	free_region->bdev = region->bdev;
+	free_region->sector = region->sector;
+	free_region->count = count;
+
+	spin_lock(&diff_storage->lock);
+	diff_storage_insert_free(diff_storage, free_region);
+	diff_storage->filled -= count;
+	spin_unlock(&diff_storage->lock);
+}
+
+/*
+ * Allocates the region from the released ones. The first suitable region is
+ * used, and the rest of it remains free. No more than
+ * DIFF_STORAGE_FREE_SCAN_MAX regions of the order of the request are checked,
+ * then the first region of the next non-empty higher order is taken. Without
+ * the released regions of a suitable size, the lock of the difference
+ * storage is not taken.
+ */
+static bool diff_storage_take_free(struct diff_storage *diff_storage,
+				   sector_t count, struct diff_region *region)
+{
+	unsigned int order = free_region_order(count);
+	struct free_region *free_region = NULL;
+	struct free_region *it;
+	unsigned int scanned = 0;
+
+	if (!(READ_ONCE(diff_storage->free_mask) >> order))
+		return false;
+
+	spin_lock(&diff_storage->lock);
+	list_for_each_entry(it, &diff_storage->free_regions[order], link) {
+		if (it->count >= count) {
+			free_region = it;
+			break;
+		}
+		if (++scanned == DIFF_STORAGE_FREE_SCAN_MAX)
+			break;
+	}
+	if (!free_region) {
+		order = find_next_bit(&diff_storage->free_mask,
+				      DIFF_STORAGE_FREE_ORDERS, order + 1);
+		if (order < DIFF_STORAGE_FREE_ORDERS)
+			free_region = list_first_entry(
+				&diff_storage->free_regions[order],
+				struct free_region, link);
+	}
+	if (free_region) {
+		list_del(&free_region->link);
+		if (list_empty(&diff_storage->free_regions[order]))
+			WRITE_ONCE(diff_storage->free_mask,
+				   diff_storage->free_mask & ~(1ul << order));
+
+		region->bdev = free_region->bdev;
+		region->sector = free_region->sector;
+		region->count = count;
+		diff_storage->filled += count;
+
+		free_region->sector += count;
+		free_region->count -= count;
+		if (free_region->count)
+			diff_storage_insert_free(diff_storage, free_region);
+		else {
+			kfree(free_region);
+			memory_object_dec(memory_object_free_region);
+		}
+	}
+	spin_unlock(&diff_storage->lock);
+
+	return !!free_region;
+}
+
+/*
+ * Refills the reservation of the CPU from the storage blocks. The rest of the
+ * previous reservation, which is not enough for the request, is released.
+ * The reservation must be locked. If the space should be released, but there
+ * is no spare description of the free region, -EAGAIN is returned and nothing
+ * is changed, then the caller allocates it without the locks and tries again.
+ */
+static int diff_storage_reserve_refill(struct diff_storage *diff_storage,
+				       struct diff_storage_reserve *reserve,
+				       sector_t count, sector_t *request,
+				       struct free_region **spare)
+{
+	int ret = 0;
+	sector_t portion = max_t(sector_t, count, DIFF_STORAGE_RESERVE_SECTORS);
+	sector_t consumed;
+
+	spin_lock(&diff_storage->lock);
+	if (reserve->count) {
+		if (diff_storage_release_needs(reserve->count, *spare)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		diff_storage_release_locked(diff_storage, reserve->bdev,
+					    reserve->sector, reserve->count,
+					    spare);
+		WRITE_ONCE(reserve->count, 0);
+	}
 	do {
 		struct storage_block *storage_block;
 		sector_t available;
 
-		storage_block = first_empty_storage_block(diff_storage);
+		storage_block = diff_storage_next_block(diff_storage);
 		if (unlikely(!storage_block)) {
-			atomic_inc(&diff_storage->overflow_flag);
 			ret = -ENOSPC;
 			break;
 		}
 
 		available = storage_block->count - storage_block->used;
 		if (likely(available >= count)) {
-			diff_region->bdev = storage_block->bdev;
-			diff_region->sector =
+			portion = min(portion, available);
+
+			reserve->bdev = storage_block->bdev;
+			reserve->sector =
 				storage_block->sector + storage_block->used;
-			diff_region->count = count;
+			WRITE_ONCE(reserve->count, portion);
 
-			storage_block->used += count;
-			diff_storage->filled += count;
+			storage_block->used += portion;
+			diff_storage->filled += portion;
 			break;
 		}
 
+		if (diff_storage_release_needs(available, *spare)) {
+			ret = -EAGAIN;
+			goto out;
+		}
 		list_del(&storage_block->link);
 		list_add_tail(&storage_block->link,
 			      &diff_storage->filled_blocks);
+		/* The filled block does not consume the turn of its device */
+		diff_storage->stripe_credit++;
 		/*
 		 * If there is still free space in the storage block, but
 		 * it is not enough to store a piece, then such a block is
-		 * considered used.
-		 * We believe that the storage blocks are large enough
-		 * to accommodate several pieces entirely.
+		 * considered used. The rest of it is released and can be used
+		 * for smaller pieces.
 		 */
 		diff_storage->filled += available;
+		diff_storage_release_locked(diff_storage, storage_block->bdev,
+					    storage_block->sector +
+						    storage_block->used,
+					    available, spare);
+		storage_block->used = storage_block->count;
 	} while (1);
-	sectors_left = diff_storage->requested - diff_storage->filled;
+	consumed = diff_storage_consumed(diff_storage);
+	diff_storage_update_rate(diff_storage, consumed);
+	*request = diff_storage_request_size(diff_storage, consumed);
+out:
 	spin_unlock(&diff_storage->lock);
 
-	if (ret) {
+	return ret;
+}
+
+static inline bool diff_storage_reserve_take(struct diff_storage_reserve *reserve,
+					     sector_t count,
+					     struct diff_region *region)
+{
+	if (reserve->count < count)
+		return false;
+
+	region->bdev = reserve->bdev;
+	region->sector = reserve->sector;
+	region->count = count;
+
+	reserve->sector += count;
+	WRITE_ONCE(reserve->count, reserve->count - count);
+	return true;
+}
+
+/*
+ * When the storage blocks are over, the rest of the reservations of other
+ * CPUs can still be used.
+ */
+static bool diff_storage_reserve_steal(struct diff_storage *diff_storage,
+				       sector_t count,
+				       struct diff_region *region)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct diff_storage_reserve *reserve =
+			per_cpu_ptr(diff_storage->reserves, cpu);
+		bool is_taken;
+
+		spin_lock(&reserve->lock);
+		is_taken = diff_storage_reserve_take(reserve, count, region);
+		spin_unlock(&reserve->lock);
+
+		if (is_taken)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Allocates a region of the difference storage. The region is taken from the
+ * reservation of the current CPU. The task may be migrated to another CPU
+ * meanwhile, but the reservation is protected by its own lock, so this does
+ * not break anything.
+ */
+int diff_storage_new_region(struct diff_storage *diff_storage, sector_t count,
+			    struct diff_region *region)
+{
+	int ret = 0;
+	sector_t request = 0;
+	struct diff_storage_reserve *reserve;
+	struct free_region *spare = NULL;
+
+	if (atomic_read(&diff_storage->overflow_flag)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	if (diff_storage_take_free(diff_storage, count, region))
+		goto out;
+
+	reserve = raw_cpu_ptr(diff_storage->reserves);
+retry:
+	spin_lock(&reserve->lock);
+	if (unlikely(reserve->count < count))
+		ret = diff_storage_reserve_refill(diff_storage, reserve, count,
+						  &request, &spare);
+	if (likely(!ret))
+		diff_storage_reserve_take(reserve, count, region);
+	spin_unlock(&reserve->lock);
+
+	if (unlikely(ret == -EAGAIN)) {
+		spare = kzalloc(sizeof(struct free_region), GFP_NOIO);
+		if (spare) {
+			memory_object_inc(memory_object_free_region);
+			ret = 0;
+			goto retry;
+		}
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (unlikely(spare)) {
+		kfree(spare);
+		memory_object_dec(memory_object_free_region);
+	}
+
+	if (request)
+		diff_storage_request_space(diff_storage, request);
+
+	if (unlikely(ret)) {
+		if (diff_storage_reserve_steal(diff_storage, count, region)) {
+			ret = 0;
+			goto out;
+		}
+
+		atomic_inc(&diff_storage->overflow_flag);
 		pr_err("Cannot get empty storage block\n");
-		diff_storage_free_region(diff_region);
-		return ERR_PTR(ret);
 	}
+out:
+	trace_blksnap_diff_storage_new_region(count, region, ret);
+	return ret;
+}
 
-	if (is_halffull(sectors_left) &&
-	    (atomic_inc_return(&diff_storage->low_space_flag) == 1))
-		diff_storage_event_low(diff_storage);
+/*
+ * Allocates several adjacent regions of the same size at once. This allows
+ * to store the data of adjacent chunks with a single request.
+ */
+int diff_storage_new_regions(struct diff_storage *diff_storage, sector_t count,
+			     unsigned int nr, struct diff_region **regions)
+{
+	int ret;
+	unsigned int inx;
+	struct diff_region region;
 
-	return diff_region;
+	ret = diff_storage_new_region(diff_storage, count * nr, &region);
+	if (ret)
+		return ret;
+
+	for (inx = 0; inx < nr; inx++) {
+		regions[inx]->bdev = region.bdev;
+		regions[inx]->sector = region.sector + count * inx;
+		regions[inx]->count = count;
+	}
+
+	return 0;
 }
@@ -2,10 +2,56 @@
 #ifndef __BLK_SNAP_DIFF_STORAGE_H
 #define __BLK_SNAP_DIFF_STORAGE_H
 
+#include <linux/blk_types.h>
+#include <linux/workqueue.h>
+#ifdef STANDALONE_BDEVFILTER
+#include "blksnap.h"
+#else
+#include <uapi/linux/blksnap.h>
+#endif
 #include "event_queue.h"
 
 struct blk_snap_block_range;
 struct diff_region;
+struct storage_bdev;
+
+/**
+ * struct diff_storage_reserve - The part of the difference storage reserved
+ *	for a CPU.
+ * @lock:
+ *	Protects the reservation. Usually it is taken on its own CPU only.
+ * @bdev:
+ *	The block device of the reserved range.
+ * @sector:
+ *	The first sector of the reserved range that has not been used yet.
+ * @count:
+ *	The number of sectors left in the reserved range. It can be read
+ *	without the lock to estimate the consumed space of the storage.
+ *
+ * The regions for chunks are allocated from the reservation of the current
+ * CPU. The lock of the difference storage is taken only when the reservation
+ * is refilled from the storage blocks, so the writers to the different
+ * devices of the snapshot do not serialize on it.
+ */
+struct diff_storage_reserve {
+	spinlock_t lock;
+	struct block_device *bdev;
+	sector_t sector;
+	sector_t count;
+};
+
+/*
+ * The number of lists of free regions. The regions are sorted into the lists
+ * by the order of their size in pages.
+ */
+#define DIFF_STORAGE_FREE_ORDERS 16
+
+/*
+ * The maximum number of free regions checked in the list of the order of
+ * the request. Any region of the higher orders is large enough, so only the
+ * first one of them is taken.
+ */
+#define DIFF_STORAGE_FREE_SCAN_MAX 16
 
 /**
  * struct diff_storage - Difference storage.
@@ -19,25 +65,66 @@ struct diff_region;
  *	located on different block devices. So, all opened block devices are
  *	located in this list. Blocks on opened block devices are allocated for
  *	storing the chunks data.
- * @empty_blocks:
- *	List of empty blocks on storage. This list can be updated while
- *	holding a snapshot. This allows us to dynamically increase the
- *	storage size for these snapshots.
+ * @stripe_bdev:
+ *	The block device from which the storage is currently allocated.
+ * @stripe_credit:
+ *	The number of reservations that can still be taken from @stripe_bdev
+ *	before switching to the next device.
  * @filled_blocks:
  *	List of filled blocks. When the blocks from the list of empty blocks are filled,
  *	we move them to the list of filled blocks.
+ * @free_regions:
+ *	Lists of the regions that were used and then released. They are
+ *	allocated again before the empty blocks.
+ * @free_mask:
+ *	The bit mask of the non-empty lists of free regions.
  * @capacity:
  *	Total amount of available storage space.
  * @filled:
- *	The number of sectors already filled in.
+ *	The number of sectors already filled in, including the unused rest of
+ *	the reservations of the CPUs.
  * @requested:
  *	The number of sectors already requested from user space.
+ * @minimum:
+ *	The minimum portion in sectors requested from user space.
+ * @fill_rate:
+ *	The estimated rate of filling of the difference storage in sectors
+ *	per second.
+ * @rate_time:
+ *	The time in nanoseconds when the rate was last estimated.
+ * @rate_filled:
+ *	The number of sectors consumed at @rate_time.
  * @low_space_flag:
- *	The flag is set if the number of free regions available in the
- *	difference storage is less than the allowed minimum.
+ *	The number of requests for free space sent to user space that have
+ *	not been satisfied yet. It is reset when the capacity reaches the
+ *	requested size.
  * @overflow_flag:
  *	The request for a free region failed due to the absence of free
  *	regions in the difference storage.
+ * @reserves:
+ *	Per-CPU reservations of the difference storage.
+ * @durability:
+ *	The durability mode for writing to the difference storage. May contain
+ *	one of the values of &enum blk_snap_durability.
+ * @compression:
+ *	The algorithm for compressing the chunks stored in the difference
+ *	storage. May contain one of the values of &enum blk_snap_compression.
+ * @memory_limit:
+ *	The limit in bytes of the memory for keeping the compressed data of the
+ *	chunks in RAM. Zero if the chunks are not stored in the memory.
+ * @memory_used:
+ *	The size in bytes of the data of the chunks kept in the memory.
+ * @file:
+ *	The file that the module extends by itself when the free space is
+ *	running out. NULL if the space is requested from user space only.
+ * @file_size:
+ *	The size in bytes of the part of @file that has been appended to the
+ *	difference storage.
+ * @file_limit:
+ *	The maximum size in bytes of @file. Zero if it is not limited.
+ * @grow_work:
+ *	The workqueue work item. This worker extends @file and appends the new
+ *	blocks of it to the difference storage.
  * @event_queue:
  *	A queue of events to pass events to user space. Diff storage and its
  *	owner can notify its snapshot about events like snapshot overflow,
@@ -54,20 +141,41 @@ struct diff_storage {
 	spinlock_t lock;
 
 	struct list_head storage_bdevs;
-	struct list_head empty_blocks;
+	struct storage_bdev *stripe_bdev;
+	unsigned int stripe_credit;
 	struct list_head filled_blocks;
+	struct list_head free_regions[DIFF_STORAGE_FREE_ORDERS];
+	unsigned long free_mask;
 
 	sector_t capacity;
 	sector_t filled;
 	sector_t requested;
+	sector_t minimum;
+
+	u64 fill_rate;
+	u64 rate_time;
+	sector_t rate_filled;
 
 	atomic_t low_space_flag;
 	atomic_t overflow_flag;
 
+	struct diff_storage_reserve __percpu *reserves;
+
+	unsigned int durability;
+	unsigned int compression;
+	u64 memory_limit;
+	atomic64_t memory_used;
+
+	struct file *file;
+	loff_t file_size;
+	loff_t file_limit;
+	struct work_struct grow_work;
+
 	struct event_queue event_queue;
 };
 
-struct diff_storage *diff_storage_new(void);
+struct diff_storage *diff_storage_new(sector_t minimum,
+				      unsigned int device_count);
 void diff_storage_free(struct kref *kref);
 
 static inline void diff_storage_get(struct diff_storage *diff_storage)
@@ -83,13 +191,87 @@ static inline void diff_storage_put(struct diff_storage *diff_storage)
 int diff_storage_append_block(struct diff_storage *diff_storage, dev_t dev_id,
 			      struct blk_snap_block_range __user *ranges,
 			      unsigned int range_count);
-struct diff_region *diff_storage_new_region(struct diff_storage *diff_storage,
-					    sector_t count);
+#ifdef BLK_SNAP_BENCHMARK
+int diff_storage_append_range(struct diff_storage *diff_storage, dev_t dev_id,
+			      sector_t sector, sector_t count);
+#endif
+int diff_storage_set_weight(struct diff_storage *diff_storage, dev_t dev_id,
+			    unsigned int weight);
+#ifdef BLK_SNAP_MODIFICATION
+int diff_storage_set_file(struct diff_storage *diff_storage, struct file *file,
+			  loff_t size_limit);
+#endif
+int diff_storage_new_region(struct diff_storage *diff_storage, sector_t count,
+			    struct diff_region *region);
+int diff_storage_new_regions(struct diff_storage *diff_storage, sector_t count,
+			     unsigned int nr, struct diff_region **regions);
+void diff_storage_free_region(struct diff_storage *diff_storage,
+			      struct diff_region *region);
+
+/*
+ * Returns the request flags that provide the required durability of the data
+ * written to the difference storage.
+ */
+static inline unsigned int
+diff_storage_write_flags(struct diff_storage *diff_storage)
+{
+#ifdef BLK_SNAP_MODIFICATION
+	switch (READ_ONCE(diff_storage->durability)) {
+	case blk_snap_durability_flush:
+		return REQ_SYNC | REQ_PREFLUSH;
+	case blk_snap_durability_none:
+		return REQ_SYNC;
+	default:
+		break;
+	}
+#endif
+	return REQ_SYNC | REQ_FUA;
+}
+
+/*
+ * Returns true if the chunks should be compressed before storing them to the
+ * difference storage.
+ */
+static inline bool diff_storage_is_compressed(struct diff_storage *diff_storage)
+{
+#ifdef BLK_SNAP_MODIFICATION
+	return READ_ONCE(diff_storage->compression) != blk_snap_compression_none;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Returns true if the data of the chunks can be kept in the memory.
+ */
+static inline bool diff_storage_in_memory(struct diff_storage *diff_storage)
+{
+#ifdef BLK_SNAP_MODIFICATION
+	return READ_ONCE(diff_storage->memory_limit) != 0;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Reserves the memory for the data of a chunk. Returns false if the memory
+ * limit would be exceeded, then the chunk should be stored on the block
+ * devices of the difference storage.
+ */
+static inline bool diff_storage_memory_reserve(struct diff_storage *diff_storage,
+					       size_t size)
+{
+	if (atomic64_add_return(size, &diff_storage->memory_used) <=
+	    READ_ONCE(diff_storage->memory_limit))
+		return true;
+
+	atomic64_sub(size, &diff_storage->memory_used);
+	return false;
+}
 
-static inline void diff_storage_free_region(struct diff_region *region)
+static inline void diff_storage_memory_release(struct diff_storage *diff_storage,
+					       size_t size)
 {
-	kfree(region);
-	if (region)
-		memory_object_dec(memory_object_diff_region);
+	atomic64_sub(size, &diff_storage->memory_used);
 }
 #endif /* __BLK_SNAP_DIFF_STORAGE_H */
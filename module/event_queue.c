@@ -3,87 +3,306 @@
 
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/uaccess.h>
+#ifdef STANDALONE_BDEVFILTER
+#include "blksnap.h"
+#else
+#include <uapi/linux/blksnap.h>
+#endif
 #include "memory_checker.h"
 #include "event_queue.h"
 #include "log.h"
 
-void event_queue_init(struct event_queue *event_queue)
+static_assert(sizeof(struct blk_snap_event_low_free_space) <= EVENT_DATA_SIZE,
+	      "The low free space event does not fit in the event.");
+static_assert(sizeof(struct blk_snap_event_corrupted) <= EVENT_DATA_SIZE,
+	      "The corrupted event does not fit in the event.");
+
+/**
+ * event_queue_init() - Allocates the ring of the event queue.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @size:
+ *	The number of events in the ring.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int event_queue_init(struct event_queue *event_queue, unsigned int size)
 {
-	INIT_LIST_HEAD(&event_queue->list);
+	event_queue->ring = kcalloc(size, sizeof(struct event), GFP_KERNEL);
+	if (!event_queue->ring)
+		return -ENOMEM;
+	memory_object_inc(memory_object_event);
+
+	event_queue->size = size;
+	event_queue->head = 0;
+	event_queue->count = 0;
 	spin_lock_init(&event_queue->lock);
 	init_waitqueue_head(&event_queue->wq_head);
+	event_queue->is_closed = false;
+	return 0;
 }
 
 void event_queue_done(struct event_queue *event_queue)
 {
-	struct event *event;
+	if (!event_queue->ring)
+		return;
 
-	spin_lock(&event_queue->lock);
-	while (!list_empty(&event_queue->list)) {
-		event = list_first_entry(&event_queue->list, struct event,
-					 link);
-		list_del(&event->link);
-		event_free(event);
-	}
-	spin_unlock(&event_queue->lock);
+	kfree(event_queue->ring);
+	memory_object_dec(memory_object_event);
+	event_queue->ring = NULL;
+	event_queue->count = 0;
 }
 
-int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
-	      const void *data, int data_size)
+/**
+ * event_queue_close() - Marks that no more events will be generated.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ *
+ * The events remaining in the queue can still be read. After that, the
+ * readers of the event file descriptor get the end of the file.
+ */
+void event_queue_close(struct event_queue *event_queue)
 {
-	struct event *event;
+	WRITE_ONCE(event_queue->is_closed, true);
+	wake_up_all(&event_queue->wq_head);
+}
 
-	event = kzalloc(sizeof(struct event) + data_size, flags);
-	if (!event)
-		return -ENOMEM;
-	memory_object_inc(memory_object_event);
+static inline struct event *event_at(struct event_queue *event_queue,
+				     unsigned int inx)
+{
+	return &event_queue->ring[(event_queue->head + inx) %
+				  event_queue->size];
+}
+
+static inline bool event_queue_empty(struct event_queue *event_queue)
+{
+	return !READ_ONCE(event_queue->count);
+}
+
+/**
+ * event_gen() - Generates an event.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @code:
+ *	Event code.
+ * @data:
+ *	The event data.
+ * @data_size:
+ *	The size of the event data, up to EVENT_DATA_SIZE.
+ * @key_size:
+ *	The size of the beginning of the data that identifies the event.
+ * @merge:
+ *	Merges the data into the data of the pending event, or NULL to replace
+ *	the data.
+ *
+ * If the event with the same code and the same first @key_size bytes of the
+ * data has not been read yet, it is updated in place and keeps its position
+ * in the queue. With the zero @key_size, the event of the code is not
+ * duplicated at all. The function does not allocate memory and does not
+ * sleep, so it can be called on the I/O path.
+ *
+ * Return: 0 if succeeded, negative errno otherwise.
+ */
+int event_gen(struct event_queue *event_queue, int code, const void *data,
+	      int data_size, int key_size,
+	      void (*merge)(void *pending_data, const void *data))
+{
+	struct event *event = NULL;
+	unsigned int inx;
+
+	if (WARN_ON_ONCE(data_size > EVENT_DATA_SIZE || key_size > data_size))
+		return -EINVAL;
+
+	spin_lock(&event_queue->lock);
+	for (inx = 0; inx < event_queue->count; inx++) {
+		struct event *pending = event_at(event_queue, inx);
 
+		if ((pending->code == code) &&
+		    !memcmp(pending->data, data, key_size)) {
+			event = pending;
+			break;
+		}
+	}
+	if (event && merge) {
+		event->time = ktime_get();
+		merge(event->data, data);
+		spin_unlock(&event_queue->lock);
+		goto out;
+	}
+	if (!event) {
+		if (unlikely(event_queue->count == event_queue->size)) {
+			spin_unlock(&event_queue->lock);
+			pr_err("Event queue is full, event code=%d is lost\n",
+			       code);
+			return -ENOSPC;
+		}
+		event = event_at(event_queue, event_queue->count);
+		WRITE_ONCE(event_queue->count, event_queue->count + 1);
+	}
 	event->time = ktime_get();
 	event->code = code;
 	event->data_size = data_size;
 	memcpy(event->data, data, data_size);
+	spin_unlock(&event_queue->lock);
+out:
+	pr_debug("Generate event: code=%d data_size=%d\n", code, data_size);
+
+	wake_up(&event_queue->wq_head);
+	return 0;
+}
 
-	pr_debug("Generate event: time=%lld code=%d data_size=%d\n",
-		 event->time, event->code, event->data_size);
+static inline size_t event_record_size(struct event *event)
+{
+	return ALIGN(sizeof(struct blk_snap_event_header) + event->data_size,
+		     sizeof(__u64));
+}
+
+/*
+ * Takes the oldest event from the queue if it fits in the space. The event
+ * is copied, so its place in the ring can be reused at once.
+ */
+static bool event_take(struct event_queue *event_queue, size_t space,
+		       struct event *event, bool *is_too_big)
+{
+	bool taken = false;
 
 	spin_lock(&event_queue->lock);
-	list_add_tail(&event->link, &event_queue->list);
+	if (event_queue->count) {
+		struct event *oldest = event_at(event_queue, 0);
+
+		if (event_record_size(oldest) <= space) {
+			*event = *oldest;
+			event_queue->head = (event_queue->head + 1) %
+					    event_queue->size;
+			WRITE_ONCE(event_queue->count, event_queue->count - 1);
+			taken = true;
+		} else
+			*is_too_big = true;
+	}
 	spin_unlock(&event_queue->lock);
 
-	wake_up(&event_queue->wq_head);
-	return 0;
+	return taken;
 }
 
-struct event *event_wait(struct event_queue *event_queue,
-			 unsigned long timeout_ms)
+/**
+ * event_wait() - Waits for an event.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @timeout_ms:
+ *	Timeout for waiting in milliseconds.
+ * @event:
+ *	Returns the event.
+ *
+ * Return: 0 if succeeded, -ENOENT if there were no events during the
+ * timeout, negative errno otherwise.
+ */
+int event_wait(struct event_queue *event_queue, unsigned long timeout_ms,
+	       struct event *event)
 {
 	int ret;
+	bool is_too_big = false;
 
 	ret = wait_event_interruptible_timeout(event_queue->wq_head,
-					       !list_empty(&event_queue->list),
+					       !event_queue_empty(event_queue),
 					       timeout_ms);
 
 	if (ret > 0) {
-		struct event *event;
-
-		spin_lock(&event_queue->lock);
-		event = list_first_entry(&event_queue->list, struct event,
-					 link);
-		list_del(&event->link);
-		spin_unlock(&event_queue->lock);
+		/* The event could be taken by the reader of the file */
+		if (!event_take(event_queue, SIZE_MAX, event, &is_too_big))
+			return -ENOENT;
 
 		pr_debug("Event received: time=%lld code=%d\n", event->time,
 			 event->code);
-		return event;
+		return 0;
 	}
 	if (ret == 0)
-		return ERR_PTR(-ENOENT);
+		return -ENOENT;
 
 	if (ret == -ERESTARTSYS) {
 		pr_debug("event waiting interrupted\n");
-		return ERR_PTR(-EINTR);
+		return -EINTR;
 	}
 
 	pr_err("Failed to wait event. errno=%d\n", abs(ret));
-	return ERR_PTR(ret);
+	return ret;
+}
+
+__poll_t event_poll(struct event_queue *event_queue, struct file *file,
+		    poll_table *wait)
+{
+	__poll_t mask = 0;
+
+	poll_wait(file, &event_queue->wq_head, wait);
+
+	if (!event_queue_empty(event_queue))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(event_queue->is_closed))
+		mask |= EPOLLHUP;
+	return mask;
+}
+
+/**
+ * event_read() - Reads a batch of events to the user space buffer.
+ * @event_queue:
+ *	Pointer to &struct event_queue.
+ * @buf:
+ *	The user space buffer.
+ * @count:
+ *	The size of the buffer.
+ * @nonblock:
+ *	Do not wait for an event if the queue is empty.
+ *
+ * Each event is stored as &struct blk_snap_event_header followed by the
+ * event data and aligned to 8 bytes. As many events are read as fit in the
+ * buffer.
+ *
+ * Return: the number of bytes read, zero if the queue is closed and empty,
+ * negative errno otherwise.
+ */
+ssize_t event_read(struct event_queue *event_queue, char __user *buf,
+		   size_t count, bool nonblock)
+{
+	size_t copied = 0;
+	bool is_too_big = false;
+	struct event event;
+	int ret;
+
+	while (!copied) {
+		if (event_queue_empty(event_queue)) {
+			if (READ_ONCE(event_queue->is_closed))
+				return 0;
+			if (nonblock)
+				return -EAGAIN;
+
+			ret = wait_event_interruptible(event_queue->wq_head,
+				!event_queue_empty(event_queue) ||
+				READ_ONCE(event_queue->is_closed));
+			if (ret)
+				return ret;
+		}
+
+		while (event_take(event_queue, count - copied, &event,
+				  &is_too_big)) {
+			struct blk_snap_event_header header = {
+				.code = event.code,
+				.data_size = event.data_size,
+				.time_label = event.time,
+			};
+
+			if (copy_to_user(buf + copied, &header,
+					 sizeof(header)) ||
+			    copy_to_user(buf + copied + sizeof(header),
+					 event.data, event.data_size)) {
+				pr_err("Unable to read event: failed to copy data to user buffer\n");
+				return copied ? copied : -EFAULT;
+			}
+			copied += event_record_size(&event);
+		}
+
+		if (!copied && is_too_big)
+			return -EINVAL;
+	}
+
+	return copied;
 }
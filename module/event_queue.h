@@ -4,14 +4,18 @@
 
 #include <linux/types.h>
 #include <linux/ktime.h>
-#include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+
+/*
+ * The maximum size of the event data. It fits all the events of the
+ * &enum blk_snap_event_codes.
+ */
+#define EVENT_DATA_SIZE 64
 
 /**
  * struct event - An event to be passed to the user space.
- * @link:
- *	The list header allows to combine events from the queue.
  * @time:
  *	A timestamp indicates when an event occurred.
  * @code:
@@ -22,44 +26,60 @@
  *	An array of event data.
  *
  * Events can be different, so they contain different data. The size of the
- * data array is not defined exactly, but it has limitations. The size of
- * the event structure may exceed the PAGE_SIZE.
+ * data is limited by EVENT_DATA_SIZE.
  */
 struct event {
-	struct list_head link;
 	ktime_t time;
 	int code;
 	int data_size;
-	char data[1]; /* up to PAGE_SIZE - sizeof(struct blk_snap_snapshot_event) */
+	char data[EVENT_DATA_SIZE];
 };
 
 /**
  * struct event_queue - A queue of &struct event.
- * @list:
- *	Linked list for storing events.
+ * @ring:
+ *	The preallocated ring of events.
+ * @size:
+ *	The number of events in the @ring.
+ * @head:
+ *	The index of the oldest event in the @ring.
+ * @count:
+ *	The number of events in the queue.
  * @lock:
- *	Spinlock allows to guarantee safety of the linked list.
+ *	Spinlock allows to guarantee safety of the ring.
  * @wq_head:
  *	A wait queue allows to put a user thread in a waiting state until
- *	an event appears in the linked list.
+ *	an event appears in the queue.
+ * @is_closed:
+ *	No more events will be added to the queue, since the snapshot is
+ *	destroyed.
+ *
+ * The events are generated when processing the I/O, so the ring is allocated
+ * in advance, and the generation of an event never allocates memory. A new
+ * event replaces the pending event with the same code and the same key, see
+ * event_gen(). So the ring should have a place for each key of each code.
  */
 struct event_queue {
-	struct list_head list;
+	struct event *ring;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
 	spinlock_t lock;
 	struct wait_queue_head wq_head;
+	bool is_closed;
 };
 
-void event_queue_init(struct event_queue *event_queue);
+int event_queue_init(struct event_queue *event_queue, unsigned int size);
 void event_queue_done(struct event_queue *event_queue);
+void event_queue_close(struct event_queue *event_queue);
 
-int event_gen(struct event_queue *event_queue, gfp_t flags, int code,
-	      const void *data, int data_size);
-struct event *event_wait(struct event_queue *event_queue,
-			 unsigned long timeout_ms);
-static inline void event_free(struct event *event)
-{
-	kfree(event);
-	if (event)
-		memory_object_dec(memory_object_event);
-};
+int event_gen(struct event_queue *event_queue, int code, const void *data,
+	      int data_size, int key_size,
+	      void (*merge)(void *pending_data, const void *data));
+int event_wait(struct event_queue *event_queue, unsigned long timeout_ms,
+	       struct event *event);
+__poll_t event_poll(struct event_queue *event_queue, struct file *file,
+		    poll_table *wait);
+ssize_t event_read(struct event_queue *event_queue, char __user *buf,
+		   size_t count, bool nonblock);
 #endif /* __BLK_SNAP_EVENT_QUEUE_H */
@@ -4,6 +4,7 @@
 #include <linux/fs.h>
 #include <linux/kthread.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
 #include <linux/sched/task.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
@@ -24,30 +25,39 @@ struct log_request_header {
 };
 
 #define LOG_REQUEST_BUFFER_SIZE \
-	(512 - sizeof(struct list_head) - sizeof(struct log_request_header))
+	(512 - sizeof(struct log_request_header))
 
 struct log_request {
-	struct list_head link;
 	struct log_request_header header;
 	char buffer[LOG_REQUEST_BUFFER_SIZE];
 };
 
-#define LOG_REQUEST_POOL_SIZE 128
-struct log_request log_requests_pool[LOG_REQUEST_POOL_SIZE];
+/*
+ * Each CPU puts the messages into its own ring, so the CPUs do not contend
+ * for the lock on the hot path. The ring has only one producer, the CPU with
+ * the interrupts disabled, and only one consumer, the log_processor.
+ * If the ring is full, the message is dropped and counted as missed.
+ */
+#define LOG_RING_SIZE 32
+
+struct log_ring {
+	unsigned int head;
+	unsigned int tail;
+	unsigned int missed;
+	unsigned int missed_reported;
+	struct log_request requests[LOG_RING_SIZE];
+};
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0,
+	"The size of the log ring should be a power of two.");
 
 static int log_level = -1;
 static char *log_filepath = NULL;
 static int log_tz_minuteswest = 0;
 
-static LIST_HEAD(log_free_requests);
-static DEFINE_SPINLOCK(log_free_requests_lock);
-
-static LIST_HEAD(log_active_requests);
-static DEFINE_SPINLOCK(log_active_requests_lock);
+static struct log_ring __percpu *log_rings = NULL;
 
 static DECLARE_WAIT_QUEUE_HEAD(log_request_event_add);
 static struct task_struct* log_task = NULL;
-static atomic_t log_missed_counter = {0};
 
 static inline const char* get_module_name(void)
 {
@@ -58,19 +68,6 @@ static inline const char* get_module_name(void)
 #endif
 }
 
-void log_init(void)
-{
-	size_t inx;
-
-	INIT_LIST_HEAD(&log_free_requests);
-	for (inx=0; inx < LOG_REQUEST_POOL_SIZE; inx++) {
-		struct log_request *rq = &log_requests_pool[inx];
-
-		INIT_LIST_HEAD(&rq->link);
-		list_add_tail(&rq->link, &log_free_requests);
-	}
-}
-
 static inline void done_task(void)
 {
 	if (!log_task)
@@ -90,72 +87,44 @@ static inline void done_filepath(void)
 	log_filepath = NULL;
 }
 
-void log_done(void)
+static inline void done_rings(void)
 {
-	log_level = -1;
-
-	done_task();
-	done_filepath();
-}
+	struct log_ring __percpu *rings = log_rings;
 
-static inline struct log_request *log_request_new(void)
-{
-	struct log_request *rq;
-
-	spin_lock(&log_free_requests_lock);
-	rq = list_first_entry_or_null(&log_free_requests,
-				      struct log_request, link);
-	if (rq)
-		list_del(&rq->link);
-	else
-		atomic_inc(&log_missed_counter);
-	spin_unlock(&log_free_requests_lock);
-
-	return rq;
-}
-
-
-static inline void log_request_free(struct log_request *rq)
-{
-	INIT_LIST_HEAD(&rq->link);
-
-	spin_lock(&log_free_requests_lock);
-	list_add_tail(&rq->link, &log_free_requests);
-	spin_unlock(&log_free_requests_lock);
-}
-
-static inline void log_request_push(struct log_request *rq)
-{
-	INIT_LIST_HEAD(&rq->link);
+	if (!rings)
+		return;
 
-	spin_lock(&log_active_requests_lock);
-	list_add_tail(&rq->link, &log_active_requests);
-	spin_unlock(&log_active_requests_lock);
+	/*
+	 * Wait for the CPUs that are putting messages into the rings right
+	 * now. The log_processor drains the rings before it stops.
+	 */
+	WRITE_ONCE(log_rings, NULL);
+	synchronize_rcu();
+	done_task();
+	free_percpu(rings);
 }
 
-static inline struct log_request *log_request_get(void)
+void log_done(void)
 {
-	struct log_request *rq;
-
-	spin_lock(&log_active_requests_lock);
-	rq = list_first_entry_or_null(&log_active_requests,
-				      struct log_request, link);
-	if (rq)
-		list_del(&rq->link);
-	spin_unlock(&log_active_requests_lock);
+	log_level = -1;
 
-	return rq;
+	done_rings();
+	done_task();
+	done_filepath();
 }
 
-static inline bool log_request_is_ready(void)
+static inline bool log_request_is_ready(struct log_ring __percpu *rings)
 {
-	bool ret;
+	int cpu;
 
-	spin_lock(&log_active_requests_lock);
-	ret = !list_empty(&log_active_requests);
-	spin_unlock(&log_active_requests_lock);
+	for_each_possible_cpu(cpu) {
+		struct log_ring *ring = per_cpu_ptr(rings, cpu);
 
-	return ret;
+		if ((smp_load_acquire(&ring->head) != ring->tail) ||
+		    (READ_ONCE(ring->missed) != ring->missed_reported))
+			return true;
+	}
+	return false;
 }
 
 #define MAX_PREFIX_SIZE 256
@@ -186,12 +155,12 @@ static inline void log_request_write(struct file* filp, const struct log_request
 	kernel_write(filp, rq->buffer, rq->header.size, &filp->f_pos);
 }
 
-static inline bool log_waiting(void)
+static inline bool log_waiting(struct log_ring __percpu *rings)
 {
 	int ret;
 
 	ret = wait_event_interruptible_timeout(log_request_event_add,
-		log_request_is_ready() || kthread_should_stop(), 10 * HZ);
+		log_request_is_ready(rings) || kthread_should_stop(), 10 * HZ);
 
 	return (ret > 0);
 }
@@ -249,40 +218,63 @@ static inline struct file* log_close(struct file* filp)
 	return filp;
 }
 
+/*
+ * Writes all messages that are in the ring at the moment, and releases the
+ * slots of the ring one by one. Returns the number of written messages.
+ */
+static unsigned int log_ring_drain(struct log_ring *ring, struct file **pfilp)
+{
+	unsigned int head = smp_load_acquire(&ring->head);
+	unsigned int tail = ring->tail;
+	unsigned int missed = READ_ONCE(ring->missed);
+	unsigned int count = head - tail;
+
+	if (missed != ring->missed_reported) {
+		*pfilp = log_reopen(*pfilp);
+		log_printk_direct(*pfilp, LOGLEVEL_INFO,
+			"Missed %u messages\n", missed - ring->missed_reported);
+		ring->missed_reported = missed;
+	}
+	if (!count)
+		return 0;
+
+	*pfilp = log_reopen(*pfilp);
+	while (tail != head) {
+		log_request_write(*pfilp,
+				  &ring->requests[tail & (LOG_RING_SIZE - 1)]);
+		smp_store_release(&ring->tail, ++tail);
+	}
+	return count;
+}
+
+static unsigned int log_rings_drain(struct log_ring __percpu *rings,
+				    struct file **pfilp)
+{
+	unsigned int count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += log_ring_drain(per_cpu_ptr(rings, cpu), pfilp);
+	return count;
+}
+
 int log_processor(void *data)
 {
 	int ret = 0;
-	struct log_request *rq;
+	struct log_ring __percpu *rings = data;
 	struct file* filp = NULL;
-	int missed;
 
 	while (!kthread_should_stop()) {
-		missed = atomic_read(&log_missed_counter);
-		if (missed) {
-			atomic_sub(missed, &log_missed_counter);
-
-			filp = log_reopen(filp);
-			log_printk_direct(filp, LOGLEVEL_INFO,
-				"Missed %d messages\n", missed);
-		}
-
-		rq = log_request_get();
-		if (rq) {
-			filp = log_reopen(filp);
-			log_request_write(filp, rq);
-			log_request_free(rq);
+		if (log_rings_drain(rings, &filp)) {
 			if (!filp)
 				break;
 		} else
-			if (!log_waiting())
+			if (!log_waiting(rings))
 				filp = log_close(filp);
 	}
 
 	filp = log_reopen(filp);
-	while ((rq = log_request_get())) {
-		log_request_write(filp, rq);
-		log_request_free(rq);
-	}
+	log_rings_drain(rings, &filp);
 
 	log_printk_direct(filp, LOGLEVEL_INFO, "Stop log for module %s\n\n",
 		get_module_name());
@@ -296,6 +288,7 @@ int log_restart(int level, char *filepath, int tz_minuteswest)
 	int ret = 0;
 	struct file* filp;
 	struct task_struct* task;
+	struct log_ring __percpu *rings;
 
 	if ((level < 0) && !filepath){
 		/*
@@ -328,7 +321,6 @@ int log_restart(int level, char *filepath, int tz_minuteswest)
 	}
 
 	log_done();
-	log_init();
 
 	filp = filp_open(filepath, O_WRONLY | O_APPEND | O_CREAT, 0644);
 	if (IS_ERR(filp)) {
@@ -344,13 +336,25 @@ int log_restart(int level, char *filepath, int tz_minuteswest)
 		goto fail;
 	}
 
-	task = kthread_create(log_processor, NULL, "blksnaplog");
+	rings = alloc_percpu(struct log_ring);
+	if (!rings) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	task = kthread_create(log_processor, rings, "blksnaplog");
 	if (IS_ERR(task)) {
+		free_percpu(rings);
 		ret = PTR_ERR(task);
 		goto fail;
 	}
 
 	log_task = task;
+	/*
+	 * The rings are published after the log task is set, so the writers
+	 * that see the rings with READ_ONCE() also see the task to wake up.
+	 */
+	smp_store_release(&log_rings, rings);
 	log_filepath = filepath;
 	log_level = level <= LOGLEVEL_DEBUG ? level : LOGLEVEL_DEBUG;
 	log_tz_minuteswest = tz_minuteswest;
@@ -370,15 +374,41 @@ fail:
 
 static void log_vprintk(const int level, const char *fmt, va_list args)
 {
-	struct log_request *rq;
-
-	rq = log_request_new();
-	if (!rq)
-		return;
-
-	log_request_fill(rq, level, fmt, args);
-	log_request_push(rq);
-	wake_up(&log_request_event_add);
+	struct log_ring __percpu *rings;
+	struct log_ring *ring;
+	unsigned long flags;
+	unsigned int head;
+	bool is_pushed = false;
+
+	rcu_read_lock();
+	rings = READ_ONCE(log_rings);
+	if (!rings)
+		goto out;
+
+	/*
+	 * The interrupts are disabled so that the message is not interrupted
+	 * by another message on the same CPU.
+	 */
+	local_irq_save(flags);
+	ring = this_cpu_ptr(rings);
+	head = ring->head;
+	if ((head - smp_load_acquire(&ring->tail)) < LOG_RING_SIZE) {
+		log_request_fill(&ring->requests[head & (LOG_RING_SIZE - 1)],
+				 level, fmt, args);
+		smp_store_release(&ring->head, head + 1);
+		is_pushed = true;
+	} else
+		WRITE_ONCE(ring->missed, ring->missed + 1);
+	local_irq_restore(flags);
+
+	/*
+	 * The lock of the wait queue is taken only when the log_processor is
+	 * waiting. Otherwise, it writes the message with the current batch.
+	 */
+	if (is_pushed && wq_has_sleeper(&log_request_event_add))
+		wake_up(&log_request_event_add);
+out:
+	rcu_read_unlock();
 }
 
 void log_printk(const int level, const char *fmt, ...)
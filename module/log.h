@@ -4,7 +4,6 @@
 
 #ifdef BLK_SNAP_FILELOG
 
-void log_init(void);
 void log_done(void);
 int log_restart(int level, char *filepath, int tz_minuteswest);
 void log_printk(const int level, const char *fmt, ...);
@@ -85,8 +84,6 @@ void log_printk(const int level, const char *fmt, ...);
 #endif
 
 #else
-static inline void log_init(void)
-{};
 static inline void log_done(void)
 {};
 #endif /* BLK_SNAP_FILELOG */
@@ -3,6 +3,11 @@
 
 #include <linux/module.h>
 #include <linux/miscdevice.h>
+#include <linux/file.h>
+#if defined(BLK_SNAP_MODIFICATION) && defined(CONFIG_DEBUG_FS)
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#endif
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -13,8 +18,15 @@
 #include "snapshot.h"
 #include "tracker.h"
 #include "diff_io.h"
+#include "event_queue.h"
+#include "chunk.h"
+#include "chunk_cache.h"
 #include "version.h"
 #include "log.h"
+#include "benchmark.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
 
 static_assert(sizeof(uuid_t) == sizeof(struct blk_snap_uuid),
 	"Invalid size of struct blk_snap_uuid.");
@@ -99,14 +111,28 @@ int chunk_minimum_shift = 18;
 int chunk_maximum_count = 2097152;
 
 /*
- * The maximum number of chunks in memory cache.
+ * The maximum size of memory cache of chunks in MiB.
  * Since reading and writing to snapshots is performed in large chunks,
  * a cache is implemented to optimize reading small portions of data
- * from the snapshot image. As the number of chunks in the cache
- * increases, memory consumption also increases.
- * The minimum recommended value is four.
+ * from the snapshot image. The cache is shared by all block devices of the
+ * snapshot. As the size of the cache increases, memory consumption also
+ * increases.
+ * The minimum recommended value is four chunks.
+ * The deprecated parameter chunk_maximum_in_cache sets it by the number of
+ * chunks of the minimum size.
+ */
+int chunk_cache_size = 64;
+
+/*
+ * The number of chunks to read in advance.
+ * Snapshot images are usually read sequentially by backup software. When
+ * sequential reading is detected, the specified number of chunks following
+ * the current request are loaded into the cache in advance. The chunks read
+ * in advance cannot take more than a quarter of the memory cache. Zero
+ * disables read-ahead. It can be changed for a certain snapshot image by the
+ * ioctl.
  */
-int chunk_maximum_in_cache = 32;
+int chunk_read_ahead = 4;
 
 /*
  * The size of the pool of preallocated difference buffers.
@@ -125,6 +151,71 @@ int free_diff_buffer_pool_size = 128;
  */
 int diff_storage_minimum = 2097152;
 
+/*
+ * The time in seconds for which the free space of the difference storage
+ * should last at the current rate of its filling. When the free space is
+ * less, more space is requested from user space. The requested portion is
+ * also sized to last for this time, but is not less than the minimum.
+ */
+int diff_storage_lead_time = 10;
+
+/*
+ * The number of worker threads for each snapshot image.
+ * The I/O units of the snapshot image are distributed between the worker
+ * threads by chunk number, so that requests to different chunks are processed
+ * in parallel. The number of threads cannot exceed the number of online CPUs.
+ * If zero, up to four worker threads are created, since each image of each
+ * snapshot has its own threads.
+ */
+int snapimage_worker_count = 0;
+
+/*
+ * Non-blocking copy-on-write mode.
+ * By default, a write to the original device is held until the data of the
+ * affected chunks is stored in the difference storage. In non-blocking mode,
+ * the write is released as soon as the data is read into memory, and storing
+ * is performed in the background.
+ */
+int nonblocking_cow = 0;
+
+/*
+ * The memory limit for non-blocking copy-on-write in MiB.
+ * The chunks that are being stored in the background keep their data in
+ * memory. If the size of this data exceeds the limit, the writes to the
+ * original device are held until the data is stored, as in the default mode.
+ */
+int nonblocking_cow_memory_limit = 256;
+
+/*
+ * Redirect the reads of the snapshot image.
+ * The parts of the read requests that fall into chunks which have not been
+ * copied are sent directly to the original device, and the parts that fall
+ * into chunks which have been stored are sent directly to the difference
+ * storage, without copying the data through the difference buffers.
+ */
+int image_read_remap = 1;
+
+/*
+ * The I/O to the snapshot image waits for the copy-on-write operations of the
+ * original device to complete. The image I/O proceeds when the number of
+ * incomplete operations drops to image_throttling_limit, or when
+ * image_throttling_timeout in milliseconds expires. Zero limit means that
+ * the image I/O yields to any copy-on-write operation, zero timeout disables
+ * throttling.
+ */
+int image_throttling_limit;
+int image_throttling_timeout = 100;
+
+/*
+ * The NUMA placement of the snapshot image workers, the difference buffers
+ * and the completions of the copy-on-write I/O. Zero leaves it to the
+ * scheduler. One places them on the node of the original device. Two also
+ * places them on the node of the original device, but the I/O completions
+ * run on the node of the device being read or written, so the stores to the
+ * difference storage complete on its node.
+ */
+int numa_affinity;
+
 #ifdef STANDALONE_BDEVFILTER
 static const struct blk_snap_version version = {
 	.major = VERSION_MAJOR,
@@ -284,46 +375,58 @@ static int ioctl_tracker_mark_dirty_blocks(unsigned long arg)
 	return ret;
 }
 
-static int ioctl_snapshot_create(unsigned long arg)
+static int snapshot_create_from_user(struct blk_snap_dev __user *user_dev_id_array,
+				     unsigned int count,
+				     const struct snapshot_options *options,
+				     uuid_t *id)
 {
 	int ret;
-	struct blk_snap_snapshot_create karg;
 	struct blk_snap_dev *dev_id_array = NULL;
-	uuid_t new_id;
-
-	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
-		pr_err("Unable to create snapshot: invalid user buffer\n");
-		return -ENODATA;
-	}
 
-	dev_id_array =
-		kcalloc(karg.count, sizeof(struct blk_snap_dev), GFP_KERNEL);
+	dev_id_array = kcalloc(count, sizeof(struct blk_snap_dev), GFP_KERNEL);
 	if (dev_id_array == NULL) {
 		pr_err("Unable to create snapshot: too many devices %d\n",
-		       karg.count);
+		       count);
 		return -ENOMEM;
 	}
 	memory_object_inc(memory_object_blk_snap_dev);
 
-	if (copy_from_user(dev_id_array, (void *)karg.dev_id_array,
-			   karg.count * sizeof(struct blk_snap_dev))) {
+	if (copy_from_user(dev_id_array, user_dev_id_array,
+			   count * sizeof(struct blk_snap_dev))) {
 		pr_err("Unable to create snapshot: invalid user buffer\n");
 		ret = -ENODATA;
 		goto out;
 	}
 
-	ret = snapshot_create(dev_id_array, karg.count, &new_id);
+	ret = snapshot_create(dev_id_array, count, options, id);
+out:
+	kfree(dev_id_array);
+	memory_object_dec(memory_object_blk_snap_dev);
+
+	return ret;
+}
+
+static int ioctl_snapshot_create(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_create karg;
+	uuid_t new_id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ret = snapshot_create_from_user(karg.dev_id_array, karg.count, NULL,
+					&new_id);
 	if (ret)
-		goto out;
+		return ret;
 
 	export_uuid(karg.id.b, &new_id);
 	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
 		pr_err("Unable to create snapshot: invalid user buffer\n");
 		ret = -ENODATA;
 	}
-out:
-	kfree(dev_id_array);
-	memory_object_dec(memory_object_blk_snap_dev);
 
 	return ret;
 }
@@ -378,7 +481,7 @@ static int ioctl_snapshot_wait_event(unsigned long arg)
 	int ret = 0;
 	struct blk_snap_snapshot_event *karg;
 	uuid_t id;
-	struct event *event;
+	struct event event;
 
 	karg = kzalloc(sizeof(struct blk_snap_snapshot_event), GFP_KERNEL);
 	if (!karg)
@@ -395,24 +498,22 @@ static int ioctl_snapshot_wait_event(unsigned long arg)
 	}
 
 	import_uuid(&id, karg->id.b);
-	event = snapshot_wait_event(&id, karg->timeout_ms);
-	if (IS_ERR(event)) {
-		ret = PTR_ERR(event);
+	ret = snapshot_wait_event(&id, karg->timeout_ms, &event);
+	if (ret)
 		goto out;
-	}
 
-	pr_debug("Received event=%lld code=%d data_size=%d\n", event->time,
-		 event->code, event->data_size);
-	karg->code = event->code;
-	karg->time_label = event->time;
+	pr_debug("Received event=%lld code=%d data_size=%d\n", event.time,
+		 event.code, event.data_size);
+	karg->code = event.code;
+	karg->time_label = event.time;
 
-	if (event->data_size > sizeof(karg->data)) {
-		pr_err("Event size %d is too big\n", event->data_size);
+	if (event.data_size > sizeof(karg->data)) {
+		pr_err("Event size %d is too big\n", event.data_size);
 		ret = -ENOSPC;
 		/* If we can't copy all the data, we copy only part of it. */
 	}
-	memcpy(karg->data, event->data, event->data_size);
-	event_free(event);
+	memcpy(karg->data, event.data,
+	       min_t(size_t, event.data_size, sizeof(karg->data)));
 
 	if (copy_to_user((void *)arg, karg,
 			 sizeof(struct blk_snap_snapshot_event))) {
@@ -500,6 +601,26 @@ static const struct blk_snap_mod modification = {
 #ifdef BLK_SNAP_FILELOG
 	(1ull << blk_snap_compat_flag_setlog) |
 #endif
+	(1ull << blk_snap_compat_flag_read_ahead) |
+	(1ull << blk_snap_compat_flag_durability) |
+	(1ull << blk_snap_compat_flag_cbt_ranges) |
+	(1ull << blk_snap_compat_flag_cbt_persistent) |
+	(1ull << blk_snap_compat_flag_cbt_granularity) |
+	(1ull << blk_snap_compat_flag_cbt_mmap) |
+	(1ull << blk_snap_compat_flag_staged_take) |
+	(1ull << blk_snap_compat_flag_stats) |
+	(1ull << blk_snap_compat_flag_unused_blocks) |
+	(1ull << blk_snap_compat_flag_compression) |
+	(1ull << blk_snap_compat_flag_memory_storage) |
+	(1ull << blk_snap_compat_flag_storage_striping) |
+	(1ull << blk_snap_compat_flag_memory_stats) |
+	(1ull << blk_snap_compat_flag_event_fd) |
+	(1ull << blk_snap_compat_flag_snapshot_options) |
+	(1ull << blk_snap_compat_flag_release_blocks) |
+	(1ull << blk_snap_compat_flag_storage_file) |
+	(1ull << blk_snap_compat_flag_chunk_hashes) |
+	(1ull << blk_snap_compat_flag_cbt_since) |
+	(1ull << blk_snap_compat_flag_cbt_multi) |
 	0
 };
 
@@ -585,15 +706,769 @@ static int ioctl_get_sector_state(unsigned long arg)
 #endif
 }
 
+static int ioctl_set_read_ahead(unsigned long arg)
+{
+	struct blk_snap_set_read_ahead karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set read-ahead: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return snapshot_set_read_ahead(MKDEV(karg.image_dev_id.mj,
+					     karg.image_dev_id.mn),
+				       karg.chunk_count);
+}
+
+static int ioctl_snapshot_set_durability(unsigned long arg)
+{
+	struct blk_snap_snapshot_durability karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set durability mode: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_durability(&id, karg.mode);
+}
+
+static int ioctl_tracker_read_cbt_ranges(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_tracker_read_cbt_ranges karg;
+	sector_t sector_offset;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (karg.snap_number > U8_MAX) {
+		pr_err("Unable to read CBT ranges: invalid snapshot number\n");
+		return -EINVAL;
+	}
+
+	sector_offset = karg.sector_offset;
+	ret = tracker_read_cbt_ranges(MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+				      (u8)karg.snap_number, &sector_offset,
+				      karg.ranges, &karg.count);
+	if (ret)
+		return ret;
+
+	karg.sector_offset = sector_offset;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_tracker_export_cbt(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_cbt_state karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to export CBT: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ret = tracker_export_cbt(MKDEV(karg.dev_id.mj, karg.dev_id.mn), &karg);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to export CBT: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_tracker_import_cbt(unsigned long arg)
+{
+	struct blk_snap_cbt_state karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to import CBT: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return tracker_import_cbt(MKDEV(karg.dev_id.mj, karg.dev_id.mn), &karg);
+}
+
+static int ioctl_tracker_set_granularity(unsigned long arg)
+{
+	struct blk_snap_tracker_granularity karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set CBT block size: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return tracker_set_granularity(MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+				       karg.blk_size, karg.blk_count_max);
+}
+
+static int ioctl_snapshot_set_cbt_limit(unsigned long arg)
+{
+	struct blk_snap_snapshot_cbt_limit karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set CBT memory limit: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_cbt_limit(&id, karg.memory_limit);
+}
+
+static int ioctl_tracker_map_cbt(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_tracker_map_cbt karg;
+	struct file *file;
+	int fd;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to map CBT: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0)
+		return fd;
+
+	ret = tracker_map_cbt(MKDEV(karg.dev_id.mj, karg.dev_id.mn), &karg,
+			      &file);
+	if (ret) {
+		put_unused_fd(fd);
+		return ret;
+	}
+
+	karg.fd = fd;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to map CBT: invalid user buffer\n");
+		fput(file);
+		put_unused_fd(fd);
+		return -ENODATA;
+	}
+
+	/* The file descriptor becomes visible to the user space only now */
+	fd_install(fd, file);
+	return 0;
+}
+
+static int ioctl_snapshot_prepare(unsigned long arg)
+{
+	struct blk_snap_snapshot_prepare karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to prepare snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_prepare(&id);
+}
+
+static int ioctl_snapshot_abort(unsigned long arg)
+{
+	struct blk_snap_snapshot_prepare karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to abort snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_abort(&id);
+}
+
+static int ioctl_snapshot_timing(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_timing karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get snapshot timing: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_get_timing(&id, &karg.prepare_time_ns,
+				  &karg.freeze_time_ns);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get snapshot timing: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_snapshot_stats(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_stats karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get snapshot statistics: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_get_stats(&id, karg.stats_array, &karg.count);
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get snapshot statistics: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return ret;
+}
+
+static int ioctl_snapshot_unused_blocks(unsigned long arg)
+{
+	int ret = 0;
+	struct blk_snap_snapshot_unused_blocks karg;
+	struct blk_snap_block_range *ranges;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set unused blocks: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ranges = kcalloc(karg.count, sizeof(struct blk_snap_block_range),
+			 GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_block_range);
+
+	import_uuid(&id, karg.id.b);
+	if (!copy_from_user(ranges, (void *)karg.unused_blocks_array,
+			    karg.count * sizeof(struct blk_snap_block_range)))
+		ret = snapshot_set_unused_blocks(&id,
+					MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+					ranges, karg.count);
+	else {
+		pr_err("Unable to set unused blocks: invalid user buffer\n");
+		ret = -ENODATA;
+	}
+
+	kfree(ranges);
+	memory_object_dec(memory_object_blk_snap_block_range);
+
+	return ret;
+}
+
+static int ioctl_snapshot_set_compression(unsigned long arg)
+{
+	struct blk_snap_snapshot_compression karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set compression algorithm: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_compression(&id, karg.algorithm);
+}
+
+static int ioctl_snapshot_set_memory_storage(unsigned long arg)
+{
+	struct blk_snap_snapshot_memory_storage karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set memory storage limit: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_memory_storage(&id, karg.memory_limit);
+}
+
+static int ioctl_snapshot_set_storage_weight(unsigned long arg)
+{
+	struct blk_snap_snapshot_storage_weight karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set storage weight: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	return snapshot_set_storage_weight(&id,
+					   MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+					   karg.weight);
+}
+
+static int ioctl_memory_stats(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_memory_stats karg;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get memory statistics: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ret = memory_object_get_stats(karg.objects_array, &karg.count);
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get memory statistics: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return ret;
+}
+
+static int ioctl_snapshot_event_fd(unsigned long arg)
+{
+	struct blk_snap_snapshot_event_fd karg;
+	struct file *file;
+	uuid_t id;
+	int fd;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get event file descriptor: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (karg.flags & ~(O_CLOEXEC | O_NONBLOCK))
+		return -EINVAL;
+
+	fd = get_unused_fd_flags(karg.flags & O_CLOEXEC);
+	if (fd < 0)
+		return fd;
+
+	import_uuid(&id, karg.id.b);
+	file = snapshot_event_file(&id, karg.flags);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		return PTR_ERR(file);
+	}
+
+	karg.fd = fd;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get event file descriptor: invalid user buffer\n");
+		fput(file);
+		put_unused_fd(fd);
+		return -ENODATA;
+	}
+
+	/* The file descriptor becomes visible to the user space only now */
+	fd_install(fd, file);
+	return 0;
+}
+
+static int snapshot_options_import(struct snapshot_options *options,
+				   const struct blk_snap_snapshot_options *opt)
+{
+	snapshot_options_init(options);
+
+	if (opt->mask & ~((1ull << blk_snap_snapshot_option_end) - 1))
+		return -EINVAL;
+
+	if (opt->mask & (1ull << blk_snap_snapshot_option_chunk_shift)) {
+		if ((opt->chunk_shift < PAGE_SHIFT) || (opt->chunk_shift > 30))
+			return -EINVAL;
+		options->chunk_shift = opt->chunk_shift;
+	}
+	if (opt->mask & (1ull << blk_snap_snapshot_option_read_ahead))
+		options->read_ahead = opt->read_ahead;
+	if (opt->mask & (1ull << blk_snap_snapshot_option_cache_size))
+		options->cache_size = opt->cache_size;
+	if (opt->mask & (1ull << blk_snap_snapshot_option_storage_increment)) {
+		if (!opt->storage_increment)
+			return -EINVAL;
+		options->storage_increment = opt->storage_increment;
+	}
+	if (opt->mask & (1ull << blk_snap_snapshot_option_durability)) {
+		if (opt->durability >= blk_snap_durability_end)
+			return -EINVAL;
+		options->durability = opt->durability;
+	}
+	if (opt->mask & (1ull << blk_snap_snapshot_option_worker_count))
+		options->worker_count = opt->worker_count;
+	if (opt->mask & (1ull << blk_snap_snapshot_option_read_once))
+		options->read_once = true;
+	if (opt->mask & (1ull << blk_snap_snapshot_option_chunk_auto))
+		options->chunk_auto = true;
+	if (opt->mask & (1ull << blk_snap_snapshot_option_chunk_hash))
+		options->chunk_hash = true;
+
+	return 0;
+}
+
+static int ioctl_snapshot_create_ex(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_create_ex karg;
+	struct snapshot_options options;
+	uuid_t new_id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ret = snapshot_options_import(&options, &karg.options);
+	if (ret) {
+		pr_err("Unable to create snapshot: invalid options\n");
+		return ret;
+	}
+
+	ret = snapshot_create_from_user(karg.dev_id_array, karg.count,
+					&options, &new_id);
+	if (ret)
+		return ret;
+
+	export_uuid(karg.id.b, &new_id);
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to create snapshot: invalid user buffer\n");
+		ret = -ENODATA;
+	}
+
+	return ret;
+}
+
+static int ioctl_snapshot_release_blocks(unsigned long arg)
+{
+	int ret = 0;
+	struct blk_snap_snapshot_release_blocks karg;
+	struct blk_snap_block_range *ranges;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to release blocks: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	ranges = kcalloc(karg.count, sizeof(struct blk_snap_block_range),
+			 GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_block_range);
+
+	import_uuid(&id, karg.id.b);
+	if (!copy_from_user(ranges, (void *)karg.released_blocks_array,
+			    karg.count * sizeof(struct blk_snap_block_range)))
+		ret = snapshot_release_blocks(&id,
+					MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+					ranges, karg.count);
+	else {
+		pr_err("Unable to release blocks: invalid user buffer\n");
+		ret = -ENODATA;
+	}
+
+	kfree(ranges);
+	memory_object_dec(memory_object_blk_snap_block_range);
+
+	return ret;
+}
+
+static int ioctl_snapshot_set_storage_file(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_storage_file karg;
+	struct file *file;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to set difference storage file: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (karg.flags)
+		return -EINVAL;
+
+	file = fget(karg.fd);
+	if (!file)
+		return -EBADF;
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_set_storage_file(&id, file, karg.size_limit);
+	fput(file);
+
+	return ret;
+}
+
+static int ioctl_snapshot_chunk_hashes(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_snapshot_chunk_hashes karg;
+	uuid_t id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to get chunk hashes: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	import_uuid(&id, karg.id.b);
+	ret = snapshot_get_chunk_hashes(&id,
+					MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+					karg.first,
+					u64_to_user_ptr(karg.hashes_array),
+					&karg.count, &karg.chunk_shift);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to get chunk hashes: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_tracker_read_cbt_since(unsigned long arg)
+{
+	int ret;
+	struct blk_snap_tracker_read_cbt_since karg;
+	sector_t sector_offset;
+	uuid_t generation_id;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	if (karg.snap_number > U8_MAX) {
+		pr_err("Unable to read CBT ranges: invalid snapshot number\n");
+		return -EINVAL;
+	}
+
+	import_uuid(&generation_id, karg.generation_id.b);
+	sector_offset = karg.sector_offset;
+	ret = tracker_read_cbt_since(MKDEV(karg.dev_id.mj, karg.dev_id.mn),
+				     &generation_id, (u8)karg.snap_number,
+				     &sector_offset, karg.ranges, &karg.count);
+	if (ret)
+		return ret;
+
+	karg.sector_offset = sector_offset;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	return 0;
+}
+
+static int ioctl_tracker_mark_dirty_multi(unsigned long arg)
+{
+	int ret = 0;
+	struct blk_snap_tracker_mark_dirty_multi karg;
+	struct blk_snap_tracker_mark_dirty_blocks *devices;
+	struct blk_snap_block_range *dirty_blks = NULL;
+	unsigned int max_count = 0;
+	unsigned int inx;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to mark dirty blocks: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	devices = kcalloc(karg.count,
+			  sizeof(struct blk_snap_tracker_mark_dirty_blocks),
+			  GFP_KERNEL);
+	if (!devices)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_mark_dirty_blocks);
+
+	if (copy_from_user(devices, (void *)karg.devices_array,
+			   karg.count *
+			   sizeof(struct blk_snap_tracker_mark_dirty_blocks))) {
+		pr_err("Unable to mark dirty blocks: invalid user buffer\n");
+		ret = -ENODATA;
+		goto out;
+	}
+
+	/* One buffer is enough for the ranges of all devices */
+	for (inx = 0; inx < karg.count; inx++)
+		max_count = max(max_count, devices[inx].count);
+	if (max_count) {
+		dirty_blks = kcalloc(max_count,
+				     sizeof(struct blk_snap_block_range),
+				     GFP_KERNEL);
+		if (!dirty_blks) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		memory_object_inc(memory_object_blk_snap_block_range);
+	}
+
+	for (inx = 0; inx < karg.count; inx++) {
+		struct blk_snap_tracker_mark_dirty_blocks *dev = &devices[inx];
+
+		if (copy_from_user(dirty_blks, (void *)dev->dirty_blocks_array,
+				   dev->count *
+				   sizeof(struct blk_snap_block_range))) {
+			pr_err("Unable to mark dirty blocks: invalid user buffer\n");
+			ret = -ENODATA;
+			break;
+		}
+
+		ret = mark_dirty_blocks(MKDEV(dev->dev_id.mj, dev->dev_id.mn),
+					dirty_blks, dev->count);
+		if (ret)
+			break;
+	}
+
+	if (dirty_blks) {
+		kfree(dirty_blks);
+		memory_object_dec(memory_object_blk_snap_block_range);
+	}
+
+	karg.count = inx;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to mark dirty blocks: invalid user buffer\n");
+		ret = -ENODATA;
+	}
+out:
+	kfree(devices);
+	memory_object_dec(memory_object_blk_snap_mark_dirty_blocks);
+
+	return ret;
+}
+
+static int ioctl_tracker_read_cbt_multi(unsigned long arg)
+{
+	int ret = 0;
+	struct blk_snap_tracker_read_cbt_multi karg;
+	struct blk_snap_tracker_read_cbt_since *requests;
+	unsigned int inx;
+
+	if (copy_from_user(&karg, (void *)arg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		return -ENODATA;
+	}
+
+	requests = kcalloc(karg.count,
+			   sizeof(struct blk_snap_tracker_read_cbt_since),
+			   GFP_KERNEL);
+	if (!requests)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_read_cbt_since);
+
+	if (copy_from_user(requests, (void *)karg.requests_array,
+			   karg.count *
+			   sizeof(struct blk_snap_tracker_read_cbt_since))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		ret = -ENODATA;
+		goto out;
+	}
+
+	for (inx = 0; inx < karg.count; inx++) {
+		struct blk_snap_tracker_read_cbt_since *req = &requests[inx];
+		sector_t sector_offset = req->sector_offset;
+		uuid_t generation_id;
+
+		if (req->snap_number > U8_MAX) {
+			pr_err("Unable to read CBT ranges: invalid snapshot number\n");
+			ret = -EINVAL;
+			break;
+		}
+
+		import_uuid(&generation_id, req->generation_id.b);
+		ret = tracker_read_cbt_since(MKDEV(req->dev_id.mj,
+						   req->dev_id.mn),
+					     &generation_id,
+					     (u8)req->snap_number,
+					     &sector_offset, req->ranges,
+					     &req->count);
+		if (ret)
+			break;
+		req->sector_offset = sector_offset;
+	}
+
+	if (copy_to_user((void *)karg.requests_array, requests,
+			 inx * sizeof(struct blk_snap_tracker_read_cbt_since))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		ret = -ENODATA;
+		goto out;
+	}
+
+	karg.count = inx;
+	if (copy_to_user((void *)arg, &karg, sizeof(karg))) {
+		pr_err("Unable to read CBT ranges: invalid user buffer\n");
+		ret = -ENODATA;
+	}
+out:
+	kfree(requests);
+	memory_object_dec(memory_object_blk_snap_read_cbt_since);
+
+	return ret;
+}
+
 static int (*const blk_snap_ioctl_table_mod[])(unsigned long arg) = {
 	ioctl_mod,
 	ioctl_setlog,
 	ioctl_get_sector_state,
+	ioctl_set_read_ahead,
+	ioctl_snapshot_set_durability,
+	ioctl_tracker_read_cbt_ranges,
+	ioctl_tracker_export_cbt,
+	ioctl_tracker_import_cbt,
+	ioctl_tracker_set_granularity,
+	ioctl_snapshot_set_cbt_limit,
+	ioctl_tracker_map_cbt,
+	ioctl_snapshot_prepare,
+	ioctl_snapshot_abort,
+	ioctl_snapshot_timing,
+	ioctl_snapshot_stats,
+	ioctl_snapshot_unused_blocks,
+	ioctl_snapshot_set_compression,
+	ioctl_snapshot_set_memory_storage,
+	ioctl_snapshot_set_storage_weight,
+	ioctl_memory_stats,
+	ioctl_snapshot_event_fd,
+	ioctl_snapshot_create_ex,
+	ioctl_snapshot_release_blocks,
+	ioctl_snapshot_set_storage_file,
+	ioctl_snapshot_chunk_hashes,
+	ioctl_tracker_read_cbt_since,
+	ioctl_tracker_mark_dirty_multi,
+	ioctl_tracker_read_cbt_multi,
 };
 static_assert(
 	sizeof(blk_snap_ioctl_table_mod) ==
 		((blk_snap_ioctl_end_mod - IOCTL_MOD) * sizeof(void *)),
 	"The size of table blk_snap_ioctl_table_mod does not match the enum blk_snap_ioctl.");
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *blksnap_debugfs_dir;
+
+DEFINE_SHOW_ATTRIBUTE(snapshot_stats);
+
+static void blk_snap_debugfs_init(void)
+{
+	blksnap_debugfs_dir = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("stats", 0444, blksnap_debugfs_dir, NULL,
+			    &snapshot_stats_fops);
+	benchmark_debugfs_init(blksnap_debugfs_dir);
+}
+
+static void blk_snap_debugfs_done(void)
+{
+	debugfs_remove_recursive(blksnap_debugfs_dir);
+}
+#endif
 #endif /*BLK_SNAP_MODIFICATION*/
 
 static long ctrl_unlocked_ioctl(struct file *filp, unsigned int cmd,
@@ -635,7 +1510,6 @@ static int __init blk_snap_init(void)
 {
 	int ret;
 
-	log_init();
 #ifdef STANDALONE_BDEVFILTER
 	pr_info("Loading\n");
 #else
@@ -648,28 +1522,53 @@ static int __init blk_snap_init(void)
 		 tracking_block_maximum_count);
 	pr_debug("chunk_minimum_shift: %d\n", chunk_minimum_shift);
 	pr_debug("chunk_maximum_count: %d\n", chunk_maximum_count);
-	pr_debug("chunk_maximum_in_cache: %d\n", chunk_maximum_in_cache);
+	pr_debug("chunk_cache_size: %d\n", chunk_cache_size);
+	pr_debug("chunk_read_ahead: %d\n", chunk_read_ahead);
 	pr_debug("free_diff_buffer_pool_size: %d\n",
 		 free_diff_buffer_pool_size);
 	pr_debug("diff_storage_minimum: %d\n", diff_storage_minimum);
+	pr_debug("diff_storage_lead_time: %d\n", diff_storage_lead_time);
+	pr_debug("snapimage_worker_count: %d\n", snapimage_worker_count);
+	pr_debug("nonblocking_cow: %d\n", nonblocking_cow);
+	pr_debug("nonblocking_cow_memory_limit: %d\n",
+		 nonblocking_cow_memory_limit);
+	pr_debug("image_read_remap: %d\n", image_read_remap);
+	pr_debug("image_throttling_limit: %d\n", image_throttling_limit);
+	pr_debug("image_throttling_timeout: %d\n", image_throttling_timeout);
+	pr_debug("numa_affinity: %d\n", numa_affinity);
 
 	ret = diff_io_init();
 	if (ret)
 		goto fail_diff_io_init;
 
+	ret = chunk_cache_init();
+	if (ret)
+		goto fail_chunk_cache_init;
+
 	ret = tracker_init();
 	if (ret)
 		goto fail_tracker_init;
 
+	ret = snapshot_init();
+	if (ret)
+		goto fail_snapshot_init;
+
 	ret = misc_register(&blksnap_ctrl_misc);
 	if (ret)
 		goto fail_misc_register;
 
+#if defined(BLK_SNAP_MODIFICATION) && defined(CONFIG_DEBUG_FS)
+	blk_snap_debugfs_init();
+#endif
 	return 0;
 
 fail_misc_register:
+	snapshot_done();
+fail_snapshot_init:
 	tracker_done();
 fail_tracker_init:
+	chunk_cache_done();
+fail_chunk_cache_init:
 	diff_io_done();
 fail_diff_io_init:
 	log_done();
@@ -683,12 +1582,18 @@ static void __exit blk_snap_exit(void)
 	pr_info("Unloading module\n");
 #else
 	pr_debug("Unloading module\n");
+#endif
+#if defined(BLK_SNAP_MODIFICATION) && defined(CONFIG_DEBUG_FS)
+	blk_snap_debugfs_done();
 #endif
 	misc_deregister(&blksnap_ctrl_misc);
 
-	diff_io_done();
 	snapshot_done();
 	tracker_done();
+	/* The workqueues are destroyed after the snapshots are released */
+	chunk_cache_done();
+	chunk_done();
+	diff_io_done();
 	log_done();
 	memory_object_print(true);
 	pr_debug("Module was unloaded\n");
@@ -711,9 +1616,50 @@ MODULE_PARM_DESC(chunk_minimum_shift,
 module_param_named(chunk_maximum_count, chunk_maximum_count, int, 0644);
 MODULE_PARM_DESC(chunk_maximum_count,
 		 "The maximum number of chunks");
-module_param_named(chunk_maximum_in_cache, chunk_maximum_in_cache, int, 0644);
+module_param_named(chunk_cache_size, chunk_cache_size, int, 0644);
+MODULE_PARM_DESC(chunk_cache_size,
+		 "The maximum size of memory cache of chunks in MiB");
+
+static int chunk_maximum_in_cache_set(const char *val,
+				      const struct kernel_param *kp)
+{
+	int ret;
+	int count;
+	u64 size;
+
+	ret = kstrtoint(val, 0, &count);
+	if (ret)
+		return ret;
+	if (count < 0)
+		return -EINVAL;
+
+	pr_warn("The parameter chunk_maximum_in_cache is deprecated, use chunk_cache_size\n");
+	size = ((u64)count << chunk_minimum_shift) >> 20;
+	if (count && !size)
+		size = 1;
+	chunk_cache_size = (int)min_t(u64, size, INT_MAX);
+	return 0;
+}
+
+static int chunk_maximum_in_cache_get(char *buffer,
+				      const struct kernel_param *kp)
+{
+	u64 count = ((u64)max(chunk_cache_size, 0) << 20) >> chunk_minimum_shift;
+
+	return scnprintf(buffer, PAGE_SIZE, "%llu\n", count);
+}
+
+static const struct kernel_param_ops chunk_maximum_in_cache_ops = {
+	.set = chunk_maximum_in_cache_set,
+	.get = chunk_maximum_in_cache_get,
+};
+module_param_cb(chunk_maximum_in_cache, &chunk_maximum_in_cache_ops, NULL,
+		0644);
 MODULE_PARM_DESC(chunk_maximum_in_cache,
-		 "The maximum number of chunks in memory cache");
+		 "Deprecated, use chunk_cache_size. The maximum number of chunks in memory cache");
+module_param_named(chunk_read_ahead, chunk_read_ahead, int, 0644);
+MODULE_PARM_DESC(chunk_read_ahead,
+		 "The number of chunks to read in advance");
 module_param_named(free_diff_buffer_pool_size, free_diff_buffer_pool_size, int,
 		   0644);
 MODULE_PARM_DESC(free_diff_buffer_pool_size,
@@ -721,6 +1667,32 @@ MODULE_PARM_DESC(free_diff_buffer_pool_size,
 module_param_named(diff_storage_minimum, diff_storage_minimum, int, 0644);
 MODULE_PARM_DESC(diff_storage_minimum,
 	"The minimum allowable size of the difference storage in sectors");
+module_param_named(diff_storage_lead_time, diff_storage_lead_time, int, 0644);
+MODULE_PARM_DESC(diff_storage_lead_time,
+	"The time in seconds for which the free difference storage should last");
+module_param_named(snapimage_worker_count, snapimage_worker_count, int, 0644);
+MODULE_PARM_DESC(snapimage_worker_count,
+	"The number of worker threads for each snapshot image, 0 - up to 4");
+module_param_named(nonblocking_cow, nonblocking_cow, int, 0644);
+MODULE_PARM_DESC(nonblocking_cow,
+	"Release writes as soon as the original data is read into memory");
+module_param_named(nonblocking_cow_memory_limit, nonblocking_cow_memory_limit,
+		   int, 0644);
+MODULE_PARM_DESC(nonblocking_cow_memory_limit,
+	"The memory limit for non-blocking copy-on-write in MiB");
+module_param_named(image_read_remap, image_read_remap, int, 0644);
+MODULE_PARM_DESC(image_read_remap,
+	"Read the snapshot image directly from the original device and the difference storage");
+module_param_named(image_throttling_limit, image_throttling_limit, int, 0644);
+MODULE_PARM_DESC(image_throttling_limit,
+	"The number of incomplete copy-on-write operations that allows the snapshot image I/O");
+module_param_named(image_throttling_timeout, image_throttling_timeout, int,
+		   0644);
+MODULE_PARM_DESC(image_throttling_timeout,
+	"The maximum time in milliseconds the snapshot image I/O waits for copy-on-write");
+module_param_named(numa_affinity, numa_affinity, int, 0644);
+MODULE_PARM_DESC(numa_affinity,
+	"The NUMA placement: 0 - by the scheduler, 1 - on the node of the original device, 2 - the I/O completions on the node of the accessed device");
 
 MODULE_DESCRIPTION("Block Device Snapshots Module");
 MODULE_VERSION(VERSION_STR);
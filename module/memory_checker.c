@@ -1,8 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0
-#ifdef BLK_SNAP_DEBUG_MEMORY_LEAK
 #define pr_fmt(fmt) KBUILD_MODNAME "-memory_checker: " fmt
 #include <linux/atomic.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
+#ifdef STANDALONE_BDEVFILTER
+#include "blksnap.h"
+#else
+#include <uapi/linux/blksnap.h>
+#endif
 #include "memory_checker.h"
 #ifdef STANDALONE_BDEVFILTER
 #include "log.h"
@@ -15,14 +21,27 @@ char *memory_object_names[] = {
 	"cbt_map",
 	"cbt_buffer",
 	"chunk",
+	"chunk_state_map",
+	"chunk_hashes",
+	"read_progress",
+	"chunk_batch",
+	"chunk_compress",
+	"chunk_mem_data",
+	"compress_wrkmem",
 	"blk_snap_snaphot_event",
 	"diff_area",
 	"diff_io",
 	"diff_storage",
 	"storage_bdev",
 	"storage_block",
-	"diff_region",
+	"diff_storage_reserve",
+	"free_region",
+	"chunk_cache",
+	"tracker_punt",
 	"diff_buffer",
+	"diff_buffer_pool",
+	"diff_buffer_cache",
+	"diff_area_stats",
 	"event",
 	"snapimage",
 	"snapshot",
@@ -31,12 +50,20 @@ char *memory_object_names[] = {
 	/*kcalloc*/
 	"blk_snap_cbt_info",
 	"blk_snap_block_range",
+	"blk_snap_mark_dirty_blocks",
+	"blk_snap_read_cbt_since",
 	"blk_snap_dev",
 	"tracker_array",
 	"snapimage_array",
+	"diff_area_array",
 	"superblock_array",
 	"blk_snap_image_info",
+	"blk_snap_device_stats",
 	"log_filepath",
+	"benchmark_worker_array",
+	"prepare_work_array",
+	"zero_bvec_array",
+	"snapshot_array",
 	/*end*/
 };
 
@@ -44,19 +71,80 @@ static_assert(
 	sizeof(memory_object_names) == (memory_object_count * sizeof(char *)),
 	"The size of enum memory_object_type is not equal to size of memory_object_names array.");
 
-static atomic_t memory_counter[memory_object_count];
-static atomic_t memory_counter_max[memory_object_count];
+/*
+ * The objects are allocated and released on all CPUs, so each CPU counts them
+ * in its own counters. When the value of the counter of the CPU reaches
+ * MEMORY_COUNTER_BATCH, it is moved to the global counter. This way, the
+ * global counters are changed rarely and do not bounce between CPUs.
+ */
+#define MEMORY_COUNTER_BATCH 32
 
-void memory_object_inc(enum memory_object_type type)
+struct memory_counters {
+	long value[memory_object_count];
+};
+
+static DEFINE_PER_CPU(struct memory_counters, memory_counters_pcpu);
+static atomic_long_t memory_counter[memory_object_count];
+static atomic_long_t memory_counter_max[memory_object_count];
+
+static inline void memory_object_update_max(enum memory_object_type type,
+					    long value)
+{
+	long max = atomic_long_read(&memory_counter_max[type]);
+
+	while (value > max) {
+		long old;
+
+		old = atomic_long_cmpxchg(&memory_counter_max[type], max, value);
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
+static inline void memory_object_add(enum memory_object_type type, long delta)
 {
-	int value;
+	unsigned long flags;
+	long value;
 
+	/*
+	 * The objects are also released in the bio completion callbacks, so
+	 * the interrupts are disabled while the counter of the CPU is moved.
+	 */
+	local_irq_save(flags);
+	value = __this_cpu_add_return(memory_counters_pcpu.value[type], delta);
+	if (unlikely(value >= MEMORY_COUNTER_BATCH ||
+		     value <= -MEMORY_COUNTER_BATCH)) {
+		__this_cpu_sub(memory_counters_pcpu.value[type], value);
+		value = atomic_long_add_return(value, &memory_counter[type]);
+	} else
+		value += atomic_long_read(&memory_counter[type]);
+	local_irq_restore(flags);
+
+	/*
+	 * The counters of the other CPUs are not taken into account, so the
+	 * peak value is approximate.
+	 */
+	if (delta > 0)
+		memory_object_update_max(type, value);
+}
+
+static long memory_object_read(enum memory_object_type type)
+{
+	long value = atomic_long_read(&memory_counter[type]);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		value += per_cpu(memory_counters_pcpu.value[type], cpu);
+	return value;
+}
+
+void memory_object_inc(enum memory_object_type type)
+{
 	if (unlikely(type >= memory_object_count))
 		return;
 
-	value = atomic_inc_return(&memory_counter[type]);
-	if (value > atomic_read(&memory_counter_max[type]))
-		atomic_inc(&memory_counter_max[type]);
+	memory_object_add(type, 1);
 }
 
 void memory_object_dec(enum memory_object_type type)
@@ -64,34 +152,34 @@ void memory_object_dec(enum memory_object_type type)
 	if (unlikely(type >= memory_object_count))
 		return;
 
-	atomic_dec(&memory_counter[type]);
+	memory_object_add(type, -1);
 }
 
 void memory_object_print(bool is_error)
 {
 	int inx;
-	int not_free = 0;
+	long not_free = 0;
 
 	pr_debug("Objects in memory:\n");
 	for (inx = 0; inx < memory_object_count; inx++) {
-		int count = atomic_read(&memory_counter[inx]);
+		long count = memory_object_read(inx);
 
 		if (count) {
 			not_free += count;
 			if (is_error) {
-				pr_err("%s: %d\n", memory_object_names[inx],
+				pr_err("%s: %ld\n", memory_object_names[inx],
 					count);
 			} else {
-				pr_debug("%s: %d\n", memory_object_names[inx],
+				pr_debug("%s: %ld\n", memory_object_names[inx],
 					count);
 			}
 		}
 	}
 	if (not_free)
 		if (is_error)
-			pr_err("%d not released objects found\n", not_free);
+			pr_err("%ld not released objects found\n", not_free);
 		else
-			pr_debug("Found %d allocated objects\n", not_free);
+			pr_debug("Found %ld allocated objects\n", not_free);
 	else
 		pr_debug("All objects have been released\n");
 }
@@ -102,11 +190,53 @@ void memory_object_max_print(void)
 
 	pr_debug("Maximim objects in memory:\n");
 	for (inx = 0; inx < memory_object_count; inx++) {
-		int count = atomic_read(&memory_counter_max[inx]);
+		long count = atomic_long_read(&memory_counter_max[inx]);
 
 		if (count)
-			pr_debug("%s: %d\n", memory_object_names[inx], count);
+			pr_debug("%s: %ld\n", memory_object_names[inx], count);
 	}
 	pr_debug(".\n");
 }
-#endif
+
+/**
+ * memory_object_get_stats() - Copies the current and peak numbers of objects
+ *	of each type to the user space.
+ * @user_objects:
+ *	The user space array. If it is not set, only the number of object types
+ *	is returned.
+ * @pcount:
+ *	The size of the array in. The number of object types out.
+ */
+int memory_object_get_stats(struct blk_snap_memory_object __user *user_objects,
+			    unsigned int *pcount)
+{
+	int ret = 0;
+	int inx;
+
+	if (!user_objects)
+		goto out;
+
+	if (*pcount < memory_object_count) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	for (inx = 0; inx < memory_object_count; inx++) {
+		struct blk_snap_memory_object object = {0};
+
+		strscpy((char *)object.name, memory_object_names[inx],
+			BLK_SNAP_MEMORY_OBJECT_NAME_LIMIT);
+		object.value = memory_object_read(inx);
+		memory_object_update_max(inx, object.value);
+		object.peak = atomic_long_read(&memory_counter_max[inx]);
+
+		if (copy_to_user(&user_objects[inx], &object, sizeof(object))) {
+			pr_err("Unable to get memory statistics: failed to copy data to user buffer\n");
+			ret = -ENODATA;
+			break;
+		}
+	}
+out:
+	*pcount = memory_object_count;
+	return ret;
+}
@@ -2,6 +2,9 @@
 #ifndef __BLK_SNAP_MEMORY_CHECKER_H
 #define __BLK_SNAP_MEMORY_CHECKER_H
 #include <linux/types.h>
+#include <linux/errno.h>
+
+struct blk_snap_memory_object;
 
 enum memory_object_type {
 	/*alloc_page*/
@@ -10,14 +13,27 @@ enum memory_object_type {
 	memory_object_cbt_map,
 	memory_object_cbt_buffer,
 	memory_object_chunk,
+	memory_object_chunk_state_map,
+	memory_object_chunk_hashes,
+	memory_object_read_progress,
+	memory_object_chunk_batch,
+	memory_object_chunk_compress,
+	memory_object_chunk_mem_data,
+	memory_object_compress_wrkmem,
 	memory_object_blk_snap_snapshot_event,
 	memory_object_diff_area,
 	memory_object_diff_io,
 	memory_object_diff_storage,
 	memory_object_storage_bdev,
 	memory_object_storage_block,
-	memory_object_diff_region,
+	memory_object_diff_storage_reserve,
+	memory_object_free_region,
+	memory_object_chunk_cache,
+	memory_object_tracker_punt,
 	memory_object_diff_buffer,
+	memory_object_diff_buffer_pool,
+	memory_object_diff_buffer_cache,
+	memory_object_diff_area_stats,
 	memory_object_event,
 	memory_object_snapimage,
 	memory_object_snapshot,
@@ -26,32 +42,28 @@ enum memory_object_type {
 	/*kcalloc*/
 	memory_object_blk_snap_cbt_info,
 	memory_object_blk_snap_block_range,
+	memory_object_blk_snap_mark_dirty_blocks,
+	memory_object_blk_snap_read_cbt_since,
 	memory_object_blk_snap_dev,
 	memory_object_tracker_array,
 	memory_object_snapimage_array,
+	memory_object_diff_area_array,
 	memory_object_superblock_array,
 	memory_object_blk_snap_image_info,
+	memory_object_blk_snap_device_stats,
 	memory_object_log_filepath,
+	memory_object_benchmark_worker_array,
+	memory_object_prepare_work_array,
+	memory_object_zero_bvec_array,
+	memory_object_snapshot_array,
 	/*end*/
 	memory_object_count
 };
 
-#ifdef BLK_SNAP_DEBUG_MEMORY_LEAK
 void memory_object_inc(enum memory_object_type type);
 void memory_object_dec(enum memory_object_type type);
 void memory_object_print(bool is_error);
 void memory_object_max_print(void);
-#else
-static inline void memory_object_inc(
-	__attribute__ ((unused)) enum memory_object_type type)
-{};
-static inline void memory_object_dec(
-	__attribute__ ((unused)) enum memory_object_type type)
-{};
-static inline void memory_object_print(
-	__attribute__ ((unused)) bool is_error)
-{};
-static inline void memory_object_max_print(void)
-{};
-#endif
+int memory_object_get_stats(struct blk_snap_memory_object __user *user_objects,
+			    unsigned int *pcount);
 #endif /* __BLK_SNAP_MEMORY_CHECKER_H */
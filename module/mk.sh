@@ -22,6 +22,11 @@ case "$CMD" in
 		make -j`nproc` -C /lib/modules/${KERNEL_RELEASE}/build M=$(pwd) modules
 		echo Completed.
 		;;
+	build-bench)
+		echo Making with benchmark ...
+		make -j`nproc` -C /lib/modules/${KERNEL_RELEASE}/build M=$(pwd) BLK_SNAP_BENCHMARK=y modules
+		echo Completed.
+		;;
 	clean)
 		echo Cleaning ...
 		make -C /lib/modules/${KERNEL_RELEASE}/build M=$(pwd) clean
@@ -70,7 +75,7 @@ case "$CMD" in
 	*)
 		echo "Usage "
 		echo "Compile project: "
-		echo "	$0 {build | clean} [<kernel release>]"
+		echo "	$0 {build | build-bench | clean} [<kernel release>]"
 		echo "for ${MODULE_NAME} module : "
 		echo "	$0 {install | uninstall | load | unload}  [<kernel release>]"
 		echo "for ${FILTER_NAME} module : "
@@ -4,6 +4,11 @@
 #include <linux/slab.h>
 #include <linux/cdrom.h>
 #include <linux/blk-mq.h>
+#include <linux/kthread.h>
+#include <linux/ioprio.h>
+#ifdef CONFIG_BLK_CGROUP
+#include <linux/blk-cgroup.h>
+#endif
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -15,6 +20,45 @@
 #include "chunk.h"
 #include "cbt_map.h"
 #include "log.h"
+#include "trace.h"
+
+/*
+ * The maximum size of the I/O unit of the snapshot image. 8 MiB, but not
+ * less than the chunk size.
+ */
+#define SNAPIMAGE_MAX_SECTORS	(1u << (23 - SECTOR_SHIFT))
+
+/*
+ * The default number of worker threads for each snapshot image. The threads
+ * are created for every image, so their number does not grow with the number
+ * of CPUs.
+ */
+#define SNAPIMAGE_DEFAULT_WORKERS	4
+
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * The chunks that are completely covered by the discard request are
+ * released: their buffers and regions of the difference storage are freed,
+ * the writes to the original device do not copy them anymore, and the image
+ * reads them as zeroes. The partially covered chunks are kept, since the
+ * discard is only a hint.
+ */
+static void snapimage_process_discard(struct snapimage *snapimage,
+				      struct bio *bio)
+{
+	struct blk_snap_block_range range = {
+		.sector_offset = bio->bi_iter.bi_sector,
+		.sector_count = bio_sectors(bio),
+	};
+	u64 start_time = ktime_get_ns();
+
+	trace_blksnap_image_bio_begin(disk_devt(snapimage->disk), bio);
+	diff_area_release(snapimage->diff_area, &range, 1, false);
+	trace_blksnap_image_bio_end(disk_devt(snapimage->disk),
+				    range.sector_offset, bio, start_time);
+	bio_endio(bio);
+}
+#endif
 
 static void snapimage_process_bio(struct snapimage *snapimage, struct bio *bio)
 {
@@ -23,48 +67,165 @@ static void snapimage_process_bio(struct snapimage *snapimage, struct bio *bio)
 	struct bio_vec bvec;
 	struct bvec_iter iter;
 	sector_t pos = bio->bi_iter.bi_sector;
-
+	sector_t sector = pos;
+	sector_t count = bio_sectors(bio);
+	bool is_write = op_is_write(bio_op(bio));
+	u64 start_time = ktime_get_ns();
+
+#ifdef BLK_SNAP_MODIFICATION
+	if (unlikely(bio_op(bio) == REQ_OP_DISCARD)) {
+		snapimage_process_discard(snapimage, bio);
+		return;
+	}
+#endif
+	trace_blksnap_image_bio_begin(disk_devt(snapimage->disk), bio);
 	diff_area_throttling_io(snapimage->diff_area);
-	diff_area_image_ctx_init(&io_ctx, snapimage->diff_area,
-				 op_is_write(bio_op(bio)));
-	bio_for_each_segment(bvec, bio, iter) {
+	/*
+	 * The dirty chunks kept in the cache are the volatile write cache of
+	 * the image, so they are written back before the data of the bio.
+	 */
+	if (unlikely(bio->bi_opf & REQ_PREFLUSH)) {
+		if (diff_area_image_flush(snapimage->diff_area))
+			bio->bi_status = BLK_STS_IOERR;
+		if (!count || (bio->bi_status != BLK_STS_OK))
+			goto out;
+	}
+	/*
+	 * Loading of all chunks of the bio is started in advance, so that
+	 * they are read from the disk in parallel.
+	 */
+	diff_area_image_prefetch(snapimage->diff_area, pos, count, is_write);
+	diff_area_image_ctx_init(&io_ctx, snapimage->diff_area, is_write);
+	if (!is_write) {
 		blk_status_t st;
 
-		st = diff_area_image_io(&io_ctx, &bvec, &pos);
+		diff_area_image_read_ahead(snapimage->diff_area, pos, count);
+		st = diff_area_image_read(&io_ctx, bio);
 		if (unlikely(st != BLK_STS_OK))
-			break;
+			bio->bi_status = st;
+	} else {
+		bio_for_each_segment(bvec, bio, iter) {
+			blk_status_t st;
+
+			st = diff_area_image_io(&io_ctx, &bvec, &pos);
+			if (unlikely(st != BLK_STS_OK)) {
+				bio->bi_status = st;
+				break;
+			}
+		}
 	}
 	diff_area_image_ctx_done(&io_ctx);
+	if (is_write) {
+		if (unlikely(bio->bi_opf & REQ_FUA) &&
+		    (bio->bi_status == BLK_STS_OK) &&
+		    diff_area_image_writeback(snapimage->diff_area, sector,
+					      count))
+			bio->bi_status = BLK_STS_IOERR;
+		diff_area_stats_inc(snapimage->diff_area, image_writes);
+	} else {
+		diff_area_stats_inc(snapimage->diff_area, image_reads);
+		diff_area_stats_latency(snapimage->diff_area, image_read_hist,
+					start_time);
+	}
+out:
+	trace_blksnap_image_bio_end(disk_devt(snapimage->disk), sector, bio,
+				    start_time);
+#ifdef BLK_SNAP_MODIFICATION
+	/*
+	 * The chunks are released after the completion of the bio, so the
+	 * reader does not wait for it.
+	 */
+	if (!is_write && snapimage->diff_area->read_once &&
+	    (bio->bi_status == BLK_STS_OK)) {
+		bio_endio(bio);
+		diff_area_release_read(snapimage->diff_area, sector, count);
+		return;
+	}
+#endif
 	bio_endio(bio);
 }
 
-static inline struct bio *get_bio_from_queue(struct snapimage *snapimage)
+static inline struct bio *get_bio_from_queue(struct snapimage_worker *worker)
 {
 	struct bio *bio;
 
-	spin_lock(&snapimage->queue_lock);
-	bio = bio_list_pop(&snapimage->queue);
-	spin_unlock(&snapimage->queue_lock);
+	spin_lock(&worker->queue_lock);
+	bio = bio_list_pop(&worker->queue);
+	spin_unlock(&worker->queue_lock);
 
 	return bio;
 }
 
+/*
+ * The I/O units to the original device and to the difference storage that
+ * are submitted when processing the I/O unit of the snapshot image are
+ * accounted to the cgroup of the image reader and get its priority. So the
+ * io.max and io.latency policies and the I/O schedulers govern the snapshot
+ * traffic in the same way as the traffic of the reader.
+ */
+static void snapimage_worker_set_origin(struct snapimage_worker *worker,
+					struct bio *bio)
+{
+#ifdef CONFIG_BLK_CGROUP
+#ifdef HAVE_BIO_BLKCG_CSS
+	kthread_associate_blkcg(bio ? bio_blkcg_css(bio) : NULL);
+#else
+	kthread_associate_blkcg(bio && bio_blkcg(bio) ? &bio_blkcg(bio)->css :
+							NULL);
+#endif
+#endif
+	if (bio && (bio->bi_ioprio != worker->ioprio)) {
+		if (!set_task_ioprio(current, bio->bi_ioprio))
+			worker->ioprio = bio->bi_ioprio;
+	}
+}
+
 static int snapimage_kthread_worker_fn(void *param)
 {
-	struct snapimage *snapimage = param;
+	struct snapimage_worker *worker = param;
 	struct bio *bio;
 
 	for (;;) {
-		while ((bio = get_bio_from_queue(snapimage)))
-			snapimage_process_bio(snapimage, bio);
-		if (kthread_should_stop())
+		set_current_state(TASK_INTERRUPTIBLE);
+		bio = get_bio_from_queue(worker);
+		if (bio) {
+			__set_current_state(TASK_RUNNING);
+			snapimage_worker_set_origin(worker, bio);
+			snapimage_process_bio(worker->snapimage, bio);
+			continue;
+		}
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
 			break;
+		}
+		snapimage_worker_set_origin(worker, NULL);
 		schedule();
 	}
 
 	return 0;
 }
 
+static inline struct snapimage_worker *
+snapimage_select_worker(struct snapimage *snapimage, struct bio *bio)
+{
+	unsigned long nr;
+
+	if (snapimage->worker_count == 1)
+		return &snapimage->workers[0];
+
+	nr = (unsigned long)(bio->bi_iter.bi_sector >>
+			     (snapimage->diff_area->chunk_shift - SECTOR_SHIFT));
+	return &snapimage->workers[nr % snapimage->worker_count];
+}
+
+static void snapimage_stop_workers(struct snapimage *snapimage)
+{
+	unsigned int inx;
+
+	for (inx = 0; inx < snapimage->worker_count; inx++)
+		kthread_stop(snapimage->workers[inx].task);
+}
+
 #ifdef HAVE_QC_SUBMIT_BIO
 static blk_qc_t snapimage_submit_bio(struct bio *bio)
 {
@@ -81,11 +242,15 @@ static void snapimage_submit_bio(struct bio *bio)
 #endif
 
 	if (!diff_area_is_corrupted(snapimage->diff_area)) {
-		spin_lock(&snapimage->queue_lock);
-		bio_list_add(&snapimage->queue, bio);
-		spin_unlock(&snapimage->queue_lock);
+		struct snapimage_worker *worker;
+
+		worker = snapimage_select_worker(snapimage, bio);
 
-		wake_up_process(snapimage->worker);
+		spin_lock(&worker->queue_lock);
+		bio_list_add(&worker->queue, bio);
+		spin_unlock(&worker->queue_lock);
+
+		wake_up_process(worker->task);
 	} else
 		bio_io_error(bio);
 
@@ -125,7 +290,7 @@ void snapimage_free(struct snapimage *snapimage)
 
 	del_gendisk(snapimage->disk);
 
-	kthread_stop(snapimage->worker);
+	snapimage_stop_workers(snapimage);
 #ifdef HAVE_BLK_ALLOC_DISK
 #ifdef HAVE_BLK_CLEANUP_DISK
 	blk_cleanup_disk(snapimage->disk);
@@ -167,16 +332,30 @@ static inline struct gendisk *blk_alloc_disk(int node)
 }
 #endif
 
+static inline unsigned int
+snapimage_calculate_worker_count(unsigned int worker_count)
+{
+	if (!worker_count)
+		worker_count = SNAPIMAGE_DEFAULT_WORKERS;
+
+	return min_t(unsigned int, worker_count, num_online_cpus());
+}
+
 struct snapimage *snapimage_create(struct diff_area *diff_area,
-				   struct cbt_map *cbt_map)
+				   struct cbt_map *cbt_map,
+				   unsigned int worker_count)
 {
 	int ret = 0;
 	dev_t dev_id = diff_area->orig_bdev->bd_dev;
 	struct snapimage *snapimage = NULL;
 	struct gendisk *disk;
-	struct task_struct *task;
+	unsigned int inx;
+	unsigned int chunk_bytes;
+	unsigned int max_sectors;
 
-	snapimage = kzalloc(sizeof(struct snapimage), GFP_KERNEL);
+	worker_count = snapimage_calculate_worker_count(worker_count);
+	snapimage = kzalloc(struct_size(snapimage, workers, worker_count),
+			    GFP_KERNEL);
 	if (snapimage == NULL)
 		return ERR_PTR(-ENOMEM);
 	memory_object_inc(memory_object_snapimage);
@@ -185,23 +364,43 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	pr_info("Create snapshot image device for original device [%u:%u]\n",
 		MAJOR(dev_id), MINOR(dev_id));
 
-	spin_lock_init(&snapimage->queue_lock);
-	bio_list_init(&snapimage->queue);
-
-	task = kthread_create(snapimage_kthread_worker_fn, snapimage,
-			      "blksnap_%d_%d",
-			      MAJOR(dev_id), MINOR(dev_id));
-	if (IS_ERR(task)) {
-		ret = PTR_ERR(task);
-		pr_err("Failed to start worker thread. errno=%d\n", abs(ret));
-		goto fail_create_task;
+	for (inx = 0; inx < worker_count; inx++) {
+		struct snapimage_worker *worker = &snapimage->workers[inx];
+		struct task_struct *task;
+
+		spin_lock_init(&worker->queue_lock);
+		bio_list_init(&worker->queue);
+		worker->snapimage = snapimage;
+
+		task = kthread_create_on_node(snapimage_kthread_worker_fn,
+					      worker, diff_area->node,
+					      "blksnap_%d_%d/%u",
+					      MAJOR(dev_id), MINOR(dev_id), inx);
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			pr_err("Failed to start worker thread. errno=%d\n",
+			       abs(ret));
+			goto fail_create_task;
+		}
+
+		worker->task = task;
+		/* The worker stays on the node of the original device */
+		if (diff_area->node != NUMA_NO_NODE) {
+			int err = set_cpus_allowed_ptr(task,
+					cpumask_of_node(diff_area->node));
+
+			if (err)
+				pr_warn("Failed to bind worker thread to NUMA node %d. errno=%d\n",
+					diff_area->node, abs(err));
+		}
+		set_user_nice(task, MAX_NICE);
+		task->flags |= PF_LOCAL_THROTTLE | PF_MEMALLOC_NOIO;
+		snapimage->worker_count++;
 	}
+	pr_debug("Snapshot image has %u worker threads\n",
+		 snapimage->worker_count);
 
-	snapimage->worker = task;
-	set_user_nice(task, MAX_NICE);
-	task->flags |= PF_LOCAL_THROTTLE | PF_MEMALLOC_NOIO;
-
-	disk = blk_alloc_disk(NUMA_NO_NODE);
+	disk = blk_alloc_disk(diff_area->node);
 	if (!disk) {
 		pr_err("Failed to allocate disk\n");
 		ret = -ENOMEM;
@@ -209,8 +408,40 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	}
 	snapimage->disk = disk;
 
-	blk_queue_max_hw_sectors(disk->queue, BLK_DEF_MAX_SECTORS);
-	blk_queue_flag_set(QUEUE_FLAG_NOMERGES, disk->queue);
+	/*
+	 * The chunk is the unit of the copy-on-write and of the cache, so the
+	 * readers and the file systems on the image are advised to use
+	 * chunk-aligned I/O units of the chunk size. Large units are split
+	 * into chunks by the module itself, so the block layer does not need
+	 * to split them. The bio-based queue does not merge I/O units, the
+	 * readahead of the image is increased by the optimal I/O size
+	 * instead.
+	 */
+	chunk_bytes = 1u << diff_area->chunk_shift;
+	max_sectors = max_t(unsigned int, SNAPIMAGE_MAX_SECTORS,
+			    chunk_bytes >> SECTOR_SHIFT);
+	blk_queue_max_hw_sectors(disk->queue, max_sectors);
+	/* The soft limit is lowered to the default by the call above */
+	disk->queue->limits.max_sectors = max_sectors;
+	blk_queue_max_segments(disk->queue, USHRT_MAX);
+	blk_queue_io_min(disk->queue, chunk_bytes);
+	blk_queue_io_opt(disk->queue, chunk_bytes);
+	/*
+	 * The writes to the image are kept in the cache of chunks, so the
+	 * image has a volatile write cache.
+	 */
+	blk_queue_write_cache(disk->queue, true, true);
+#ifdef BLK_SNAP_MODIFICATION
+	/*
+	 * The discard releases the whole chunks, so its granularity is the
+	 * chunk size.
+	 */
+	disk->queue->limits.discard_granularity = chunk_bytes;
+	blk_queue_max_discard_sectors(disk->queue, UINT_MAX >> SECTOR_SHIFT);
+#ifdef HAVE_QUEUE_FLAG_DISCARD
+	blk_queue_flag_set(QUEUE_FLAG_DISCARD, disk->queue);
+#endif
+#endif
 
 	disk->flags = 0;
 #ifdef STANDALONE_BDEVFILTER
@@ -261,7 +492,7 @@ struct snapimage *snapimage_create(struct diff_area *diff_area,
 	return snapimage;
 
 fail_cleanup_disk:
-	kthread_stop(snapimage->worker);
+	snapimage_stop_workers(snapimage);
 #ifdef HAVE_BLK_ALLOC_DISK
 #ifdef HAVE_BLK_CLEANUP_DISK
 	blk_cleanup_disk(disk);
@@ -274,8 +505,8 @@ fail_cleanup_disk:
 	return ERR_PTR(ret);
 
 fail_disk_alloc:
-	kthread_stop(snapimage->worker);
 fail_create_task:
+	snapimage_stop_workers(snapimage);
 	kfree(snapimage);
 	memory_object_dec(memory_object_snapimage);
 	return ERR_PTR(ret);
@@ -10,26 +10,48 @@
 
 struct diff_area;
 struct cbt_map;
+struct snapimage;
 
 /**
- * struct snapimage - Snapshot image block device.
+ * struct snapimage_worker - Worker thread of the snapshot image.
  *
- * @capacity:
- *	The size of the snapshot image in sectors must be equal to the size
- *	of the original device at the time of taking the snapshot.
- * @worker:
+ * @task:
  *	A pointer to the &struct task of the worker thread that process I/O
- *      units.
+ *	units.
  * @queue_lock:
- *      Lock for &queue.
+ *	Lock for &queue.
  * @queue:
  *	A queue of I/O units waiting to be processed.
+ * @snapimage:
+ *	A pointer to the snapshot image that owns this worker.
+ * @ioprio:
+ *	The I/O priority of the worker thread. It is equal to the priority of
+ *	the last processed I/O unit.
+ */
+struct snapimage_worker {
+	struct task_struct *task;
+	spinlock_t queue_lock;
+	struct bio_list queue;
+	struct snapimage *snapimage;
+	unsigned short ioprio;
+};
+
+/**
+ * struct snapimage - Snapshot image block device.
+ *
+ * @capacity:
+ *	The size of the snapshot image in sectors must be equal to the size
+ *	of the original device at the time of taking the snapshot.
  * @disk:
  *	A pointer to the &struct gendisk for the image block device.
  * @diff_area:
  *	A pointer to the owned &struct diff_area.
  * @cbt_map:
  *	A pointer to the owned &struct cbt_map.
+ * @worker_count:
+ *	The number of worker threads.
+ * @workers:
+ *	An array of worker threads.
  *
  * The snapshot image is presented in the system as a block device. But
  * when reading or writing a snapshot image, the data is redirected to
@@ -39,23 +61,28 @@ struct cbt_map;
  * from different threads in parallel. To avoid the problem with simultaneous
  * access, it is enough to open the snapshot image block device with the
  * FMODE_EXCL parameter.
+ *
+ * I/O units are distributed between the worker threads by the number of
+ * the chunk that the unit starts from. Therefore, requests to different
+ * chunks are processed in parallel, and requests to the same chunk are
+ * processed in order of arrival.
  */
 struct snapimage {
 	sector_t capacity;
 
-	struct task_struct *worker;
-	spinlock_t queue_lock;
-	struct bio_list queue;
-
 	struct gendisk *disk;
 
 	struct diff_area *diff_area;
 	struct cbt_map *cbt_map;
+
+	unsigned int worker_count;
+	struct snapimage_worker workers[];
 };
 
 void snapimage_free(struct snapimage *snapimage);
 struct snapimage *snapimage_create(struct diff_area *diff_area,
-				   struct cbt_map *cbt_map);
+				   struct cbt_map *cbt_map,
+				   unsigned int worker_count);
 
 #ifdef BLK_SNAP_DEBUG_SECTOR_STATE
 int snapimage_get_chunk_state(struct snapimage *snapimage, sector_t sector,
@@ -2,7 +2,18 @@
 #define pr_fmt(fmt) KBUILD_MODNAME "-snapshot: " fmt
 
 #include <linux/slab.h>
+#include <linux/sizes.h>
+#include <linux/math64.h>
 #include <linux/sched/mm.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#ifdef BLK_SNAP_MODIFICATION
+#include <linux/anon_inodes.h>
+#include <linux/fs.h>
+#endif
+#ifdef CONFIG_DEBUG_FS
+#include <linux/seq_file.h>
+#endif
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #include "bdevfilter.h"
@@ -14,13 +25,27 @@
 #include "tracker.h"
 #include "diff_storage.h"
 #include "diff_area.h"
+#include "chunk.h"
+#include "chunk_cache.h"
 #include "snapimage.h"
 #include "cbt_map.h"
 #include "log.h"
 
+extern int chunk_minimum_shift;
+extern int chunk_cache_size;
+extern int chunk_read_ahead;
+extern int diff_storage_minimum;
+extern int snapimage_worker_count;
+
 LIST_HEAD(snapshots);
 DECLARE_RWSEM(snapshots_lock);
 
+/*
+ * The difference areas, the chunks and their buffers and the difference
+ * storage of the destroyed snapshots are released by this workqueue.
+ */
+static struct workqueue_struct *snapshot_release_wq;
+
 #if defined(BLK_SNAP_SEQUENTALFREEZE)
 /*
  * snapshot_release_trackers - Releases snapshots trackers
@@ -35,19 +60,20 @@ static void snapshot_release_trackers(struct snapshot *snapshot)
 
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 		struct super_block *sb = NULL;
 #else
 		bool is_frozen = false;
 #endif
-		if (!tracker || !tracker->diff_area)
+		if (!tracker || !diff_area)
 			continue;
 
 		/* Flush and freeze fs */
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_freeze_bdev(tracker->diff_area->orig_bdev, &sb);
+		_freeze_bdev(diff_area->orig_bdev, &sb);
 #else
-		if (freeze_bdev(tracker->diff_area->orig_bdev))
+		if (freeze_bdev(diff_area->orig_bdev))
 			pr_err("Failed to freeze device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else {
@@ -58,15 +84,15 @@ static void snapshot_release_trackers(struct snapshot *snapshot)
 #endif
 
 		/* Set tracker as available for new snapshots. */
-		tracker_release_snapshot(tracker);
+		tracker_release_snapshot(tracker, diff_area);
 
 		/* Thaw fs */
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_thaw_bdev(tracker->diff_area->orig_bdev, sb);
+		_thaw_bdev(diff_area->orig_bdev, sb);
 #else
 		if (!is_frozen)
 			continue;
-		if (thaw_bdev(tracker->diff_area->orig_bdev))
+		if (thaw_bdev(diff_area->orig_bdev))
 			pr_err("Failed to thaw device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -90,15 +116,16 @@ static void snapshot_release_trackers(struct snapshot *snapshot)
 	/* Flush and freeze fs on each original block device. */
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 
-		if (!tracker || !tracker->diff_area)
+		if (!tracker || !diff_area)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_freeze_bdev(tracker->diff_area->orig_bdev,
+		_freeze_bdev(diff_area->orig_bdev,
 			     &snapshot->superblock_array[inx]);
 #else
-		if (freeze_bdev(tracker->diff_area->orig_bdev))
+		if (freeze_bdev(diff_area->orig_bdev))
 			pr_warn("Failed to freeze device [%u:%u]\n",
 				MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else {
@@ -110,21 +137,27 @@ static void snapshot_release_trackers(struct snapshot *snapshot)
 	}
 
 	/* Set tracker as available for new snapshots. */
-	for (inx = 0; inx < snapshot->count; ++inx)
-		tracker_release_snapshot(snapshot->tracker_array[inx]);
+	for (inx = 0; inx < snapshot->count; ++inx) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
+
+		if (tracker && diff_area)
+			tracker_release_snapshot(tracker, diff_area);
+	}
 
 	/* Thaw fs on each original block device. */
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 
-		if (!tracker || !tracker->diff_area || !tracker->is_frozen)
+		if (!tracker || !diff_area || !tracker->is_frozen)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_thaw_bdev(tracker->diff_area->orig_bdev,
+		_thaw_bdev(diff_area->orig_bdev,
 			   snapshot->superblock_array[inx]);
 #else
-		if (thaw_bdev(tracker->diff_area->orig_bdev))
+		if (thaw_bdev(diff_area->orig_bdev))
 			pr_err("Failed to thaw device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -137,6 +170,140 @@ static void snapshot_release_trackers(struct snapshot *snapshot)
 
 #endif /* BLK_SNAP_SEQUENTALFREEZE */
 
+/*
+ * Allocates the difference area for the device, unless it has already been
+ * allocated.
+ */
+static int snapshot_prepare_diff_area(struct snapshot *snapshot, int inx)
+{
+	struct tracker *tracker = snapshot->tracker_array[inx];
+	struct diff_area *diff_area;
+	unsigned int chunk_shift = snapshot->options.chunk_shift;
+
+	if (!tracker || snapshot->diff_area_array[inx])
+		return 0;
+
+#ifdef BLK_SNAP_MODIFICATION
+	if (snapshot->options.chunk_auto)
+		chunk_shift = tracker_suggest_chunk_shift(tracker, chunk_shift);
+#endif
+	diff_area = diff_area_new(tracker->dev_id, snapshot->diff_storage,
+				  snapshot->chunk_cache, chunk_shift,
+				  snapshot->options.read_ahead);
+	if (IS_ERR(diff_area))
+		return PTR_ERR(diff_area);
+#ifdef BLK_SNAP_MODIFICATION
+	if (snapshot->options.read_once) {
+		int ret = diff_area_enable_read_once(diff_area);
+
+		if (ret) {
+			diff_area_put(diff_area);
+			return ret;
+		}
+	}
+	if (snapshot->options.chunk_hash) {
+		int ret = diff_area_enable_hashes(diff_area);
+
+		if (ret) {
+			diff_area_put(diff_area);
+			return ret;
+		}
+	}
+#endif
+	snapshot->diff_area_array[inx] = diff_area;
+
+	return 0;
+}
+
+/**
+ * struct snapshot_prepare_work - The allocation of the difference area for
+ *	one device of the snapshot.
+ * @work:
+ *	The work item in the unbound workqueue.
+ * @snapshot:
+ *	Pointer to &struct snapshot.
+ * @inx:
+ *	The index of the device in the snapshot.
+ * @ret:
+ *	The result of the allocation.
+ */
+struct snapshot_prepare_work {
+	struct work_struct work;
+	struct snapshot *snapshot;
+	int inx;
+	int ret;
+};
+
+static void snapshot_prepare_work_fn(struct work_struct *work)
+{
+	struct snapshot_prepare_work *prepare =
+		container_of(work, struct snapshot_prepare_work, work);
+
+	prepare->ret = snapshot_prepare_diff_area(prepare->snapshot,
+						  prepare->inx);
+}
+
+/*
+ * Allocates the difference areas for the devices for which they have not yet
+ * been allocated.
+ *
+ * Opening the devices and allocating their chunk state maps and buffers takes
+ * time, so the difference areas are allocated in parallel in the unbound
+ * workqueue. The preparation of a set of devices takes about as long as the
+ * preparation of the largest one.
+ */
+static int snapshot_prepare_diff_areas(struct snapshot *snapshot)
+{
+	int ret = 0;
+	int inx;
+	struct snapshot_prepare_work *works;
+
+	lockdep_assert_held(&snapshot->take_lock);
+
+	if (snapshot->count == 1)
+		return snapshot_prepare_diff_area(snapshot, 0);
+
+	works = kcalloc(snapshot->count, sizeof(struct snapshot_prepare_work),
+			GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+	memory_object_inc(memory_object_prepare_work_array);
+
+	for (inx = 0; inx < snapshot->count; inx++) {
+		INIT_WORK(&works[inx].work, snapshot_prepare_work_fn);
+		works[inx].snapshot = snapshot;
+		works[inx].inx = inx;
+		queue_work(system_unbound_wq, &works[inx].work);
+	}
+
+	/* All the devices must be ready before any of them is frozen */
+	for (inx = 0; inx < snapshot->count; inx++) {
+		flush_work(&works[inx].work);
+		if (!ret)
+			ret = works[inx].ret;
+	}
+
+	kfree(works);
+	memory_object_dec(memory_object_prepare_work_array);
+	return ret;
+}
+
+static void snapshot_free_diff_areas(struct snapshot *snapshot)
+{
+	int inx;
+
+	lockdep_assert_held(&snapshot->take_lock);
+
+	for (inx = 0; inx < snapshot->count; inx++) {
+		diff_area_put(snapshot->diff_area_array[inx]);
+		snapshot->diff_area_array[inx] = NULL;
+	}
+}
+
+/*
+ * Detaches the snapshot from the original block devices. The snapshot
+ * images are removed and the trackers are available for new snapshots.
+ */
 static void snapshot_release(struct snapshot *snapshot)
 {
 	int inx;
@@ -147,32 +314,44 @@ static void snapshot_release(struct snapshot *snapshot)
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct snapimage *snapimage = snapshot->snapimage_array[inx];
 
-		if (snapimage)
+		if (snapimage) {
 			snapimage_free(snapimage);
+			snapshot->snapimage_array[inx] = NULL;
+		}
 	}
 
 	snapshot_release_trackers(snapshot);
 
-	/* Destroy diff area for each tracker. */
 	for (inx = 0; inx < snapshot->count; ++inx) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
 
 		if (tracker) {
-			diff_area_put(tracker->diff_area);
-			tracker->diff_area = NULL;
-
 			tracker_put(tracker);
 			snapshot->tracker_array[inx] = NULL;
 		}
 	}
+
+	if (snapshot->diff_storage)
+		event_queue_close(&snapshot->diff_storage->event_queue);
 }
 
-static void snapshot_free(struct kref *kref)
+/*
+ * Releases the chunks, their buffers and the difference storage. It takes a
+ * while for large devices, so it is done after the snapshot is detached.
+ */
+static void snapshot_release_work(struct work_struct *work)
 {
-	struct snapshot *snapshot = container_of(kref, struct snapshot, kref);
+	struct snapshot *snapshot =
+		container_of(work, struct snapshot, release_work);
 
-	snapshot_release(snapshot);
+	/* Destroy diff area for each tracker. */
+	mutex_lock(&snapshot->take_lock);
+	snapshot_free_diff_areas(snapshot);
+	mutex_unlock(&snapshot->take_lock);
 
+	kfree(snapshot->diff_area_array);
+	if (snapshot->diff_area_array)
+		memory_object_dec(memory_object_diff_area_array);
 	kfree(snapshot->snapimage_array);
 	if (snapshot->snapimage_array)
 		memory_object_dec(memory_object_snapimage_array);
@@ -187,12 +366,22 @@ static void snapshot_free(struct kref *kref)
 	}
 #endif
 
+	chunk_cache_put(snapshot->chunk_cache);
 	diff_storage_put(snapshot->diff_storage);
 
+	pr_debug("Snapshot %pUb was released\n", &snapshot->id);
 	kfree(snapshot);
 	memory_object_dec(memory_object_snapshot);
 }
 
+static void snapshot_free(struct kref *kref)
+{
+	struct snapshot *snapshot = container_of(kref, struct snapshot, kref);
+
+	snapshot_release(snapshot);
+	queue_work(snapshot_release_wq, &snapshot->release_work);
+}
+
 static inline void snapshot_get(struct snapshot *snapshot)
 {
 	kref_get(&snapshot->kref);
@@ -203,7 +392,8 @@ static inline void snapshot_put(struct snapshot *snapshot)
 		kref_put(&snapshot->kref, snapshot_free);
 };
 
-static struct snapshot *snapshot_new(unsigned int count)
+static struct snapshot *snapshot_new(unsigned int count,
+				     const struct snapshot_options *options)
 {
 	int ret;
 	struct snapshot *snapshot = NULL;
@@ -229,33 +419,59 @@ static struct snapshot *snapshot_new(unsigned int count)
 	}
 	memory_object_inc(memory_object_snapimage_array);
 
+	snapshot->diff_area_array = kcalloc(count, sizeof(void *), GFP_KERNEL);
+	if (!snapshot->diff_area_array) {
+		ret = -ENOMEM;
+		goto fail_free_snapimage;
+	}
+	memory_object_inc(memory_object_diff_area_array);
+
 #if defined(HAVE_SUPER_BLOCK_FREEZE) && !defined(BLK_SNAP_SEQUENTALFREEZE)
 	snapshot->superblock_array = kcalloc(count, sizeof(void *), GFP_KERNEL);
 	if (!snapshot->superblock_array) {
 		ret = -ENOMEM;
-		goto fail_free_snapimage;
+		goto fail_free_diff_areas;
 	}
 	memory_object_inc(memory_object_superblock_array);
 #endif
-	snapshot->diff_storage = diff_storage_new();
+	snapshot->options = *options;
+	snapshot->diff_storage = diff_storage_new(options->storage_increment,
+						 count);
 	if (!snapshot->diff_storage) {
 		ret = -ENOMEM;
-		goto fail_free_snapimage;
+		goto fail_free_diff_areas;
+	}
+#ifdef BLK_SNAP_MODIFICATION
+	snapshot->diff_storage->durability = options->durability;
+#endif
+	snapshot->chunk_cache = chunk_cache_new(options->cache_size);
+	if (!snapshot->chunk_cache) {
+		ret = -ENOMEM;
+		goto fail_free_diff_storage;
 	}
 
 	INIT_LIST_HEAD(&snapshot->link);
 	kref_init(&snapshot->kref);
+	INIT_WORK(&snapshot->release_work, snapshot_release_work);
+	mutex_init(&snapshot->take_lock);
 	uuid_gen(&snapshot->id);
 	snapshot->is_taken = false;
 
 	return snapshot;
 
-fail_free_snapimage:
+fail_free_diff_storage:
+	diff_storage_put(snapshot->diff_storage);
+
+fail_free_diff_areas:
 #if defined(HAVE_SUPER_BLOCK_FREEZE) && !defined(BLK_SNAP_SEQUENTALFREEZE)
 	kfree(snapshot->superblock_array);
 	if (snapshot->superblock_array)
 		memory_object_dec(memory_object_superblock_array);
 #endif
+	kfree(snapshot->diff_area_array);
+	memory_object_dec(memory_object_diff_area_array);
+
+fail_free_snapimage:
 	kfree(snapshot->snapimage_array);
 	if (snapshot->snapimage_array)
 		memory_object_dec(memory_object_snapimage_array);
@@ -273,6 +489,15 @@ fail:
 	return ERR_PTR(ret);
 }
 
+int snapshot_init(void)
+{
+	snapshot_release_wq = alloc_workqueue("blksnap-release",
+					      WQ_UNBOUND | WQ_SYSFS, 0);
+	if (!snapshot_release_wq)
+		return -ENOMEM;
+	return 0;
+}
+
 void snapshot_done(void)
 {
 	struct snapshot *snapshot;
@@ -286,160 +511,769 @@ void snapshot_done(void)
 			list_del(&snapshot->link);
 		up_write(&snapshots_lock);
 
-		snapshot_put(snapshot);
-	} while (snapshot);
-}
+		snapshot_put(snapshot);
+	} while (snapshot);
+
+	/* Waits for the release of the destroyed snapshots */
+	destroy_workqueue(snapshot_release_wq);
+}
+
+static inline bool blk_snap_dev_is_equal(struct blk_snap_dev *first,
+				    struct blk_snap_dev *second)
+{
+	return (first->mj == second->mj) && (first->mn == second->mn);
+}
+
+static inline int check_same_devices(struct blk_snap_dev *devices,
+				     unsigned int count)
+{
+	struct blk_snap_dev *first;
+	struct blk_snap_dev *second;
+
+	for (first = devices; first < (devices + (count - 1)); ++first) {
+		for (second = first + 1; second < (devices + count); ++second) {
+			if (blk_snap_dev_is_equal(first, second)) {
+				pr_err("Unable to create snapshot: The same device [%d:%d] was added twice.\n",
+					first->mj, first->mn);
+				return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * snapshot_options_init() - Sets the options of the snapshot from the module
+ *	parameters.
+ * @options:
+ *	Pointer to &struct snapshot_options.
+ */
+void snapshot_options_init(struct snapshot_options *options)
+{
+	options->chunk_shift = chunk_minimum_shift;
+	options->read_ahead = max(chunk_read_ahead, 0);
+	options->cache_size = (size_t)max(chunk_cache_size, 0) << 20;
+	options->storage_increment = max(diff_storage_minimum, 0);
+#ifdef BLK_SNAP_MODIFICATION
+	options->durability = blk_snap_durability_fua;
+#else
+	options->durability = 0;
+#endif
+	options->worker_count = max(snapimage_worker_count, 0);
+	options->read_once = false;
+	options->chunk_auto = false;
+	options->chunk_hash = false;
+}
+
+int snapshot_create(struct blk_snap_dev *dev_id_array, unsigned int count,
+		    const struct snapshot_options *options, uuid_t *id)
+{
+	struct snapshot_options default_options;
+	struct snapshot *snapshot = NULL;
+	int ret;
+	unsigned int inx;
+
+	pr_info("Create snapshot for devices:\n");
+	for (inx = 0; inx < count; ++inx)
+		pr_info("\t%u:%u\n", dev_id_array[inx].mj,
+			dev_id_array[inx].mn);
+
+	ret = check_same_devices(dev_id_array, count);
+	if (ret)
+		return ret;
+
+	if (!options) {
+		snapshot_options_init(&default_options);
+		options = &default_options;
+	}
+
+	snapshot = snapshot_new(count, options);
+	if (IS_ERR(snapshot)) {
+		pr_err("Unable to create snapshot: failed to allocate snapshot structure\n");
+		return PTR_ERR(snapshot);
+	}
+
+	ret = -ENODEV;
+	for (inx = 0; inx < count; ++inx) {
+		dev_t dev_id =
+			MKDEV(dev_id_array[inx].mj, dev_id_array[inx].mn);
+		struct tracker *tracker;
+
+		tracker = tracker_create_or_get(dev_id);
+		if (IS_ERR(tracker)) {
+			pr_err("Unable to create snapshot\n");
+			pr_err("Failed to add device [%u:%u] to snapshot tracking\n",
+			       MAJOR(dev_id), MINOR(dev_id));
+			ret = PTR_ERR(tracker);
+			goto fail;
+		}
+
+		snapshot->tracker_array[inx] = tracker;
+		snapshot->count++;
+	}
+
+	down_write(&snapshots_lock);
+	list_add_tail(&snapshots, &snapshot->link);
+	up_write(&snapshots_lock);
+
+	uuid_copy(id, &snapshot->id);
+	pr_info("Snapshot %pUb was created\n", &snapshot->id);
+	return 0;
+fail:
+	pr_err("Snapshot cannot be created\n");
+
+	snapshot_put(snapshot);
+	return ret;
+}
+
+static struct snapshot *snapshot_get_by_id(uuid_t *id)
+{
+	struct snapshot *snapshot = NULL;
+	struct snapshot *s;
+
+	down_read(&snapshots_lock);
+	if (list_empty(&snapshots))
+		goto out;
+
+	list_for_each_entry(s, &snapshots, link) {
+		if (uuid_equal(&s->id, id)) {
+			snapshot = s;
+			snapshot_get(snapshot);
+			break;
+		}
+	}
+out:
+	up_read(&snapshots_lock);
+	return snapshot;
+}
+
+int snapshot_destroy(uuid_t *id)
+{
+	struct snapshot *snapshot = NULL;
+
+	pr_info("Destroy snapshot %pUb\n", id);
+	memory_object_print(false);
+	down_write(&snapshots_lock);
+	if (!list_empty(&snapshots)) {
+		struct snapshot *s = NULL;
+
+		list_for_each_entry(s, &snapshots, link) {
+			if (uuid_equal(&s->id, id)) {
+				snapshot = s;
+				list_del(&snapshot->link);
+				break;
+			}
+		}
+	}
+	up_write(&snapshots_lock);
+
+	if (!snapshot) {
+		pr_err("Unable to destroy snapshot: cannot find snapshot by id %pUb\n",
+		       id);
+		return -ENODEV;
+	}
+	snapshot_put(snapshot);
+	memory_object_print(false);
+	memory_object_max_print();
+
+	return 0;
+}
+
+int snapshot_append_storage(uuid_t *id, struct blk_snap_dev dev_id,
+			    struct blk_snap_block_range __user *ranges,
+			    unsigned int range_count)
+{
+	int ret = 0;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = diff_storage_append_block(snapshot->diff_storage,
+					MKDEV(dev_id.mj, dev_id.mn), ranges,
+					range_count);
+	snapshot_put(snapshot);
+	return ret;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+int snapshot_set_durability(uuid_t *id, unsigned int mode)
+{
+	struct snapshot *snapshot;
+
+	if (mode >= blk_snap_durability_end)
+		return -EINVAL;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	pr_debug("Set durability mode %u for snapshot %pUb\n", mode, id);
+	WRITE_ONCE(snapshot->diff_storage->durability, mode);
+
+	snapshot_put(snapshot);
+	return 0;
+}
+
+int snapshot_set_compression(uuid_t *id, unsigned int algorithm)
+{
+	struct snapshot *snapshot;
+	int ret;
+
+	if (algorithm >= blk_snap_compression_end)
+		return -EINVAL;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	if (algorithm != blk_snap_compression_none) {
+		ret = chunk_compress_init();
+		if (ret) {
+			pr_err("Unable to allocate the compression workspaces\n");
+			snapshot_put(snapshot);
+			return ret;
+		}
+	}
+
+	pr_debug("Set compression algorithm %u for snapshot %pUb\n", algorithm,
+		 id);
+	WRITE_ONCE(snapshot->diff_storage->compression, algorithm);
+
+	snapshot_put(snapshot);
+	return 0;
+}
+
+int snapshot_set_memory_storage(uuid_t *id, u64 memory_limit)
+{
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	pr_debug("Set memory limit %llu bytes of difference storage for snapshot %pUb\n",
+		 memory_limit, id);
+	WRITE_ONCE(snapshot->diff_storage->memory_limit, memory_limit);
+
+	snapshot_put(snapshot);
+	return 0;
+}
+
+int snapshot_set_storage_weight(uuid_t *id, dev_t dev_id, unsigned int weight)
+{
+	int ret;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = diff_storage_set_weight(snapshot->diff_storage, dev_id, weight);
+	if (ret)
+		pr_err("Unable to set weight %u for difference storage device [%u:%u]\n",
+		       weight, MAJOR(dev_id), MINOR(dev_id));
+
+	snapshot_put(snapshot);
+	return ret;
+}
+
+/*
+ * Checks whether the file is located on an original device of the snapshot.
+ * The writes to such a file would be copied to the difference storage that is
+ * running out of space.
+ */
+static bool snapshot_is_file_on_original(struct snapshot *snapshot,
+					 struct file *file)
+{
+	struct block_device *bdev = file_inode(file)->i_sb->s_bdev;
+	int inx;
+
+	if (!bdev)
+		return false;
+
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+
+		if (!tracker)
+			continue;
+		if ((tracker->dev_id == bdev->bd_dev) ||
+		    (tracker->dev_id == disk_devt(bdev->bd_disk)))
+			return true;
+	}
+	return false;
+}
+
+int snapshot_set_storage_file(uuid_t *id, struct file *file, u64 size_limit)
+{
+	int ret;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	if (snapshot_is_file_on_original(snapshot, file)) {
+		pr_err("Unable to set difference storage file for snapshot %pUb: the file is on an original device\n",
+		       id);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = diff_storage_set_file(snapshot->diff_storage, file, size_limit);
+	if (ret)
+		pr_err("Unable to set difference storage file for snapshot %pUb. errno=%d\n",
+		       id, abs(ret));
+out:
+	snapshot_put(snapshot);
+	return ret;
+}
+
+int snapshot_prepare(uuid_t *id)
+{
+	int ret;
+	struct snapshot *snapshot;
+	u64 start;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+	mutex_lock(&snapshot->take_lock);
+
+	if (snapshot->is_taken) {
+		ret = -EALREADY;
+		goto out;
+	}
+
+	if (!snapshot->count) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	start = ktime_get_ns();
+	ret = snapshot_prepare_diff_areas(snapshot);
+	snapshot->prepare_time_ns = ktime_get_ns() - start;
+	if (ret) {
+		pr_err("Unable to prepare snapshot %pUb. errno=%d\n", id,
+		       abs(ret));
+		snapshot_free_diff_areas(snapshot);
+		goto out;
+	}
+
+	pr_debug("Snapshot %pUb was prepared in %llu us\n", id,
+		 div_u64(snapshot->prepare_time_ns, NSEC_PER_USEC));
+out:
+	mutex_unlock(&snapshot->take_lock);
+	snapshot_put(snapshot);
+	return ret;
+}
+
+int snapshot_abort(uuid_t *id)
+{
+	int ret = 0;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+	mutex_lock(&snapshot->take_lock);
+
+	if (snapshot->is_taken) {
+		pr_err("Unable to abort snapshot %pUb: snapshot is already taken\n",
+		       id);
+		ret = -EBUSY;
+		goto out;
+	}
+
+	snapshot_free_diff_areas(snapshot);
+	pr_debug("Preparation of snapshot %pUb was aborted\n", id);
+out:
+	mutex_unlock(&snapshot->take_lock);
+	snapshot_put(snapshot);
+	return ret;
+}
+
+int snapshot_get_timing(uuid_t *id, u64 *prepare_time_ns, u64 *freeze_time_ns)
+{
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	*prepare_time_ns = snapshot->prepare_time_ns;
+	*freeze_time_ns = snapshot->freeze_time_ns;
+
+	snapshot_put(snapshot);
+	return 0;
+}
+
+int snapshot_set_cbt_limit(uuid_t *id, u64 memory_limit)
+{
+	int ret = 0;
+	int inx;
+	struct snapshot *snapshot;
+	u64 total_capacity = 0;
+	/* Both the readable and the writable tables use a byte per block */
+	u64 blk_count_limit = memory_limit >> 1;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	if (snapshot->is_taken) {
+		pr_err("Unable to set CBT memory limit: snapshot is already taken\n");
+		ret = -EBUSY;
+		goto out;
+	}
+
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+
+		if (tracker)
+			total_capacity += tracker->cbt_map->device_capacity;
+	}
+	if (!total_capacity)
+		goto out;
+
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+		u64 capacity;
+		u64 fraction;
+		u64 blk_count_max;
+
+		if (!tracker)
+			continue;
+		capacity = tracker->cbt_map->device_capacity;
+
+		/*
+		 * The fraction of the device in the total capacity with 20 bits
+		 * of precision avoids an overflow of the multiplication.
+		 */
+		fraction = div64_u64(capacity << 20, total_capacity);
+		blk_count_max = (blk_count_limit >> 20) * fraction +
+				(((blk_count_limit & (SZ_1M - 1)) * fraction) >> 20);
+		blk_count_max = clamp_t(u64, blk_count_max, 1, UINT_MAX);
+
+		pr_debug("Set CBT limit %llu blocks for device [%u:%u]\n",
+			 blk_count_max, MAJOR(tracker->dev_id),
+			 MINOR(tracker->dev_id));
+		ret = tracker_set_granularity(tracker->dev_id, 0,
+					      (unsigned int)blk_count_max);
+		if (ret)
+			break;
+	}
+out:
+	snapshot_put(snapshot);
+	return ret;
+}
+
+static void snapshot_collect_device_stats(struct snapshot *snapshot, int inx,
+					  struct blk_snap_device_stats *stats)
+{
+	struct tracker *tracker = snapshot->tracker_array[inx];
+
+	lockdep_assert_held(&snapshot->take_lock);
+	if (!tracker)
+		return;
+
+	stats->orig_dev_id.mj = MAJOR(tracker->dev_id);
+	stats->orig_dev_id.mn = MINOR(tracker->dev_id);
+	if (snapshot->diff_area_array && snapshot->diff_area_array[inx])
+		diff_area_stats_collect(snapshot->diff_area_array[inx], stats);
+}
+
+int snapshot_get_stats(uuid_t *id,
+		       struct blk_snap_device_stats __user *user_stats_array,
+		       unsigned int *pcount)
+{
+	int ret = 0;
+	int inx;
+	struct blk_snap_device_stats *stats_array = NULL;
+	struct snapshot *snapshot;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	if (!user_stats_array) {
+		pr_debug("Unable to get snapshot statistics: users buffer is not set\n");
+		goto out;
+	}
+
+	if (*pcount < snapshot->count) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	stats_array = kcalloc(snapshot->count,
+			      sizeof(struct blk_snap_device_stats), GFP_KERNEL);
+	if (!stats_array) {
+		pr_err("Unable to get snapshot statistics: not enough memory.\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	memory_object_inc(memory_object_blk_snap_device_stats);
+
+	mutex_lock(&snapshot->take_lock);
+	for (inx = 0; inx < snapshot->count; inx++)
+		snapshot_collect_device_stats(snapshot, inx, &stats_array[inx]);
+	mutex_unlock(&snapshot->take_lock);
+
+	if (copy_to_user(user_stats_array, stats_array,
+			 snapshot->count * sizeof(struct blk_snap_device_stats))) {
+		pr_err("Unable to get snapshot statistics: failed to copy data to user buffer\n");
+		ret = -ENODATA;
+	}
+out:
+	*pcount = snapshot->count;
 
-static inline bool blk_snap_dev_is_equal(struct blk_snap_dev *first,
-				    struct blk_snap_dev *second)
-{
-	return (first->mj == second->mj) && (first->mn == second->mn);
+	kfree(stats_array);
+	if (stats_array)
+		memory_object_dec(memory_object_blk_snap_device_stats);
+	snapshot_put(snapshot);
+
+	return ret;
 }
 
-static inline int check_same_devices(struct blk_snap_dev *devices,
-				     unsigned int count)
+int snapshot_set_unused_blocks(uuid_t *id, dev_t dev_id,
+			       struct blk_snap_block_range *ranges,
+			       unsigned int count)
 {
-	struct blk_snap_dev *first;
-	struct blk_snap_dev *second;
+	int ret = -ENODEV;
+	int inx;
+	struct snapshot *snapshot;
 
-	for (first = devices; first < (devices + (count - 1)); ++first) {
-		for (second = first + 1; second < (devices + count); ++second) {
-			if (blk_snap_dev_is_equal(first, second)) {
-				pr_err("Unable to create snapshot: The same device [%d:%d] was added twice.\n",
-					first->mj, first->mn);
-				return -EINVAL;
-			}
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+	mutex_lock(&snapshot->take_lock);
+
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area;
+
+		if (!tracker || (tracker->dev_id != dev_id))
+			continue;
+
+		diff_area = snapshot->diff_area_array ?
+			snapshot->diff_area_array[inx] : NULL;
+		if (!diff_area) {
+			pr_err("Unable to set unused blocks: snapshot is not prepared\n");
+			break;
 		}
+
+		pr_debug("Marked %lu chunks as unused for device [%u:%u]\n",
+			 diff_area_set_unused(diff_area, ranges, count),
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = 0;
+		break;
 	}
+	mutex_unlock(&snapshot->take_lock);
 
-	return 0;
+	snapshot_put(snapshot);
+	return ret;
 }
 
-int snapshot_create(struct blk_snap_dev *dev_id_array, unsigned int count,
-		    uuid_t *id)
+int snapshot_release_blocks(uuid_t *id, dev_t dev_id,
+			    struct blk_snap_block_range *ranges,
+			    unsigned int count)
 {
-	struct snapshot *snapshot = NULL;
-	int ret;
-	unsigned int inx;
-
-	pr_info("Create snapshot for devices:\n");
-	for (inx = 0; inx < count; ++inx)
-		pr_info("\t%u:%u\n", dev_id_array[inx].mj,
-			dev_id_array[inx].mn);
+	int ret = -ENODEV;
+	int inx;
+	struct snapshot *snapshot;
 
-	ret = check_same_devices(dev_id_array, count);
-	if (ret)
-		return ret;
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+	mutex_lock(&snapshot->take_lock);
 
-	snapshot = snapshot_new(count);
-	if (IS_ERR(snapshot)) {
-		pr_err("Unable to create snapshot: failed to allocate snapshot structure\n");
-		return PTR_ERR(snapshot);
-	}
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area;
 
-	ret = -ENODEV;
-	for (inx = 0; inx < count; ++inx) {
-		dev_t dev_id =
-			MKDEV(dev_id_array[inx].mj, dev_id_array[inx].mn);
-		struct tracker *tracker;
+		if (!tracker || (tracker->dev_id != dev_id))
+			continue;
 
-		tracker = tracker_create_or_get(dev_id);
-		if (IS_ERR(tracker)) {
-			pr_err("Unable to create snapshot\n");
-			pr_err("Failed to add device [%u:%u] to snapshot tracking\n",
-			       MAJOR(dev_id), MINOR(dev_id));
-			ret = PTR_ERR(tracker);
-			goto fail;
+		diff_area = snapshot->diff_area_array ?
+			snapshot->diff_area_array[inx] : NULL;
+		if (!diff_area) {
+			pr_err("Unable to release blocks: snapshot is not prepared\n");
+			break;
 		}
 
-		snapshot->tracker_array[inx] = tracker;
-		snapshot->count++;
+		pr_debug("Released %lu chunks for device [%u:%u]\n",
+			 diff_area_release(diff_area, ranges, count, true),
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = 0;
+		break;
 	}
-
-	down_write(&snapshots_lock);
-	list_add_tail(&snapshots, &snapshot->link);
-	up_write(&snapshots_lock);
-
-	uuid_copy(id, &snapshot->id);
-	pr_info("Snapshot %pUb was created\n", &snapshot->id);
-	return 0;
-fail:
-	pr_err("Snapshot cannot be created\n");
+	mutex_unlock(&snapshot->take_lock);
 
 	snapshot_put(snapshot);
 	return ret;
 }
 
-static struct snapshot *snapshot_get_by_id(uuid_t *id)
+int snapshot_get_chunk_hashes(uuid_t *id, dev_t dev_id, u64 first,
+			      u64 __user *user_hashes, unsigned int *pcount,
+			      unsigned int *pchunk_shift)
 {
-	struct snapshot *snapshot = NULL;
-	struct snapshot *s;
+	int ret = -ENODEV;
+	int inx;
+	struct snapshot *snapshot;
 
-	down_read(&snapshots_lock);
-	if (list_empty(&snapshots))
-		goto out;
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+	mutex_lock(&snapshot->take_lock);
 
-	list_for_each_entry(s, &snapshots, link) {
-		if (uuid_equal(&s->id, id)) {
-			snapshot = s;
-			snapshot_get(snapshot);
+	for (inx = 0; inx < snapshot->count; inx++) {
+		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area;
+
+		if (!tracker || (tracker->dev_id != dev_id))
+			continue;
+
+		diff_area = snapshot->diff_area_array ?
+			snapshot->diff_area_array[inx] : NULL;
+		if (!diff_area) {
+			pr_err("Unable to get chunk hashes: snapshot is not prepared\n");
 			break;
 		}
+
+		*pchunk_shift = diff_area->chunk_shift;
+		ret = diff_area_get_hashes(diff_area, first, user_hashes,
+					   pcount);
+		break;
 	}
-out:
-	up_read(&snapshots_lock);
-	return snapshot;
+	mutex_unlock(&snapshot->take_lock);
+
+	snapshot_put(snapshot);
+	return ret;
 }
 
-int snapshot_destroy(uuid_t *id)
+#ifdef CONFIG_DEBUG_FS
+static void snapshot_stats_show_hist(struct seq_file *m, const char *name,
+				     u64 *hist)
 {
-	struct snapshot *snapshot = NULL;
+	int inx;
 
-	pr_info("Destroy snapshot %pUb\n", id);
-	memory_object_print(false);
-	down_write(&snapshots_lock);
-	if (!list_empty(&snapshots)) {
-		struct snapshot *s = NULL;
+	seq_printf(m, "  %s:", name);
+	for (inx = 0; inx < BLK_SNAP_STATS_HIST_SIZE; inx++)
+		seq_printf(m, " %llu", hist[inx]);
+	seq_putc(m, '\n');
+}
 
-		list_for_each_entry(s, &snapshots, link) {
-			if (uuid_equal(&s->id, id)) {
-				snapshot = s;
-				list_del(&snapshot->link);
-				break;
-			}
-		}
+/*
+ * The snapshot is taken by the thread that holds its take_lock and then
+ * removes it from the list if the take failed, so take_lock cannot be
+ * acquired under snapshots_lock. The references to the snapshots are taken
+ * under snapshots_lock, and their statistics are collected after it is
+ * released.
+ */
+static struct snapshot **snapshot_get_all(unsigned int *pcount)
+{
+	struct snapshot **snapshot_array;
+	struct snapshot *snapshot;
+	unsigned int count = 0;
+
+	down_read(&snapshots_lock);
+	list_for_each_entry(snapshot, &snapshots, link)
+		count++;
+	if (!count) {
+		up_read(&snapshots_lock);
+		*pcount = 0;
+		return NULL;
 	}
-	up_write(&snapshots_lock);
 
-	if (!snapshot) {
-		pr_err("Unable to destroy snapshot: cannot find snapshot by id %pUb\n",
-		       id);
-		return -ENODEV;
+	snapshot_array = kcalloc(count, sizeof(void *), GFP_KERNEL);
+	if (!snapshot_array) {
+		up_read(&snapshots_lock);
+		return ERR_PTR(-ENOMEM);
 	}
-	snapshot_put(snapshot);
-	memory_object_print(false);
-	memory_object_max_print();
+	memory_object_inc(memory_object_snapshot_array);
 
-	return 0;
+	count = 0;
+	list_for_each_entry(snapshot, &snapshots, link) {
+		snapshot_get(snapshot);
+		snapshot_array[count++] = snapshot;
+	}
+	up_read(&snapshots_lock);
+
+	*pcount = count;
+	return snapshot_array;
 }
 
-int snapshot_append_storage(uuid_t *id, struct blk_snap_dev dev_id,
-			    struct blk_snap_block_range __user *ranges,
-			    unsigned int range_count)
+int snapshot_stats_show(struct seq_file *m, void *v)
 {
-	int ret = 0;
+	int inx;
+	unsigned int count;
+	unsigned int snapshot_inx;
+	struct snapshot **snapshot_array;
 	struct snapshot *snapshot;
+	struct blk_snap_device_stats *stats;
+
+	stats = kzalloc(sizeof(struct blk_snap_device_stats), GFP_KERNEL);
+	if (!stats)
+		return -ENOMEM;
+	memory_object_inc(memory_object_blk_snap_device_stats);
+
+	snapshot_array = snapshot_get_all(&count);
+	if (IS_ERR(snapshot_array)) {
+		kfree(stats);
+		memory_object_dec(memory_object_blk_snap_device_stats);
+		return PTR_ERR(snapshot_array);
+	}
 
-	snapshot = snapshot_get_by_id(id);
-	if (!snapshot)
-		return -ESRCH;
+	for (snapshot_inx = 0; snapshot_inx < count; snapshot_inx++) {
+		snapshot = snapshot_array[snapshot_inx];
+
+		seq_printf(m, "snapshot %pUb\n", &snapshot->id);
+		mutex_lock(&snapshot->take_lock);
+		for (inx = 0; inx < snapshot->count; inx++) {
+			memset(stats, 0, sizeof(struct blk_snap_device_stats));
+			snapshot_collect_device_stats(snapshot, inx, stats);
+
+			seq_printf(m, " device %u:%u\n", stats->orig_dev_id.mj,
+				   stats->orig_dev_id.mn);
+			seq_printf(m, "  chunks_copied: %llu\n",
+				   stats->chunks_copied);
+			seq_printf(m, "  chunks_shared: %llu\n",
+				   stats->chunks_shared);
+			seq_printf(m, "  bytes_stored: %llu\n",
+				   stats->bytes_stored);
+			seq_printf(m, "  cow_eagain: %llu\n", stats->cow_eagain);
+			seq_printf(m, "  cow_wait_ns: %llu\n", stats->cow_wait_ns);
+			seq_printf(m, "  image_reads: %llu\n", stats->image_reads);
+			seq_printf(m, "  image_writes: %llu\n",
+				   stats->image_writes);
+			seq_printf(m, "  image_cache_hits: %llu\n",
+				   stats->image_cache_hits);
+			seq_printf(m, "  image_cache_misses: %llu\n",
+				   stats->image_cache_misses);
+			snapshot_stats_show_hist(m, "cow_load_hist_us",
+						 stats->cow_load_hist);
+			snapshot_stats_show_hist(m, "cow_store_hist_us",
+						 stats->cow_store_hist);
+			snapshot_stats_show_hist(m, "image_read_hist_us",
+						 stats->image_read_hist);
+		}
+		mutex_unlock(&snapshot->take_lock);
+		snapshot_put(snapshot);
+	}
+	if (snapshot_array) {
+		kfree(snapshot_array);
+		memory_object_dec(memory_object_snapshot_array);
+	}
 
-	ret = diff_storage_append_block(snapshot->diff_storage,
-					MKDEV(dev_id.mj, dev_id.mn), ranges,
-					range_count);
-	snapshot_put(snapshot);
-	return ret;
+	kfree(stats);
+	memory_object_dec(memory_object_blk_snap_device_stats);
+	return 0;
 }
+#endif /* CONFIG_DEBUG_FS */
+#endif
 
 #if defined(BLK_SNAP_SEQUENTALFREEZE)
 
@@ -453,9 +1287,12 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 	int ret = 0;
 	int inx;
 
+	lockdep_assert_held(&snapshot->take_lock);
+
 	/* Try to flush and freeze file system on each original block device. */
 	for (inx = 0; inx < snapshot->count; inx++) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 		struct super_block *sb;
 #else
@@ -466,7 +1303,7 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 		if (!tracker)
 			continue;
 
-		orig_bdev = tracker->diff_area->orig_bdev;
+		orig_bdev = diff_area->orig_bdev;
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 		_freeze_bdev(orig_bdev, &sb);
 #else
@@ -485,7 +1322,7 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 		 * Take snapshot - switch CBT tables and enable COW logic
 		 * for each tracker.
 		 */
-		ret = tracker_take_snapshot(tracker);
+		ret = tracker_take_snapshot(tracker, diff_area);
 		if (ret) {
 			pr_err("Unable to take snapshot: failed to capture snapshot %pUb\n",
 			       &snapshot->id);
@@ -514,6 +1351,7 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 
 	while (inx--) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 		struct super_block *sb;
 #endif
@@ -522,9 +1360,9 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_freeze_bdev(tracker->diff_area->orig_bdev, &sb);
+		_freeze_bdev(diff_area->orig_bdev, &sb);
 #else
-		if (freeze_bdev(tracker->diff_area->orig_bdev))
+		if (freeze_bdev(diff_area->orig_bdev))
 			pr_warn("Failed to freeze device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -532,12 +1370,12 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 				MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 #endif
 
-		tracker_release_snapshot(tracker);
+		tracker_release_snapshot(tracker, diff_area);
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_thaw_bdev(tracker->diff_area->orig_bdev, sb);
+		_thaw_bdev(diff_area->orig_bdev, sb);
 #else
-		if (thaw_bdev(tracker->diff_area->orig_bdev))
+		if (thaw_bdev(diff_area->orig_bdev))
 			pr_err("Failed to thaw device [%u:%u]\n",
 			       MAJOR(tracker->dev_id),
 			       MINOR(tracker->dev_id));
@@ -563,18 +1401,21 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 	int ret = 0;
 	int inx;
 
+	lockdep_assert_held(&snapshot->take_lock);
+
 	/* Try to flush and freeze file system on each original block device. */
 	for (inx = 0; inx < snapshot->count; inx++) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 
 		if (!tracker)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_freeze_bdev(tracker->diff_area->orig_bdev,
+		_freeze_bdev(diff_area->orig_bdev,
 			     &snapshot->superblock_array[inx]);
 #else
-		if (freeze_bdev(tracker->diff_area->orig_bdev))
+		if (freeze_bdev(diff_area->orig_bdev))
 			pr_warn("Failed to freeze device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else {
@@ -593,7 +1434,8 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 		if (!snapshot->tracker_array[inx])
 			continue;
 
-		ret = tracker_take_snapshot(snapshot->tracker_array[inx]);
+		ret = tracker_take_snapshot(snapshot->tracker_array[inx],
+					    snapshot->diff_area_array[inx]);
 		if (ret) {
 			pr_err("Unable to take snapshot: failed to capture snapshot %pUb\n",
 			       &snapshot->id);
@@ -606,7 +1448,8 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 			struct tracker *tracker = snapshot->tracker_array[inx];
 
 			if (tracker)
-				tracker_release_snapshot(tracker);
+				tracker_release_snapshot(
+					tracker, snapshot->diff_area_array[inx]);
 		}
 	} else
 		snapshot->is_taken = true;
@@ -614,15 +1457,16 @@ static int snapshot_take_trackers(struct snapshot *snapshot)
 	/* Thaw file systems on original block devices. */
 	for (inx = 0; inx < snapshot->count; inx++) {
 		struct tracker *tracker = snapshot->tracker_array[inx];
+		struct diff_area *diff_area = snapshot->diff_area_array[inx];
 
 		if (!tracker || !tracker->is_frozen)
 			continue;
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
-		_thaw_bdev(tracker->diff_area->orig_bdev,
+		_thaw_bdev(diff_area->orig_bdev,
 			   snapshot->superblock_array[inx]);
 #else
-		if (thaw_bdev(tracker->diff_area->orig_bdev))
+		if (thaw_bdev(diff_area->orig_bdev))
 			pr_err("Failed to thaw device [%u:%u]\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 		else
@@ -641,10 +1485,12 @@ int snapshot_take(uuid_t *id)
 	int ret = 0;
 	struct snapshot *snapshot;
 	int inx;
+	u64 start;
 
 	snapshot = snapshot_get_by_id(id);
 	if (!snapshot)
 		return -ESRCH;
+	mutex_lock(&snapshot->take_lock);
 
 	if (snapshot->is_taken) {
 		ret = -EALREADY;
@@ -656,28 +1502,22 @@ int snapshot_take(uuid_t *id)
 		goto out;
 	}
 
-	/* Allocate diff area for each device in the snapshot. */
-	for (inx = 0; inx < snapshot->count; inx++) {
-		struct tracker *tracker = snapshot->tracker_array[inx];
-		struct diff_area *diff_area;
-
-		if (!tracker)
-			continue;
-
-		diff_area =
-			diff_area_new(tracker->dev_id, snapshot->diff_storage);
-		if (IS_ERR(diff_area)) {
-			ret = PTR_ERR(diff_area);
-			goto fail;
-		}
-		tracker->diff_area = diff_area;
-	}
+	/*
+	 * Allocate diff area for each device in the snapshot, unless it has
+	 * been done in advance.
+	 */
+	ret = snapshot_prepare_diff_areas(snapshot);
+	if (ret)
+		goto fail;
 
+	start = ktime_get_ns();
 	ret = snapshot_take_trackers(snapshot);
+	snapshot->freeze_time_ns = ktime_get_ns() - start;
 	if (ret)
 		goto fail;
 
-	pr_info("Snapshot was taken successfully\n");
+	pr_info("Snapshot was taken successfully, devices were frozen for %llu us\n",
+		div_u64(snapshot->freeze_time_ns, NSEC_PER_USEC));
 
 	/*
 	 * Sometimes a snapshot is in the state of corrupt immediately
@@ -689,7 +1529,8 @@ int snapshot_take(uuid_t *id)
 		if (!tracker)
 			continue;
 
-		if (unlikely(diff_area_is_corrupted(tracker->diff_area))) {
+		if (unlikely(diff_area_is_corrupted(
+			    snapshot->diff_area_array[inx]))) {
 			pr_err("Unable to freeze devices [%u:%u]: diff area is corrupted\n",
 			       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 			ret = -EFAULT;
@@ -702,8 +1543,9 @@ int snapshot_take(uuid_t *id)
 		struct snapimage *snapimage;
 		struct tracker *tracker = snapshot->tracker_array[inx];
 
-		snapimage =
-			snapimage_create(tracker->diff_area, tracker->cbt_map);
+		snapimage = snapimage_create(snapshot->diff_area_array[inx],
+					     tracker->cbt_map,
+					     snapshot->options.worker_count);
 		if (IS_ERR(snapimage)) {
 			ret = PTR_ERR(snapimage);
 			pr_err("Failed to create snapshot image for device [%u:%u] with error=%d\n",
@@ -723,24 +1565,83 @@ fail:
 	up_write(&snapshots_lock);
 	snapshot_put(snapshot);
 out:
+	mutex_unlock(&snapshot->take_lock);
+	snapshot_put(snapshot);
+	return ret;
+}
+
+int snapshot_wait_event(uuid_t *id, unsigned long timeout_ms,
+			struct event *event)
+{
+	struct snapshot *snapshot;
+	int ret;
+
+	snapshot = snapshot_get_by_id(id);
+	if (!snapshot)
+		return -ESRCH;
+
+	ret = event_wait(&snapshot->diff_storage->event_queue, timeout_ms,
+			 event);
+
 	snapshot_put(snapshot);
 	return ret;
 }
 
-struct event *snapshot_wait_event(uuid_t *id, unsigned long timeout_ms)
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * The event file holds the difference storage, since the event queue is a
+ * part of it. When the snapshot is destroyed, the queue is closed.
+ */
+static __poll_t snapshot_event_poll(struct file *file, poll_table *wait)
+{
+	struct diff_storage *diff_storage = file->private_data;
+
+	return event_poll(&diff_storage->event_queue, file, wait);
+}
+
+static ssize_t snapshot_event_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	struct diff_storage *diff_storage = file->private_data;
+
+	return event_read(&diff_storage->event_queue, buf, count,
+			  file->f_flags & O_NONBLOCK);
+}
+
+static int snapshot_event_release(struct inode *inode, struct file *file)
+{
+	diff_storage_put(file->private_data);
+	return 0;
+}
+
+static const struct file_operations snapshot_event_fops = {
+	.owner		= THIS_MODULE,
+	.poll		= snapshot_event_poll,
+	.read		= snapshot_event_read,
+	.release	= snapshot_event_release,
+	.llseek		= noop_llseek,
+};
+
+struct file *snapshot_event_file(uuid_t *id, unsigned int flags)
 {
 	struct snapshot *snapshot;
-	struct event *event;
+	struct file *file;
 
 	snapshot = snapshot_get_by_id(id);
 	if (!snapshot)
 		return ERR_PTR(-ESRCH);
 
-	event = event_wait(&snapshot->diff_storage->event_queue, timeout_ms);
+	diff_storage_get(snapshot->diff_storage);
+	file = anon_inode_getfile("[blksnap-event]", &snapshot_event_fops,
+				  snapshot->diff_storage,
+				  O_RDONLY | (flags & O_NONBLOCK));
+	if (IS_ERR(file))
+		diff_storage_put(snapshot->diff_storage);
 
 	snapshot_put(snapshot);
-	return event;
+	return file;
 }
+#endif
 
 int snapshot_collect(unsigned int *pcount, struct blk_snap_uuid __user *id_array)
 {
@@ -908,6 +1809,57 @@ out:
 	return ret;
 }
 
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * Looks for the snapshot image by its device ID.
+ * The caller must hold the snapshots_lock.
+ */
+static struct snapimage *snapshot_find_image(dev_t image_dev_id)
+{
+	int inx;
+	struct snapshot *s;
+
+	list_for_each_entry(s, &snapshots, link) {
+		if (!s->is_taken)
+			continue;
+
+		for (inx = 0; inx < s->count; inx++) {
+			struct snapimage *img = s->snapimage_array[inx];
+
+			if (img && (MKDEV(img->disk->major,
+					  img->disk->first_minor) ==
+				    image_dev_id))
+				return img;
+		}
+	}
+
+	return NULL;
+}
+
+int snapshot_set_read_ahead(dev_t image_dev_id, unsigned int chunk_count)
+{
+	int ret = 0;
+	struct snapimage *image;
+
+	down_read(&snapshots_lock);
+	image = snapshot_find_image(image_dev_id);
+	if (!image) {
+		pr_err("Cannot find snapshot image device [%u:%u]\n",
+		       MAJOR(image_dev_id), MINOR(image_dev_id));
+		ret = -ENODEV;
+		goto out;
+	}
+
+	pr_debug("Set read-ahead %u chunks for snapshot image [%u:%u]\n",
+		 chunk_count, MAJOR(image_dev_id), MINOR(image_dev_id));
+	diff_area_set_read_ahead(image->diff_area, chunk_count);
+out:
+	up_read(&snapshots_lock);
+
+	return ret;
+}
+#endif
+
 #ifdef BLK_SNAP_DEBUG_SECTOR_STATE
 int snapshot_get_chunk_state(dev_t image_dev_id, sector_t sector,
 			     struct blk_snap_sector_state *state)
@@ -9,12 +9,57 @@
 #include <linux/uuid.h>
 #include <linux/spinlock.h>
 #include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
+#include <linux/workqueue.h>
 #include "event_queue.h"
 
 struct tracker;
 struct diff_storage;
+struct chunk_cache;
 struct snapimage;
+struct diff_area;
+struct seq_file;
+
+/**
+ * struct snapshot_options - The tuning parameters of the snapshot.
+ * @chunk_shift:
+ *	The minimum chunk size as a power of two.
+ * @read_ahead:
+ *	The number of chunks to read in advance.
+ * @cache_size:
+ *	The size of the memory cache of chunks in bytes.
+ * @storage_increment:
+ *	The minimum portion of the difference storage in sectors requested
+ *	from user space.
+ * @durability:
+ *	The durability mode of the difference storage.
+ * @worker_count:
+ *	The number of worker threads for each snapshot image. Zero means one
+ *	for each online CPU.
+ * @read_once:
+ *	The chunks of the snapshot images are released as soon as they are
+ *	read.
+ * @chunk_auto:
+ *	The chunk size of each device is chosen by its write pattern, the
+ *	@chunk_shift is the largest allowed.
+ * @chunk_hash:
+ *	The hashes of the original contents of the chunks are computed.
+ *
+ * By default, the options are taken from the module parameters.
+ */
+struct snapshot_options {
+	unsigned int chunk_shift;
+	unsigned int read_ahead;
+	size_t cache_size;
+	sector_t storage_increment;
+	unsigned int durability;
+	unsigned int worker_count;
+	bool read_once;
+	bool chunk_auto;
+	bool chunk_hash;
+};
+
 /**
  * struct snapshot - Snapshot structure.
  * @link:
@@ -24,10 +69,18 @@ struct snapimage;
  *	an ioctl.
  * @id:
  *	UUID of snapshot.
+ * @take_lock:
+ *	Serializes the preparation, the abort and the taking of the snapshot.
+ *	The difference areas are allocated and released under it, so it must
+ *	be held to access @diff_area_array while the snapshot is in the list
+ *	of snapshots.
  * @is_taken:
  *	Flag that the snapshot was taken.
  * @diff_storage:
  *	A pointer to the difference storage of this snapshot.
+ * @chunk_cache:
+ *	A pointer to the cache of chunks shared by the block devices of this
+ *	snapshot.
  * @count:
  *	The number of block devices in the snapshot. This number
  *	corresponds to the size of arrays of pointers to trackers
@@ -36,13 +89,27 @@ struct snapimage;
  *	Array of pointers to block device trackers.
  * @snapimage_array:
  *	Array of pointers to images of snapshots of block devices.
+ * @diff_area_array:
+ *	Array of pointers to difference areas of block devices. Protected by
+ *	@take_lock.
+ * @prepare_time_ns:
+ *	The time spent allocating the difference areas.
+ * @freeze_time_ns:
+ *	The time from freezing the first block device to thawing the last one
+ *	when the snapshot was taken.
+ * @options:
+ *	The tuning parameters of the snapshot.
+ * @release_work:
+ *	The work item that releases the difference areas and the difference
+ *	storage after the snapshot is detached from the block devices.
  *
  * A snapshot corresponds to a single backup session and provides snapshot
  * images for multiple block devices. Several backup sessions can be
  * performed at the same time, which means that several snapshots can
- * exist at the same time. However, the original block device can only
- * belong to one snapshot. Creating multiple snapshots from the same block
- * device is not allowed.
+ * exist at the same time. The original block device can belong to several
+ * snapshots, up to TRACKER_SNAPSHOT_MAX. The snapshots of the same device
+ * share the data read from it when copying on write, but each of them
+ * stores the data in its own difference storage.
  *
  * A UUID is used to identify the snapshot.
  *
@@ -51,26 +118,65 @@ struct snapshot {
 	struct list_head link;
 	struct kref kref;
 	uuid_t id;
+	struct mutex take_lock;
 	bool is_taken;
 	struct diff_storage *diff_storage;
+	struct chunk_cache *chunk_cache;
 	int count;
 	struct tracker **tracker_array;
 	struct snapimage **snapimage_array;
+	struct diff_area **diff_area_array;
+	u64 prepare_time_ns;
+	u64 freeze_time_ns;
+	struct snapshot_options options;
+	struct work_struct release_work;
 #if defined(HAVE_SUPER_BLOCK_FREEZE) && !defined(BLK_SNAP_SEQUENTALFREEZE)
 	struct super_block **superblock_array;
 #endif
 };
 
+int snapshot_init(void);
 void snapshot_done(void);
 
+void snapshot_options_init(struct snapshot_options *options);
 int snapshot_create(struct blk_snap_dev *dev_id_array, unsigned int count,
-		    uuid_t *id);
+		    const struct snapshot_options *options, uuid_t *id);
 int snapshot_destroy(uuid_t *id);
 int snapshot_append_storage(uuid_t *id, struct blk_snap_dev dev_id,
 			    struct blk_snap_block_range __user *ranges,
 			    unsigned int range_count);
 int snapshot_take(uuid_t *id);
-struct event *snapshot_wait_event(uuid_t *id, unsigned long timeout_ms);
+#ifdef BLK_SNAP_MODIFICATION
+int snapshot_set_durability(uuid_t *id, unsigned int mode);
+int snapshot_set_compression(uuid_t *id, unsigned int algorithm);
+int snapshot_set_memory_storage(uuid_t *id, u64 memory_limit);
+int snapshot_set_storage_weight(uuid_t *id, dev_t dev_id, unsigned int weight);
+int snapshot_set_storage_file(uuid_t *id, struct file *file, u64 size_limit);
+int snapshot_set_cbt_limit(uuid_t *id, u64 memory_limit);
+int snapshot_prepare(uuid_t *id);
+int snapshot_abort(uuid_t *id);
+int snapshot_get_timing(uuid_t *id, u64 *prepare_time_ns, u64 *freeze_time_ns);
+int snapshot_get_stats(uuid_t *id,
+		       struct blk_snap_device_stats __user *user_stats_array,
+		       unsigned int *pcount);
+int snapshot_set_unused_blocks(uuid_t *id, dev_t dev_id,
+			       struct blk_snap_block_range *ranges,
+			       unsigned int count);
+int snapshot_release_blocks(uuid_t *id, dev_t dev_id,
+			    struct blk_snap_block_range *ranges,
+			    unsigned int count);
+int snapshot_get_chunk_hashes(uuid_t *id, dev_t dev_id, u64 first,
+			      u64 __user *user_hashes, unsigned int *pcount,
+			      unsigned int *pchunk_shift);
+#ifdef CONFIG_DEBUG_FS
+int snapshot_stats_show(struct seq_file *m, void *v);
+#endif
+#endif
+int snapshot_wait_event(uuid_t *id, unsigned long timeout_ms,
+			struct event *event);
+#ifdef BLK_SNAP_MODIFICATION
+struct file *snapshot_event_file(uuid_t *id, unsigned int flags);
+#endif
 int snapshot_collect(unsigned int *pcount, struct blk_snap_uuid __user *id_array);
 int snapshot_collect_images(uuid_t *id,
 			    struct blk_snap_image_info __user *image_info_array,
@@ -78,6 +184,9 @@ int snapshot_collect_images(uuid_t *id,
 int snapshot_mark_dirty_blocks(dev_t image_dev_id,
 			       struct blk_snap_block_range *block_ranges,
 			       unsigned int count);
+#ifdef BLK_SNAP_MODIFICATION
+int snapshot_set_read_ahead(dev_t image_dev_id, unsigned int chunk_count);
+#endif
 
 #ifdef BLK_SNAP_DEBUG_SECTOR_STATE
 int snapshot_get_chunk_state(dev_t image_dev_id, sector_t sector,
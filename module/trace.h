@@ -0,0 +1,243 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM blksnap
+
+#if !defined(__BLK_SNAP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define __BLK_SNAP_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blkdev.h>
+#include <linux/ktime.h>
+#include "diff_io.h"
+#include "diff_area.h"
+#include "chunk.h"
+
+/*
+ * The tracepoints of the copy-on-write and snapshot image pipelines.
+ * They are available in /sys/kernel/tracing/events/blksnap/ and cost
+ * nothing while disabled, so they can be used on production systems to
+ * find out where the latency of the writes to the original device and of
+ * the reads from the snapshot images comes from.
+ */
+
+TRACE_EVENT(blksnap_intercept_start,
+	TP_PROTO(dev_t dev, sector_t sector, sector_t count, bool is_nowait),
+	TP_ARGS(dev, sector, count, is_nowait),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, sector)
+		__field(sector_t, count)
+		__field(bool, is_nowait)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->sector = sector;
+		__entry->count = count;
+		__entry->is_nowait = is_nowait;
+	),
+	TP_printk("dev=%d:%d sector=%llu count=%llu nowait=%d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector,
+		  (unsigned long long)__entry->count, __entry->is_nowait)
+);
+
+TRACE_EVENT(blksnap_intercept_end,
+	TP_PROTO(dev_t dev, sector_t sector, sector_t count, bool is_punted,
+		 u64 start_time),
+	TP_ARGS(dev, sector, count, is_punted, start_time),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, sector)
+		__field(sector_t, count)
+		__field(bool, is_punted)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->sector = sector;
+		__entry->count = count;
+		__entry->is_punted = is_punted;
+		__entry->latency = ktime_get_ns() - start_time;
+	),
+	TP_printk("dev=%d:%d sector=%llu count=%llu punted=%d latency=%lluns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector,
+		  (unsigned long long)__entry->count, __entry->is_punted,
+		  __entry->latency)
+);
+
+DECLARE_EVENT_CLASS(blksnap_chunk_class,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, number)
+		__field(unsigned int, state)
+	),
+	TP_fast_assign(
+		__entry->dev = chunk->diff_area->orig_bdev->bd_dev;
+		__entry->number = chunk->number;
+		__entry->state = chunk_state_get(chunk);
+	),
+	TP_printk("dev=%d:%d chunk=%lu state=0x%x",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  __entry->number, __entry->state)
+);
+
+/* The loading of the chunk data into the buffer is started. */
+DEFINE_EVENT(blksnap_chunk_class, blksnap_chunk_load,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk)
+);
+
+/* The chunk data has been loaded into the buffer. */
+DEFINE_EVENT(blksnap_chunk_class, blksnap_chunk_loaded,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk)
+);
+
+/* The storing of the chunk data to the difference storage is started. */
+DEFINE_EVENT(blksnap_chunk_class, blksnap_chunk_store,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk)
+);
+
+/* The chunk data has been stored to the difference storage. */
+DEFINE_EVENT(blksnap_chunk_class, blksnap_chunk_stored,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk)
+);
+
+/* The chunk is placed in the cache. */
+DEFINE_EVENT(blksnap_chunk_class, blksnap_chunk_cache,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk)
+);
+
+/* The buffer of the chunk is released. */
+DEFINE_EVENT(blksnap_chunk_class, blksnap_chunk_evict,
+	TP_PROTO(struct chunk *chunk),
+	TP_ARGS(chunk)
+);
+
+TRACE_EVENT(blksnap_diff_io_submit,
+	TP_PROTO(struct diff_io *diff_io, struct diff_region *diff_region),
+	TP_ARGS(diff_io, diff_region),
+	TP_STRUCT__entry(
+		__field(const void *, diff_io)
+		__field(dev_t, dev)
+		__field(sector_t, sector)
+		__field(sector_t, count)
+		__field(bool, is_write)
+		__field(bool, is_sync_io)
+	),
+	TP_fast_assign(
+		__entry->diff_io = diff_io;
+		__entry->dev = diff_region->bdev->bd_dev;
+		__entry->sector = diff_region->sector;
+		__entry->count = diff_region->count;
+		__entry->is_write = diff_io->is_write;
+		__entry->is_sync_io = diff_io->is_sync_io;
+	),
+	TP_printk("diff_io=%p dev=%d:%d sector=%llu count=%llu %s %s",
+		  __entry->diff_io, MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector,
+		  (unsigned long long)__entry->count,
+		  __entry->is_write ? "write" : "read",
+		  __entry->is_sync_io ? "sync" : "async")
+);
+
+TRACE_EVENT(blksnap_diff_io_complete,
+	TP_PROTO(struct diff_io *diff_io),
+	TP_ARGS(diff_io),
+	TP_STRUCT__entry(
+		__field(const void *, diff_io)
+		__field(int, error)
+		__field(bool, is_write)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->diff_io = diff_io;
+		__entry->error = diff_io->error;
+		__entry->is_write = diff_io->is_write;
+		__entry->latency = ktime_get_ns() - diff_io->start_time;
+	),
+	TP_printk("diff_io=%p %s error=%d latency=%lluns", __entry->diff_io,
+		  __entry->is_write ? "write" : "read", __entry->error,
+		  __entry->latency)
+);
+
+TRACE_EVENT(blksnap_diff_storage_new_region,
+	TP_PROTO(sector_t count, struct diff_region *region, int ret),
+	TP_ARGS(count, region, ret),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, sector)
+		__field(sector_t, count)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->dev = (!ret && region->bdev) ? region->bdev->bd_dev : 0;
+		__entry->sector = ret ? 0 : region->sector;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+	TP_printk("dev=%d:%d sector=%llu count=%llu ret=%d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector,
+		  (unsigned long long)__entry->count, __entry->ret)
+);
+
+TRACE_EVENT(blksnap_image_bio_begin,
+	TP_PROTO(dev_t dev, struct bio *bio),
+	TP_ARGS(dev, bio),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, sector)
+		__field(unsigned int, count)
+		__field(bool, is_write)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->sector = bio->bi_iter.bi_sector;
+		__entry->count = bio_sectors(bio);
+		__entry->is_write = op_is_write(bio_op(bio));
+	),
+	TP_printk("dev=%d:%d sector=%llu count=%u %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector, __entry->count,
+		  __entry->is_write ? "write" : "read")
+);
+
+TRACE_EVENT(blksnap_image_bio_end,
+	TP_PROTO(dev_t dev, sector_t sector, struct bio *bio, u64 start_time),
+	TP_ARGS(dev, sector, bio, start_time),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(sector_t, sector)
+		__field(bool, is_write)
+		__field(int, status)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->sector = sector;
+		__entry->is_write = op_is_write(bio_op(bio));
+		__entry->status = blk_status_to_errno(bio->bi_status);
+		__entry->latency = ktime_get_ns() - start_time;
+	),
+	TP_printk("dev=%d:%d sector=%llu %s error=%d latency=%lluns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long long)__entry->sector,
+		  __entry->is_write ? "write" : "read", __entry->status,
+		  __entry->latency)
+);
+
+#endif /* __BLK_SNAP_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
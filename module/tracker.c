@@ -4,6 +4,8 @@
 #include <linux/slab.h>
 #include <linux/blk-mq.h>
 #include <linux/sched/mm.h>
+#include <linux/sizes.h>
+#include <linux/log2.h>
 #ifdef STANDALONE_BDEVFILTER
 #include "blksnap.h"
 #else
@@ -14,6 +16,7 @@
 #include "cbt_map.h"
 #include "diff_area.h"
 #include "log.h"
+#include "trace.h"
 
 #ifndef HAVE_BDEV_NR_SECTORS
 static inline sector_t bdev_nr_sectors(struct block_device *bdev)
@@ -29,8 +32,34 @@ struct tracked_device {
 
 LIST_HEAD(tracked_device_list);
 DEFINE_SPINLOCK(tracked_device_lock);
+/*
+ * Serializes changes of the lists of difference areas of the trackers.
+ * The lists are read without locking, since they are changed only while
+ * the queue of the device is frozen.
+ */
+static DEFINE_SPINLOCK(diff_areas_lock);
 static refcount_t trackers_counter = REFCOUNT_INIT(1);
 
+/**
+ * struct tracker_punt - The write that could not be processed without
+ *	blocking.
+ * @work:
+ *	The workqueue work item.
+ * @bio:
+ *	The original bio with the REQ_NOWAIT flag.
+ *
+ * If the copy-on-write for the REQ_NOWAIT bio would block, the bio is not
+ * failed, but passed to the worker. The worker resubmits it without the flag,
+ * so the copy-on-write is completed in the blocking mode and the bio is
+ * completed asynchronously.
+ */
+struct tracker_punt {
+	struct work_struct work;
+	struct bio *bio;
+};
+
+static struct workqueue_struct *tracker_punt_wq;
+
 struct tracker_release_worker {
 	struct work_struct work;
 	struct list_head list;
@@ -45,8 +74,11 @@ static void tracker_free(struct tracker *tracker)
 	pr_debug("Free tracker for device [%u:%u].\n", MAJOR(tracker->dev_id),
 		 MINOR(tracker->dev_id));
 
-	diff_area_put(tracker->diff_area);
+	WARN_ON(!list_empty(&tracker->diff_areas));
 	cbt_map_put(tracker->cbt_map);
+#ifdef BLK_SNAP_MODIFICATION
+	free_percpu(tracker->write_hist);
+#endif
 
 	kfree(tracker);
 	memory_object_dec(memory_object_tracker);
@@ -79,6 +111,128 @@ static inline struct tracker *tracker_get_by_dev(struct block_device *bdev)
 void diff_io_endio(struct bio *bio);
 #endif
 
+/*
+ * Copies the data of the chunks that will be overwritten to the difference
+ * area. If the @source is not NULL, the chunks that were loaded to it are
+ * copied from the memory.
+ */
+static int tracker_copy_on_write(struct diff_area *diff_area,
+				 struct diff_area *source, sector_t sector,
+				 sector_t count, const bool is_nowait)
+{
+	struct bio_list bio_list_on_stack[2] = { };
+	struct bio *new_bio;
+	int err;
+	unsigned int current_flag;
+
+	if (diff_area_is_corrupted(diff_area))
+		return 0;
+
+	current_flag = memalloc_noio_save();
+	bio_list_init(&bio_list_on_stack[0]);
+	current->bio_list = bio_list_on_stack;
+
+	err = diff_area_copy(diff_area, source, sector, count, is_nowait);
+
+	current->bio_list = NULL;
+	memalloc_noio_restore(current_flag);
+
+	if (unlikely(err)) {
+		if (err != -EAGAIN)
+			pr_err("Failed to copy data to diff storage with error %d.\n", abs(err));
+		else
+			diff_area_stats_inc(diff_area, cow_eagain);
+		return err;
+	}
+
+	while ((new_bio = bio_list_pop(&bio_list_on_stack[0]))) {
+		/*
+		 * The result from submitting a bio from the
+		 * filter itself does not need to be processed,
+		 * even if this function has a return code.
+		 */
+#ifdef STANDALONE_BDEVFILTER
+		submit_bio_noacct_notrace(new_bio);
+#else
+		bio_set_flag(new_bio, BIO_FILTERED);
+		submit_bio_noacct(new_bio);
+#endif
+	}
+	/*
+	 * If a new bio was created during the handling, then new bios must
+	 * be sent and returned to complete the processing of the original bio.
+	 * Unfortunately, this has to be done for any bio, regardless of their
+	 * flags and options.
+	 * Otherwise, write I/O units may overtake read I/O units.
+	 */
+	err = diff_area_wait(diff_area, sector, count, is_nowait);
+	if (unlikely(err == -EAGAIN))
+		diff_area_stats_inc(diff_area, cow_eagain);
+	else if (unlikely(err))
+		pr_err("Failed to wait for available data in diff storage with error %d.\n", abs(err));
+	return err;
+}
+
+static void tracker_punt_work(struct work_struct *work)
+{
+	struct tracker_punt *punt = container_of(work, struct tracker_punt, work);
+	struct bio *bio = punt->bio;
+
+	kfree(punt);
+	memory_object_dec(memory_object_tracker_punt);
+
+	bio->bi_opf &= ~REQ_NOWAIT;
+#ifndef STANDALONE_BDEVFILTER
+	/*
+	 * The bio has already passed through the filter, so the flag must be
+	 * cleared. Otherwise it is not intercepted again, and the remaining
+	 * snapshots do not copy the chunks.
+	 */
+	bio_clear_flag(bio, BIO_FILTERED);
+#endif
+	submit_bio_noacct(bio);
+}
+
+/*
+ * Passes the REQ_NOWAIT bio to the worker. If there is no memory for that,
+ * the bio is completed with the BLK_STS_AGAIN status.
+ */
+static void tracker_punt_bio(struct bio *bio)
+{
+	struct tracker_punt *punt;
+
+	punt = kzalloc(sizeof(struct tracker_punt), GFP_NOWAIT | __GFP_NOWARN);
+	if (!punt) {
+		bio_wouldblock_error(bio);
+		return;
+	}
+	memory_object_inc(memory_object_tracker_punt);
+
+	INIT_WORK(&punt->work, tracker_punt_work);
+	punt->bio = bio;
+	queue_work(tracker_punt_wq, &punt->work);
+}
+
+/*
+ * Counts the size of the write in the histogram. Only the data writes are
+ * counted, and the bio that was punted to the worker is counted only when it
+ * is processed again.
+ */
+static inline void tracker_write_hist_add(struct tracker *tracker,
+					  struct bio *bio, sector_t count)
+{
+#ifdef BLK_SNAP_MODIFICATION
+	int inx;
+
+	if (bio_op(bio) != REQ_OP_WRITE)
+		return;
+
+	inx = order_base_2(count) - (PAGE_SHIFT - SECTOR_SHIFT);
+	inx = clamp(inx, 0, TRACKER_WRITE_HIST_SIZE - 1);
+	this_cpu_inc(tracker->write_hist->buckets[inx]);
+#endif
+}
+
 #ifdef STANDALONE_BDEVFILTER
 static bool tracker_submit_bio(struct bio *bio,
 	struct bdev_filter *flt)
@@ -88,14 +242,15 @@ static bool tracker_submit_bio(struct bio *bio)
 {
 	struct bdev_filter *flt = bio->bi_bdev->bd_filter;
 #endif
-	struct bio_list bio_list_on_stack[2] = { };
-	struct bio *new_bio;
 	struct tracker *tracker = container_of(flt, struct tracker, flt);
+	struct diff_area *diff_area;
+	struct diff_area *source = NULL;
 	int err;
 	sector_t sector;
 	sector_t count;
 	unsigned int current_flag;
 	bool is_nowait = !!(bio->bi_opf & REQ_NOWAIT);
+	u64 start_time;
 
 #ifdef STANDALONE_BDEVFILTER
 	/*
@@ -121,61 +276,43 @@ static bool tracker_submit_bio(struct bio *bio)
 	if (bio_flagged(bio, BIO_REMAPPED))
 		sector -= bio->bi_bdev->bd_start_sect;
 #endif
-	current_flag = memalloc_noio_save();
-	err = cbt_map_set(tracker->cbt_map, sector, count);
-	memalloc_noio_restore(current_flag);
-
-	if (err ||
-	    !atomic_read(&tracker->snapshot_is_taken) ||
-	    diff_area_is_corrupted(tracker->diff_area))
-		return false;
+	trace_blksnap_intercept_start(tracker->dev_id, sector, count,
+				      is_nowait);
+	start_time = trace_blksnap_intercept_end_enabled() ? ktime_get_ns() : 0;
 
 	current_flag = memalloc_noio_save();
-	bio_list_init(&bio_list_on_stack[0]);
-	current->bio_list = bio_list_on_stack;
-
-	err = diff_area_copy(tracker->diff_area, sector, count, is_nowait);
-
-	current->bio_list = NULL;
+	err = cbt_map_set(tracker->cbt_map, sector, count);
 	memalloc_noio_restore(current_flag);
 
-	if (unlikely(err)) {
-		if (err == -EAGAIN) {
-			bio_wouldblock_error(bio);
-			return true;
-		}
-		pr_err("Failed to copy data to diff storage with error %d.\n", abs(err));
+	if (err || !atomic_read(&tracker->snapshot_is_taken)) {
+		tracker_write_hist_add(tracker, bio, count);
+		trace_blksnap_intercept_end(tracker->dev_id, sector, count,
+					    false, start_time);
 		return false;
 	}
 
-	while ((new_bio = bio_list_pop(&bio_list_on_stack[0]))) {
-		/*
-		 * The result from submitting a bio from the
-		 * filter itself does not need to be processed,
-		 * even if this function has a return code.
-		 */
-#ifdef STANDALONE_BDEVFILTER
-		submit_bio_noacct_notrace(new_bio);
-#else
-		bio_set_flag(new_bio, BIO_FILTERED);
-		submit_bio_noacct(new_bio);
-#endif
-	}
 	/*
-	 * If a new bio was created during the handling, then new bios must
-	 * be sent and returned to complete the processing of the original bio.
-	 * Unfortunately, this has to be done for any bio, regardless of their
-	 * flags and options.
-	 * Otherwise, write I/O units may overtake read I/O units.
+	 * The newest snapshot reads the data from the original device, and
+	 * each older one can take it from the snapshot next to it.
 	 */
-	err = diff_area_wait(tracker->diff_area, sector, count, is_nowait);
-	if (unlikely(err)) {
-		if (err == -EAGAIN) {
-			bio_wouldblock_error(bio);
+	list_for_each_entry(diff_area, &tracker->diff_areas, tracker_link) {
+		err = tracker_copy_on_write(diff_area, source, sector, count,
+					    is_nowait);
+		if (unlikely(err == -EAGAIN)) {
+			/*
+			 * The chunks that have already been copied are skipped
+			 * when the bio is resubmitted.
+			 */
+			tracker_punt_bio(bio);
+			trace_blksnap_intercept_end(tracker->dev_id, sector,
+						    count, true, start_time);
 			return true;
 		}
-		pr_err("Failed to wait for available data in diff storage with error %d.\n", abs(err));
+		source = diff_area;
 	}
+	tracker_write_hist_add(tracker, bio, count);
+	trace_blksnap_intercept_end(tracker->dev_id, sector, count, false,
+				    start_time);
 	return false;
 }
 
@@ -332,7 +469,8 @@ static struct tracker *tracker_new(struct block_device *bdev)
 	refcount_inc(&trackers_counter);
 	bdev_filter_init(&tracker->flt, &tracker_fops);
 	INIT_LIST_HEAD(&tracker->link);
-	atomic_set(&tracker->snapshot_is_taken, false);
+	atomic_set(&tracker->snapshot_is_taken, 0);
+	INIT_LIST_HEAD(&tracker->diff_areas);
 	tracker->dev_id = bdev->bd_dev;
 
 	pr_info("Create tracker for device [%u:%u]. Capacity 0x%llx sectors\n",
@@ -348,6 +486,13 @@ static struct tracker *tracker_new(struct block_device *bdev)
 	}
 	tracker->cbt_map = cbt_map;
 	tracker->is_frozen = false;
+#ifdef BLK_SNAP_MODIFICATION
+	tracker->write_hist = alloc_percpu(struct tracker_write_hist);
+	if (!tracker->write_hist) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+#endif
 
 	ret = tracker_filter_attach(bdev, tracker);
 	if (ret) {
@@ -364,11 +509,12 @@ fail:
 	return ERR_PTR(ret);
 }
 
-int tracker_take_snapshot(struct tracker *tracker)
+int tracker_take_snapshot(struct tracker *tracker,
+			  struct diff_area *diff_area)
 {
 	int ret = 0;
 	bool cbt_reset_needed = false;
-	struct block_device *orig_bdev = tracker->diff_area->orig_bdev;
+	struct block_device *orig_bdev = diff_area->orig_bdev;
 	sector_t capacity;
 	unsigned int current_flag;
 
@@ -380,6 +526,13 @@ int tracker_take_snapshot(struct tracker *tracker)
 
 	current_flag = memalloc_noio_save();
 
+	if (atomic_read(&tracker->snapshot_is_taken) >= TRACKER_SNAPSHOT_MAX) {
+		pr_err("Too many snapshots of device [%u:%u]\n",
+		       MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
+		ret = -EBUSY;
+		goto out;
+	}
+
 	if (tracker->cbt_map->is_corrupted) {
 		cbt_reset_needed = true;
 		pr_warn("Corrupted CBT table detected. CBT fault\n");
@@ -396,13 +549,18 @@ int tracker_take_snapshot(struct tracker *tracker)
 		if (ret) {
 			pr_err("Failed to create tracker. errno=%d\n",
 			       abs(ret));
-			return ret;
+			goto out;
 		}
 	}
 
 	cbt_map_switch(tracker->cbt_map);
-	atomic_set(&tracker->snapshot_is_taken, true);
 
+	diff_area_get(diff_area);
+	spin_lock(&diff_areas_lock);
+	list_add(&diff_area->tracker_link, &tracker->diff_areas);
+	atomic_inc(&tracker->snapshot_is_taken);
+	spin_unlock(&diff_areas_lock);
+out:
 	memalloc_noio_restore(current_flag);
 
 #ifdef STANDALONE_BDEVFILTER
@@ -410,27 +568,35 @@ int tracker_take_snapshot(struct tracker *tracker)
 #else
 	blk_mq_unfreeze_queue(orig_bdev->bd_queue);
 #endif
-	return 0;
+	return ret;
 }
 
-void tracker_release_snapshot(struct tracker *tracker)
+void tracker_release_snapshot(struct tracker *tracker,
+			      struct diff_area *diff_area)
 {
+	if (list_empty(&diff_area->tracker_link))
+		return;
+
 #ifdef STANDALONE_BDEVFILTER
 	bdevfilter_freeze_queue(&tracker->flt);
 #else
-	blk_mq_freeze_queue(tracker->diff_area->orig_bdev->bd_queue);
+	blk_mq_freeze_queue(diff_area->orig_bdev->bd_queue);
 #endif
 
 	pr_debug("Tracker for device [%u:%u] release snapshot\n",
 		 MAJOR(tracker->dev_id), MINOR(tracker->dev_id));
 
-	atomic_set(&tracker->snapshot_is_taken, false);
+	spin_lock(&diff_areas_lock);
+	list_del_init(&diff_area->tracker_link);
+	atomic_dec(&tracker->snapshot_is_taken);
+	spin_unlock(&diff_areas_lock);
 
 #ifdef STANDALONE_BDEVFILTER
 	bdevfilter_unfreeze_queue(&tracker->flt);
 #else
-	blk_mq_unfreeze_queue(tracker->diff_area->orig_bdev->bd_queue);
+	blk_mq_unfreeze_queue(diff_area->orig_bdev->bd_queue);
 #endif
+	diff_area_put(diff_area);
 }
 
 int tracker_init(void)
@@ -439,6 +605,10 @@ int tracker_init(void)
 	INIT_LIST_HEAD(&tracker_release_worker.list);
 	spin_lock_init(&tracker_release_worker.lock);
 
+	tracker_punt_wq = alloc_workqueue("blksnap-punt",
+					  WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!tracker_punt_wq)
+		return -ENOMEM;
 	return 0;
 }
 
@@ -472,6 +642,8 @@ void tracker_done(void)
 	struct tracked_device *tr_dev;
 
 	pr_debug("Cleanup trackers\n");
+	/* The deferred writes are completed while the trackers exist */
+	flush_workqueue(tracker_punt_wq);
 	while (true) {
 		spin_lock(&tracked_device_lock);
 		tr_dev = list_first_entry_or_null(&tracked_device_list,
@@ -489,6 +661,7 @@ void tracker_done(void)
 	}
 
 	tracker_wait_for_release();
+	destroy_workqueue(tracker_punt_wq);
 }
 
 struct tracker *tracker_create_or_get(dev_t dev_id)
@@ -669,6 +842,359 @@ put_bdev:
 	return ret;
 }
 
+int tracker_read_cbt_ranges(dev_t dev_id, u8 snap_number,
+			    sector_t *sector_offset,
+			    struct blk_snap_block_range __user *ranges,
+			    unsigned int *count)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open device [%u:%u]\n", MAJOR(dev_id),
+		       MINOR(dev_id));
+		return PTR_ERR(bdev);
+	}
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker)) {
+		pr_err("Cannot get tracker for device [%u:%u]\n",
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = PTR_ERR(tracker);
+		goto put_bdev;
+	}
+	if (!tracker) {
+		pr_info("Unable to read CBT ranges for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_info("tracker not found\n");
+		ret = -ENODATA;
+		goto put_bdev;
+	}
+
+	if (atomic_read(&tracker->snapshot_is_taken)) {
+		ret = cbt_map_read_ranges_to_user(tracker->cbt_map, snap_number,
+						  sector_offset, ranges, count);
+	} else {
+		pr_err("Unable to read CBT ranges for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_err("device is not captured by snapshot\n");
+		ret = -EPERM;
+	}
+
+	tracker_put(tracker);
+put_bdev:
+	blkdev_put(bdev, 0);
+	return ret;
+}
+
+#ifdef BLK_SNAP_MODIFICATION
+int tracker_read_cbt_since(dev_t dev_id, uuid_t *generation_id, u8 snap_number,
+			   sector_t *sector_offset,
+			   struct blk_snap_block_range __user *ranges,
+			   unsigned int *count)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open device [%u:%u]\n", MAJOR(dev_id),
+		       MINOR(dev_id));
+		return PTR_ERR(bdev);
+	}
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker)) {
+		pr_err("Cannot get tracker for device [%u:%u]\n",
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = PTR_ERR(tracker);
+		goto put_bdev;
+	}
+	if (!tracker) {
+		pr_info("Unable to read CBT ranges for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_info("tracker not found\n");
+		ret = -ENODATA;
+		goto put_bdev;
+	}
+
+	if (atomic_read(&tracker->snapshot_is_taken)) {
+		ret = cbt_map_read_ranges_since(tracker->cbt_map, generation_id,
+						snap_number, sector_offset,
+						ranges, count);
+	} else {
+		pr_err("Unable to read CBT ranges for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_err("device is not captured by snapshot\n");
+		ret = -EPERM;
+	}
+
+	tracker_put(tracker);
+put_bdev:
+	blkdev_put(bdev, 0);
+	return ret;
+}
+
+int tracker_export_cbt(dev_t dev_id, struct blk_snap_cbt_state *state)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open device [%u:%u]\n", MAJOR(dev_id),
+		       MINOR(dev_id));
+		return PTR_ERR(bdev);
+	}
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker)) {
+		pr_err("Cannot get tracker for device [%u:%u]\n",
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = PTR_ERR(tracker);
+		goto put_bdev;
+	}
+	if (!tracker) {
+		pr_info("Unable to export CBT for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_info("tracker not found\n");
+		ret = -ENODATA;
+		goto put_bdev;
+	}
+
+	ret = cbt_map_export(tracker->cbt_map, state);
+
+	tracker_put(tracker);
+put_bdev:
+	blkdev_put(bdev, 0);
+	return ret;
+}
+
+int tracker_map_cbt(dev_t dev_id, struct blk_snap_tracker_map_cbt *arg,
+		    struct file **pfile)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open device [%u:%u]\n", MAJOR(dev_id),
+		       MINOR(dev_id));
+		return PTR_ERR(bdev);
+	}
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker)) {
+		pr_err("Cannot get tracker for device [%u:%u]\n",
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = PTR_ERR(tracker);
+		goto put_bdev;
+	}
+	if (!tracker) {
+		pr_info("Unable to map CBT for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_info("tracker not found\n");
+		ret = -ENODATA;
+		goto put_bdev;
+	}
+
+	if (atomic_read(&tracker->snapshot_is_taken)) {
+		*pfile = cbt_map_get_file(tracker->cbt_map, arg);
+		ret = PTR_ERR_OR_ZERO(*pfile);
+	} else {
+		pr_err("Unable to map CBT for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_err("device is not captured by snapshot\n");
+		ret = -EPERM;
+	}
+
+	tracker_put(tracker);
+put_bdev:
+	blkdev_put(bdev, 0);
+	return ret;
+}
+
+int tracker_import_cbt(dev_t dev_id, const struct blk_snap_cbt_state *state)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		pr_info("Cannot open device [%u:%u]\n", MAJOR(dev_id),
+		       MINOR(dev_id));
+		return PTR_ERR(bdev);
+	}
+
+	tracker = tracker_get_by_dev(bdev);
+	if (IS_ERR(tracker)) {
+		pr_err("Cannot get tracker for device [%u:%u]\n",
+			 MAJOR(dev_id), MINOR(dev_id));
+		ret = PTR_ERR(tracker);
+		goto put_bdev;
+	}
+	if (!tracker) {
+		pr_info("Unable to import CBT for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_info("tracker not found\n");
+		ret = -ENODATA;
+		goto put_bdev;
+	}
+
+	if (atomic_read(&tracker->snapshot_is_taken)) {
+		pr_err("Unable to import CBT for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_err("device is captured by snapshot\n");
+		ret = -EBUSY;
+		goto put_tracker;
+	}
+
+	/* The table cannot be changed while it is being replaced */
+#ifdef STANDALONE_BDEVFILTER
+	bdevfilter_freeze_queue(&tracker->flt);
+#else
+	blk_mq_freeze_queue(bdev->bd_queue);
+#endif
+	ret = cbt_map_import(tracker->cbt_map, state);
+#ifdef STANDALONE_BDEVFILTER
+	bdevfilter_unfreeze_queue(&tracker->flt);
+#else
+	blk_mq_unfreeze_queue(bdev->bd_queue);
+#endif
+
+put_tracker:
+	tracker_put(tracker);
+put_bdev:
+	blkdev_put(bdev, 0);
+	return ret;
+}
+
+int tracker_set_granularity(dev_t dev_id, unsigned int blk_size,
+			    unsigned int blk_count_max)
+{
+	int ret;
+	struct tracker *tracker;
+	struct block_device *bdev;
+	size_t blk_size_shift_min;
+
+	if (blk_size && (!is_power_of_2(blk_size) || (blk_size < SZ_4K) ||
+			 (blk_size > SZ_1G))) {
+		pr_err("Invalid change tracking block size %u\n", blk_size);
+		return -EINVAL;
+	}
+
+	tracker = tracker_create_or_get(dev_id);
+	if (IS_ERR(tracker))
+		return PTR_ERR(tracker);
+
+	bdev = blkdev_get_by_dev(dev_id, 0, NULL);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto put_tracker;
+	}
+
+	if (atomic_read(&tracker->snapshot_is_taken)) {
+		pr_err("Unable to set CBT block size for device [%u:%u]: ",
+		       MAJOR(dev_id), MINOR(dev_id));
+		pr_err("device is captured by snapshot\n");
+		ret = -EBUSY;
+		goto put_bdev;
+	}
+
+	blk_size_shift_min = blk_size ? ilog2(blk_size) :
+			     tracker->cbt_map->blk_size_shift_min;
+	if (!blk_count_max)
+		blk_count_max = tracker->cbt_map->blk_count_max;
+
+#ifdef STANDALONE_BDEVFILTER
+	bdevfilter_freeze_queue(&tracker->flt);
+#else
+	blk_mq_freeze_queue(bdev->bd_queue);
+#endif
+	ret = cbt_map_set_granularity(tracker->cbt_map, blk_size_shift_min,
+				      blk_count_max);
+#ifdef STANDALONE_BDEVFILTER
+	bdevfilter_unfreeze_queue(&tracker->flt);
+#else
+	blk_mq_unfreeze_queue(bdev->bd_queue);
+#endif
+
+put_bdev:
+	blkdev_put(bdev, 0);
+put_tracker:
+	tracker_put(tracker);
+	return ret;
+}
+
+/*
+ * The share of the writes in percent that should fit in a single chunk when
+ * the chunk size is chosen by the write pattern.
+ */
+#define TRACKER_WRITE_HIST_PERCENTILE 75
+/* The number of writes that is enough to judge the write pattern */
+#define TRACKER_WRITE_HIST_MIN_SAMPLES 1024
+
+/**
+ * tracker_suggest_chunk_shift() - Chooses the chunk size by the write pattern.
+ * @tracker:
+ *	Pointer to &struct tracker.
+ * @maximum_shift:
+ *	The largest chunk size as a power of two.
+ *
+ * The smallest chunk size that fits most of the writes sampled since the
+ * previous call is chosen, so that the small random writes do not copy large
+ * chunks. The large writes still use large requests, since the adjacent
+ * chunks are copied together. The histogram is reset, so the next snapshot
+ * is tuned by the writes made after this one is created.
+ *
+ * Return: the suggested shift or @maximum_shift if too few writes have been
+ * sampled.
+ */
+unsigned int tracker_suggest_chunk_shift(struct tracker *tracker,
+					 unsigned int maximum_shift)
+{
+	u64 hist[TRACKER_WRITE_HIST_SIZE] = { 0 };
+	u64 total = 0;
+	u64 sum = 0;
+	unsigned int inx;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct tracker_write_hist *wh =
+			per_cpu_ptr(tracker->write_hist, cpu);
+
+		for (inx = 0; inx < TRACKER_WRITE_HIST_SIZE; inx++) {
+			u64 value = READ_ONCE(wh->buckets[inx]);
+
+			/* The writes counted meanwhile do not matter much */
+			WRITE_ONCE(wh->buckets[inx], 0);
+			hist[inx] += value;
+			total += value;
+		}
+	}
+
+	if (total < TRACKER_WRITE_HIST_MIN_SAMPLES)
+		return maximum_shift;
+
+	for (inx = 0; inx < (TRACKER_WRITE_HIST_SIZE - 1); inx++) {
+		sum += hist[inx];
+		if (sum * 100 >= total * TRACKER_WRITE_HIST_PERCENTILE)
+			break;
+	}
+
+	pr_debug("Writes to device [%u:%u] are mostly up to %lu bytes\n",
+		 MAJOR(tracker->dev_id), MINOR(tracker->dev_id),
+		 PAGE_SIZE << inx);
+	return min_t(unsigned int, PAGE_SHIFT + inx, maximum_shift);
+}
+#endif
+
 static inline void collect_cbt_info(dev_t dev_id,
 				    struct blk_snap_cbt_info *cbt_info)
 {
@@ -15,6 +15,21 @@
 
 struct cbt_map;
 struct diff_area;
+struct blk_snap_cbt_state;
+struct blk_snap_tracker_map_cbt;
+
+#ifdef BLK_SNAP_MODIFICATION
+/*
+ * The number of buckets in the histogram of the write sizes. The first bucket
+ * counts the writes up to PAGE_SIZE, each next one counts the writes up to
+ * twice the size.
+ */
+#define TRACKER_WRITE_HIST_SIZE 19
+
+struct tracker_write_hist {
+	u64 buckets[TRACKER_WRITE_HIST_SIZE];
+};
+#endif
 
 /**
  * struct tracker - Tracker for a block device.
@@ -28,16 +43,26 @@ struct diff_area;
  * @dev_id:
  *	Original block device ID.
  * @snapshot_is_taken:
- *	Indicates that a snapshot was taken for the device whose I/O unit are
- *	handled by this tracker.
+ *	The number of snapshots that were taken for the device whose I/O unit
+ *	are handled by this tracker.
  * @cbt_map:
  *	Pointer to a change block tracker map.
- * @diff_area:
- *	Pointer to a difference area.
+ * @diff_areas:
+ *	The list of difference areas of the snapshots taken for the device.
+ *	The newest snapshot is at the head of the list. The list is changed
+ *	only while the queue of the device is frozen.
+ * @write_hist:
+ *	Per-CPU histogram of the sizes of the writes to the device. Allows to
+ *	choose the chunk size of the next snapshot by the write pattern.
  *
  * The goal of the tracker is to handle I/O unit. The tracker detectes
  * the range of sectors that will change and transmits them to the CBT map
- * and to the difference area.
+ * and to the difference areas.
+ *
+ * Several snapshots of the device can exist at the same time. When a chunk
+ * is overwritten, its data is read from the original device only once, by
+ * the newest snapshot. The older snapshots that still need the chunk copy
+ * the data from the memory of the newer one.
  */
 struct tracker {
 	struct bdev_filter flt;
@@ -47,7 +72,10 @@ struct tracker {
 	atomic_t snapshot_is_taken;
 
 	struct cbt_map *cbt_map;
-	struct diff_area *diff_area;
+	struct list_head diff_areas;
+#ifdef BLK_SNAP_MODIFICATION
+	struct tracker_write_hist __percpu *write_hist;
+#endif
 
         bool is_frozen;
 };
@@ -58,6 +86,12 @@ static inline void tracker_put(struct tracker *tracker)
 		bdev_filter_put(&tracker->flt);
 };
 
+/*
+ * The maximum number of snapshots that can be taken for one device at the
+ * same time. Each write to the device is processed by all of them.
+ */
+#define TRACKER_SNAPSHOT_MAX 8
+
 int tracker_init(void);
 void tracker_done(void);
 
@@ -67,12 +101,32 @@ int tracker_collect(int max_count, struct blk_snap_cbt_info *cbt_info,
 		    int *pcount);
 int tracker_read_cbt_bitmap(dev_t dev_id, unsigned int offset, size_t length,
 			    char __user *user_buff);
+int tracker_read_cbt_ranges(dev_t dev_id, u8 snap_number,
+			    sector_t *sector_offset,
+			    struct blk_snap_block_range __user *ranges,
+			    unsigned int *count);
+#ifdef BLK_SNAP_MODIFICATION
+int tracker_export_cbt(dev_t dev_id, struct blk_snap_cbt_state *state);
+int tracker_import_cbt(dev_t dev_id, const struct blk_snap_cbt_state *state);
+int tracker_set_granularity(dev_t dev_id, unsigned int blk_size,
+			    unsigned int blk_count_max);
+int tracker_map_cbt(dev_t dev_id, struct blk_snap_tracker_map_cbt *arg,
+		    struct file **pfile);
+int tracker_read_cbt_since(dev_t dev_id, uuid_t *generation_id, u8 snap_number,
+			   sector_t *sector_offset,
+			   struct blk_snap_block_range __user *ranges,
+			   unsigned int *count);
+unsigned int tracker_suggest_chunk_shift(struct tracker *tracker,
+					 unsigned int maximum_shift);
+#endif
 int tracker_mark_dirty_blocks(dev_t dev_id,
 			      struct blk_snap_block_range *block_ranges,
 			      unsigned int count);
 
-int tracker_take_snapshot(struct tracker *tracker);
-void tracker_release_snapshot(struct tracker *tracker);
+int tracker_take_snapshot(struct tracker *tracker,
+			  struct diff_area *diff_area);
+void tracker_release_snapshot(struct tracker *tracker,
+			      struct diff_area *diff_area);
 
 #if defined(HAVE_SUPER_BLOCK_FREEZE)
 static inline int _freeze_bdev(struct block_device *bdev,
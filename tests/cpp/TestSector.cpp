@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0+
-#include <boost/crc.hpp>
+#include <algorithm>
 #include <string.h>
+#include "helpers/Crc32c.h"
 #include "helpers/Log.h"
 #include "helpers/RandomHelper.h"
 #include "TestSector.h"
@@ -30,12 +31,8 @@ void CTestSectorGenetor::Generate(unsigned char* buffer, size_t size, sector_t s
         CRandomHelper::GenerateBuffer(t->body, sizeof(t->body));
 
         if (m_useCrc32)
-        {
-            boost::crc_32_type calc;
-            calc.process_bytes(buffer + offset + offsetof(STestHeader, seqNumber),
-                               SECTOR_SIZE - offsetof(STestHeader, seqNumber));
-            t->header.crc = calc.checksum();
-        }
+            t->header.crc = CCrc32c::Calculate(buffer + offset + offsetof(STestHeader, seqNumber),
+                                               SECTOR_SIZE - offsetof(STestHeader, seqNumber));
 
         sector++;
     }
@@ -54,12 +51,8 @@ void CTestSectorGenetor::Check(unsigned char* buffer, size_t size, sector_t sect
 
         int crc = 0xDEC032CC;
         if (m_useCrc32)
-        {
-            boost::crc_32_type calc;
-            calc.process_bytes(buffer + offsetof(STestHeader, seqNumber),
-                               SECTOR_SIZE - offsetof(STestHeader, seqNumber));
-            crc = calc.checksum();
-        }
+            crc = CCrc32c::Calculate(buffer + offsetof(STestHeader, seqNumber),
+                                     SECTOR_SIZE - offsetof(STestHeader, seqNumber));
 
         bool isCorrupted = (crc != t->header.crc);
         bool isIncorrect = (sector != t->header.sector);
@@ -123,6 +116,8 @@ void CTestSectorGenetor::LogSector(sector_t sector, const std::string& failMessa
 
 void CTestSectorGenetor::SetFailedSector(sector_t sector, const std::string& failMessage)
 {
+    std::lock_guard<std::mutex> guard(m_failLock);
+
     m_failCount++;
 
     if (!m_failedRanges.empty())
@@ -139,3 +134,19 @@ void CTestSectorGenetor::SetFailedSector(sector_t sector, const std::string& fai
     m_failedRanges.emplace_back(sector, 1);
     LogSector(sector, failMessage);
 }
+
+void CTestSectorGenetor::SortFails()
+{
+    std::vector<SRange> ranges;
+
+    std::sort(m_failedRanges.begin(), m_failedRanges.end(),
+              [](const SRange& l, const SRange& r) { return l.sector < r.sector; });
+    for (const SRange& rg : m_failedRanges)
+    {
+        if (!ranges.empty() && ((ranges.back().sector + ranges.back().count) == rg.sector))
+            ranges.back().count += rg.count;
+        else
+            ranges.push_back(rg);
+    }
+    m_failedRanges.swap(ranges);
+}
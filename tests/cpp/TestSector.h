@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0+
 #include <atomic>
 #include <ctime>
+#include <mutex>
 #include <vector>
 #include <blksnap/Sector.h>
 
@@ -64,13 +65,20 @@ public:
     {
         return m_failedRanges;
     };
+    /**
+     * The sectors can be checked by several threads in parallel. Then the
+     * failed ranges should be sorted and merged. The function does not
+     * contain locks too.
+     */
+    void SortFails();
 
 private:
     bool m_useCrc32;
     std::atomic<int> m_seqNumber;
-    int m_failCount;
-    int m_logLineCount;
+    std::atomic<int> m_failCount;
+    std::atomic<int> m_logLineCount;
     std::vector<blksnap::SRange> m_failedRanges;
+    std::mutex m_failLock;
     bool m_isCrc32Checking;
 
 private:
@@ -6,14 +6,17 @@
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
+#include <atomic>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <mutex>
 #include <thread>
 #include <unistd.h>
 
 #include "helpers/AlignedBuffer.hpp"
 #include "helpers/BlockDevice.h"
+#include "helpers/LoadGenerator.h"
 #include "helpers/Log.h"
 #include "TestSector.h"
 
@@ -47,29 +50,53 @@ void FillAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared
 }
 
 /**
- * Fill the contents of the block device with special test data.
+ * Check the contents of the block device.
+ * The portions of the device are read and checked by several threads.
  */
 void CheckAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev,
               const int seqNumber, const clock_t seqTime)
 {
-    AlignedBuffer<unsigned char> portion(g_blksz, 1024 * 1024);
+    const size_t portionSize = 1024 * 1024;
     off_t sizeBdev = ptrBdev->Size();
-    sector_t sector = 0;
+    std::atomic<off_t> nextOffset(0);
+    std::vector<std::thread> threads;
+    std::exception_ptr error;
+    std::mutex errorLock;
+    unsigned int threadCount = std::max(1U, std::min(std::thread::hardware_concurrency(), 8U));
 
     logger.Info("Check on image [" + ptrBdev->Name() + "]");
 
     ::sync();
 
-    for (off_t offset = 0; offset < sizeBdev; offset += portion.Size())
-    {
-        size_t portionSize = std::min(portion.Size(), static_cast<size_t>(sizeBdev - offset));
+    for (unsigned int inx = 0; inx < threadCount; inx++)
+        threads.emplace_back([&]() {
+            try
+            {
+                AlignedBuffer<unsigned char> portion(g_blksz, portionSize);
+                off_t offset;
 
-        ptrBdev->Read(portion.Data(), portionSize, offset);
+                while ((offset = nextOffset.fetch_add(portionSize)) < sizeBdev)
+                {
+                    size_t size = std::min(portionSize, static_cast<size_t>(sizeBdev - offset));
 
-        ptrGen->Check(portion.Data(), portionSize, sector, seqNumber, seqTime);
+                    ptrBdev->Read(portion.Data(), size, offset);
+                    ptrGen->Check(portion.Data(), size, offset >> SECTOR_SHIFT, seqNumber, seqTime);
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!error)
+                    error = std::current_exception();
+                nextOffset = sizeBdev;
+            }
+        });
+    for (std::thread& thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
 
-        sector += (portionSize >> SECTOR_SHIFT);
-    }
+    ptrGen->SortFails();
 }
 
 void FillBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev,
@@ -238,7 +265,7 @@ void CheckCorruption(const std::string& origDevName, const std::string& diffStor
     logger.Info("diffStorage: " + diffStorage);
     logger.Info("duration: " + std::to_string(durationLimitSec) + " seconds");
 
-    auto ptrGen = std::make_shared<CTestSectorGenetor>(false);
+    auto ptrGen = std::make_shared<CTestSectorGenetor>(true);
     auto ptrOrininal = std::make_shared<CBlockDevice>(origDevName, isSync);
 
     logger.Info("device size: " + std::to_string(ptrOrininal->Size()));
@@ -485,10 +512,12 @@ void CheckCbtCorrupt(const std::map<std::string, std::shared_ptr<blksnap::SCbtIn
 }
 
 void MultithreadCheckCorruption(const std::vector<std::string>& origDevNames, const std::string& diffStorage,
-                                const int durationLimitSec)
+                                const int durationLimitSec, const unsigned int loadThreads,
+                                const unsigned int loadQueueDepth)
 {
     std::map<std::string, std::shared_ptr<CTestSectorGenetor>> genMap;
     std::vector<std::thread> genThreads;
+    std::vector<std::shared_ptr<CLoadGenerator>> loadGens;
     std::vector<std::shared_ptr<SGeneratorContext>> genCtxs;
     std::vector<SCorruptInfo> corrupts;
     std::map<std::string, std::shared_ptr<blksnap::SCbtInfo>> previousCbtInfoMap;
@@ -505,7 +534,7 @@ void MultithreadCheckCorruption(const std::vector<std::string>& origDevNames, co
     logger.Info("duration: " + std::to_string(durationLimitSec) + " seconds");
 
     for (const std::string& origDevName : origDevNames)
-        genMap[origDevName] = std::make_shared<CTestSectorGenetor>(false);
+        genMap[origDevName] = std::make_shared<CTestSectorGenetor>(true);
 
     for (const std::string& origDevName : origDevNames)
         genCtxs.push_back(
@@ -521,6 +550,35 @@ void MultithreadCheckCorruption(const std::vector<std::string>& origDevNames, co
     for (const std::shared_ptr<SGeneratorContext>& ptrCtx : genCtxs)
         genThreads.emplace_back(GeneratorThreadFunction, ptrCtx);
 
+    /*
+     * The load generators write the test pattern with a high queue depth
+     * in parallel with the generator threads. The Zipfian hot spots make
+     * the same chunks to be written again and again.
+     */
+    if (loadThreads)
+    {
+        logger.Info("-- Start load with " + std::to_string(loadThreads) + " threads and queue depth "
+                    + std::to_string(loadQueueDepth));
+        for (const std::shared_ptr<SGeneratorContext>& ptrCtx : genCtxs)
+        {
+            SLoadOptions loadOptions;
+            std::shared_ptr<CTestSectorGenetor> ptrGen = ptrCtx->ptrGen;
+
+            loadOptions.threads = loadThreads;
+            loadOptions.queueDepth = loadQueueDepth;
+            loadOptions.blockSize = std::max(g_blksz, 4096);
+            loadOptions.readPercent = 30;
+            loadOptions.pattern = eLoadZipfian;
+            loadOptions.fill = [ptrGen](unsigned char* buffer, size_t size, sector_t sector) {
+                ptrGen->Generate(buffer, size, sector);
+            };
+
+            auto ptrLoadGen = std::make_shared<CLoadGenerator>(ptrCtx->ptrBdev->Name(), loadOptions);
+            ptrLoadGen->Start();
+            loadGens.push_back(ptrLoadGen);
+        }
+    }
+
     std::time_t startTime = std::time(nullptr);
     int elapsed;
     bool isErrorFound = false;
@@ -677,6 +735,22 @@ void MultithreadCheckCorruption(const std::vector<std::string>& origDevNames, co
     for (auto& genThread : genThreads)
         genThread.join();
 
+    for (const std::shared_ptr<CLoadGenerator>& ptrLoadGen : loadGens)
+    {
+        try
+        {
+            SLoadStats stats = ptrLoadGen->Stop();
+
+            logger.Info("Load: " + std::to_string(stats.reads) + " reads and " + std::to_string(stats.writes)
+                        + " writes");
+        }
+        catch (std::exception& ex)
+        {
+            isErrorFound = true;
+            logger.Err(ex.what());
+        }
+    }
+
     if (!corrupts.empty())
     {
         // Create snapshot and check corrupted ranges and cbt table content.
@@ -713,6 +787,10 @@ void Main(int argc, char* argv[])
         ("sync", "Use O_SYNC for access to original device.")
         ("blksz", po::value<int>()->default_value(512), "Align reads and writes to the block size.")
         ("blocks", po::value<int>()->default_value(4096), "The maximum limit of writing blocks.")
+        ("load_threads", po::value<unsigned int>()->default_value(2),
+            "The number of threads of additional load in multithread test mode. Zero disables the load.")
+        ("load_depth", po::value<unsigned int>()->default_value(16),
+            "The number of requests in flight for each thread of additional load.")
         ;
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
@@ -756,9 +834,15 @@ void Main(int argc, char* argv[])
     int blocksCountMax = vm["blocks"].as<int>();
     logger.Info("blocks: " + std::to_string(blocksCountMax));
 
+    unsigned int loadThreads = vm["load_threads"].as<unsigned int>();
+    logger.Info("load_threads: " + std::to_string(loadThreads));
+
+    unsigned int loadQueueDepth = vm["load_depth"].as<unsigned int>();
+    logger.Info("load_depth: " + std::to_string(loadQueueDepth));
+
     std::srand(std::time(0));
     if (!!vm.count("multithread"))
-        MultithreadCheckCorruption(origDevNames, diffStorage, duration * 60);
+        MultithreadCheckCorruption(origDevNames, diffStorage, duration * 60, loadThreads, loadQueueDepth);
     else
     {
         if (origDevNames.size() > 1)
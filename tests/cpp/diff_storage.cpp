@@ -11,6 +11,7 @@
 
 #include "helpers/AlignedBuffer.hpp"
 #include "helpers/BlockDevice.h"
+#include "helpers/LoadGenerator.h"
 #include "helpers/Log.h"
 #include "helpers/RandomHelper.h"
 #include "TestSector.h"
@@ -225,7 +226,8 @@ static void LogRanges(const std::string& header, const std::vector<SRange>& rang
     logger.Info("Total sectors: " + std::to_string(totalSectors));
 }
 
-static void CheckDiffStorage(const std::string& origDevName, const int durationLimitSec, const bool isSync)
+static void CheckDiffStorage(const std::string& origDevName, const int durationLimitSec, const bool isSync,
+                             const unsigned int loadThreads, const unsigned int loadQueueDepth)
 {
     std::vector<SRange> diffStorage;
 
@@ -323,10 +325,48 @@ static void CheckDiffStorage(const std::string& origDevName, const int durationL
             logger.Info("Generated " + std::to_string(writeRanges.size()) + " write blocks with " + std::to_string(totalCount) + " sectors.");
         }
 
+        /*
+         * The load writes the test pattern outside the difference storage
+         * while the test data is written and checked.
+         */
+        std::shared_ptr<CLoadGenerator> ptrLoadGen;
+        if (loadThreads)
+        {
+            SLoadOptions loadOptions;
+
+            loadOptions.threads = loadThreads;
+            loadOptions.queueDepth = loadQueueDepth;
+            loadOptions.blockSize = g_blksz;
+            loadOptions.readPercent = 30;
+            loadOptions.pattern = eLoadZipfian;
+            loadOptions.areas = availableRanges;
+            loadOptions.fill = [ptrGen](unsigned char* buffer, size_t size, sector_t sector) {
+                ptrGen->Generate(buffer, size, sector);
+            };
+            ptrLoadGen = std::make_shared<CLoadGenerator>(origDevName, loadOptions);
+            ptrLoadGen->Start();
+        }
+
         FillArea(ptrGen, ptrOrininal, writeRanges);
         logger.Info("Test data has been written.");
 
         CheckArea(ptrGen, ptrImage, availableRanges, testSeqNumber, testSeqTime);
+
+        if (ptrLoadGen)
+        {
+            try
+            {
+                SLoadStats stats = ptrLoadGen->Stop();
+
+                logger.Info("Load: " + std::to_string(stats.reads) + " reads and " + std::to_string(stats.writes)
+                            + " writes");
+            }
+            catch (std::exception& ex)
+            {
+                isErrorFound = true;
+                logger.Err(ex.what());
+            }
+        }
         if (ptrGen->Fails() > 0)
         {
             isErrorFound = true;
@@ -372,7 +412,11 @@ void Main(int argc, char* argv[])
         ("device,d", po::value<std::string>(), "Device name. ")
         ("duration,u", po::value<int>()->default_value(5), "The test duration limit in minutes.")
         ("sync", "Use O_SYNC for access to original device.")
-        ("blksz", po::value<int>()->default_value(512), "Align reads and writes to the block size.");
+        ("blksz", po::value<int>()->default_value(512), "Align reads and writes to the block size.")
+        ("load_threads", po::value<unsigned int>()->default_value(2),
+            "The number of threads of additional load. Zero disables the load.")
+        ("load_depth", po::value<unsigned int>()->default_value(16),
+            "The number of requests in flight for each thread of additional load.");
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
     po::store(parsed, vm);
@@ -411,8 +455,14 @@ void Main(int argc, char* argv[])
     page_sectors = getpagesize() / 512;
     sector_mask = page_sectors - 1;
 
+    unsigned int loadThreads = vm["load_threads"].as<unsigned int>();
+    logger.Info("load_threads: " + std::to_string(loadThreads));
+
+    unsigned int loadQueueDepth = vm["load_depth"].as<unsigned int>();
+    logger.Info("load_depth: " + std::to_string(loadQueueDepth));
+
     std::srand(std::time(0));
-    CheckDiffStorage(origDevName, duration * 60, isSync);
+    CheckDiffStorage(origDevName, duration * 60, isSync, loadThreads, loadQueueDepth);
 }
 
 int main(int argc, char* argv[])
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "Crc32c.h"
+
+#include <string.h>
+#if defined(__x86_64__)
+#    include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#    include <arm_acle.h>
+#endif
+
+namespace
+{
+    const uint32_t crc32cPoly = 0x82F63B78;
+
+    struct SCrc32cTable
+    {
+        uint32_t value[256];
+
+        SCrc32cTable()
+        {
+            for (uint32_t inx = 0; inx < 256; inx++)
+            {
+                uint32_t crc = inx;
+
+                for (int bit = 0; bit < 8; bit++)
+                    crc = (crc & 1) ? ((crc >> 1) ^ crc32cPoly) : (crc >> 1);
+                value[inx] = crc;
+            }
+        };
+    };
+
+    uint32_t SoftCrc32c(uint32_t crc, const unsigned char* buf, size_t size)
+    {
+        static const SCrc32cTable table;
+
+        while (size--)
+            crc = table.value[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2"))) uint32_t HwCrc32c(uint32_t crc, const unsigned char* buf, size_t size)
+    {
+        uint64_t crc64 = crc;
+
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), buf += sizeof(uint64_t))
+        {
+            uint64_t value;
+
+            memcpy(&value, buf, sizeof(value));
+            crc64 = _mm_crc32_u64(crc64, value);
+        }
+        crc = static_cast<uint32_t>(crc64);
+        while (size--)
+            crc = _mm_crc32_u8(crc, *buf++);
+        return crc;
+    }
+
+    bool IsHwSupported()
+    {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    uint32_t HwCrc32c(uint32_t crc, const unsigned char* buf, size_t size)
+    {
+        for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), buf += sizeof(uint64_t))
+        {
+            uint64_t value;
+
+            memcpy(&value, buf, sizeof(value));
+            crc = __crc32cd(crc, value);
+        }
+        while (size--)
+            crc = __crc32cb(crc, *buf++);
+        return crc;
+    }
+
+    bool IsHwSupported()
+    {
+        return true;
+    }
+#else
+    uint32_t HwCrc32c(uint32_t crc, const unsigned char* buf, size_t size)
+    {
+        return SoftCrc32c(crc, buf, size);
+    }
+
+    bool IsHwSupported()
+    {
+        return false;
+    }
+#endif
+}
+
+uint32_t CCrc32c::Calculate(const void* data, size_t size)
+{
+    static const bool isHwSupported = IsHwSupported();
+    const unsigned char* buf = static_cast<const unsigned char*>(data);
+
+    if (isHwSupported)
+        return ~HwCrc32c(~0U, buf, size);
+    return ~SoftCrc32c(~0U, buf, size);
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The CRC32C (Castagnoli) checksum. The instructions of the processor are
+ * used if they are available: SSE4.2 on x86_64 and CRC32 on ARMv8.
+ */
+class CCrc32c
+{
+public:
+    static uint32_t Calculate(const void* data, size_t size);
+};
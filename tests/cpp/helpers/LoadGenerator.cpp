@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "LoadGenerator.h"
+#include "RandomHelper.h"
+
+#include <algorithm>
+#include <cmath>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    inline int io_setup(unsigned int nr, aio_context_t* ctx)
+    {
+        return ::syscall(__NR_io_setup, nr, ctx);
+    }
+    inline int io_destroy(aio_context_t ctx)
+    {
+        return ::syscall(__NR_io_destroy, ctx);
+    }
+    inline int io_submit(aio_context_t ctx, long nr, struct iocb** iocbpp)
+    {
+        return ::syscall(__NR_io_submit, ctx, nr, iocbpp);
+    }
+    inline int io_getevents(aio_context_t ctx, long min_nr, long max_nr, struct io_event* events)
+    {
+        return ::syscall(__NR_io_getevents, ctx, min_nr, max_nr, events, nullptr);
+    }
+
+    /*
+     * The exact sum is calculated for the first million of members. The
+     * rest of the sum is approximated by the integral.
+     */
+    double Zeta(off_t n, double theta)
+    {
+        const off_t exactLimit = 1000000;
+        off_t exactCount = std::min(n, exactLimit);
+        double sum = 0;
+
+        for (off_t i = 1; i <= exactCount; i++)
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        if (n > exactCount)
+            sum += (std::pow(static_cast<double>(n), 1.0 - theta)
+                    - std::pow(static_cast<double>(exactCount), 1.0 - theta)) / (1.0 - theta);
+        return sum;
+    }
+
+    /*
+     * The hot blocks are scattered over the device.
+     */
+    inline off_t Scramble(off_t rank, off_t n)
+    {
+        uint64_t hash = 0xCBF29CE484222325ULL;
+
+        for (int inx = 0; inx < 8; inx++)
+        {
+            hash ^= (static_cast<uint64_t>(rank) >> (inx * 8)) & 0xFF;
+            hash *= 0x100000001B3ULL;
+        }
+        return hash % n;
+    }
+}
+
+CLoadGenerator::CLoadGenerator(const std::string& name, const SLoadOptions& options)
+    : m_name(name)
+    , m_options(options)
+    , m_fd(-1)
+    , m_blockCount(0)
+    , m_zetan(0)
+    , m_zeta2(0)
+    , m_sequentialBlock(0)
+    , m_stop(false)
+{
+    if (!m_options.blockSize || (m_options.blockSize % SECTOR_SIZE))
+        throw std::invalid_argument("The block size should be a multiple of the sector size.");
+    m_options.threads = std::max(m_options.threads, 1U);
+    m_options.queueDepth = std::max(m_options.queueDepth, 1U);
+
+    /*
+     * The device is not opened exclusively, since the test may keep it
+     * open by itself.
+     */
+    m_fd = ::open(m_name.c_str(), O_RDWR | O_DIRECT);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Failed to open file '" + m_name + "'.");
+
+    if (m_options.areas.empty())
+    {
+        off_t size = 0;
+
+        if (::ioctl(m_fd, BLKGETSIZE64, &size) == -1)
+        {
+            int err = errno;
+
+            ::close(m_fd);
+            throw std::system_error(err, std::generic_category(), "Failed to get block device size");
+        }
+        m_options.areas.emplace_back(0, size >> SECTOR_SHIFT);
+    }
+
+    for (const blksnap::SRange& rg : m_options.areas)
+    {
+        SArea area;
+
+        area.offset = static_cast<off_t>(rg.sector) << SECTOR_SHIFT;
+        area.blockCount = (static_cast<off_t>(rg.count) << SECTOR_SHIFT) / m_options.blockSize;
+        area.firstBlock = m_blockCount;
+        if (!area.blockCount)
+            continue;
+
+        m_areas.push_back(area);
+        m_blockCount += area.blockCount;
+    }
+    if (!m_blockCount)
+    {
+        ::close(m_fd);
+        throw std::invalid_argument("The areas of the load are too small for the block size.");
+    }
+
+    if (m_options.pattern == eLoadZipfian)
+    {
+        if ((m_options.zipfTheta <= 0) || (m_options.zipfTheta >= 1))
+        {
+            ::close(m_fd);
+            throw std::invalid_argument("The skew of the Zipfian distribution should be between 0 and 1.");
+        }
+        m_zetan = Zeta(m_blockCount, m_options.zipfTheta);
+        m_zeta2 = Zeta(2, m_options.zipfTheta);
+    }
+}
+
+CLoadGenerator::~CLoadGenerator()
+{
+    m_stop = true;
+    for (std::thread& thread : m_threads)
+        thread.join();
+    ::close(m_fd);
+}
+
+off_t CLoadGenerator::BlockOffset(off_t block)
+{
+    auto it = std::upper_bound(m_areas.begin(), m_areas.end(), block,
+                               [](off_t value, const SArea& area) { return value < area.firstBlock; });
+    const SArea& area = *(--it);
+
+    return area.offset + (block - area.firstBlock) * m_options.blockSize;
+}
+
+void CLoadGenerator::ThreadFunction(unsigned int inx)
+{
+    struct SSlot
+    {
+        struct iocb cb;
+        unsigned char* buffer;
+        std::chrono::steady_clock::time_point start;
+    };
+    const size_t blockSize = m_options.blockSize;
+    const double theta = m_options.zipfTheta;
+    const double alpha = 1.0 / (1.0 - theta);
+    const double eta = (1.0 - std::pow(2.0 / m_blockCount, 1.0 - theta)) / (1.0 - m_zeta2 / m_zetan);
+    SLoadStats& stats = m_threadStats[inx];
+    std::vector<SSlot> slots(m_options.queueDepth);
+    std::vector<SSlot*> freeSlots;
+    std::vector<struct io_event> events(m_options.queueDepth);
+    std::mt19937_64 generator(CRandomHelper::GenerateInt() + inx);
+    std::uniform_int_distribution<off_t> uniform(0, m_blockCount - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_int_distribution<unsigned int> percent(0, 99);
+    aio_context_t ctx = 0;
+    unsigned int inflight = 0;
+
+    for (SSlot& slot : slots)
+        slot.buffer = nullptr;
+
+    try
+    {
+        if (io_setup(m_options.queueDepth, &ctx))
+            throw std::system_error(errno, std::generic_category(), "Failed to create I/O context");
+
+        for (SSlot& slot : slots)
+        {
+            if (::posix_memalign(reinterpret_cast<void**>(&slot.buffer), 4096, blockSize))
+                throw std::system_error(ENOMEM, std::generic_category(), "Failed to allocate I/O buffer");
+            CRandomHelper::GenerateBuffer(slot.buffer, blockSize);
+            freeSlots.push_back(&slot);
+        }
+
+        while (!m_stop || inflight)
+        {
+            while (!m_stop && !freeSlots.empty())
+            {
+                SSlot* slot = freeSlots.back();
+                struct iocb* cbs[1] = {&slot->cb};
+                bool isRead = percent(generator) < m_options.readPercent;
+                off_t block;
+
+                switch (m_options.pattern)
+                {
+                case eLoadSequential:
+                    block = m_sequentialBlock++ % m_blockCount;
+                    break;
+                case eLoadZipfian:
+                {
+                    double u = unit(generator);
+                    double uz = u * m_zetan;
+                    off_t rank;
+
+                    if (uz < 1.0)
+                        rank = 0;
+                    else if (uz < 1.0 + std::pow(0.5, theta))
+                        rank = 1;
+                    else
+                        rank = std::min(static_cast<off_t>(m_blockCount * std::pow(eta * u - eta + 1.0, alpha)),
+                                        m_blockCount - 1);
+                    block = Scramble(rank, m_blockCount);
+                    break;
+                }
+                default:
+                    block = uniform(generator);
+                }
+                off_t offset = BlockOffset(block);
+
+                if (!isRead && m_options.fill)
+                    m_options.fill(slot->buffer, blockSize, offset >> SECTOR_SHIFT);
+
+                memset(&slot->cb, 0, sizeof(slot->cb));
+                slot->cb.aio_data = reinterpret_cast<uint64_t>(slot);
+                slot->cb.aio_lio_opcode = isRead ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+                slot->cb.aio_fildes = m_fd;
+                slot->cb.aio_buf = reinterpret_cast<uint64_t>(slot->buffer);
+                slot->cb.aio_nbytes = blockSize;
+                slot->cb.aio_offset = offset;
+                slot->start = std::chrono::steady_clock::now();
+
+                if (io_submit(ctx, 1, cbs) < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::system_error(errno, std::generic_category(), "Failed to submit request");
+                }
+                freeSlots.pop_back();
+                inflight++;
+                if (isRead)
+                    stats.reads++;
+                else
+                    stats.writes++;
+            }
+
+            int count = io_getevents(ctx, 1, events.size(), events.data());
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "Failed to get completions");
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            for (int inx = 0; inx < count; inx++)
+            {
+                SSlot* slot = reinterpret_cast<SSlot*>(events[inx].data);
+
+                inflight--;
+                freeSlots.push_back(slot);
+                if (events[inx].res < 0)
+                    throw std::system_error(-events[inx].res, std::generic_category(),
+                                            "Failed to access block device. offset="
+                                                + std::to_string(slot->cb.aio_offset));
+                if (static_cast<size_t>(events[inx].res) < blockSize)
+                    throw std::runtime_error("Access outside the boundaries of a block device");
+
+                stats.latencies.push_back(
+                  std::chrono::duration_cast<std::chrono::microseconds>(now - slot->start).count());
+            }
+        }
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> guard(m_errorLock);
+        if (!m_error)
+            m_error = std::current_exception();
+        m_stop = true;
+    }
+
+    /*
+     * Destroying the context waits for the requests in flight.
+     */
+    if (ctx)
+        io_destroy(ctx);
+    for (SSlot& slot : slots)
+        ::free(slot.buffer);
+}
+
+void CLoadGenerator::Start()
+{
+    if (!m_threads.empty())
+        throw std::runtime_error("The load generator is already started.");
+
+    m_stop = false;
+    m_error = nullptr;
+    m_threadStats.assign(m_options.threads, SLoadStats());
+    m_start = std::chrono::steady_clock::now();
+    for (unsigned int inx = 0; inx < m_options.threads; inx++)
+        m_threads.emplace_back(&CLoadGenerator::ThreadFunction, this, inx);
+}
+
+SLoadStats CLoadGenerator::Stop()
+{
+    SLoadStats stats;
+
+    m_stop = true;
+    for (std::thread& thread : m_threads)
+        thread.join();
+    m_threads.clear();
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+
+    if (m_error)
+        std::rethrow_exception(m_error);
+
+    for (const SLoadStats& threadStats : m_threadStats)
+    {
+        stats.reads += threadStats.reads;
+        stats.writes += threadStats.writes;
+        stats.latencies.insert(stats.latencies.end(), threadStats.latencies.begin(), threadStats.latencies.end());
+    }
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    return stats;
+}
+
+SLoadStats CLoadGenerator::Run(int durationSec)
+{
+    Start();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(durationSec);
+    while (!m_stop && (std::chrono::steady_clock::now() < deadline))
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    return Stop();
+}
@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+#include <blksnap/Sector.h>
+
+enum ELoadPattern
+{
+    eLoadSequential,
+    eLoadUniform,
+    eLoadZipfian,
+};
+
+struct SLoadOptions
+{
+    /* The number of threads. Each thread has its own queue of requests. */
+    unsigned int threads = 1;
+    /* The number of requests in flight for each thread */
+    unsigned int queueDepth = 1;
+    /* The size of a request in bytes */
+    size_t blockSize = 4096;
+    /* The share of the read requests in percent */
+    unsigned int readPercent = 0;
+    ELoadPattern pattern = eLoadUniform;
+    /* The skew of the Zipfian distribution, from 0 to 1 exclusively */
+    double zipfTheta = 0.99;
+    /* The areas of the device to access. If empty, the whole device. */
+    std::vector<blksnap::SRange> areas;
+    /* Prepares the data before writing. If not set, random data is written. */
+    std::function<void(unsigned char* buffer, size_t size, blksnap::sector_t sector)> fill;
+};
+
+/*
+ * The statistics of the load. The latencies are in microseconds.
+ */
+struct SLoadStats
+{
+    unsigned long long reads = 0;
+    unsigned long long writes = 0;
+    double seconds = 0;
+    std::vector<unsigned long> latencies;
+};
+
+/*
+ * The generator of the load on a block device. Each thread submits
+ * asynchronous direct requests and keeps its queue full.
+ */
+class CLoadGenerator
+{
+public:
+    CLoadGenerator(const std::string& name, const SLoadOptions& options);
+    ~CLoadGenerator();
+
+    void Start();
+    /* Stops the threads and throws the first error that occurred */
+    SLoadStats Stop();
+    /* Runs the load for the duration */
+    SLoadStats Run(int durationSec);
+
+private:
+    struct SArea
+    {
+        off_t offset;
+        off_t blockCount;
+        off_t firstBlock;
+    };
+
+    void ThreadFunction(unsigned int inx);
+    off_t BlockOffset(off_t block);
+
+private:
+    std::string m_name;
+    SLoadOptions m_options;
+    int m_fd;
+    std::vector<SArea> m_areas;
+    off_t m_blockCount;
+    double m_zetan;
+    double m_zeta2;
+    std::atomic<off_t> m_sequentialBlock;
+    std::atomic<bool> m_stop;
+    std::vector<std::thread> m_threads;
+    std::vector<SLoadStats> m_threadStats;
+    std::mutex m_errorLock;
+    std::exception_ptr m_error;
+    std::chrono::steady_clock::time_point m_start;
+};
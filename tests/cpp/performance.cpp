@@ -1,16 +1,21 @@
 // SPDX-License-Identifier: GPL-2.0+
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
+#include <blksnap/ImageReader.h>
 #include <blksnap/Service.h>
 #include <blksnap/Session.h>
 #include <boost/program_options.hpp>
 #include <errno.h>
+#include <fstream>
+#include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "helpers/AlignedBuffer.hpp"
 #include "helpers/BlockDevice.h"
+#include "helpers/LoadGenerator.h"
 #include "helpers/Log.h"
 #include "helpers/RandomHelper.h"
 #include "TestSector.h"
@@ -19,20 +24,308 @@ namespace po = boost::program_options;
 using blksnap::sector_t;
 using blksnap::SRange;
 
-void CheckPerformance(const std::string& device, const std::string& diffStorage)
+struct SPerfOptions
 {
-    bool isErrorFound = false;
+    std::vector<size_t> blockSizes;
+    std::vector<unsigned int> queueDepths;
+    std::vector<std::string> patterns;
+    unsigned int threads;
+    unsigned int readPercent;
+    int durationSec;
+    off_t readSize;
+};
 
+/*
+ * The result of one case of the benchmark. The latencies are in
+ * microseconds. For the reads of the snapshot image, they are taken from
+ * the latency histogram of the kernel module and are rounded up to the
+ * upper bound of the bucket.
+ */
+struct SPerfResult
+{
+    std::string phase;
+    std::string operation;
+    std::string pattern;
+    size_t blockSize;
+    unsigned int queueDepth;
+    unsigned long long count;
+    double seconds;
+    double iops;
+    double mibPerSec;
+    unsigned long latP50;
+    unsigned long latP90;
+    unsigned long latP99;
+    unsigned long latP999;
+    unsigned long latMax;
+};
+
+class CPerfReport
+{
+public:
+    void Add(const SPerfResult& result)
+    {
+        m_results.push_back(result);
+
+        std::stringstream ss;
+        ss << result.phase << " " << result.operation << " " << result.pattern << " bs=" << result.blockSize
+           << " qd=" << result.queueDepth << ": " << static_cast<unsigned long long>(result.iops) << " IOPS "
+           << result.mibPerSec << " MiB/s p50=" << result.latP50 << "us p99=" << result.latP99 << "us";
+        logger.Info(ss);
+    };
+    void AddMetric(const std::string& name, double value)
+    {
+        m_metrics.emplace_back(name, value);
+        logger.Info(name + ": " + std::to_string(value));
+    };
+
+    void WriteJson(std::ostream& out) const
+    {
+        out << "{" << std::endl;
+        out << "  \"version\": \"" << blksnap::Version() << "\"," << std::endl;
+        out << "  \"metrics\": {";
+        for (size_t inx = 0; inx < m_metrics.size(); inx++)
+            out << (inx ? "," : "") << std::endl
+                << "    \"" << m_metrics[inx].first << "\": " << m_metrics[inx].second;
+        out << std::endl << "  }," << std::endl;
+        out << "  \"results\": [";
+        for (size_t inx = 0; inx < m_results.size(); inx++)
+        {
+            const SPerfResult& r = m_results[inx];
+
+            out << (inx ? "," : "") << std::endl;
+            out << "    {\"phase\": \"" << r.phase << "\", \"operation\": \"" << r.operation << "\", \"pattern\": \""
+                << r.pattern << "\", \"block_size\": " << r.blockSize << ", \"queue_depth\": " << r.queueDepth
+                << ", \"count\": " << r.count << ", \"seconds\": " << r.seconds << ", \"iops\": " << r.iops
+                << ", \"mib_per_sec\": " << r.mibPerSec << ", \"lat_p50_us\": " << r.latP50
+                << ", \"lat_p90_us\": " << r.latP90 << ", \"lat_p99_us\": " << r.latP99
+                << ", \"lat_p999_us\": " << r.latP999 << ", \"lat_max_us\": " << r.latMax << "}";
+        }
+        out << std::endl << "  ]" << std::endl;
+        out << "}" << std::endl;
+    };
+
+    void WriteCsv(std::ostream& out) const
+    {
+        out << "phase,operation,pattern,block_size,queue_depth,count,seconds,iops,mib_per_sec,"
+               "lat_p50_us,lat_p90_us,lat_p99_us,lat_p999_us,lat_max_us"
+            << std::endl;
+        for (const SPerfResult& r : m_results)
+            out << r.phase << "," << r.operation << "," << r.pattern << "," << r.blockSize << "," << r.queueDepth
+                << "," << r.count << "," << r.seconds << "," << r.iops << "," << r.mibPerSec << "," << r.latP50 << ","
+                << r.latP90 << "," << r.latP99 << "," << r.latP999 << "," << r.latMax << std::endl;
+        out << std::endl;
+        out << "metric,value" << std::endl;
+        for (const auto& metric : m_metrics)
+            out << metric.first << "," << metric.second << std::endl;
+    };
+
+private:
+    std::vector<SPerfResult> m_results;
+    std::vector<std::pair<std::string, double>> m_metrics;
+};
+
+static double SecondsSince(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static unsigned long Percentile(const std::vector<unsigned long>& sorted, double percent)
+{
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * percent / 100.0))];
+}
+
+static void CalculateResult(SPerfResult& result, std::vector<unsigned long>& latencies, double seconds)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    result.count = latencies.size();
+    result.seconds = seconds;
+    result.iops = seconds ? result.count / seconds : 0;
+    result.mibPerSec = seconds ? (result.count * result.blockSize) / seconds / (1024 * 1024) : 0;
+    result.latP50 = Percentile(latencies, 50);
+    result.latP90 = Percentile(latencies, 90);
+    result.latP99 = Percentile(latencies, 99);
+    result.latP999 = Percentile(latencies, 99.9);
+    result.latMax = latencies.empty() ? 0 : latencies.back();
+}
+
+static SPerfResult WriteCase(const std::shared_ptr<CBlockDevice>& ptrDevice, const std::string& phase,
+                             const std::string& pattern, size_t blockSize, unsigned int queueDepth,
+                             const SPerfOptions& options)
+{
+    SPerfResult result = {phase, options.readPercent ? "mixed" : "write", pattern, blockSize, queueDepth};
+    SLoadOptions loadOptions;
+
+    loadOptions.threads = options.threads;
+    loadOptions.queueDepth = queueDepth;
+    loadOptions.blockSize = blockSize;
+    loadOptions.readPercent = options.readPercent;
+    if (pattern == "seq")
+        loadOptions.pattern = eLoadSequential;
+    else if (pattern == "zipf")
+        loadOptions.pattern = eLoadZipfian;
+    else
+        loadOptions.pattern = eLoadUniform;
+
+    CLoadGenerator generator(ptrDevice->Name(), loadOptions);
+    SLoadStats stats = generator.Run(options.durationSec);
+
+    CalculateResult(result, stats.latencies, stats.seconds);
+    return result;
+}
+
+/*
+ * The bucket with index N of the module's histogram counts the operations
+ * that took up to 2^N microseconds.
+ */
+static void HistToLatencies(const std::vector<unsigned long long>& before,
+                            const std::vector<unsigned long long>& after, std::vector<unsigned long>& latencies)
+{
+    for (size_t inx = 0; inx < after.size(); inx++)
+    {
+        unsigned long long count = after[inx] - (inx < before.size() ? before[inx] : 0);
+
+        latencies.insert(latencies.end(), count, 1UL << inx);
+    }
+}
+
+static SPerfResult ReadImageCase(const std::shared_ptr<blksnap::ISession>& ptrSession, const std::string& imageName,
+                                 size_t blockSize, unsigned int queueDepth, off_t readSize)
+{
+    SPerfResult result = {"image", "read", "seq", blockSize, queueDepth};
+    blksnap::SImageReaderOptions options;
+    blksnap::SSessionStats statsBefore;
+    blksnap::SSessionStats statsAfter;
+    std::vector<unsigned long> latencies;
+    std::vector<SRange> ranges;
+
+    options.queueDepth = queueDepth;
+    options.blockSize = blockSize;
+    auto ptrReader = blksnap::IImageReader::Create(imageName, options);
+
+    readSize = std::min(readSize, ptrReader->GetSize());
+    ranges.emplace_back(0, readSize >> SECTOR_SHIFT);
+
+    unsigned long long count = 0;
+    ptrSession->GetStats(statsBefore);
+    auto start = std::chrono::steady_clock::now();
+    ptrReader->Read(ranges, [&count](off_t, const void*, size_t) { count++; });
+    double seconds = SecondsSince(start);
+    ptrSession->GetStats(statsAfter);
+
+    HistToLatencies(statsBefore.imageReadHist, statsAfter.imageReadHist, latencies);
+    CalculateResult(result, latencies, seconds);
+    result.count = count;
+    result.iops = seconds ? count / seconds : 0;
+    result.mibPerSec = seconds ? readSize / seconds / (1024 * 1024) : 0;
+    return result;
+}
+
+void CheckPerformance(const std::string& device, const std::string& diffStorage, const SPerfOptions& options,
+                      CPerfReport& report)
+{
     logger.Info("--- Test: check performance ---");
+    logger.Info("version: " + blksnap::Version());
+    logger.Info("device: " + device);
+    logger.Info("duration: " + std::to_string(options.durationSec) + " seconds for each case");
+
+    auto ptrOriginal = std::make_shared<CBlockDevice>(device);
+    report.AddMetric("device_size", ptrOriginal->Size());
+
+    logger.Info("-- Write to the original device without snapshot");
+    for (const std::string& pattern : options.patterns)
+        for (size_t blockSize : options.blockSizes)
+            for (unsigned int queueDepth : options.queueDepths)
+                report.Add(WriteCase(ptrOriginal, "original", pattern, blockSize, queueDepth, options));
+
+    /*
+     * Each case is run with a new snapshot. Otherwise, only the first case
+     * would pay for the copy-on-write of the chunks.
+     */
+    logger.Info("-- Write to the original device with snapshot");
+    std::vector<std::string> devices;
+    devices.push_back(device);
+
+    std::shared_ptr<blksnap::ISession> ptrSession;
+    std::string errorMessage;
+    double createMs = 0;
+    double destroyMs = 0;
+    double seconds = 0;
+    unsigned long long diffStorageFilled = 0;
+    unsigned int snapshotCount = 0;
+    for (const std::string& pattern : options.patterns)
+        for (size_t blockSize : options.blockSizes)
+            for (unsigned int queueDepth : options.queueDepths)
+            {
+                auto start = std::chrono::steady_clock::now();
+                if (ptrSession)
+                {
+                    ptrSession.reset();
+                    destroyMs += SecondsSince(start) * 1000;
+                    start = std::chrono::steady_clock::now();
+                }
+                ptrSession = blksnap::ISession::Create(devices, diffStorage);
+                createMs += SecondsSince(start) * 1000;
+                snapshotCount++;
+
+                SPerfResult result = WriteCase(ptrOriginal, "snapshot", pattern, blockSize, queueDepth, options);
+                report.Add(result);
+                seconds += result.seconds;
 
-    throw std::runtime_error("Is not implemented yet.");
+                if (ptrSession->GetError(errorMessage))
+                    throw std::runtime_error("Snapshot failed: " + errorMessage);
 
-    if (isErrorFound)
-        throw std::runtime_error("--- Failed: check performance ---");
+                blksnap::SSessionStats stats;
+                ptrSession->GetStats(stats);
+                diffStorageFilled += stats.bytesStored;
+            }
+    report.AddMetric("snapshot_create_ms", createMs / snapshotCount);
+    report.AddMetric("diff_storage_filled_bytes", diffStorageFilled);
+    report.AddMetric("diff_storage_fill_mib_per_sec", seconds ? diffStorageFilled / seconds / (1024 * 1024) : 0);
+
+    /*
+     * The image of the snapshot of the last case is read.
+     */
+    std::string imageDevName = ptrSession->GetImageDevice(device);
+    logger.Info("Found image block device [" + imageDevName + "]");
+
+    logger.Info("-- Read snapshot image");
+    for (size_t blockSize : options.blockSizes)
+        for (unsigned int queueDepth : options.queueDepths)
+            report.Add(ReadImageCase(ptrSession, imageDevName, blockSize, queueDepth, options.readSize));
+
+    logger.Info("-- Destroy snapshot");
+    auto start = std::chrono::steady_clock::now();
+    ptrSession.reset();
+    destroyMs += SecondsSince(start) * 1000;
+    report.AddMetric("snapshot_destroy_ms", destroyMs / snapshotCount);
 
     logger.Info("--- Success: check performance ---");
 }
 
+template <typename T>
+static std::vector<T> ParseList(const std::string& str)
+{
+    std::vector<T> list;
+    std::stringstream ss(str);
+    std::string item;
+
+    while (std::getline(ss, item, ','))
+    {
+        std::stringstream itemStream(item);
+        T value;
+
+        if (!(itemStream >> value))
+            throw std::invalid_argument("Invalid list item '" + item + "'.");
+        list.push_back(value);
+    }
+    if (list.empty())
+        throw std::invalid_argument("The list '" + str + "' is empty.");
+    return list;
+}
+
 void Main(int argc, char* argv[])
 {
     po::options_description desc;
@@ -43,7 +336,22 @@ void Main(int argc, char* argv[])
         ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
         ("device,d", po::value<std::string>(), "Device name. ")
         ("diff_storage,s", po::value<std::string>(),
-            "Directory name for allocating diff storage files.");
+            "Directory name for allocating diff storage files.")
+        ("block_sizes,b", po::value<std::string>()->default_value("4096,65536,1048576"),
+            "Comma-separated list of block sizes in bytes.")
+        ("queue_depths,q", po::value<std::string>()->default_value("1,8,32"),
+            "Comma-separated list of the numbers of asynchronous requests in flight.")
+        ("patterns,p", po::value<std::string>()->default_value("seq,rand,zipf"),
+            "Comma-separated list of write patterns: 'seq', 'rand' and 'zipf' for hot spots.")
+        ("threads,t", po::value<unsigned int>()->default_value(1),
+            "The number of writer threads. The queue depth is set for each thread.")
+        ("read_percent,r", po::value<unsigned int>()->default_value(0),
+            "The share of reads mixed with writes in percent.")
+        ("duration,u", po::value<int>()->default_value(5), "The duration of each write case in seconds.")
+        ("read_size", po::value<off_t>()->default_value(1024),
+            "The size of the snapshot image to read in each case in MiB.")
+        ("output,o", po::value<std::string>(), "File name for the results. By default, they are printed.")
+        ("format,f", po::value<std::string>()->default_value("json"), "The format of the results: 'json' or 'csv'.");
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
     po::store(parsed, vm);
@@ -70,8 +378,45 @@ void Main(int argc, char* argv[])
         throw std::invalid_argument("Argument 'diff_storage' is missed.");
     std::string diffStorage = vm["diff_storage"].as<std::string>();
 
+    SPerfOptions options;
+    options.blockSizes = ParseList<size_t>(vm["block_sizes"].as<std::string>());
+    for (size_t blockSize : options.blockSizes)
+        if (!blockSize || (blockSize & (blockSize - 1)) || (blockSize < SECTOR_SIZE))
+            throw std::invalid_argument("Block size should be a power of two and not less than a sector.");
+    options.queueDepths = ParseList<unsigned int>(vm["queue_depths"].as<std::string>());
+    for (unsigned int queueDepth : options.queueDepths)
+        if (!queueDepth)
+            throw std::invalid_argument("Queue depth should not be zero.");
+    options.patterns = ParseList<std::string>(vm["patterns"].as<std::string>());
+    for (const std::string& pattern : options.patterns)
+        if ((pattern != "seq") && (pattern != "rand") && (pattern != "zipf"))
+            throw std::invalid_argument("Unknown pattern '" + pattern + "'.");
+    options.threads = vm["threads"].as<unsigned int>();
+    options.readPercent = vm["read_percent"].as<unsigned int>();
+    if (options.readPercent >= 100)
+        throw std::invalid_argument("Argument 'read_percent' should be less than 100.");
+    options.durationSec = vm["duration"].as<int>();
+    options.readSize = vm["read_size"].as<off_t>() * 1024 * 1024;
+
+    std::string format = vm["format"].as<std::string>();
+    if ((format != "json") && (format != "csv"))
+        throw std::invalid_argument("Argument 'format' should be 'json' or 'csv'.");
+
     std::srand(std::time(0));
-    CheckPerformance(origDevName, diffStorage);
+    CPerfReport report;
+    CheckPerformance(origDevName, diffStorage, options, report);
+
+    std::ofstream file;
+    if (vm.count("output"))
+    {
+        file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        file.open(vm["output"].as<std::string>());
+    }
+    std::ostream& out = vm.count("output") ? file : std::cout;
+    if (format == "json")
+        report.WriteJson(out);
+    else
+        report.WriteCsv(out);
 }
 
 int main(int argc, char* argv[])
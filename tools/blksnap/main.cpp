@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0+
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <chrono>
 #include <cstring>
 #include <errno.h>
 #include <fcntl.h>
@@ -12,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
@@ -19,6 +21,9 @@
 #include <uuid/uuid.h>
 #include <vector>
 #include <blksnap/blksnap.h>
+#include <blksnap/Cbt.h>
+#include <blksnap/CbtDecoder.h>
+#include <blksnap/ImageReader.h>
 #include <time.h>
 
 namespace po = boost::program_options;
@@ -83,6 +88,9 @@ namespace
             if (m_blksnapFd < 0)
                 throw std::system_error(errno, std::generic_category(), blksnap_filename);
         };
+        explicit CBlksnapFileWrap(int fd)
+            : m_blksnapFd(fd)
+        {};
         ~CBlksnapFileWrap()
         {
             if (m_blksnapFd > 0)
@@ -285,6 +293,51 @@ public:
 
                 if (param.compatibility_flags & (1ull << blk_snap_compat_flag_setlog))
                     std::cout << "setlog" << std::endl;
+
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_read_ahead))
+                    std::cout << "read_ahead" << std::endl;
+
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_durability))
+                    std::cout << "durability" << std::endl;
+
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_cbt_ranges))
+                    std::cout << "cbt_ranges" << std::endl;
+
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_cbt_persistent))
+                    std::cout << "cbt_persistent" << std::endl;
+
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_cbt_granularity))
+                    std::cout << "cbt_granularity" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_cbt_mmap))
+                    std::cout << "cbt_mmap" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_staged_take))
+                    std::cout << "staged_take" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_stats))
+                    std::cout << "stats" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_unused_blocks))
+                    std::cout << "unused_blocks" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_compression))
+                    std::cout << "compression" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_memory_storage))
+                    std::cout << "memory_storage" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_storage_striping))
+                    std::cout << "storage_striping" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_memory_stats))
+                    std::cout << "memory_stats" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_event_fd))
+                    std::cout << "event_fd" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_snapshot_options))
+                    std::cout << "snapshot_options" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_release_blocks))
+                    std::cout << "release_blocks" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_storage_file))
+                    std::cout << "storage_file" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_chunk_hashes))
+                    std::cout << "chunk_hashes" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_cbt_since))
+                    std::cout << "cbt_since" << std::endl;
+                if (param.compatibility_flags & (1ull << blk_snap_compat_flag_cbt_multi))
+                    std::cout << "cbt_multi" << std::endl;
             }
             return;
         }
@@ -387,7 +440,18 @@ public:
         m_desc.add_options()
             ("device,d", po::value<std::string>(), "[TBD]Device name.")
             ("file,f", po::value<std::string>(), "[TBD]File name for output.")
-            ("json,j", "[TBD]Use json format for output.");
+            ("json,j", "[TBD]Use json format for output.")
+            ("ranges,r", "Output ranges of changed sectors as text instead of the map.")
+            ("snap-number,s", po::value<unsigned int>()->default_value(0),
+                "Blocks with a change number greater than this are considered changed. Used with 'ranges'.")
+            ("min-io,m", po::value<unsigned long long>()->default_value(0),
+                "Ranges separated by a gap of no more than this number of bytes are merged. Used with 'ranges'.")
+#ifdef BLK_SNAP_MODIFICATION
+            ("mmap", "Map the table into memory instead of copying it.")
+            ("generation,g", po::value<std::string>(),
+                "The generation of changes of the snap-number. It is checked by the module. Used with 'ranges'.")
+#endif
+            ;
     };
 
     void Execute(po::variables_map& vm) override
@@ -408,6 +472,19 @@ public:
         if (vm.count("json"))
             throw std::invalid_argument("Argument 'json' is not supported yet.");
 
+#ifdef BLK_SNAP_MODIFICATION
+        if (vm.count("mmap"))
+        {
+            ExecuteMapped(vm, blksnapFd, param.dev_id);
+            return;
+        }
+#endif
+        if (vm.count("ranges"))
+        {
+            ExecuteRanges(vm, blksnapFd, param);
+            return;
+        }
+
         if (!vm.count("file"))
             throw std::invalid_argument("Argument 'file' is missed.");
 
@@ -429,6 +506,117 @@ public:
 
         output.close();
     };
+
+private:
+    void ExecuteRanges(po::variables_map& vm, CBlksnapFileWrap& blksnapFd,
+                       struct blk_snap_tracker_read_cbt_bitmap& param)
+    {
+        int ret;
+        unsigned int snapNumber = vm["snap-number"].as<unsigned int>();
+
+        if (snapNumber > UINT8_MAX)
+            throw std::invalid_argument("Argument 'snap-number' should be less than 256.");
+
+        auto ptrCbtInfo = blksnap::ICbt::Create()->GetCbtInfo(vm["device"].as<std::string>());
+        const blksnap::sector_t blockSectors = ptrCbtInfo->blockSize >> SECTOR_SHIFT;
+        const blksnap::sector_t capacity = ptrCbtInfo->deviceCapacity >> SECTOR_SHIFT;
+
+        std::ofstream file;
+        if (vm.count("file"))
+            file.open(vm["file"].as<std::string>(), std::ofstream::out);
+        std::ostream& output = vm.count("file") ? file : std::cout;
+
+        const std::function<void(const blksnap::SRange&)> print = [&output](const blksnap::SRange& range) {
+            output << range.sector << " " << range.count << std::endl;
+        };
+        blksnap::CRangeMerger merger(vm["min-io"].as<unsigned long long>() >> SECTOR_SHIFT, print);
+
+#ifdef BLK_SNAP_MODIFICATION
+        if (vm.count("generation"))
+        {
+            Uuid generationId(vm["generation"].as<std::string>());
+
+            blksnap::ICbt::Create()->GetChangedRangesSince(
+              vm["device"].as<std::string>(), generationId.Get(), snapNumber,
+              [&merger](const blksnap::SRange& range) { merger.Add(range.sector, range.count); });
+            merger.Flush();
+            return;
+        }
+#endif
+        do
+        {
+            ret = ::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_TRACKER_READ_CBT_MAP, &param);
+            if (ret < 0)
+                throw std::system_error(errno, std::generic_category(),
+                                        "[TBD]Failed to read map of difference from change tracking.");
+            if (ret > 0)
+            {
+                blksnap::CbtFindChanged(param.buff, ret, snapNumber, [&](size_t first, size_t count) {
+                    const blksnap::sector_t sector = (param.offset + first) * blockSectors;
+
+                    merger.Add(sector, std::min(count * blockSectors, capacity - sector));
+                });
+                param.offset += ret;
+            }
+        } while (ret);
+        merger.Flush();
+    };
+
+#ifdef BLK_SNAP_MODIFICATION
+    void ExecuteMapped(po::variables_map& vm, CBlksnapFileWrap& blksnapFd, const struct blk_snap_dev& dev_id)
+    {
+        struct blk_snap_tracker_map_cbt param = {0};
+
+        param.dev_id = dev_id;
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_TRACKER_MAP_CBT, &param))
+            throw std::system_error(errno, std::generic_category(),
+                                    "Failed to get file descriptor for mapping change tracking map.");
+        CBlksnapFileWrap mapFd(param.fd);
+
+        void* map = ::mmap(nullptr, param.blk_count, PROT_READ, MAP_SHARED, mapFd.get(), 0);
+        if (map == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "Failed to map change tracking map.");
+        std::shared_ptr<void> mapGuard(map, [&param](void* ptr) { ::munmap(ptr, param.blk_count); });
+        const unsigned char* cbtmap = static_cast<const unsigned char*>(map);
+
+        if (!vm.count("ranges"))
+        {
+            if (!vm.count("file"))
+                throw std::invalid_argument("Argument 'file' is missed.");
+
+            std::ofstream output;
+            output.open(vm["file"].as<std::string>(), std::ofstream::out | std::ofstream::binary);
+            output.write(reinterpret_cast<const char*>(cbtmap), param.blk_count);
+            output.close();
+            return;
+        }
+
+        unsigned int snapNumber = vm["snap-number"].as<unsigned int>();
+        if (snapNumber > UINT8_MAX)
+            throw std::invalid_argument("Argument 'snap-number' should be less than 256.");
+
+        auto ptrCbtInfo = blksnap::ICbt::Create()->GetCbtInfo(vm["device"].as<std::string>());
+        const blksnap::sector_t blockSectors = param.blk_size >> SECTOR_SHIFT;
+        const blksnap::sector_t capacity = ptrCbtInfo->deviceCapacity >> SECTOR_SHIFT;
+
+        std::ofstream file;
+        if (vm.count("file"))
+            file.open(vm["file"].as<std::string>(), std::ofstream::out);
+        std::ostream& output = vm.count("file") ? file : std::cout;
+
+        const std::function<void(const blksnap::SRange&)> print = [&output](const blksnap::SRange& range) {
+            output << range.sector << " " << range.count << std::endl;
+        };
+        blksnap::CRangeMerger merger(vm["min-io"].as<unsigned long long>() >> SECTOR_SHIFT, print);
+
+        blksnap::CbtFindChanged(cbtmap, param.blk_count, snapNumber, [&](size_t first, size_t count) {
+            const blksnap::sector_t sector = first * blockSectors;
+
+            merger.Add(sector, std::min(count * blockSectors, capacity - sector));
+        });
+        merger.Flush();
+    };
+#endif
 };
 
 class TrackerMarkDirtyBlockArgsProc : public IArgsProc
@@ -670,9 +858,14 @@ public:
             switch (param.code)
             {
             case blk_snap_event_code_low_free_space:
+            {
+                struct blk_snap_event_low_free_space* data = (struct blk_snap_event_low_free_space*)(param.data);
+
                 std::cout << "event=low_free_space" << std::endl;
-                std::cout << "requested_nr_sect=" << *(__u64*)(param.data) << std::endl;
+                std::cout << "requested_nr_sect=" << data->requested_nr_sect << std::endl;
+                std::cout << "fill_rate=" << data->fill_rate << std::endl;
                 break;
+            }
             case blk_snap_event_code_corrupted:
                 std::cout << "event=corrupted" << std::endl;
                 break;
@@ -785,7 +978,7 @@ private:
         int fd;
 
         std::cout << time_label << " - Low free space in diff storage. Requested " << data->requested_nr_sect
-                  << " sectors." << std::endl;
+                  << " sectors. Fill rate " << data->fill_rate << " bytes/s." << std::endl;
 
         if (m_allocated_sect > m_limit_sect)
         {
@@ -913,6 +1106,173 @@ public:
     };
 };
 
+static const char extentStreamSignature[16] = "blksnap-extents";
+
+/*
+ * The changed blocks stream consists of the header and the extents. Each
+ * extent is the record header followed by the data. The stream ends with
+ * the record which size is zero.
+ */
+struct SExtentStreamHeader
+{
+    char signature[sizeof(extentStreamSignature)];
+    uint64_t imageSize;
+};
+struct SExtentRecord
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+class ImageExportArgsProc : public IArgsProc
+{
+public:
+    ImageExportArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Export the snapshot image to a sparse file or to a stream of changed blocks.");
+        m_desc.add_options()
+          ("image,i", po::value<std::string>(), "Snapshot image device name.")
+          ("file,f", po::value<std::string>(), "File name for output.")
+          ("format", po::value<std::string>()->default_value("sparse"),
+                "The format of the output: 'sparse' file of the image size or 'stream' of changed blocks.")
+          ("device,d", po::value<std::string>(),
+                "Original device name. If it is set, only the blocks changed according to the CBT are exported.")
+          ("snap-number,s", po::value<unsigned int>()->default_value(0),
+                "Blocks with a change number greater than this are considered changed. Used with 'device'.")
+          ("queue-depth,q", po::value<unsigned int>()->default_value(32), "The number of parallel read requests.")
+          ("block-size,b", po::value<size_t>()->default_value(1024 * 1024), "The size of a read request in bytes.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        blksnap::SImageReaderOptions options;
+
+        if (!vm.count("image"))
+            throw std::invalid_argument("Argument 'image' is missed.");
+        if (!vm.count("file"))
+            throw std::invalid_argument("Argument 'file' is missed.");
+
+        std::string format = vm["format"].as<std::string>();
+        if ((format != "sparse") && (format != "stream"))
+            throw std::invalid_argument("Argument 'format' should be 'sparse' or 'stream'.");
+
+        unsigned int snapNumber = vm["snap-number"].as<unsigned int>();
+        if (snapNumber > UINT8_MAX)
+            throw std::invalid_argument("Argument 'snap-number' should be less than 256.");
+
+        options.queueDepth = vm["queue-depth"].as<unsigned int>();
+        options.blockSize = vm["block-size"].as<size_t>();
+        auto ptrReader = blksnap::IImageReader::Create(vm["image"].as<std::string>(), options);
+
+        std::string filename = vm["file"].as<std::string>();
+        /*
+         * The sparse file is not truncated. So the changed blocks can be
+         * applied to the copy of the previous snapshot image.
+         */
+        int fd = ::open(filename.c_str(), (format == "sparse") ? (O_WRONLY | O_CREAT) : (O_WRONLY | O_CREAT | O_TRUNC),
+                        0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to open file [" + filename + "]");
+
+        unsigned long long totalSize = 0;
+        off_t streamOffset = 0;
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            blksnap::IImageReader::DataCallback callback;
+
+            if (format == "sparse")
+            {
+                if (::ftruncate(fd, ptrReader->GetSize()))
+                    throw std::system_error(errno, std::generic_category(), "Failed to set size of file [" + filename + "]");
+
+                callback = [fd, &totalSize](off_t offset, const void* data, size_t size) {
+                    totalSize += size;
+                    /*
+                     * The zeroed blocks are left as holes.
+                     */
+                    if (IsZeroed(data, size) &&
+                        !::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size))
+                        return;
+                    WriteAll(fd, data, size, offset);
+                };
+            }
+            else
+            {
+                struct SExtentStreamHeader header = {0};
+
+                memcpy(header.signature, extentStreamSignature, sizeof(header.signature));
+                header.imageSize = ptrReader->GetSize();
+                WriteAll(fd, &header, sizeof(header), streamOffset);
+                streamOffset += sizeof(header);
+
+                callback = [fd, &totalSize, &streamOffset](off_t offset, const void* data, size_t size) {
+                    struct SExtentRecord record = {static_cast<uint64_t>(offset), size};
+
+                    totalSize += size;
+                    WriteAll(fd, &record, sizeof(record), streamOffset);
+                    streamOffset += sizeof(record);
+                    WriteAll(fd, data, size, streamOffset);
+                    streamOffset += size;
+                };
+            }
+
+            if (vm.count("device"))
+                ptrReader->ReadChanged(vm["device"].as<std::string>(), static_cast<uint8_t>(snapNumber), callback);
+            else
+                ptrReader->ReadAll(callback);
+
+            if (format == "stream")
+            {
+                struct SExtentRecord record = {0};
+
+                WriteAll(fd, &record, sizeof(record), streamOffset);
+            }
+            if (::fsync(fd))
+                throw std::system_error(errno, std::generic_category(), "Failed to flush file [" + filename + "]");
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        std::cout << "exported: " << totalSize << " bytes" << std::endl;
+        std::cout << "elapsed: " << elapsed.count() << " ms" << std::endl;
+        if (elapsed.count())
+            std::cout << "throughput: " << (totalSize * 1000 / elapsed.count()) / (1024 * 1024) << " MiB/s" << std::endl;
+    };
+
+private:
+    static bool IsZeroed(const void* data, size_t size)
+    {
+        const char* buf = static_cast<const char*>(data);
+
+        return !size || ((buf[0] == 0) && !memcmp(buf, buf + 1, size - 1));
+    };
+    static void WriteAll(int fd, const void* data, size_t size, off_t offset)
+    {
+        const char* buf = static_cast<const char*>(data);
+
+        while (size)
+        {
+            ssize_t ret = ::pwrite(fd, buf, size, offset);
+
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "Failed to write output file");
+            }
+            buf += ret;
+            offset += ret;
+            size -= ret;
+        }
+    };
+};
+
 #ifdef BLK_SNAP_MODIFICATION
 static int CalculateTzMinutesWest()
 {
@@ -978,6 +1338,675 @@ public:
             throw std::system_error(errno, std::generic_category(), "Failed to set logging.");
     };
 };
+
+class SnapshotReadAheadArgsProc : public IArgsProc
+{
+public:
+    SnapshotReadAheadArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Set read-ahead window for snapshot image.");
+        m_desc.add_options()
+          ("image,i", po::value<std::string>(), "Snapshot image device name.")
+          ("chunks,c", po::value<unsigned int>(), "The number of chunks to read in advance. Zero disables read-ahead.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_set_read_ahead param = {0};
+
+        if (!vm.count("image"))
+            throw std::invalid_argument("Argument 'image' is missed.");
+        param.image_dev_id = deviceByName(vm["image"].as<std::string>());
+
+        if (!vm.count("chunks"))
+            throw std::invalid_argument("Argument 'chunks' is missed.");
+        param.chunk_count = vm["chunks"].as<unsigned int>();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SET_READ_AHEAD, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set read-ahead.");
+    };
+};
+
+class SnapshotDurabilityArgsProc : public IArgsProc
+{
+public:
+    SnapshotDurabilityArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Set durability mode for difference storage of snapshot.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("mode,m", po::value<std::string>(), "Durability mode: 'fua' (default), 'flush' or 'none'.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_durability param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("mode"))
+            throw std::invalid_argument("Argument 'mode' is missed.");
+        std::string mode = vm["mode"].as<std::string>();
+        if (mode == "fua")
+            param.mode = blk_snap_durability_fua;
+        else if (mode == "flush")
+            param.mode = blk_snap_durability_flush;
+        else if (mode == "none")
+            param.mode = blk_snap_durability_none;
+        else
+            throw std::invalid_argument("Invalid value of argument 'mode'.");
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_SET_DURABILITY, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set durability mode.");
+    };
+};
+
+/*
+ * The file with the saved state of the change tracking contains a signature,
+ * the parameters of the table and the table itself.
+ */
+static const char cbtStateSignature[16] = "blksnap-cbt-v1";
+
+class TrackerExportCbtArgsProc : public IArgsProc
+{
+public:
+    TrackerExportCbtArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Save the state of change tracking to a file. The device should not be written.");
+        m_desc.add_options()
+          ("device,d", po::value<std::string>(), "Device name.")
+          ("file,f", po::value<std::string>(), "File name for output.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_cbt_state param = {0};
+
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        param.dev_id = deviceByName(vm["device"].as<std::string>());
+
+        if (!vm.count("file"))
+            throw std::invalid_argument("Argument 'file' is missed.");
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_TRACKER_EXPORT_CBT, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get change tracking parameters.");
+
+        std::vector<unsigned char> cbtmap(param.blk_count);
+        param.buff = cbtmap.data();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_TRACKER_EXPORT_CBT, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to export change tracking.");
+        param.buff = nullptr;
+
+        std::ofstream output;
+        output.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        output.open(vm["file"].as<std::string>(), std::ofstream::out | std::ofstream::binary);
+        output.write(cbtStateSignature, sizeof(cbtStateSignature));
+        output.write((char*)&param, sizeof(param));
+        output.write((char*)cbtmap.data(), cbtmap.size());
+        output.close();
+    };
+};
+
+class TrackerImportCbtArgsProc : public IArgsProc
+{
+public:
+    TrackerImportCbtArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Restore the state of change tracking from a file.");
+        m_desc.add_options()
+          ("device,d", po::value<std::string>(), "Device name.")
+          ("file,f", po::value<std::string>(), "File name for input.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_cbt_state param = {0};
+        char signature[sizeof(cbtStateSignature)];
+
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+
+        if (!vm.count("file"))
+            throw std::invalid_argument("Argument 'file' is missed.");
+
+        std::ifstream input;
+        input.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        input.open(vm["file"].as<std::string>(), std::ifstream::in | std::ifstream::binary);
+        input.read(signature, sizeof(signature));
+        if (memcmp(signature, cbtStateSignature, sizeof(signature)))
+            throw std::runtime_error("The file does not contain the state of change tracking.");
+        input.read((char*)&param, sizeof(param));
+
+        std::vector<unsigned char> cbtmap(param.blk_count);
+        input.read((char*)cbtmap.data(), cbtmap.size());
+        input.close();
+
+        param.dev_id = deviceByName(vm["device"].as<std::string>());
+        param.buff = cbtmap.data();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_TRACKER_IMPORT_CBT, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to import change tracking.");
+    };
+};
+
+class TrackerGranularityArgsProc : public IArgsProc
+{
+public:
+    TrackerGranularityArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Set change tracking block size for the device. Resets the change tracking.");
+        m_desc.add_options()
+          ("device,d", po::value<std::string>(), "Device name.")
+          ("blksize,b", po::value<unsigned int>()->default_value(0),
+                "Minimum change tracking block size in bytes. Zero keeps the current value.")
+          ("maxcount,c", po::value<unsigned int>()->default_value(0),
+                "Maximum number of change tracking blocks. Zero keeps the current value.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_tracker_granularity param = {0};
+
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        param.dev_id = deviceByName(vm["device"].as<std::string>());
+        param.blk_size = vm["blksize"].as<unsigned int>();
+        param.blk_count_max = vm["maxcount"].as<unsigned int>();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_TRACKER_SET_GRANULARITY, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set change tracking block size.");
+    };
+};
+
+class SnapshotCbtLimitArgsProc : public IArgsProc
+{
+public:
+    SnapshotCbtLimitArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Limit the memory for change tracking of the snapshot devices.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("limit,l", po::value<unsigned long long>(), "Memory limit in bytes.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_cbt_limit param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("limit"))
+            throw std::invalid_argument("Argument 'limit' is missed.");
+        param.memory_limit = vm["limit"].as<unsigned long long>();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_SET_CBT_LIMIT, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set change tracking memory limit.");
+    };
+};
+
+class SnapshotPrepareArgsProc : public IArgsProc
+{
+public:
+    SnapshotPrepareArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Prepare the snapshot to be taken, or abort the preparation.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("abort,a", "Release the resources allocated by the preparation.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_prepare param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (vm.count("abort"))
+        {
+            if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_ABORT, &param))
+                throw std::system_error(errno, std::generic_category(), "Failed to abort snapshot preparation.");
+            return;
+        }
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_PREPARE, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to prepare snapshot.");
+    };
+};
+
+class SnapshotTimingArgsProc : public IArgsProc
+{
+public:
+    SnapshotTimingArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Print the duration of the stages of taking the snapshot.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_timing param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_TIMING, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get snapshot timing.");
+
+        std::cout << "prepare_time_ns=" << param.prepare_time_ns << std::endl;
+        std::cout << "freeze_time_ns=" << param.freeze_time_ns << std::endl;
+    };
+};
+
+class SnapshotStatsArgsProc : public IArgsProc
+{
+private:
+    static void PrintHist(const char* name, const __u64* hist)
+    {
+        std::cout << name << "=";
+        for (size_t inx = 0; inx < BLK_SNAP_STATS_HIST_SIZE; inx++)
+            std::cout << (inx ? "," : "") << hist[inx];
+        std::cout << std::endl;
+    };
+
+public:
+    SnapshotStatsArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Print the I/O statistics of the snapshot.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_stats param = {0};
+        std::vector<struct blk_snap_device_stats> statsVector;
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_STATS, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get snapshot statistics.");
+        if (param.count == 0)
+            return;
+
+        statsVector.resize(param.count);
+        param.stats_array = statsVector.data();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_STATS, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get snapshot statistics.");
+
+        for (const struct blk_snap_device_stats& st : statsVector)
+        {
+            std::cout << "device=" << st.orig_dev_id.mj << ":" << st.orig_dev_id.mn << std::endl;
+            std::cout << "chunks_copied=" << st.chunks_copied << std::endl;
+            std::cout << "chunks_shared=" << st.chunks_shared << std::endl;
+            std::cout << "bytes_stored=" << st.bytes_stored << std::endl;
+            std::cout << "cow_eagain=" << st.cow_eagain << std::endl;
+            std::cout << "cow_wait_ns=" << st.cow_wait_ns << std::endl;
+            std::cout << "image_reads=" << st.image_reads << std::endl;
+            std::cout << "image_writes=" << st.image_writes << std::endl;
+            std::cout << "image_cache_hits=" << st.image_cache_hits << std::endl;
+            std::cout << "image_cache_misses=" << st.image_cache_misses << std::endl;
+            PrintHist("cow_load_hist_us", st.cow_load_hist);
+            PrintHist("cow_store_hist_us", st.cow_store_hist);
+            PrintHist("image_read_hist_us", st.image_read_hist);
+        }
+    };
+};
+
+class SnapshotUnusedBlocksArgsProc : public IArgsProc
+{
+public:
+    SnapshotUnusedBlocksArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Set the blocks whose data is not needed in the snapshot.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("file,f", po::value<std::string>(), "File whose blocks are not needed, e.g. a swap file.")
+          ("device,d", po::value<std::string>(), "Device name.")
+          ("ranges,r", po::value<std::vector<std::string>>()->multitoken(), "Sectors range in format 'sector:count'. It's multitoken argument.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_unused_blocks param = {0};
+        std::vector<struct blk_snap_block_range> ranges;
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (vm.count("file"))
+        {
+            fiemapStorage(vm["file"].as<std::string>(), param.dev_id, ranges);
+        }
+        else
+        {
+            if (!vm.count("device"))
+                throw std::invalid_argument("Argument 'device' is missed.");
+            param.dev_id = deviceByName(vm["device"].as<std::string>());
+
+            if (!vm.count("ranges"))
+                throw std::invalid_argument("Argument 'ranges' is missed.");
+            for (const std::string& range : vm["ranges"].as<std::vector<std::string>>())
+                ranges.push_back(parseRange(range));
+        }
+
+        param.count = ranges.size();
+        param.unused_blocks_array = ranges.data();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_UNUSED_BLOCKS, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set unused blocks.");
+    };
+};
+
+class SnapshotReleaseBlocksArgsProc : public IArgsProc
+{
+public:
+    SnapshotReleaseBlocksArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Release the blocks of the snapshot image that are no longer needed.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("device,d", po::value<std::string>(), "Device name.")
+          ("ranges,r", po::value<std::vector<std::string>>()->multitoken(), "Sectors range in format 'sector:count'. It's multitoken argument.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_release_blocks param = {0};
+        std::vector<struct blk_snap_block_range> ranges;
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        param.dev_id = deviceByName(vm["device"].as<std::string>());
+
+        if (!vm.count("ranges"))
+            throw std::invalid_argument("Argument 'ranges' is missed.");
+        for (const std::string& range : vm["ranges"].as<std::vector<std::string>>())
+            ranges.push_back(parseRange(range));
+
+        param.count = ranges.size();
+        param.released_blocks_array = ranges.data();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_RELEASE_BLOCKS, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to release blocks.");
+    };
+};
+
+class SnapshotChunkHashesArgsProc : public IArgsProc
+{
+public:
+    SnapshotChunkHashesArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Print the hashes of the original contents of the chunks of the snapshot image.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("device,d", po::value<std::string>(), "Device name.")
+          ("first,f", po::value<unsigned long long>(), "The number of the first chunk.")
+          ("count,c", po::value<unsigned long long>(), "The number of chunks. All the rest by default.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_chunk_hashes param = {0};
+        std::vector<__u64> hashes(4096);
+        unsigned long long count = ~0ull;
+        bool printedShift = false;
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        param.dev_id = deviceByName(vm["device"].as<std::string>());
+
+        if (vm.count("first"))
+            param.first = vm["first"].as<unsigned long long>();
+        if (vm.count("count"))
+            count = vm["count"].as<unsigned long long>();
+
+        while (count)
+        {
+            unsigned int portion = std::min<unsigned long long>(count, hashes.size());
+
+            param.count = portion;
+            param.hashes_array = static_cast<__u64>(reinterpret_cast<uintptr_t>(hashes.data()));
+            if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_CHUNK_HASHES, &param))
+                throw std::system_error(errno, std::generic_category(), "Failed to get chunk hashes.");
+
+            if (!printedShift)
+            {
+                std::cout << "chunk_shift=" << param.chunk_shift << std::endl;
+                printedShift = true;
+            }
+            for (unsigned int inx = 0; inx < param.count; inx++)
+                std::cout << (param.first + inx) << "=" << std::hex << hashes[inx] << std::dec << std::endl;
+
+            if (param.count < portion)
+                break;
+            param.first += param.count;
+            count -= param.count;
+        }
+    };
+};
+
+class SnapshotCompressionArgsProc : public IArgsProc
+{
+public:
+    SnapshotCompressionArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Set compression algorithm for difference storage of snapshot.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("algorithm,a", po::value<std::string>(), "Compression algorithm: 'none' (default) or 'lz4'.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_compression param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("algorithm"))
+            throw std::invalid_argument("Argument 'algorithm' is missed.");
+        std::string algorithm = vm["algorithm"].as<std::string>();
+        if (algorithm == "none")
+            param.algorithm = blk_snap_compression_none;
+        else if (algorithm == "lz4")
+            param.algorithm = blk_snap_compression_lz4;
+        else
+            throw std::invalid_argument("Invalid value of argument 'algorithm'.");
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_SET_COMPRESSION, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set compression algorithm.");
+    };
+};
+
+class SnapshotMemoryStorageArgsProc : public IArgsProc
+{
+public:
+    SnapshotMemoryStorageArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Allow to keep the compressed difference storage of the snapshot in memory.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("limit,l", po::value<unsigned long long>(), "Memory limit in bytes. Zero disables the memory storage.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_memory_storage param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("limit"))
+            throw std::invalid_argument("Argument 'limit' is missed.");
+        param.memory_limit = vm["limit"].as<unsigned long long>();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_SET_MEMORY_STORAGE, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set memory storage limit.");
+    };
+};
+
+class SnapshotStorageFileArgsProc : public IArgsProc
+{
+public:
+    SnapshotStorageFileArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Let the module extend the difference storage with the file by itself.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("path,p", po::value<std::string>(), "File name, or directory for an unnamed temporary file.")
+          ("limit,l", po::value<unsigned long long>(), "Maximum size of the file in bytes.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_storage_file param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("path"))
+            throw std::invalid_argument("Argument 'path' is missed.");
+        std::string path = vm["path"].as<std::string>();
+
+        if (vm.count("limit"))
+            param.size_limit = vm["limit"].as<unsigned long long>();
+
+        int flags = O_RDWR | O_LARGEFILE;
+        if (fs::is_directory(path))
+            flags |= O_TMPFILE;
+        else
+            flags |= O_CREAT;
+
+        int fd = ::open(path.c_str(), flags, 0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to open file [" + path + "].");
+        param.fd = fd;
+
+        /* The module keeps its own reference to the file. */
+        int ret = ::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_FILE, &param);
+        int err = errno;
+        ::close(fd);
+        if (ret)
+            throw std::system_error(err, std::generic_category(), "Failed to set difference storage file.");
+    };
+};
+
+class SnapshotStorageWeightArgsProc : public IArgsProc
+{
+public:
+    SnapshotStorageWeightArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Set the weight of a difference storage device for striping.");
+        m_desc.add_options()
+          ("id,i", po::value<std::string>(), "Snapshot uuid.")
+          ("device,d", po::value<std::string>(), "Difference storage device name.")
+          ("weight,w", po::value<unsigned int>(), "Weight of the device from 1 to 64.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_snapshot_storage_weight param = {0};
+
+        if (!vm.count("id"))
+            throw std::invalid_argument("Argument 'id' is missed.");
+        Uuid id(vm["id"].as<std::string>());
+        uuid_copy(param.id.b, id.Get());
+
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        param.dev_id = deviceByName(vm["device"].as<std::string>());
+
+        if (!vm.count("weight"))
+            throw std::invalid_argument("Argument 'weight' is missed.");
+        param.weight = vm["weight"].as<unsigned int>();
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_SNAPSHOT_SET_STORAGE_WEIGHT, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to set storage weight.");
+    };
+};
+
+class MemoryStatsArgsProc : public IArgsProc
+{
+public:
+    MemoryStatsArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Print the current and peak numbers of objects allocated by the module.");
+    };
+    void Execute(po::variables_map& vm) override
+    {
+        CBlksnapFileWrap blksnapFd;
+        struct blk_snap_memory_stats param = {0};
+        std::vector<struct blk_snap_memory_object> objectsVector;
+
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_MEMORY_STATS, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get memory statistics.");
+        if (param.count == 0)
+            return;
+
+        objectsVector.resize(param.count);
+        param.objects_array = objectsVector.data();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLK_SNAP_MEMORY_STATS, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to get memory statistics.");
+
+        for (const struct blk_snap_memory_object& obj : objectsVector)
+        {
+            std::string name(reinterpret_cast<const char*>(obj.name),
+                             strnlen(reinterpret_cast<const char*>(obj.name), BLK_SNAP_MEMORY_OBJECT_NAME_LIMIT));
+
+            std::cout << name << "=" << obj.value << "," << obj.peak << std::endl;
+        }
+    };
+};
 #endif
 
 static std::map<std::string, std::shared_ptr<IArgsProc>> argsProcMap{
@@ -993,8 +2022,26 @@ static std::map<std::string, std::shared_ptr<IArgsProc>> argsProcMap{
   {"snapshot_waitevent", std::make_shared<SnapshotWaitEventArgsProc>()},
   {"snapshot_collect", std::make_shared<SnapshotCollectArgsProc>()},
   {"stretch_snapshot", std::make_shared<StretchSnapshotArgsProc>()},
+  {"image_export", std::make_shared<ImageExportArgsProc>()},
 #ifdef BLK_SNAP_MODIFICATION
   {"setlog", std::make_shared<SetlogArgsProc>()},
+  {"snapshot_readahead", std::make_shared<SnapshotReadAheadArgsProc>()},
+  {"snapshot_durability", std::make_shared<SnapshotDurabilityArgsProc>()},
+  {"tracker_exportcbt", std::make_shared<TrackerExportCbtArgsProc>()},
+  {"tracker_importcbt", std::make_shared<TrackerImportCbtArgsProc>()},
+  {"tracker_granularity", std::make_shared<TrackerGranularityArgsProc>()},
+  {"snapshot_cbtlimit", std::make_shared<SnapshotCbtLimitArgsProc>()},
+  {"snapshot_prepare", std::make_shared<SnapshotPrepareArgsProc>()},
+  {"snapshot_timing", std::make_shared<SnapshotTimingArgsProc>()},
+  {"snapshot_stats", std::make_shared<SnapshotStatsArgsProc>()},
+  {"snapshot_unused", std::make_shared<SnapshotUnusedBlocksArgsProc>()},
+  {"snapshot_release", std::make_shared<SnapshotReleaseBlocksArgsProc>()},
+  {"snapshot_chunkhashes", std::make_shared<SnapshotChunkHashesArgsProc>()},
+  {"snapshot_compression", std::make_shared<SnapshotCompressionArgsProc>()},
+  {"snapshot_memstorage", std::make_shared<SnapshotMemoryStorageArgsProc>()},
+  {"snapshot_storageweight", std::make_shared<SnapshotStorageWeightArgsProc>()},
+  {"snapshot_storagefile", std::make_shared<SnapshotStorageFileArgsProc>()},
+  {"memory_stats", std::make_shared<MemoryStatsArgsProc>()},
 #endif
 };
 